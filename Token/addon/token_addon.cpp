@@ -0,0 +1,796 @@
+// token_addon: Node-API binding of PKCS11Library for the Electron main process.
+//
+// One Token object keeps its module loaded and initialized for as long as
+// it lives, instead of loading and finalizing the vendor library per call.
+// Every token call runs on the libuv threadpool and returns a Promise, so
+// the JS thread never waits on the device; calls are serialised by the
+// library's own mutex. Identical reads in flight at the same time (same
+// method, arguments and session state) share one library call and result;
+// only the first is queued, the rest settle from its result without taking
+// a threadpool thread. Byte results are Buffers that own the library's
+// vector directly where the runtime allows external memory.
+//
+// Build, e.g.
+//   g++ -O2 -std=gnu++17 -shared -fPIC -IToken/include -I"$(dirname "$(which node)")/../include/node" -o Token/lib/token_addon.node Token/addon/token_addon.cpp Token/src/*.cpp -ldl -lcrypto -lpthread
+// Node-API is ABI-stable, so the same binary loads in Node and in Electron.
+//
+//   const { Token } = require("./token_addon.node");
+//   const token = new Token();
+//   await token.initialize("/usr/lib/libshuttle_p11v220.so");
+//   await token.openSession((await token.getSlotList())[0]);
+//   await token.login(pin);
+//   const signature = await token.sign(key.handle, data, "SHA256");
+//
+// Methods (all return Promises):
+//   initialize(libraryPath)               finalize()
+//   getSlotList([tokenPresent])           getTokenInfo(slot)
+//   probeToken()                          { present, userLoggedIn, soLoggedIn, generation, hardwareSerial, busy }
+//   openSession(slot, [readWrite])        closeSession()
+//   login(pin)                            logout()
+//   findKeys([class])                     findCertificates()
+//   getAttribute(handle, type)            exportCertificate(handle)
+//   exportPublicKey(handle, ["DER"|"PEM"]) DER Buffer or PEM string
+//   sign(key, data, [hash])               verify(key, data, signature, [hash])
+//   signECDSA(key, data, [hash])          verifyECDSA(key, data, signature, [hash])
+//   generateRSAKeyPair(bits, label, [tokenObject])
+//   generateECKeyPair(label, [tokenObject])
+// Handles, slots and attribute types are numbers, data are Buffers or
+// Uint8Arrays, hashes are "SHA1", "SHA256" etc. Rejections are Errors with
+// `status` (Status) and `code` (CK_RV) set.
+
+#include "pkcs11_lib.h"
+#include "single_flight.h"
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <node_api.h>
+
+using namespace PKCS11Lib;
+
+namespace {
+
+struct Token {
+    PKCS11Library lib;
+
+    // Part of every coalescing key. Bumped on the JS thread when a call that
+    // changes the session, login or object state is queued, and again when it
+    // finishes: a read issued after a login never joins one issued before it
+    std::atomic<uint64_t> epoch{0};
+    SingleFlight<std::string, std::vector<CK_SLOT_ID>> slotFlights;
+    SingleFlight<std::string, TokenInfo> tokenInfoFlights;
+    SingleFlight<std::string, std::vector<KeyInfo>> keyFlights;
+    SingleFlight<std::string, std::vector<CertificateInfo>> certificateFlights;
+    SingleFlight<std::string, std::vector<CK_BYTE>> byteFlights;
+
+    // Taken on the JS thread when the call is made
+    std::string flightKey(const char* method, unsigned long a = 0, unsigned long b = 0) const {
+        return std::string(method) + "/" + std::to_string(epoch.load()) + "/" + std::to_string(a) + "/" +
+               std::to_string(b);
+    }
+
+    // JS thread, as the changing call is queued
+    void changing() {
+        epoch++;
+    }
+
+    // Threadpool, as it finishes
+    template<typename R>
+    R changed(R result) {
+        epoch++;
+        return result;
+    }
+};
+
+// ---- values ------------------------------------------------------------------
+
+void deleteVector(napi_env, void*, void* hint) {
+    delete static_cast<std::vector<CK_BYTE>*>(hint);
+}
+
+// Hands the vector to a Buffer without copying; runtimes with the V8
+// sandbox (Electron) refuse external memory, and get a copy instead
+napi_value toBuffer(napi_env env, std::vector<CK_BYTE>& bytes) {
+    napi_value buffer = nullptr;
+    if (!bytes.empty()) {
+        auto* owned = new std::vector<CK_BYTE>(std::move(bytes));
+        if (napi_create_external_buffer(env, owned->size(), owned->data(), deleteVector, owned, &buffer) == napi_ok) {
+            return buffer;
+        }
+        bytes = std::move(*owned);
+        delete owned;
+    }
+    void* data = nullptr;
+    napi_create_buffer_copy(env, bytes.size(), bytes.data(), &data, &buffer);
+    return buffer;
+}
+
+napi_value toNumber(napi_env env, double value) {
+    napi_value number;
+    napi_create_double(env, value, &number);
+    return number;
+}
+
+napi_value toString(napi_env env, const std::string& text) {
+    napi_value string;
+    napi_create_string_utf8(env, text.data(), text.size(), &string);
+    return string;
+}
+
+napi_value toBool(napi_env env, bool flag) {
+    napi_value value;
+    napi_get_boolean(env, flag, &value);
+    return value;
+}
+
+void set(napi_env env, napi_value object, const char* name, napi_value value) {
+    napi_set_named_property(env, object, name, value);
+}
+
+napi_value keyObject(napi_env env, KeyInfo& key) {
+    napi_value object;
+    napi_create_object(env, &object);
+    set(env, object, "handle", toNumber(env, key.handle));
+    set(env, object, "label", toString(env, key.label));
+    set(env, object, "keyType", toNumber(env, key.keyType));
+    set(env, object, "class", toNumber(env, key.objectClass));
+    set(env, object, "id", toBuffer(env, key.id));
+    set(env, object, "canEncrypt", toBool(env, key.canEncrypt));
+    set(env, object, "canDecrypt", toBool(env, key.canDecrypt));
+    set(env, object, "canSign", toBool(env, key.canSign));
+    set(env, object, "canVerify", toBool(env, key.canVerify));
+    set(env, object, "sensitive", toBool(env, key.isSensitive));
+    set(env, object, "extractable", toBool(env, key.isExtractable));
+    return object;
+}
+
+napi_value certificateObject(napi_env env, CertificateInfo& cert) {
+    napi_value object;
+    napi_create_object(env, &object);
+    set(env, object, "handle", toNumber(env, cert.handle));
+    set(env, object, "label", toString(env, cert.label));
+    set(env, object, "subject", toBuffer(env, cert.subject));
+    set(env, object, "id", toBuffer(env, cert.id));
+    set(env, object, "value", toBuffer(env, cert.value));
+    set(env, object, "type", toNumber(env, cert.type));
+    return object;
+}
+
+napi_value keyPairObject(napi_env env, KeyPair& pair) {
+    napi_value object;
+    napi_create_object(env, &object);
+    set(env, object, "publicKey", keyObject(env, pair.publicKey));
+    set(env, object, "privateKey", keyObject(env, pair.privateKey));
+    return object;
+}
+
+napi_value tokenInfoObject(napi_env env, TokenInfo& info) {
+    napi_value object;
+    napi_create_object(env, &object);
+    set(env, object, "label", toString(env, info.label));
+    set(env, object, "manufacturerId", toString(env, info.manufacturerId));
+    set(env, object, "model", toString(env, info.model));
+    set(env, object, "serialNumber", toString(env, info.serialNumber));
+    set(env, object, "flags", toNumber(env, info.flags));
+    set(env, object, "sessionCount", toNumber(env, info.sessionCount));
+    set(env, object, "maxSessionCount", toNumber(env, info.maxSessionCount));
+    set(env, object, "freePublicMemory", toNumber(env, info.freePublicMemory));
+    set(env, object, "totalPublicMemory", toNumber(env, info.totalPublicMemory));
+    set(env, object, "freePrivateMemory", toNumber(env, info.freePrivateMemory));
+    set(env, object, "totalPrivateMemory", toNumber(env, info.totalPrivateMemory));
+    return object;
+}
+
+napi_value tokenProbeObject(napi_env env, TokenProbe& probe) {
+    napi_value object;
+    napi_create_object(env, &object);
+    set(env, object, "present", toBool(env, probe.present));
+    set(env, object, "userLoggedIn", toBool(env, probe.userLoggedIn));
+    set(env, object, "soLoggedIn", toBool(env, probe.soLoggedIn));
+    set(env, object, "generation", toNumber(env, static_cast<double>(probe.generation)));
+    set(env, object, "hardwareSerial", toBuffer(env, probe.hardwareSerial));
+    set(env, object, "busy", toBool(env, probe.busy));
+    return object;
+}
+
+template<typename T>
+napi_value errorObject(napi_env env, const Result<T>& result) {
+    std::string message = result.errorMessage.empty() ? result.getErrorDescription() : result.errorMessage;
+    napi_value error;
+    napi_create_error(env, nullptr, toString(env, message), &error);
+    set(env, error, "status", toNumber(env, static_cast<int>(result.errorCode)));
+    set(env, error, "code", toNumber(env, result.pkcs11Error));
+    return error;
+}
+
+// ---- async calls -------------------------------------------------------------
+
+class AsyncCall {
+public:
+    virtual ~AsyncCall() = default;
+    virtual void execute() = 0;                 // threadpool
+    virtual void settle(napi_env env) = 0;      // JS thread
+
+    napi_async_work work = nullptr;
+    napi_deferred deferred = nullptr;
+    napi_ref self = nullptr;                    // keeps the Token alive while queued
+};
+
+template<typename T, typename Run, typename Convert>
+class Call : public AsyncCall {
+public:
+    Call(Run run, Convert convert)
+        : run_(std::move(run)), convert_(std::move(convert)),
+          result_(Result<T>::Error(Status::ERROR_GENERAL, "Call did not run")) {}
+
+    void execute() override { result_ = run_(); }
+
+    void settle(napi_env env) override {
+        if (finish_) {
+            finish_(result_);
+        }
+        if (!result_.isOk()) {
+            napi_reject_deferred(env, deferred, errorObject(env, result_));
+            return;
+        }
+        if constexpr (std::is_void_v<T>) {
+            napi_value undefined;
+            napi_get_undefined(env, &undefined);
+            napi_resolve_deferred(env, deferred, undefined);
+        } else {
+            napi_resolve_deferred(env, deferred, convert_(env, result_.value));
+        }
+    }
+
+    // Runs on the JS thread with the result, before the call's own promise
+    // settles; used to settle the calls that joined this one
+    std::function<void(const Result<T>&)> finish_;
+
+private:
+    Run run_;
+    Convert convert_;
+    Result<T> result_;
+};
+
+void executeCall(napi_env, void* data) {
+    static_cast<AsyncCall*>(data)->execute();
+}
+
+void completeCall(napi_env env, napi_status, void* data) {
+    auto* call = static_cast<AsyncCall*>(data);
+    call->settle(env);
+    napi_delete_reference(env, call->self);
+    napi_delete_async_work(env, call->work);
+    delete call;
+}
+
+bool start(napi_env env, napi_value self, const char* name, AsyncCall* call) {
+    if (napi_create_async_work(env, nullptr, toString(env, name), executeCall, completeCall, call,
+                               &call->work) != napi_ok) {
+        return false;
+    }
+    napi_create_reference(env, self, 1, &call->self);
+    napi_queue_async_work(env, call->work);
+    return true;
+}
+
+// Queues run() on the threadpool; the Promise resolves with convert(env, value)
+template<typename T, typename Run, typename Convert>
+napi_value queue(napi_env env, napi_value self, const char* name, Run run, Convert convert) {
+    auto* call = new Call<T, Run, Convert>(std::move(run), std::move(convert));
+    napi_value promise;
+    if (napi_create_promise(env, &call->deferred, &promise) != napi_ok || !start(env, self, name, call)) {
+        delete call;
+        napi_throw_error(env, nullptr, "Cannot queue token call");
+        return nullptr;
+    }
+    return promise;
+}
+
+// Like queue(), but a read whose key is already in flight is not queued at
+// all: its Promise settles from the running call's result on the JS thread,
+// so a joiner never holds a threadpool thread
+template<typename T, typename Run, typename Convert>
+napi_value queueShared(napi_env env, napi_value self, const char* name, SingleFlight<std::string, T>& flights,
+                       const std::string& key, Run run, Convert convert) {
+    napi_deferred deferred;
+    napi_value promise;
+    if (napi_create_promise(env, &deferred, &promise) != napi_ok) {
+        napi_throw_error(env, nullptr, "Cannot queue token call");
+        return nullptr;
+    }
+    bool joined = flights.join(key, [env, deferred, convert](const Result<T>& result) {
+        if (!result.isOk()) {
+            napi_reject_deferred(env, deferred, errorObject(env, result));
+            return;
+        }
+        T value = result.value;
+        napi_resolve_deferred(env, deferred, convert(env, value));
+    });
+    if (joined) {
+        return promise;
+    }
+
+    auto* call = new Call<T, Run, Convert>(std::move(run), std::move(convert));
+    call->deferred = deferred;
+    call->finish_ = [&flights, key](const Result<T>& result) { flights.finish(key, result); };
+    if (!start(env, self, name, call)) {
+        flights.finish(key, Result<T>::Error(Status::ERROR_GENERAL, "Cannot queue token call"));
+        delete call;
+        napi_throw_error(env, nullptr, "Cannot queue token call");
+        return nullptr;
+    }
+    return promise;
+}
+
+template<typename Run>
+napi_value queueVoid(napi_env env, napi_value self, const char* name, Run run) {
+    return queue<void>(env, self, name, std::move(run), [](napi_env) { return napi_value(nullptr); });
+}
+
+template<typename Run>
+napi_value queueBytes(napi_env env, napi_value self, const char* name, Run run) {
+    return queue<std::vector<CK_BYTE>>(env, self, name, std::move(run), toBuffer);
+}
+
+// ---- arguments ---------------------------------------------------------------
+
+struct Args {
+    napi_env env;
+    napi_value self;
+    Token* token;
+    napi_value argv[4];
+    size_t argc;
+
+    bool missing(size_t index) const {
+        if (index >= argc) {
+            return true;
+        }
+        napi_valuetype type;
+        napi_typeof(env, argv[index], &type);
+        return type == napi_undefined;
+    }
+
+    bool fail(const char* name, const char* expected) {
+        std::string message = std::string("Argument '") + name + "' must be " + expected;
+        napi_throw_type_error(env, nullptr, message.c_str());
+        return false;
+    }
+
+    bool number(size_t index, const char* name, unsigned long& out) {
+        double value;
+        if (missing(index) || napi_get_value_double(env, argv[index], &value) != napi_ok ||
+            value < 0 || value != static_cast<double>(static_cast<unsigned long>(value))) {
+            return fail(name, "an unsigned integer");
+        }
+        out = static_cast<unsigned long>(value);
+        return true;
+    }
+
+    bool number(size_t index, const char* name, unsigned long& out, unsigned long fallback) {
+        if (missing(index)) {
+            out = fallback;
+            return true;
+        }
+        return number(index, name, out);
+    }
+
+    bool flag(size_t index, const char* name, bool& out, bool fallback) {
+        if (missing(index)) {
+            out = fallback;
+            return true;
+        }
+        if (napi_get_value_bool(env, argv[index], &out) != napi_ok) {
+            return fail(name, "a boolean");
+        }
+        return true;
+    }
+
+    bool string(size_t index, const char* name, std::string& out) {
+        size_t length;
+        if (missing(index) || napi_get_value_string_utf8(env, argv[index], nullptr, 0, &length) != napi_ok) {
+            return fail(name, "a string");
+        }
+        out.resize(length + 1);
+        napi_get_value_string_utf8(env, argv[index], &out[0], out.size(), &length);
+        out.resize(length);
+        return true;
+    }
+
+    // Buffers and other Uint8Arrays
+    bool bytes(size_t index, const char* name, std::vector<CK_BYTE>& out) {
+        bool isTypedArray = false;
+        if (!missing(index)) {
+            napi_is_typedarray(env, argv[index], &isTypedArray);
+        }
+        napi_typedarray_type type;
+        size_t length;
+        void* data;
+        if (!isTypedArray ||
+            napi_get_typedarray_info(env, argv[index], &type, &length, &data, nullptr, nullptr) != napi_ok ||
+            type != napi_uint8_array) {
+            return fail(name, "a Buffer or Uint8Array");
+        }
+        const CK_BYTE* begin = static_cast<const CK_BYTE*>(data);
+        out.assign(begin, begin + length);
+        return true;
+    }
+
+    bool hash(size_t index, const char* name, HashAlgorithm& out, HashAlgorithm fallback) {
+        if (missing(index)) {
+            out = fallback;
+            return true;
+        }
+        std::string text;
+        if (!string(index, name, text)) {
+            return false;
+        }
+        static const std::pair<const char*, HashAlgorithm> names[] = {
+            {"SHA1", HashAlgorithm::SHA1}, {"SHA224", HashAlgorithm::SHA224}, {"SHA256", HashAlgorithm::SHA256},
+            {"SHA384", HashAlgorithm::SHA384}, {"SHA512", HashAlgorithm::SHA512}, {"MD5", HashAlgorithm::MD5}};
+        for (const auto& entry : names) {
+            if (text == entry.first) {
+                out = entry.second;
+                return true;
+            }
+        }
+        return fail(name, "SHA1, SHA224, SHA256, SHA384, SHA512 or MD5");
+    }
+};
+
+bool unpack(napi_env env, napi_callback_info info, Args& args) {
+    args.env = env;
+    args.argc = 4;
+    void* token = nullptr;
+    if (napi_get_cb_info(env, info, &args.argc, args.argv, &args.self, nullptr) != napi_ok ||
+        napi_unwrap(env, args.self, &token) != napi_ok) {
+        napi_throw_type_error(env, nullptr, "Not a Token");
+        return false;
+    }
+    args.token = static_cast<Token*>(token);
+    return true;
+}
+
+// ---- methods -----------------------------------------------------------------
+
+napi_value Initialize(napi_env env, napi_callback_info info) {
+    Args a;
+    std::string path;
+    if (!unpack(env, info, a) || !a.string(0, "libraryPath", path)) {
+        return nullptr;
+    }
+    Token* token = a.token;
+    token->changing();
+    return queueVoid(env, a.self, "token.initialize", [token, path] { return token->changed(token->lib.initialize(path)); });
+}
+
+napi_value Finalize(napi_env env, napi_callback_info info) {
+    Args a;
+    if (!unpack(env, info, a)) {
+        return nullptr;
+    }
+    Token* token = a.token;
+    token->changing();
+    return queueVoid(env, a.self, "token.finalize", [token] { return token->changed(token->lib.finalize()); });
+}
+
+napi_value GetSlotList(napi_env env, napi_callback_info info) {
+    Args a;
+    bool present = true;
+    if (!unpack(env, info, a) || !a.flag(0, "tokenPresent", present, true)) {
+        return nullptr;
+    }
+    Token* token = a.token;
+    return queueShared(env, a.self, "token.getSlotList", token->slotFlights, token->flightKey("slots", present),
+        [token, present] { return token->lib.getSlotList(present); },
+        [](napi_env e, std::vector<CK_SLOT_ID>& slots) {
+            napi_value array;
+            napi_create_array_with_length(e, slots.size(), &array);
+            for (size_t i = 0; i < slots.size(); i++) {
+                napi_set_element(e, array, static_cast<uint32_t>(i), toNumber(e, slots[i]));
+            }
+            return array;
+        });
+}
+
+napi_value GetTokenInfo(napi_env env, napi_callback_info info) {
+    Args a;
+    unsigned long slot = 0;
+    if (!unpack(env, info, a) || !a.number(0, "slot", slot)) {
+        return nullptr;
+    }
+    Token* token = a.token;
+    return queueShared(env, a.self, "token.getTokenInfo", token->tokenInfoFlights, token->flightKey("tokenInfo", slot),
+        [token, slot] { return token->lib.getTokenInfo(slot); }, tokenInfoObject);
+}
+
+napi_value ProbeToken(napi_env env, napi_callback_info info) {
+    Args a;
+    if (!unpack(env, info, a)) {
+        return nullptr;
+    }
+    Token* token = a.token;
+    return queue<TokenProbe>(env, a.self, "token.probeToken", [token] { return token->lib.probeToken(); },
+                             tokenProbeObject);
+}
+
+napi_value OpenSession(napi_env env, napi_callback_info info) {
+    Args a;
+    unsigned long slot = 0;
+    bool readWrite = true;
+    if (!unpack(env, info, a) || !a.number(0, "slot", slot) || !a.flag(1, "readWrite", readWrite, true)) {
+        return nullptr;
+    }
+    Token* token = a.token;
+    token->changing();
+    return queueVoid(env, a.self, "token.openSession",
+        [token, slot, readWrite] { return token->changed(token->lib.openSession(slot, readWrite)); });
+}
+
+napi_value CloseSession(napi_env env, napi_callback_info info) {
+    Args a;
+    if (!unpack(env, info, a)) {
+        return nullptr;
+    }
+    Token* token = a.token;
+    token->changing();
+    return queueVoid(env, a.self, "token.closeSession", [token] { return token->changed(token->lib.closeSession()); });
+}
+
+napi_value Login(napi_env env, napi_callback_info info) {
+    Args a;
+    std::string pin;
+    if (!unpack(env, info, a) || !a.string(0, "pin", pin)) {
+        return nullptr;
+    }
+    Token* token = a.token;
+    token->changing();
+    return queueVoid(env, a.self, "token.login", [token, pin] { return token->changed(token->lib.login(pin)); });
+}
+
+napi_value Logout(napi_env env, napi_callback_info info) {
+    Args a;
+    if (!unpack(env, info, a)) {
+        return nullptr;
+    }
+    Token* token = a.token;
+    token->changing();
+    return queueVoid(env, a.self, "token.logout", [token] { return token->changed(token->lib.logout()); });
+}
+
+napi_value FindKeys(napi_env env, napi_callback_info info) {
+    Args a;
+    unsigned long keyClass = 0;
+    if (!unpack(env, info, a) || !a.number(0, "class", keyClass, CKO_PUBLIC_KEY)) {
+        return nullptr;
+    }
+    Token* token = a.token;
+    return queueShared(env, a.self, "token.findKeys", token->keyFlights, token->flightKey("keys", keyClass),
+        [token, keyClass] { return token->lib.findKeys(keyClass); },
+        [](napi_env e, std::vector<KeyInfo>& keys) {
+            napi_value array;
+            napi_create_array_with_length(e, keys.size(), &array);
+            for (size_t i = 0; i < keys.size(); i++) {
+                napi_set_element(e, array, static_cast<uint32_t>(i), keyObject(e, keys[i]));
+            }
+            return array;
+        });
+}
+
+napi_value FindCertificates(napi_env env, napi_callback_info info) {
+    Args a;
+    if (!unpack(env, info, a)) {
+        return nullptr;
+    }
+    Token* token = a.token;
+    return queueShared(env, a.self, "token.findCertificates", token->certificateFlights,
+        token->flightKey("certificates"), [token] { return token->lib.findCertificates(); },
+        [](napi_env e, std::vector<CertificateInfo>& certs) {
+            napi_value array;
+            napi_create_array_with_length(e, certs.size(), &array);
+            for (size_t i = 0; i < certs.size(); i++) {
+                napi_set_element(e, array, static_cast<uint32_t>(i), certificateObject(e, certs[i]));
+            }
+            return array;
+        });
+}
+
+napi_value GetAttribute(napi_env env, napi_callback_info info) {
+    Args a;
+    unsigned long handle = 0, type = 0;
+    if (!unpack(env, info, a) || !a.number(0, "handle", handle) || !a.number(1, "type", type)) {
+        return nullptr;
+    }
+    Token* token = a.token;
+    return queueShared(env, a.self, "token.getAttribute", token->byteFlights,
+        token->flightKey("attribute", handle, type),
+        [token, handle, type] { return token->lib.getObjectAttribute(handle, type); }, toBuffer);
+}
+
+napi_value ExportCertificate(napi_env env, napi_callback_info info) {
+    Args a;
+    unsigned long handle = 0;
+    if (!unpack(env, info, a) || !a.number(0, "handle", handle)) {
+        return nullptr;
+    }
+    Token* token = a.token;
+    return queueShared(env, a.self, "token.exportCertificate", token->byteFlights,
+        token->flightKey("certificate", handle), [token, handle] { return token->lib.exportCertificate(handle); },
+        toBuffer);
+}
+
+napi_value ExportPublicKey(napi_env env, napi_callback_info info) {
+    Args a;
+    unsigned long handle = 0;
+    std::string format = "DER";
+    if (!unpack(env, info, a) || !a.number(0, "handle", handle) ||
+        (!a.missing(1) && !a.string(1, "format", format))) {
+        return nullptr;
+    }
+    if (format != "DER" && format != "PEM") {
+        a.fail("format", "DER or PEM");
+        return nullptr;
+    }
+    Token* token = a.token;
+    bool pem = format == "PEM";
+    return queueShared(env, a.self, "token.exportPublicKey", token->byteFlights,
+        token->flightKey(pem ? "publicKeyPem" : "publicKeyDer", handle),
+        [token, handle, pem] { return token->lib.exportPublicKey(handle, pem ? KeyFormat::PEM : KeyFormat::DER); },
+        [pem](napi_env e, std::vector<CK_BYTE>& key) {
+            return pem ? toString(e, std::string(key.begin(), key.end())) : toBuffer(e, key);
+        });
+}
+
+napi_value Sign(napi_env env, napi_callback_info info) {
+    Args a;
+    unsigned long key = 0;
+    std::vector<CK_BYTE> data;
+    HashAlgorithm hash = HashAlgorithm::SHA1;
+    if (!unpack(env, info, a) || !a.number(0, "key", key) || !a.bytes(1, "data", data) ||
+        !a.hash(2, "hash", hash, HashAlgorithm::SHA1)) {
+        return nullptr;
+    }
+    PKCS11Library* lib = &a.token->lib;
+    return queueBytes(env, a.self, "token.sign",
+        [lib, key, data = std::move(data), hash] { return lib->sign(key, data, hash); });
+}
+
+napi_value Verify(napi_env env, napi_callback_info info) {
+    Args a;
+    unsigned long key = 0;
+    std::vector<CK_BYTE> data, signature;
+    HashAlgorithm hash = HashAlgorithm::SHA1;
+    if (!unpack(env, info, a) || !a.number(0, "key", key) || !a.bytes(1, "data", data) ||
+        !a.bytes(2, "signature", signature) || !a.hash(3, "hash", hash, HashAlgorithm::SHA1)) {
+        return nullptr;
+    }
+    PKCS11Library* lib = &a.token->lib;
+    return queueVoid(env, a.self, "token.verify",
+        [lib, key, data = std::move(data), signature = std::move(signature), hash] {
+            return lib->verify(key, data, signature, hash);
+        });
+}
+
+napi_value SignECDSA(napi_env env, napi_callback_info info) {
+    Args a;
+    unsigned long key = 0;
+    std::vector<CK_BYTE> data;
+    HashAlgorithm hash = HashAlgorithm::SHA1;
+    if (!unpack(env, info, a) || !a.number(0, "key", key) || !a.bytes(1, "data", data) ||
+        !a.hash(2, "hash", hash, HashAlgorithm::SHA256)) {
+        return nullptr;
+    }
+    PKCS11Library* lib = &a.token->lib;
+    return queueBytes(env, a.self, "token.signECDSA",
+        [lib, key, data = std::move(data), hash] { return lib->signECDSA(key, data, hash); });
+}
+
+napi_value VerifyECDSA(napi_env env, napi_callback_info info) {
+    Args a;
+    unsigned long key = 0;
+    std::vector<CK_BYTE> data, signature;
+    HashAlgorithm hash = HashAlgorithm::SHA1;
+    if (!unpack(env, info, a) || !a.number(0, "key", key) || !a.bytes(1, "data", data) ||
+        !a.bytes(2, "signature", signature) || !a.hash(3, "hash", hash, HashAlgorithm::SHA256)) {
+        return nullptr;
+    }
+    PKCS11Library* lib = &a.token->lib;
+    return queueVoid(env, a.self, "token.verifyECDSA",
+        [lib, key, data = std::move(data), signature = std::move(signature), hash] {
+            return lib->verifyECDSA(key, data, signature, hash);
+        });
+}
+
+napi_value GenerateRSAKeyPair(napi_env env, napi_callback_info info) {
+    Args a;
+    unsigned long bits = 0;
+    std::string label;
+    bool tokenObject = true;
+    if (!unpack(env, info, a) || !a.number(0, "bits", bits) || !a.string(1, "label", label) ||
+        !a.flag(2, "tokenObject", tokenObject, true)) {
+        return nullptr;
+    }
+    Token* token = a.token;
+    token->changing();
+    return queue<KeyPair>(env, a.self, "token.generateRSAKeyPair",
+        [token, bits, label, tokenObject] {
+            return token->changed(token->lib.generateRSAKeyPair(bits, label, tokenObject));
+        },
+        keyPairObject);
+}
+
+napi_value GenerateECKeyPair(napi_env env, napi_callback_info info) {
+    Args a;
+    std::string label;
+    bool tokenObject = true;
+    if (!unpack(env, info, a) || !a.string(0, "label", label) || !a.flag(1, "tokenObject", tokenObject, true)) {
+        return nullptr;
+    }
+    Token* token = a.token;
+    token->changing();
+    return queue<KeyPair>(env, a.self, "token.generateECKeyPair",
+        [token, label, tokenObject] { return token->changed(token->lib.generateECKeyPair(label, tokenObject)); }, keyPairObject);
+}
+
+// ---- class -------------------------------------------------------------------
+
+void DeleteToken(napi_env, void* data, void*) {
+    // Pending calls hold a reference, so none can still be running here
+    delete static_cast<Token*>(data);
+}
+
+napi_value Construct(napi_env env, napi_callback_info info) {
+    napi_value target;
+    napi_get_new_target(env, info, &target);
+    if (!target) {
+        napi_throw_type_error(env, nullptr, "Token must be called with new");
+        return nullptr;
+    }
+    napi_value self;
+    napi_get_cb_info(env, info, nullptr, nullptr, &self, nullptr);
+    auto* token = new Token();
+    if (napi_wrap(env, self, token, DeleteToken, nullptr, nullptr) != napi_ok) {
+        delete token;
+        napi_throw_error(env, nullptr, "Cannot create Token");
+        return nullptr;
+    }
+    return self;
+}
+
+} // namespace
+
+NAPI_MODULE_INIT() {
+    static const napi_property_descriptor methods[] = {
+        {"initialize", nullptr, Initialize, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+        {"finalize", nullptr, Finalize, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+        {"getSlotList", nullptr, GetSlotList, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+        {"getTokenInfo", nullptr, GetTokenInfo, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+        {"probeToken", nullptr, ProbeToken, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+        {"openSession", nullptr, OpenSession, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+        {"closeSession", nullptr, CloseSession, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+        {"login", nullptr, Login, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+        {"logout", nullptr, Logout, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+        {"findKeys", nullptr, FindKeys, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+        {"findCertificates", nullptr, FindCertificates, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+        {"getAttribute", nullptr, GetAttribute, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+        {"exportCertificate", nullptr, ExportCertificate, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+        {"exportPublicKey", nullptr, ExportPublicKey, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+        {"sign", nullptr, Sign, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+        {"verify", nullptr, Verify, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+        {"signECDSA", nullptr, SignECDSA, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+        {"verifyECDSA", nullptr, VerifyECDSA, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+        {"generateRSAKeyPair", nullptr, GenerateRSAKeyPair, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+        {"generateECKeyPair", nullptr, GenerateECKeyPair, nullptr, nullptr, nullptr, napi_default_method, nullptr},
+    };
+    napi_value constructor;
+    if (napi_define_class(env, "Token", NAPI_AUTO_LENGTH, Construct, nullptr,
+                          sizeof(methods) / sizeof(methods[0]), methods, &constructor) != napi_ok) {
+        return nullptr;
+    }
+    napi_set_named_property(env, exports, "Token", constructor);
+    return exports;
+}
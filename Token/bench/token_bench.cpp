@@ -0,0 +1,500 @@
+// Micro-benchmarks for PKCS11Library against the in-tree software token.
+//
+// Build and run, e.g.
+//   g++ -O2 -std=gnu++17 -IToken/include Token/bench/token_bench.cpp Token/src/*.cpp -ldl -lcrypto -lpthread
+//   ./a.out --library ./libsofttoken.so --output bench.json
+// Options:
+//   --library PATH        PKCS#11 module (default libsofttoken.so)
+//   --pin PIN             user PIN (default 1234, the softtoken default)
+//   --min-time MS         minimum measured time per benchmark (default 500)
+//   --latency-scale X     SOFTTOKEN_LATENCY_SCALE for the run (default 0, so the
+//                         numbers are library and host cost, not modelled device time)
+//   --filter TEXT         only run benchmarks whose name contains TEXT
+//   --output PATH         write the JSON results to PATH instead of stdout
+//
+// Per benchmark the JSON carries ops/s and ns/op from the timed run, heap
+// allocations per op (counted by the operator new below), and PKCS#11 calls
+// per op, taken from TokenMetrics in a separate untimed pass so that metric
+// recording does not distort the timing.
+
+#include "pkcs11_lib.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <dlfcn.h>
+
+using namespace PKCS11Lib;
+
+// ---- allocation counting -----------------------------------------------------
+
+namespace {
+
+std::atomic<uint64_t> allocationCount{0};
+std::atomic<uint64_t> allocationBytes{0};
+
+void* countedAlloc(size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    allocationBytes.fetch_add(size, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+} // namespace
+
+void* operator new(size_t size) { return countedAlloc(size); }
+void* operator new[](size_t size) { return countedAlloc(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return countedAlloc(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept { return operator new(size, tag); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+namespace {
+
+// ---- harness -----------------------------------------------------------------
+
+template<typename T>
+inline void doNotOptimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct Benchmark {
+    std::string name;
+    size_t bytesPerOp;                  // payload size, 0 if not meaningful
+    std::function<bool()> run;          // one operation; false aborts the benchmark
+};
+
+struct Measurement {
+    std::string name;
+    size_t bytesPerOp = 0;
+    uint64_t iterations = 0;
+    double nanosPerOp = 0;
+    double opsPerSecond = 0;
+    double tokenCallsPerOp = 0;
+    double allocationsPerOp = 0;
+    double allocatedBytesPerOp = 0;
+    std::string error;
+};
+
+struct Options {
+    std::string library = "libsofttoken.so";
+    std::string pin = "1234";
+    std::string latencyScale = "0";
+    std::string filter;
+    std::string output;
+    std::chrono::milliseconds minTime{500};
+};
+
+uint64_t nowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Token calls are counted over a short separate pass with metrics enabled
+constexpr uint64_t CALL_COUNT_ITERATIONS = 16;
+
+Measurement measure(const Benchmark& benchmark, PKCS11Library* metricsLib, std::chrono::milliseconds minTime) {
+    Measurement m;
+    m.name = benchmark.name;
+    m.bytesPerOp = benchmark.bytesPerOp;
+
+    if (!benchmark.run()) { // Warm-up, and surfaces setup errors early
+        m.error = "operation failed";
+        return m;
+    }
+
+    if (metricsLib) {
+        metricsLib->metrics().reset();
+        metricsLib->metrics().setEnabled(true);
+        for (uint64_t i = 0; i < CALL_COUNT_ITERATIONS; i++) {
+            benchmark.run();
+        }
+        metricsLib->metrics().setEnabled(false);
+        m.tokenCallsPerOp = static_cast<double>(metricsLib->metrics().snapshot().totalCalls()) /
+                            CALL_COUNT_ITERATIONS;
+    }
+
+    // Grow the batch until a single batch takes at least minTime
+    const uint64_t target = std::chrono::duration_cast<std::chrono::nanoseconds>(minTime).count();
+    uint64_t batch = 1;
+    while (true) {
+        uint64_t allocationsBefore = allocationCount.load(std::memory_order_relaxed);
+        uint64_t bytesBefore = allocationBytes.load(std::memory_order_relaxed);
+        uint64_t start = nowNanos();
+        for (uint64_t i = 0; i < batch; i++) {
+            if (!benchmark.run()) {
+                m.error = "operation failed";
+                return m;
+            }
+        }
+        uint64_t elapsed = nowNanos() - start;
+
+        if (elapsed >= target || batch >= (uint64_t(1) << 40)) {
+            m.iterations = batch;
+            m.nanosPerOp = static_cast<double>(elapsed) / batch;
+            m.opsPerSecond = elapsed ? batch * 1e9 / elapsed : 0;
+            m.allocationsPerOp =
+                static_cast<double>(allocationCount.load(std::memory_order_relaxed) - allocationsBefore) / batch;
+            m.allocatedBytesPerOp =
+                static_cast<double>(allocationBytes.load(std::memory_order_relaxed) - bytesBefore) / batch;
+            return m;
+        }
+
+        // Aim slightly past the target so the final batch normally suffices
+        uint64_t perOp = elapsed / batch + 1;
+        uint64_t next = target * 6 / 5 / perOp + 1;
+        batch = std::max(batch * 2, std::min(next, batch * 100));
+    }
+}
+
+std::string jsonEscape(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+void writeJson(FILE* out, const Options& options, const std::vector<Measurement>& results) {
+    fprintf(out, "{\n  \"library\": \"%s\",\n  \"latencyScale\": %g,\n  \"minTimeMs\": %lld,\n  \"benchmarks\": [\n",
+            jsonEscape(options.library).c_str(), strtod(options.latencyScale.c_str(), nullptr),
+            static_cast<long long>(options.minTime.count()));
+    for (size_t i = 0; i < results.size(); i++) {
+        const Measurement& m = results[i];
+        fprintf(out, "    {\"name\": \"%s\", ", jsonEscape(m.name).c_str());
+        if (!m.error.empty()) {
+            fprintf(out, "\"error\": \"%s\"}", jsonEscape(m.error).c_str());
+        } else {
+            fprintf(out, "\"iterations\": %llu, \"opsPerSec\": %.1f, \"nsPerOp\": %.1f, "
+                    "\"tokenCallsPerOp\": %.2f, \"allocsPerOp\": %.2f, \"allocBytesPerOp\": %.1f",
+                    static_cast<unsigned long long>(m.iterations), m.opsPerSecond, m.nanosPerOp,
+                    m.tokenCallsPerOp, m.allocationsPerOp, m.allocatedBytesPerOp);
+            if (m.bytesPerOp) {
+                fprintf(out, ", \"bytesPerOp\": %zu, \"mbPerSec\": %.2f", m.bytesPerOp,
+                        m.opsPerSecond * m.bytesPerOp / 1e6);
+            }
+            fprintf(out, "}");
+        }
+        fprintf(out, "%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+bool parseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "missing value for %s\n", arg.c_str());
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--library") {
+            options.library = value;
+        } else if (arg == "--pin") {
+            options.pin = value;
+        } else if (arg == "--min-time") {
+            options.minTime = std::chrono::milliseconds(strtoll(value.c_str(), nullptr, 10));
+        } else if (arg == "--latency-scale") {
+            options.latencyScale = value;
+        } else if (arg == "--filter") {
+            options.filter = value;
+        } else if (arg == "--output") {
+            options.output = value;
+        } else {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+// ---- fixture -----------------------------------------------------------------
+
+// Certificates are not created through PKCS11Library, so they are seeded with
+// the module's own C_CreateObject on a separate session
+bool seedCertificates(const std::string& library, CK_SLOT_ID slot, size_t count) {
+    void* handle = dlopen(library.c_str(), RTLD_NOW);
+    if (!handle) {
+        return false;
+    }
+    auto getFunctionList = (CK_C_GetFunctionList)dlsym(handle, "C_GetFunctionList");
+    CK_FUNCTION_LIST_PTR functions = nullptr;
+    if (!getFunctionList || getFunctionList(&functions) != CKR_OK) {
+        dlclose(handle);
+        return false;
+    }
+
+    CK_SESSION_HANDLE session;
+    if (functions->C_OpenSession(slot, CKF_SERIAL_SESSION | CKF_RW_SESSION, nullptr, nullptr, &session) != CKR_OK) {
+        dlclose(handle);
+        return false;
+    }
+
+    bool ok = true;
+    std::vector<CK_BYTE> value(900, 0x30); // Stand-in DER body, roughly a 2048-bit RSA certificate
+    for (size_t i = 0; i < count && ok; i++) {
+        CK_OBJECT_CLASS objectClass = CKO_CERTIFICATE;
+        CK_CERTIFICATE_TYPE certificateType = CKC_X_509;
+        CK_BBOOL isToken = CK_TRUE;
+        std::string label = "bench-cert-" + std::to_string(i);
+        CK_BYTE id[2] = {0xBE, static_cast<CK_BYTE>(i)};
+        CK_BYTE subject[] = {0x30, 0x00};
+        CK_ATTRIBUTE attributes[] = {
+            {CKA_CLASS, &objectClass, sizeof(objectClass)},
+            {CKA_CERTIFICATE_TYPE, &certificateType, sizeof(certificateType)},
+            {CKA_TOKEN, &isToken, sizeof(isToken)},
+            {CKA_LABEL, &label[0], label.size()},
+            {CKA_ID, id, sizeof(id)},
+            {CKA_SUBJECT, subject, sizeof(subject)},
+            {CKA_VALUE, value.data(), value.size()},
+        };
+        CK_OBJECT_HANDLE object;
+        ok = functions->C_CreateObject(session, attributes, sizeof(attributes) / sizeof(attributes[0]),
+                                       &object) == CKR_OK;
+    }
+
+    functions->C_CloseSession(session);
+    dlclose(handle);
+    return ok;
+}
+
+std::vector<CK_BYTE> pattern(size_t size) {
+    std::vector<CK_BYTE> data(size);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = static_cast<CK_BYTE>(i * 131 + 7);
+    }
+    return data;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        return 2;
+    }
+    setenv("SOFTTOKEN_LATENCY_SCALE", options.latencyScale.c_str(), 1);
+
+    // Keep the module resident so that initialize() measures library start-up
+    // rather than loading the shared object from disk
+    void* resident = dlopen(options.library.c_str(), RTLD_NOW);
+    if (!resident) {
+        fprintf(stderr, "cannot load %s: %s\n", options.library.c_str(), dlerror());
+        return 1;
+    }
+
+    std::vector<Benchmark> benchmarks;
+    std::vector<Measurement> results;
+    auto selected = [&](const std::string& name) {
+        return options.filter.empty() || name.find(options.filter) != std::string::npos;
+    };
+
+    // initialize/finalize runs first, while no other instance holds the
+    // module, so that each iteration pays the real C_Initialize/C_Finalize
+    if (selected("initialize")) {
+        PKCS11Library lifecycle;
+        Benchmark initialize{"initialize+finalize", 0, [&] {
+            bool ok = lifecycle.initialize(options.library).isOk();
+            lifecycle.finalize();
+            return ok;
+        }};
+        results.push_back(measure(initialize, &lifecycle, options.minTime));
+    }
+
+    PKCS11Library lib;
+    auto initialized = lib.initialize(options.library);
+    if (!initialized.isOk()) {
+        fprintf(stderr, "initialize failed: %s\n", initialized.errorMessage.c_str());
+        return 1;
+    }
+    auto slots = lib.getSlotList();
+    if (!slots.isOk() || slots.value.empty()) {
+        fprintf(stderr, "no token present\n");
+        return 1;
+    }
+    CK_SLOT_ID slot = slots.value[0];
+    if (!lib.openSession(slot).isOk() || !lib.login(options.pin).isOk()) {
+        fprintf(stderr, "cannot open a logged-in session on slot %lu\n", slot);
+        return 1;
+    }
+
+    // Token objects, so that findKeys.private has something to find
+    auto rsa = lib.generateRSAKeyPair(2048, "bench-rsa", true);
+    auto ec = lib.generateECKeyPair("bench-ec", true);
+    auto aes = lib.generateSymmetricKey(SymmetricAlgorithm::AES, 32, "bench-aes");
+    if (!rsa.isOk() || !ec.isOk() || !aes.isOk()) {
+        fprintf(stderr, "key generation failed\n");
+        return 1;
+    }
+    if (!seedCertificates(options.library, slot, 4)) {
+        fprintf(stderr, "cannot create certificates on the token\n");
+        return 1;
+    }
+
+    benchmarks.push_back({"getSlotList", 0, [&] {
+        auto r = lib.getSlotList();
+        doNotOptimize(r.value.data());
+        return r.isOk();
+    }});
+    benchmarks.push_back({"findKeys.private", 0, [&] {
+        auto r = lib.findKeys(CKO_PRIVATE_KEY);
+        doNotOptimize(r.value.data());
+        return r.isOk() && !r.value.empty();
+    }});
+    benchmarks.push_back({"findCertificates", 0, [&] {
+        auto r = lib.findCertificates();
+        doNotOptimize(r.value.data());
+        return r.isOk() && !r.value.empty();
+    }});
+
+    std::vector<CK_BYTE> message = pattern(256);
+    auto rsaSignature = lib.sign(rsa.value.privateKey.handle, message, HashAlgorithm::SHA256);
+    auto ecSignature = lib.signECDSA(ec.value.privateKey.handle, message);
+    benchmarks.push_back({"sign.rsa2048.sha256", message.size(), [&] {
+        auto r = lib.sign(rsa.value.privateKey.handle, message, HashAlgorithm::SHA256);
+        doNotOptimize(r.value.data());
+        return r.isOk();
+    }});
+    benchmarks.push_back({"verify.rsa2048.sha256", message.size(), [&] {
+        return lib.verify(rsa.value.publicKey.handle, message, rsaSignature.value, HashAlgorithm::SHA256).isOk();
+    }});
+    benchmarks.push_back({"sign.ecdsa.p256", message.size(), [&] {
+        auto r = lib.signECDSA(ec.value.privateKey.handle, message);
+        doNotOptimize(r.value.data());
+        return r.isOk();
+    }});
+    benchmarks.push_back({"verify.ecdsa.p256", message.size(), [&] {
+        return lib.verifyECDSA(ec.value.publicKey.handle, message, ecSignature.value).isOk();
+    }});
+
+    const std::vector<CK_BYTE> iv(16, 0x42);
+    std::vector<std::vector<CK_BYTE>> plaintexts;
+    std::vector<std::vector<CK_BYTE>> ciphertexts;
+    for (size_t size : {16, 1024, 65536}) {
+        plaintexts.push_back(pattern(size));
+        ciphertexts.push_back(lib.encrypt(aes.value.handle, plaintexts.back(), SymmetricAlgorithm::AES,
+                                          CipherMode::CBC_PAD, iv).value);
+    }
+    for (size_t i = 0; i < plaintexts.size(); i++) {
+        size_t size = plaintexts[i].size();
+        std::string suffix = std::to_string(size);
+        benchmarks.push_back({"encrypt.aes256cbc." + suffix, size, [&, i] {
+            auto r = lib.encrypt(aes.value.handle, plaintexts[i], SymmetricAlgorithm::AES, CipherMode::CBC_PAD, iv);
+            doNotOptimize(r.value.data());
+            return r.isOk();
+        }});
+        benchmarks.push_back({"decrypt.aes256cbc." + suffix, size, [&, i] {
+            auto r = lib.decrypt(aes.value.handle, ciphertexts[i], SymmetricAlgorithm::AES, CipherMode::CBC_PAD, iv);
+            doNotOptimize(r.value.data());
+            return r.isOk();
+        }});
+    }
+
+    std::vector<CK_BYTE> rsaPlaintext = pattern(32);
+    auto rsaCiphertext = lib.encryptRSA(rsa.value.publicKey.handle, rsaPlaintext);
+    benchmarks.push_back({"encrypt.rsa2048.32", rsaPlaintext.size(), [&] {
+        auto r = lib.encryptRSA(rsa.value.publicKey.handle, rsaPlaintext);
+        doNotOptimize(r.value.data());
+        return r.isOk();
+    }});
+    benchmarks.push_back({"decrypt.rsa2048.32", rsaPlaintext.size(), [&] {
+        auto r = lib.decryptRSA(rsa.value.privateKey.handle, rsaCiphertext.value);
+        doNotOptimize(r.value.data());
+        return r.isOk();
+    }});
+
+    std::vector<std::vector<CK_BYTE>> hexInputs = {pattern(32), pattern(4096)};
+    std::vector<std::string> hexStrings;
+    for (const auto& bytes : hexInputs) {
+        hexStrings.push_back(PKCS11Library::bytesToHex(bytes));
+    }
+    for (size_t i = 0; i < hexInputs.size(); i++) {
+        size_t size = hexInputs[i].size();
+        std::string suffix = std::to_string(size);
+        benchmarks.push_back({"bytesToHex." + suffix, size, [&, i] {
+            std::string r = PKCS11Library::bytesToHex(hexInputs[i]);
+            doNotOptimize(r.data());
+            return r.size() == hexInputs[i].size() * 2;
+        }});
+        benchmarks.push_back({"hexToBytes." + suffix, size, [&, i] {
+            std::vector<CK_BYTE> r = PKCS11Library::hexToBytes(hexStrings[i]);
+            doNotOptimize(r.data());
+            return r.size() == hexInputs[i].size();
+        }});
+    }
+
+    const std::vector<CK_BYTE> signatureSized = pattern(256);
+    benchmarks.push_back({"Result.ok.bytes256", 0, [&] {
+        auto r = Result<std::vector<CK_BYTE>>::Ok(signatureSized);
+        doNotOptimize(r.value.data());
+        return r.isOk();
+    }});
+    benchmarks.push_back({"Result.error.bytes", 0, [&] {
+        auto r = Result<std::vector<CK_BYTE>>::Error(Status::ERROR_DEVICE_REMOVED, "Failed to sign data",
+                                                    CKR_DEVICE_REMOVED);
+        doNotOptimize(r.errorMessage.data());
+        return r.isError();
+    }});
+    benchmarks.push_back({"Result.ok.void", 0, [&] {
+        auto r = Result<void>::Ok();
+        doNotOptimize(r);
+        return r.isOk();
+    }});
+
+    for (const auto& benchmark : benchmarks) {
+        if (selected(benchmark.name)) {
+            results.push_back(measure(benchmark, &lib, options.minTime));
+            fprintf(stderr, "%-28s done\n", benchmark.name.c_str());
+        }
+    }
+
+    lib.finalize();
+    dlclose(resident);
+
+    FILE* out = stdout;
+    if (!options.output.empty()) {
+        out = fopen(options.output.c_str(), "w");
+        if (!out) {
+            fprintf(stderr, "cannot write %s\n", options.output.c_str());
+            return 1;
+        }
+    }
+    writeJson(out, options, results);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    for (const auto& m : results) {
+        if (!m.error.empty()) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,330 @@
+#include "broker_client.h"
+
+#include <sys/un.h>
+
+namespace PKCS11Lib {
+
+using namespace Broker;
+
+namespace {
+
+std::vector<CK_BYTE> readBytes(Reader& r) {
+    return r.bytes();
+}
+
+KeyPair readKeyPair(Reader& r) {
+    KeyPair pair;
+    pair.publicKey = readKeyInfo(r);
+    pair.privateKey = readKeyInfo(r);
+    return pair;
+}
+
+template<typename T, T (*Decode)(Reader&)>
+std::vector<T> readList(Reader& r) {
+    std::vector<T> items;
+    uint32_t count = r.u32();
+    for (uint32_t i = 0; i < count && !r.failed(); i++) {
+        items.push_back(Decode(r));
+    }
+    return items;
+}
+
+} // namespace
+
+BrokerClient::BrokerClient()
+    : fd_(-1), nextRequestId_(1), slot_(0), priority_(Priority::Normal), budget_(0) {
+}
+
+BrokerClient::~BrokerClient() {
+    disconnect();
+}
+
+Result<void> BrokerClient::connect(const std::string& socketPath) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (fd_ >= 0) {
+            return Result<void>::Ok();
+        }
+
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path)) {
+            return Result<void>::Error(Status::ERROR_INVALID_PARAMETER, "Socket path too long");
+        }
+        strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+        fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd_ < 0 || ::connect(fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+            if (fd_ >= 0) {
+                close(fd_);
+                fd_ = -1;
+            }
+            return Result<void>::Error(Status::ERROR_FILE_IO, "Cannot connect to token broker at " + socketPath);
+        }
+    }
+
+    Writer hello;
+    hello.u32(PROTOCOL_VERSION);
+    auto result = request(Op::Hello, hello);
+    if (!result.isOk()) {
+        disconnect();
+    }
+    return result;
+}
+
+void BrokerClient::disconnect() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+}
+
+template<typename T, typename Decode>
+Result<T> BrokerClient::request(Op op, const Writer& args, Decode decode) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (fd_ < 0) {
+        return Result<T>::Error(Status::ERROR_GENERAL, "Not connected to token broker");
+    }
+
+    FrameHeader header{};
+    header.length = static_cast<uint32_t>(args.data().size());
+    header.op = static_cast<uint16_t>(op);
+    header.requestId = nextRequestId_++;
+    header.flags = priorityFlags(priority_);
+    header.budgetMs = static_cast<uint32_t>(budget_.count());
+    header.slot = slot_;
+
+    FrameHeader responseHeader;
+    std::vector<uint8_t> response;
+    bool ok = header.length <= MAX_PAYLOAD && sendFrame(fd_, header, args.data().data()) &&
+              readFrame(fd_, responseHeader, response) && responseHeader.requestId == header.requestId;
+    if (!ok) {
+        // The stream is out of step or gone; later calls fail fast
+        close(fd_);
+        fd_ = -1;
+        return Result<T>::Error(Status::ERROR_DEVICE_REMOVED, "Lost connection to token broker");
+    }
+
+    Reader r(response.data(), response.size());
+    auto status = static_cast<Status>(r.u32());
+    unsigned long rv = r.u64();
+    if (r.failed()) {
+        return Result<T>::Error(Status::ERROR_GENERAL, "Malformed broker response");
+    }
+    if (status != Status::OK) {
+        return Result<T>::Error(status, r.str(), rv);
+    }
+
+    T value = decode(r);
+    if (r.failed()) {
+        return Result<T>::Error(Status::ERROR_GENERAL, "Malformed broker response");
+    }
+    return Result<T>::Ok(value);
+}
+
+Result<void> BrokerClient::request(Op op, const Writer& args) {
+    auto result = request<bool>(op, args, [](Reader&) { return true; });
+    if (!result.isOk()) {
+        return Result<void>::Error(result.errorCode, result.errorMessage, result.pkcs11Error);
+    }
+    return Result<void>::Ok();
+}
+
+Result<std::vector<int>> BrokerClient::openChannel(uint32_t entries, uint64_t arenaBytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (fd_ < 0) {
+        return Result<std::vector<int>>::Error(Status::ERROR_GENERAL, "Not connected to token broker");
+    }
+
+    Writer args;
+    args.u32(entries).u64(arenaBytes);
+    FrameHeader header{};
+    header.length = static_cast<uint32_t>(args.data().size());
+    header.op = static_cast<uint16_t>(Op::OpenChannel);
+    header.requestId = nextRequestId_++;
+
+    FrameHeader responseHeader;
+    std::vector<uint8_t> response;
+    std::vector<int> fds;
+    if (!sendFrame(fd_, header, args.data().data()) ||
+        !readFrameWithFds(fd_, responseHeader, response, fds) || responseHeader.requestId != header.requestId) {
+        for (int fd : fds) {
+            close(fd);
+        }
+        close(fd_);
+        fd_ = -1;
+        return Result<std::vector<int>>::Error(Status::ERROR_DEVICE_REMOVED, "Lost connection to token broker");
+    }
+
+    Reader r(response.data(), response.size());
+    auto status = static_cast<Status>(r.u32());
+    unsigned long rv = r.u64();
+    if (status != Status::OK || fds.size() != 3) {
+        for (int fd : fds) {
+            close(fd);
+        }
+        std::string message = status != Status::OK ? r.str() : "Broker sent no channel descriptors";
+        return Result<std::vector<int>>::Error(status != Status::OK ? status : Status::ERROR_GENERAL, message, rv);
+    }
+    return Result<std::vector<int>>::Ok(fds);
+}
+
+Result<std::vector<BrokerToken>> BrokerClient::listTokens() {
+    return request<std::vector<BrokerToken>>(Op::ListTokens, Writer(), [](Reader& r) {
+        std::vector<BrokerToken> tokens;
+        uint32_t count = r.u32();
+        for (uint32_t i = 0; i < count && !r.failed(); i++) {
+            BrokerToken token;
+            token.slot = r.u64();
+            token.label = r.str();
+            token.serialNumber = r.str();
+            token.model = r.str();
+            token.loggedIn = r.u32() != 0;
+            tokens.push_back(std::move(token));
+        }
+        return tokens;
+    });
+}
+
+Result<void> BrokerClient::login(const std::string& pin) {
+    Writer args;
+    args.str(pin);
+    return request(Op::Login, args);
+}
+
+Result<void> BrokerClient::logout() {
+    return request(Op::Logout, Writer());
+}
+
+Result<TokenInfo> BrokerClient::getTokenInfo() {
+    return request<TokenInfo>(Op::GetTokenInfo, Writer(), readTokenInfo);
+}
+
+Result<PinInfo> BrokerClient::getPinInfo() {
+    return request<PinInfo>(Op::GetPinInfo, Writer(), readPinInfo);
+}
+
+Result<std::vector<PriorityStats>> BrokerClient::getQueueStats() {
+    return request<std::vector<PriorityStats>>(Op::GetQueueStats, Writer(), readList<PriorityStats, readQueueStats>);
+}
+
+Result<std::vector<CertificateInfo>> BrokerClient::findCertificates() {
+    return request<std::vector<CertificateInfo>>(Op::FindCertificates, Writer(),
+                                                 readList<CertificateInfo, readCertificateInfo>);
+}
+
+Result<std::vector<KeyInfo>> BrokerClient::findKeys(CK_OBJECT_CLASS keyClass) {
+    Writer args;
+    args.u64(keyClass);
+    return request<std::vector<KeyInfo>>(Op::FindKeys, args, readList<KeyInfo, readKeyInfo>);
+}
+
+Result<std::vector<CK_BYTE>> BrokerClient::exportCertificate(CK_OBJECT_HANDLE certHandle) {
+    Writer args;
+    args.u64(certHandle);
+    return request<std::vector<CK_BYTE>>(Op::ExportCertificate, args, readBytes);
+}
+
+Result<std::vector<CK_BYTE>> BrokerClient::getObjectAttribute(CK_OBJECT_HANDLE objectHandle,
+                                                              CK_ATTRIBUTE_TYPE attrType) {
+    Writer args;
+    args.u64(objectHandle).u64(attrType);
+    return request<std::vector<CK_BYTE>>(Op::GetAttribute, args, readBytes);
+}
+
+Result<void> BrokerClient::setObjectAttribute(CK_OBJECT_HANDLE objectHandle, CK_ATTRIBUTE_TYPE attrType,
+                                              const std::vector<CK_BYTE>& value) {
+    Writer args;
+    args.u64(objectHandle).u64(attrType).bytes(value);
+    return request(Op::SetAttribute, args);
+}
+
+Result<void> BrokerClient::destroyObject(CK_OBJECT_HANDLE objectHandle) {
+    Writer args;
+    args.u64(objectHandle);
+    return request(Op::DestroyObject, args);
+}
+
+Result<std::vector<CK_BYTE>> BrokerClient::sign(CK_OBJECT_HANDLE privateKeyHandle, const std::vector<CK_BYTE>& data,
+                                               HashAlgorithm hashAlg) {
+    Writer args;
+    args.u64(privateKeyHandle).u32(static_cast<uint32_t>(hashAlg)).bytes(data);
+    return request<std::vector<CK_BYTE>>(Op::Sign, args, readBytes);
+}
+
+Result<void> BrokerClient::verify(CK_OBJECT_HANDLE publicKeyHandle, const std::vector<CK_BYTE>& data,
+                                  const std::vector<CK_BYTE>& signature, HashAlgorithm hashAlg) {
+    Writer args;
+    args.u64(publicKeyHandle).u32(static_cast<uint32_t>(hashAlg)).bytes(data).bytes(signature);
+    return request(Op::Verify, args);
+}
+
+Result<std::vector<CK_BYTE>> BrokerClient::signECDSA(CK_OBJECT_HANDLE privateKeyHandle,
+                                                    const std::vector<CK_BYTE>& data,
+                                                    HashAlgorithm hashAlg, SignatureEncoding encoding) {
+    Writer args;
+    args.u64(privateKeyHandle).u32(static_cast<uint32_t>(hashAlg)).u32(static_cast<uint32_t>(encoding)).bytes(data);
+    return request<std::vector<CK_BYTE>>(Op::SignECDSA, args, readBytes);
+}
+
+Result<void> BrokerClient::verifyECDSA(CK_OBJECT_HANDLE publicKeyHandle, const std::vector<CK_BYTE>& data,
+                                       const std::vector<CK_BYTE>& signature, HashAlgorithm hashAlg,
+                                       SignatureEncoding encoding) {
+    Writer args;
+    args.u64(publicKeyHandle).u32(static_cast<uint32_t>(hashAlg)).u32(static_cast<uint32_t>(encoding));
+    args.bytes(data).bytes(signature);
+    return request(Op::VerifyECDSA, args);
+}
+
+Result<std::vector<CK_BYTE>> BrokerClient::encrypt(CK_OBJECT_HANDLE keyHandle, const std::vector<CK_BYTE>& plaintext,
+                                                  SymmetricAlgorithm algorithm, CipherMode mode,
+                                                  const std::vector<CK_BYTE>& iv) {
+    Writer args;
+    args.u64(keyHandle).u32(static_cast<uint32_t>(algorithm)).u32(static_cast<uint32_t>(mode));
+    args.bytes(iv).bytes(plaintext);
+    return request<std::vector<CK_BYTE>>(Op::Encrypt, args, readBytes);
+}
+
+Result<std::vector<CK_BYTE>> BrokerClient::decrypt(CK_OBJECT_HANDLE keyHandle, const std::vector<CK_BYTE>& ciphertext,
+                                                  SymmetricAlgorithm algorithm, CipherMode mode,
+                                                  const std::vector<CK_BYTE>& iv) {
+    Writer args;
+    args.u64(keyHandle).u32(static_cast<uint32_t>(algorithm)).u32(static_cast<uint32_t>(mode));
+    args.bytes(iv).bytes(ciphertext);
+    return request<std::vector<CK_BYTE>>(Op::Decrypt, args, readBytes);
+}
+
+Result<std::vector<CK_BYTE>> BrokerClient::encryptRSA(CK_OBJECT_HANDLE publicKeyHandle,
+                                                     const std::vector<CK_BYTE>& plaintext) {
+    Writer args;
+    args.u64(publicKeyHandle).bytes(plaintext);
+    return request<std::vector<CK_BYTE>>(Op::EncryptRSA, args, readBytes);
+}
+
+Result<std::vector<CK_BYTE>> BrokerClient::decryptRSA(CK_OBJECT_HANDLE privateKeyHandle,
+                                                     const std::vector<CK_BYTE>& ciphertext) {
+    Writer args;
+    args.u64(privateKeyHandle).bytes(ciphertext);
+    return request<std::vector<CK_BYTE>>(Op::DecryptRSA, args, readBytes);
+}
+
+Result<KeyPair> BrokerClient::generateRSAKeyPair(CK_ULONG modulusBits, const std::string& label, bool tokenObject) {
+    Writer args;
+    args.u64(modulusBits).str(label).u32(tokenObject ? 1 : 0);
+    return request<KeyPair>(Op::GenerateRSAKeyPair, args, readKeyPair);
+}
+
+Result<KeyPair> BrokerClient::generateECKeyPair(const std::string& label, bool tokenObject) {
+    Writer args;
+    args.str(label).u32(tokenObject ? 1 : 0);
+    return request<KeyPair>(Op::GenerateECKeyPair, args, readKeyPair);
+}
+
+Result<std::vector<CK_BYTE>> BrokerClient::transmitAPDU(const std::vector<CK_BYTE>& command) {
+    Writer args;
+    args.bytes(command);
+    return request<std::vector<CK_BYTE>>(Op::TransmitAPDU, args, readBytes);
+}
+
+} // namespace PKCS11Lib
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "broker_protocol.h"
+
+namespace PKCS11Lib {
+
+struct BrokerToken {
+    CK_SLOT_ID slot;
+    std::string label;
+    std::string serialNumber;
+    std::string model;
+    bool loggedIn;          // the broker's session, not this client's authorization
+};
+
+// Client side of token-broker. Mirrors the PKCS11Library calls the broker
+// serves, on the token chosen with selectSlot(); each call is one request
+// and one response on the broker socket. Calls are serialised per client:
+// use one client per thread for concurrent requests.
+//
+//   BrokerClient client;
+//   client.connect();
+//   client.selectSlot(client.listTokens().value.at(0).slot);
+//   client.login(pin);
+//   auto signature = client.sign(key, data, HashAlgorithm::SHA256);
+class BrokerClient {
+public:
+    BrokerClient();
+    ~BrokerClient();
+
+    BrokerClient(const BrokerClient&) = delete;
+    BrokerClient& operator=(const BrokerClient&) = delete;
+
+    Result<void> connect(const std::string& socketPath = Broker::defaultSocketPath());
+    void disconnect();
+    bool isConnected() const { return fd_ >= 0; }
+
+    Result<std::vector<BrokerToken>> listTokens();
+    void selectSlot(CK_SLOT_ID slot) { slot_ = slot; }
+    CK_SLOT_ID currentSlotId() const { return slot_; }
+
+    // Scheduling of this client's later requests on the broker: Interactive
+    // requests overtake queued Bulk ones. A nonzero budget makes a request
+    // fail with ERROR_FUNCTION_CANCELED when the token stays busy that long.
+    void setPriority(Priority priority) { priority_ = priority; }
+    void setQueueBudget(std::chrono::milliseconds budget) { budget_ = budget; }
+
+    // Authorizes this connection for the selected token
+    Result<void> login(const std::string& pin);
+    Result<void> logout();
+
+    Result<TokenInfo> getTokenInfo();
+    Result<PinInfo> getPinInfo();
+    // Per-priority queue counters and latencies of the selected token
+    Result<std::vector<PriorityStats>> getQueueStats();
+
+    Result<std::vector<CertificateInfo>> findCertificates();
+    Result<std::vector<KeyInfo>> findKeys(CK_OBJECT_CLASS keyClass = CKO_PUBLIC_KEY);
+    Result<std::vector<CK_BYTE>> exportCertificate(CK_OBJECT_HANDLE certHandle);
+    Result<std::vector<CK_BYTE>> getObjectAttribute(CK_OBJECT_HANDLE objectHandle, CK_ATTRIBUTE_TYPE attrType);
+    Result<void> setObjectAttribute(CK_OBJECT_HANDLE objectHandle, CK_ATTRIBUTE_TYPE attrType,
+                                    const std::vector<CK_BYTE>& value);
+    Result<void> destroyObject(CK_OBJECT_HANDLE objectHandle);
+
+    Result<std::vector<CK_BYTE>> sign(CK_OBJECT_HANDLE privateKeyHandle, const std::vector<CK_BYTE>& data,
+                                     HashAlgorithm hashAlg = HashAlgorithm::SHA1);
+    Result<void> verify(CK_OBJECT_HANDLE publicKeyHandle, const std::vector<CK_BYTE>& data,
+                       const std::vector<CK_BYTE>& signature, HashAlgorithm hashAlg = HashAlgorithm::SHA1);
+    Result<std::vector<CK_BYTE>> signECDSA(CK_OBJECT_HANDLE privateKeyHandle, const std::vector<CK_BYTE>& data,
+                                          HashAlgorithm hashAlg = HashAlgorithm::SHA256,
+                                          SignatureEncoding encoding = SignatureEncoding::RAW);
+    Result<void> verifyECDSA(CK_OBJECT_HANDLE publicKeyHandle, const std::vector<CK_BYTE>& data,
+                            const std::vector<CK_BYTE>& signature, HashAlgorithm hashAlg = HashAlgorithm::SHA256,
+                            SignatureEncoding encoding = SignatureEncoding::RAW);
+    Result<std::vector<CK_BYTE>> encrypt(CK_OBJECT_HANDLE keyHandle, const std::vector<CK_BYTE>& plaintext,
+                                        SymmetricAlgorithm algorithm = SymmetricAlgorithm::DES,
+                                        CipherMode mode = CipherMode::CBC, const std::vector<CK_BYTE>& iv = {});
+    Result<std::vector<CK_BYTE>> decrypt(CK_OBJECT_HANDLE keyHandle, const std::vector<CK_BYTE>& ciphertext,
+                                        SymmetricAlgorithm algorithm = SymmetricAlgorithm::DES,
+                                        CipherMode mode = CipherMode::CBC, const std::vector<CK_BYTE>& iv = {});
+    Result<std::vector<CK_BYTE>> encryptRSA(CK_OBJECT_HANDLE publicKeyHandle, const std::vector<CK_BYTE>& plaintext);
+    Result<std::vector<CK_BYTE>> decryptRSA(CK_OBJECT_HANDLE privateKeyHandle, const std::vector<CK_BYTE>& ciphertext);
+
+    Result<KeyPair> generateRSAKeyPair(CK_ULONG modulusBits, const std::string& label, bool tokenObject = true);
+    Result<KeyPair> generateECKeyPair(const std::string& label, bool tokenObject = true);
+
+    Result<std::vector<CK_BYTE>> transmitAPDU(const std::vector<CK_BYTE>& command);
+
+private:
+    friend class SharedChannel;
+
+    // OpenChannel request; returns the memfd, submit and complete eventfds
+    Result<std::vector<int>> openChannel(uint32_t entries, uint64_t arenaBytes);
+
+    // Sends one request and decodes the matching response with decode(Reader&)
+    template<typename T, typename Decode>
+    Result<T> request(Broker::Op op, const Broker::Writer& args, Decode decode);
+    Result<void> request(Broker::Op op, const Broker::Writer& args);
+
+    std::mutex mutex_;
+    int fd_;
+    uint32_t nextRequestId_;
+    CK_SLOT_ID slot_;
+    Priority priority_;
+    std::chrono::milliseconds budget_;
+};
+
+} // namespace PKCS11Lib
@@ -0,0 +1,503 @@
+#pragma once
+
+// Wire protocol between token-broker and its clients.
+//
+// Frames travel over a local Unix stream socket in host byte order. Each
+// frame is a FrameHeader followed by `length` payload bytes. A request's
+// payload holds the operation's arguments; the response echoes the op and
+// requestId and carries u32 status, u64 rv, then either the result fields
+// (status OK) or an error message. Fields are u32/u64 scalars and byte
+// strings (u32 length + bytes), in the order listed for each Op below.
+//
+// Requests may be pipelined: responses carry the request's id, and requests
+// for different tokens can complete out of order. Requests for one token run
+// one at a time, ordered by the priority in their flags (see FRAME_PRIORITY_MASK)
+// and otherwise in arrival order.
+
+#include "pkcs11_lib.h"
+#include "token_scheduler.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+namespace PKCS11Lib {
+namespace Broker {
+
+constexpr uint32_t PROTOCOL_VERSION = 1;
+constexpr uint32_t MAX_PAYLOAD = 16u << 20;
+
+enum class Op : uint16_t {
+    // Broker level, no token needed
+    Hello = 1,              // u32 version -> u32 version, u32 maxPayload
+    ListTokens = 2,         // -> u32 count, count x (u64 slot, str label, str serial, str model, u32 loggedIn)
+    OpenChannel = 3,        // u32 entries, u64 arenaBytes -> u32 entries, u64 arenaBytes, plus
+                            // SCM_RIGHTS memfd, submit eventfd, complete eventfd (see SharedChannelHeader)
+
+    // Authentication: login proves the PIN for this connection. The token
+    // itself is logged in once, by the first client, and stays logged in.
+    Login = 10,             // str pin
+    Logout = 11,            // drops this connection's authorization only
+
+    // Open to any permitted peer
+    GetTokenInfo = 20,      // -> TokenInfo
+    GetPinInfo = 21,        // -> PinInfo
+    GetQueueStats = 22,     // -> u32 count, count x QueueStats; answered without queueing
+
+    // Require Login on this connection
+    FindCertificates = 30,  // -> u32 count, CertificateInfo...
+    FindKeys = 31,          // u64 class -> u32 count, KeyInfo...
+    ExportCertificate = 32, // u64 handle -> bytes
+    GetAttribute = 33,      // u64 handle, u64 type -> bytes
+    SetAttribute = 34,      // u64 handle, u64 type, bytes value
+    DestroyObject = 35,     // u64 handle
+
+    Sign = 40,              // u64 key, u32 hash, bytes data -> bytes
+    Verify = 41,            // u64 key, u32 hash, bytes data, bytes signature
+    SignECDSA = 42,         // u64 key, u32 hash, u32 encoding, bytes data -> bytes
+    VerifyECDSA = 43,       // u64 key, u32 hash, u32 encoding, bytes data, bytes signature
+    Encrypt = 44,           // u64 key, u32 algorithm, u32 mode, bytes iv, bytes data -> bytes
+    Decrypt = 45,           // u64 key, u32 algorithm, u32 mode, bytes iv, bytes data -> bytes
+    EncryptRSA = 46,        // u64 key, bytes data -> bytes
+    DecryptRSA = 47,        // u64 key, bytes data -> bytes
+
+    GenerateRSAKeyPair = 50, // u64 bits, str label, u32 tokenObject -> KeyPair
+    GenerateECKeyPair = 51,  // str label, u32 tokenObject -> KeyPair
+
+    TransmitAPDU = 60       // bytes command -> bytes
+};
+
+struct FrameHeader {
+    uint32_t length;        // payload bytes that follow
+    uint16_t op;
+    uint16_t flags;         // request: FRAME_PRIORITY_* in the low bits; other bits 0
+    uint32_t requestId;
+    uint32_t budgetMs;      // request: answered with ERROR_FUNCTION_CANCELED if the token
+                            // is not free within this many ms; 0 waits indefinitely
+    uint64_t slot;          // target token, ignored by broker-level ops
+};
+static_assert(sizeof(FrameHeader) == 24, "FrameHeader is part of the wire format");
+
+// Request priority. 0 is Normal so that clients which leave flags zero keep
+// their place; Interactive requests overtake queued Bulk ones between operations.
+constexpr uint16_t FRAME_PRIORITY_MASK = 0x3;
+constexpr uint16_t FRAME_PRIORITY_NORMAL = 0;
+constexpr uint16_t FRAME_PRIORITY_INTERACTIVE = 1;
+constexpr uint16_t FRAME_PRIORITY_BULK = 2;
+
+inline uint16_t priorityFlags(Priority priority) {
+    switch (priority) {
+        case Priority::Interactive: return FRAME_PRIORITY_INTERACTIVE;
+        case Priority::Bulk: return FRAME_PRIORITY_BULK;
+        default: return FRAME_PRIORITY_NORMAL;
+    }
+}
+
+inline Priority framePriority(uint16_t flags) {
+    switch (flags & FRAME_PRIORITY_MASK) {
+        case FRAME_PRIORITY_INTERACTIVE: return Priority::Interactive;
+        case FRAME_PRIORITY_BULK: return Priority::Bulk;
+        default: return Priority::Normal;
+    }
+}
+
+// ---- shared-memory channel ---------------------------------------------------
+//
+// A channel is a memfd mapped by the client and the broker:
+//   SharedChannelHeader | entries x SharedSubmission | entries x SharedCompletion | arena
+// Requests go through the submission ring (client produces, broker
+// consumes) and finish in the completion ring (broker produces, client
+// consumes). Both rings are single-producer/single-consumer and lock-free.
+// Arguments and results stay in the arena and are passed by offset: the
+// arguments use the socket encoding, and the result is a complete response
+// payload (u32 status, u64 rv, fields).
+//
+// Wakeups: a consumer that finds its ring empty sets its sleeping flag,
+// checks again, then blocks on its eventfd; a producer writes the eventfd
+// only when the flag is set, so a busy channel makes no system calls.
+
+constexpr uint32_t CHANNEL_MAGIC = 0x43423131; // "11BC"
+constexpr uint32_t CHANNEL_MAX_ENTRIES = 4096;
+constexpr uint64_t CHANNEL_MAX_ARENA = 1ull << 30;
+
+struct SharedSubmission {
+    uint32_t requestId;
+    uint16_t op;
+    uint16_t flags;         // FRAME_PRIORITY_* as in FrameHeader
+    uint64_t slot;
+    uint64_t argsOffset;    // arena offsets
+    uint64_t resultOffset;
+    uint32_t argsLength;
+    uint32_t resultCapacity;
+};
+
+struct SharedCompletion {
+    uint32_t requestId;
+    uint32_t status;        // Status::OK: the response is at resultOffset.
+                            // ERROR_BUFFER_TOO_SMALL: resultLength is the size needed.
+                            // ERROR_ARGUMENTS_BAD: offsets outside the arena, not run
+    uint32_t resultLength;
+    uint32_t reserved;
+};
+
+struct SharedChannelHeader {
+    uint32_t magic;
+    uint32_t entries;       // power of two
+    uint64_t submissionsOffset;
+    uint64_t completionsOffset;
+    uint64_t arenaOffset;
+    uint64_t arenaSize;
+
+    alignas(64) std::atomic<uint32_t> submitHead;       // written by the client
+    alignas(64) std::atomic<uint32_t> submitTail;       // written by the broker
+    alignas(64) std::atomic<uint32_t> completeHead;     // written by the broker
+    alignas(64) std::atomic<uint32_t> completeTail;     // written by the client
+    alignas(64) std::atomic<uint32_t> brokerSleeping;
+    alignas(64) std::atomic<uint32_t> clientSleeping;
+};
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "ring indices are shared between processes");
+
+struct ChannelLayout {
+    uint64_t submissionsOffset;
+    uint64_t completionsOffset;
+    uint64_t arenaOffset;
+    uint64_t totalSize;
+};
+
+inline ChannelLayout channelLayout(uint32_t entries, uint64_t arenaSize) {
+    auto align = [](uint64_t value, uint64_t to) { return (value + to - 1) / to * to; };
+    ChannelLayout layout;
+    layout.submissionsOffset = align(sizeof(SharedChannelHeader), 64);
+    layout.completionsOffset = align(layout.submissionsOffset + entries * sizeof(SharedSubmission), 64);
+    layout.arenaOffset = align(layout.completionsOffset + entries * sizeof(SharedCompletion), 4096);
+    layout.totalSize = layout.arenaOffset + align(arenaSize, 4096);
+    return layout;
+}
+
+class Writer {
+public:
+    Writer& u32(uint32_t value) { return raw(&value, sizeof(value)); }
+    Writer& u64(uint64_t value) { return raw(&value, sizeof(value)); }
+
+    Writer& bytes(const void* data, size_t length) {
+        u32(static_cast<uint32_t>(length));
+        return raw(data, length);
+    }
+    Writer& bytes(const std::vector<CK_BYTE>& value) { return bytes(value.data(), value.size()); }
+    Writer& str(const std::string& value) { return bytes(value.data(), value.size()); }
+
+    const std::vector<uint8_t>& data() const { return data_; }
+    std::vector<uint8_t> take() { return std::move(data_); }
+
+private:
+    Writer& raw(const void* data, size_t length) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        data_.insert(data_.end(), p, p + length);
+        return *this;
+    }
+
+    std::vector<uint8_t> data_;
+};
+
+// Reads fields in order; a short or malformed payload sets failed() and
+// yields zero values from then on
+class Reader {
+public:
+    Reader(const uint8_t* data, size_t size) : data_(data), size_(size), offset_(0), failed_(false) {}
+
+    uint32_t u32() { uint32_t value = 0; raw(&value, sizeof(value)); return value; }
+    uint64_t u64() { uint64_t value = 0; raw(&value, sizeof(value)); return value; }
+
+    std::vector<CK_BYTE> bytes() {
+        uint32_t length = u32();
+        if (failed_ || length > size_ - offset_) {
+            failed_ = true;
+            return {};
+        }
+        std::vector<CK_BYTE> value(data_ + offset_, data_ + offset_ + length);
+        offset_ += length;
+        return value;
+    }
+
+    std::string str() {
+        std::vector<CK_BYTE> value = bytes();
+        return std::string(value.begin(), value.end());
+    }
+
+    bool failed() const { return failed_; }
+    bool atEnd() const { return !failed_ && offset_ == size_; }
+
+private:
+    void raw(void* out, size_t length) {
+        if (failed_ || length > size_ - offset_) {
+            failed_ = true;
+            return;
+        }
+        memcpy(out, data_ + offset_, length);
+        offset_ += length;
+    }
+
+    const uint8_t* data_;
+    size_t size_;
+    size_t offset_;
+    bool failed_;
+};
+
+// ---- result types ------------------------------------------------------------
+
+inline void writeTokenInfo(Writer& w, const TokenInfo& info) {
+    w.str(info.label).str(info.manufacturerId).str(info.model).str(info.serialNumber);
+    w.u64(info.flags).u64(info.maxSessionCount).u64(info.sessionCount);
+    w.u64(info.maxRwSessionCount).u64(info.rwSessionCount).u64(info.maxPinLen).u64(info.minPinLen);
+    w.u64(info.totalPublicMemory).u64(info.freePublicMemory);
+    w.u64(info.totalPrivateMemory).u64(info.freePrivateMemory);
+    w.u32(info.hardwareVersion.major << 8 | info.hardwareVersion.minor);
+    w.u32(info.firmwareVersion.major << 8 | info.firmwareVersion.minor);
+}
+
+inline TokenInfo readTokenInfo(Reader& r) {
+    TokenInfo info;
+    info.label = r.str();
+    info.manufacturerId = r.str();
+    info.model = r.str();
+    info.serialNumber = r.str();
+    info.flags = r.u64();
+    info.maxSessionCount = r.u64();
+    info.sessionCount = r.u64();
+    info.maxRwSessionCount = r.u64();
+    info.rwSessionCount = r.u64();
+    info.maxPinLen = r.u64();
+    info.minPinLen = r.u64();
+    info.totalPublicMemory = r.u64();
+    info.freePublicMemory = r.u64();
+    info.totalPrivateMemory = r.u64();
+    info.freePrivateMemory = r.u64();
+    uint32_t hardware = r.u32();
+    uint32_t firmware = r.u32();
+    info.hardwareVersion = {static_cast<CK_BYTE>(hardware >> 8), static_cast<CK_BYTE>(hardware)};
+    info.firmwareVersion = {static_cast<CK_BYTE>(firmware >> 8), static_cast<CK_BYTE>(firmware)};
+    return info;
+}
+
+inline void writePinInfo(Writer& w, const PinInfo& info) {
+    w.u32(info.soMaxRetries).u32(info.soCurCounter).u32(info.userMaxRetries).u32(info.userCurCounter);
+    w.u64(info.pinFlags);
+}
+
+inline PinInfo readPinInfo(Reader& r) {
+    PinInfo info;
+    info.soMaxRetries = static_cast<CK_BYTE>(r.u32());
+    info.soCurCounter = static_cast<CK_BYTE>(r.u32());
+    info.userMaxRetries = static_cast<CK_BYTE>(r.u32());
+    info.userCurCounter = static_cast<CK_BYTE>(r.u32());
+    info.pinFlags = r.u64();
+    return info;
+}
+
+// QueueStats: u32 priority, u64 submitted, completed, expired, rejected,
+// promoted, pending, then u64 wait p50, p99, max and latency p50, p99, max (ns)
+inline void writeQueueStats(Writer& w, const PriorityStats& stats) {
+    w.u32(static_cast<uint32_t>(stats.priority));
+    w.u64(stats.submitted).u64(stats.completed).u64(stats.expired).u64(stats.rejected).u64(stats.promoted);
+    w.u64(stats.pending);
+    w.u64(stats.waitP50Nanos).u64(stats.waitP99Nanos).u64(stats.waitMaxNanos);
+    w.u64(stats.latencyP50Nanos).u64(stats.latencyP99Nanos).u64(stats.latencyMaxNanos);
+}
+
+inline PriorityStats readQueueStats(Reader& r) {
+    PriorityStats stats;
+    stats.priority = static_cast<Priority>(r.u32());
+    stats.submitted = r.u64();
+    stats.completed = r.u64();
+    stats.expired = r.u64();
+    stats.rejected = r.u64();
+    stats.promoted = r.u64();
+    stats.pending = r.u64();
+    stats.waitP50Nanos = r.u64();
+    stats.waitP99Nanos = r.u64();
+    stats.waitMaxNanos = r.u64();
+    stats.latencyP50Nanos = r.u64();
+    stats.latencyP99Nanos = r.u64();
+    stats.latencyMaxNanos = r.u64();
+    return stats;
+}
+
+inline void writeCertificateInfo(Writer& w, const CertificateInfo& info) {
+    w.u64(info.handle).str(info.label).bytes(info.subject).bytes(info.id).bytes(info.value).u64(info.type);
+}
+
+inline CertificateInfo readCertificateInfo(Reader& r) {
+    CertificateInfo info;
+    info.handle = r.u64();
+    info.label = r.str();
+    info.subject = r.bytes();
+    info.id = r.bytes();
+    info.value = r.bytes();
+    info.type = r.u64();
+    return info;
+}
+
+inline void writeKeyInfo(Writer& w, const KeyInfo& info) {
+    uint32_t flags = (info.canEncrypt ? 1u : 0) | (info.canDecrypt ? 2u : 0) | (info.canSign ? 4u : 0) |
+                     (info.canVerify ? 8u : 0) | (info.canWrap ? 16u : 0) | (info.canUnwrap ? 32u : 0) |
+                     (info.canDerive ? 64u : 0) | (info.isSensitive ? 128u : 0) | (info.isExtractable ? 256u : 0);
+    w.u64(info.handle).str(info.label).u64(info.keyType).u64(info.objectClass).bytes(info.id).u32(flags);
+}
+
+inline KeyInfo readKeyInfo(Reader& r) {
+    KeyInfo info;
+    info.handle = r.u64();
+    info.label = r.str();
+    info.keyType = r.u64();
+    info.objectClass = r.u64();
+    info.id = r.bytes();
+    uint32_t flags = r.u32();
+    info.canEncrypt = flags & 1;
+    info.canDecrypt = flags & 2;
+    info.canSign = flags & 4;
+    info.canVerify = flags & 8;
+    info.canWrap = flags & 16;
+    info.canUnwrap = flags & 32;
+    info.canDerive = flags & 64;
+    info.isSensitive = flags & 128;
+    info.isExtractable = flags & 256;
+    return info;
+}
+
+// ---- framing -----------------------------------------------------------------
+
+inline bool readFull(int fd, void* data, size_t length) {
+    uint8_t* p = static_cast<uint8_t*>(data);
+    while (length > 0) {
+        ssize_t got = recv(fd, p, length, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        p += got;
+        length -= static_cast<size_t>(got);
+    }
+    return true;
+}
+
+constexpr size_t MAX_FRAME_FDS = 4;
+
+// fds, if any, travel as SCM_RIGHTS with the first bytes of the frame
+inline bool sendFrame(int fd, const FrameHeader& header, const uint8_t* payload,
+                      const int* fds = nullptr, size_t fdCount = 0) {
+    iovec parts[2] = {{const_cast<FrameHeader*>(&header), sizeof(header)},
+                      {const_cast<uint8_t*>(payload), header.length}};
+    msghdr message{};
+    message.msg_iov = parts;
+    message.msg_iovlen = header.length ? 2 : 1;
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_FRAME_FDS)];
+    if (fdCount > 0 && fdCount <= MAX_FRAME_FDS) {
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fdCount);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fdCount);
+    }
+
+    size_t remaining = sizeof(header) + header.length;
+    while (remaining > 0) {
+        ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        remaining -= static_cast<size_t>(sent);
+        message.msg_control = nullptr;
+        message.msg_controllen = 0;
+        // Skip what went out
+        size_t skip = static_cast<size_t>(sent);
+        while (message.msg_iovlen > 0 && skip >= message.msg_iov->iov_len) {
+            skip -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (message.msg_iovlen > 0) {
+            message.msg_iov->iov_base = static_cast<uint8_t*>(message.msg_iov->iov_base) + skip;
+            message.msg_iov->iov_len -= skip;
+        }
+    }
+    return true;
+}
+
+// Reads one frame; false on EOF, I/O error or an oversized payload
+inline bool readFrame(int fd, FrameHeader& header, std::vector<uint8_t>& payload) {
+    if (!readFull(fd, &header, sizeof(header)) || header.length > MAX_PAYLOAD) {
+        return false;
+    }
+    payload.resize(header.length);
+    return header.length == 0 || readFull(fd, payload.data(), header.length);
+}
+
+// Reads one frame and the descriptors sent with it; fds receives up to
+// MAX_FRAME_FDS descriptors, which the caller owns
+inline bool readFrameWithFds(int fd, FrameHeader& header, std::vector<uint8_t>& payload, std::vector<int>& fds) {
+    iovec part = {&header, sizeof(header)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_FRAME_FDS)];
+    msghdr message{};
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t got;
+    do {
+        got = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+    } while (got < 0 && errno == EINTR);
+    if (got <= 0) {
+        return false;
+    }
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < count; i++) {
+                int received;
+                memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                fds.push_back(received);
+            }
+        }
+    }
+
+    if (static_cast<size_t>(got) < sizeof(header) &&
+        !readFull(fd, reinterpret_cast<uint8_t*>(&header) + got, sizeof(header) - got)) {
+        return false;
+    }
+    if (header.length > MAX_PAYLOAD) {
+        return false;
+    }
+    payload.resize(header.length);
+    return header.length == 0 || readFull(fd, payload.data(), header.length);
+}
+
+// $PKCS11_BROKER_SOCKET, else token-broker.sock in $XDG_RUNTIME_DIR, else in /tmp
+inline std::string defaultSocketPath() {
+    if (const char* path = getenv("PKCS11_BROKER_SOCKET")) {
+        return path;
+    }
+    if (const char* runtime = getenv("XDG_RUNTIME_DIR")) {
+        return std::string(runtime) + "/token-broker.sock";
+    }
+    return "/tmp/token-broker-" + std::to_string(getuid()) + ".sock";
+}
+
+} // namespace Broker
+} // namespace PKCS11Lib
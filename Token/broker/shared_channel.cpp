@@ -0,0 +1,303 @@
+#include "shared_channel.h"
+
+#include <algorithm>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace PKCS11Lib {
+
+using namespace Broker;
+
+namespace {
+
+constexpr uint64_t BLOCK_ALIGN = 64;
+
+uint64_t alignBlock(uint64_t size) {
+    return (size + BLOCK_ALIGN - 1) / BLOCK_ALIGN * BLOCK_ALIGN;
+}
+
+} // namespace
+
+// ---- Request -----------------------------------------------------------------
+
+SharedChannel::Request& SharedChannel::Request::raw(const void* data, size_t length) {
+    if (overflow_ || length > capacity_ - length_) {
+        overflow_ = true;
+        return *this;
+    }
+    memcpy(args_ + length_, data, length);
+    length_ += length;
+    return *this;
+}
+
+SharedChannel::Request& SharedChannel::Request::bytes(const void* data, size_t length) {
+    uint8_t* target = reserveBytes(length);
+    if (target && length) {
+        memcpy(target, data, length);
+    }
+    return *this;
+}
+
+uint8_t* SharedChannel::Request::reserveBytes(size_t length) {
+    uint32_t prefix = static_cast<uint32_t>(length);
+    if (overflow_ || length > UINT32_MAX || sizeof(prefix) + length > capacity_ - length_) {
+        overflow_ = true;
+        return nullptr;
+    }
+    raw(&prefix, sizeof(prefix));
+    uint8_t* target = args_ + length_;
+    length_ += length;
+    return target;
+}
+
+// ---- SharedChannel -----------------------------------------------------------
+
+SharedChannel::SharedChannel()
+    : base_(nullptr), size_(0), header_(nullptr), submissions_(nullptr), completions_(nullptr),
+      arena_(nullptr), entries_(0), submitFd_(-1), completeFd_(-1), client_(nullptr), slot_(0),
+      priority_(Priority::Normal), nextRequestId_(1) {
+}
+
+SharedChannel::~SharedChannel() {
+    close();
+}
+
+Result<void> SharedChannel::open(BrokerClient& client, uint32_t entries, uint64_t arenaBytes) {
+    if (isOpen()) {
+        return Result<void>::Ok();
+    }
+    auto fds = client.openChannel(entries, arenaBytes);
+    if (!fds.isOk()) {
+        return Result<void>::Error(fds.errorCode, fds.errorMessage, fds.pkcs11Error);
+    }
+    int memFd = fds.value[0];
+    submitFd_ = fds.value[1];
+    completeFd_ = fds.value[2];
+
+    ChannelLayout layout = channelLayout(entries, arenaBytes);
+    void* base = mmap(nullptr, layout.totalSize, PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+    ::close(memFd);
+    if (base == MAP_FAILED) {
+        close();
+        return Result<void>::Error(Status::ERROR_MEMORY, "Cannot map broker channel");
+    }
+
+    base_ = static_cast<uint8_t*>(base);
+    size_ = layout.totalSize;
+    header_ = reinterpret_cast<SharedChannelHeader*>(base_);
+    if (header_->magic != CHANNEL_MAGIC || header_->entries != entries || header_->arenaSize != arenaBytes) {
+        close();
+        return Result<void>::Error(Status::ERROR_GENERAL, "Broker channel layout mismatch");
+    }
+    submissions_ = reinterpret_cast<SharedSubmission*>(base_ + header_->submissionsOffset);
+    completions_ = reinterpret_cast<SharedCompletion*>(base_ + header_->completionsOffset);
+    arena_ = base_ + header_->arenaOffset;
+    entries_ = entries;
+    slot_ = client.currentSlotId();
+    client_ = &client;
+
+    free_.clear();
+    blocks_.clear();
+    pending_.clear();
+    free_[0] = arenaBytes;
+    return Result<void>::Ok();
+}
+
+void SharedChannel::close() {
+    if (base_) {
+        munmap(base_, size_);
+        base_ = nullptr;
+    }
+    for (int* fd : {&submitFd_, &completeFd_}) {
+        if (*fd >= 0) {
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+    header_ = nullptr;
+    pending_.clear();
+}
+
+Result<uint64_t> SharedChannel::allocate(uint64_t size) {
+    // First fit; requests are usually released in submission order, so the
+    // free list stays short
+    for (auto it = free_.begin(); it != free_.end(); ++it) {
+        if (it->second >= size) {
+            uint64_t offset = it->first;
+            uint64_t remaining = it->second - size;
+            free_.erase(it);
+            if (remaining) {
+                free_[offset + size] = remaining;
+            }
+            blocks_[offset] = size;
+            return Result<uint64_t>::Ok(offset);
+        }
+    }
+    return Result<uint64_t>::Error(Status::ERROR_MEMORY, "Channel arena full");
+}
+
+void SharedChannel::free(uint64_t offset) {
+    auto block = blocks_.find(offset);
+    if (block == blocks_.end()) {
+        return;
+    }
+    uint64_t size = block->second;
+    blocks_.erase(block);
+
+    auto next = free_.lower_bound(offset);
+    if (next != free_.end() && offset + size == next->first) {
+        size += next->second;
+        next = free_.erase(next);
+    }
+    if (next != free_.begin()) {
+        auto previous = std::prev(next);
+        if (previous->first + previous->second == offset) {
+            previous->second += size;
+            return;
+        }
+    }
+    free_[offset] = size;
+}
+
+Result<SharedChannel::Request> SharedChannel::prepare(Op op, size_t argsCapacity, size_t resultCapacity) {
+    if (!isOpen()) {
+        return Result<Request>::Error(Status::ERROR_GENERAL, "Channel not open");
+    }
+    if (argsCapacity > UINT32_MAX || resultCapacity > UINT32_MAX) {
+        return Result<Request>::Error(Status::ERROR_ARGUMENTS_BAD, "Request too large");
+    }
+
+    uint64_t argsSize = alignBlock(argsCapacity);
+    auto block = allocate(argsSize + alignBlock(resultCapacity));
+    if (!block.isOk()) {
+        return Result<Request>::Error(block.errorCode, block.errorMessage);
+    }
+
+    Request request;
+    request.op_ = op;
+    request.slot_ = slot_;
+    request.block_ = block.value;
+    request.argsOffset_ = block.value;
+    request.resultOffset_ = block.value + argsSize;
+    request.resultCapacity_ = static_cast<uint32_t>(resultCapacity);
+    request.args_ = arena_ + block.value;
+    request.capacity_ = argsCapacity;
+    return Result<Request>::Ok(request);
+}
+
+void SharedChannel::discard(const Request& request) {
+    free(request.block_);
+}
+
+Result<uint32_t> SharedChannel::submit(const Request& request) {
+    if (!isOpen()) {
+        return Result<uint32_t>::Error(Status::ERROR_GENERAL, "Channel not open");
+    }
+    if (request.overflow_) {
+        return Result<uint32_t>::Error(Status::ERROR_ARGUMENTS_BAD, "Request arguments exceed their capacity");
+    }
+    uint32_t head = header_->submitHead.load(std::memory_order_relaxed);
+    if (pending_.size() >= entries_ ||
+        head - header_->submitTail.load(std::memory_order_acquire) >= entries_) {
+        return Result<uint32_t>::Error(Status::ERROR_FUNCTION_FAILED, "Too many requests in flight");
+    }
+
+    uint32_t requestId = nextRequestId_++;
+    SharedSubmission& submission = submissions_[head & (entries_ - 1)];
+    submission.requestId = requestId;
+    submission.op = static_cast<uint16_t>(request.op_);
+    submission.flags = priorityFlags(priority_);
+    submission.slot = request.slot_;
+    submission.argsOffset = request.argsOffset_;
+    submission.argsLength = static_cast<uint32_t>(request.length_);
+    submission.resultOffset = request.resultOffset_;
+    submission.resultCapacity = request.resultCapacity_;
+    header_->submitHead.store(head + 1, std::memory_order_seq_cst);
+    pending_[requestId] = {request.block_, request.resultOffset_, request.resultCapacity_, false};
+
+    if (header_->brokerSleeping.load(std::memory_order_seq_cst)) {
+        uint64_t one = 1;
+        if (write(submitFd_, &one, sizeof(one)) < 0) {
+            // Counter saturated: the broker is already due to wake
+        }
+    }
+    return Result<uint32_t>::Ok(requestId);
+}
+
+Result<SharedChannel::Completion> SharedChannel::wait(int timeoutMs) {
+    if (!isOpen()) {
+        return Result<Completion>::Error(Status::ERROR_GENERAL, "Channel not open");
+    }
+
+    uint32_t tail = header_->completeTail.load(std::memory_order_relaxed);
+    while (header_->completeHead.load(std::memory_order_acquire) == tail) {
+        header_->clientSleeping.store(1, std::memory_order_seq_cst);
+        if (header_->completeHead.load(std::memory_order_seq_cst) != tail) {
+            header_->clientSleeping.store(0, std::memory_order_relaxed);
+            break;
+        }
+        // The socket reports the broker going away, which the eventfd cannot
+        pollfd fds[2] = {{completeFd_, POLLIN, 0}, {client_->fd_, 0, 0}};
+        int ready = poll(fds, 2, timeoutMs);
+        header_->clientSleeping.store(0, std::memory_order_relaxed);
+        if (ready == 0) {
+            return Result<Completion>::Error(Status::ERROR_FUNCTION_FAILED, "Timed out waiting for the broker");
+        }
+        if (client_->fd_ < 0 || (fds[1].revents & (POLLERR | POLLHUP))) {
+            return Result<Completion>::Error(Status::ERROR_DEVICE_REMOVED, "Broker channel closed");
+        }
+        uint64_t value;
+        if (read(completeFd_, &value, sizeof(value)) < 0) {
+            // Nonblocking, already drained
+        }
+    }
+
+    SharedCompletion done = completions_[tail & (entries_ - 1)];
+    header_->completeTail.store(tail + 1, std::memory_order_release);
+
+    Completion completion{};
+    completion.requestId = done.requestId;
+    completion.status = static_cast<Status>(done.status);
+    auto pending = pending_.find(done.requestId);
+    if (pending == pending_.end()) {
+        return Result<Completion>::Error(Status::ERROR_GENERAL, "Broker completed an unknown request");
+    }
+    pending->second.completed = true;
+
+    if (completion.status == Status::OK) {
+        size_t length = std::min(done.resultLength, pending->second.resultCapacity);
+        Reader r(arena_ + pending->second.resultOffset, length);
+        completion.status = static_cast<Status>(r.u32());
+        completion.rv = r.u64();
+        if (completion.status != Status::OK) {
+            completion.errorMessage = r.str();
+        }
+        size_t header = sizeof(uint32_t) + sizeof(uint64_t);
+        if (r.failed()) {
+            completion.status = Status::ERROR_GENERAL;
+            completion.errorMessage = "Malformed broker response";
+        } else if (completion.status == Status::OK) {
+            completion.result = arena_ + pending->second.resultOffset + header;
+            completion.resultLength = length - header;
+        }
+    } else if (completion.status == Status::ERROR_BUFFER_TOO_SMALL) {
+        completion.resultNeeded = done.resultLength;
+        completion.errorMessage = "Result does not fit the reserved space";
+    } else {
+        completion.errorMessage = "Broker rejected the request";
+    }
+    return Result<Completion>::Ok(completion);
+}
+
+void SharedChannel::release(uint32_t requestId) {
+    auto pending = pending_.find(requestId);
+    if (pending == pending_.end() || !pending->second.completed) {
+        return;
+    }
+    free(pending->second.block);
+    pending_.erase(pending);
+}
+
+} // namespace PKCS11Lib
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "broker_client.h"
+
+namespace PKCS11Lib {
+
+// Client end of a shared-memory channel to token-broker (see the channel
+// section of broker_protocol.h). Arguments are written once, straight into
+// memory the broker reads, and results are read where the broker wrote
+// them; nothing is copied through the socket. Requests are asynchronous:
+// submit as many as fit, then collect completions in any order.
+//
+//   SharedChannel channel;
+//   channel.open(client);
+//   auto request = channel.prepare(Broker::Op::Sign, 16 + size, 1024);
+//   request.value.u64(key).u32(static_cast<uint32_t>(HashAlgorithm::SHA256));
+//   read(file, request.value.reserveBytes(size), size);
+//   channel.submit(request.value);
+//   ...
+//   auto done = channel.wait();
+//   auto signature = done.value.reader().bytes();
+//   channel.release(done.value.requestId);
+//
+// A channel is used from one thread at a time. It stays bound to the
+// connection it was opened on: that connection's login authorizes it, and
+// closing the client closes the channel.
+class SharedChannel {
+public:
+    // Arguments of one request, encoded as by Broker::Writer but directly
+    // into the arena. Writing past the capacity given to prepare() sets
+    // overflowed() and makes submit() fail.
+    class Request {
+    public:
+        Request& u32(uint32_t value) { return raw(&value, sizeof(value)); }
+        Request& u64(uint64_t value) { return raw(&value, sizeof(value)); }
+        Request& bytes(const void* data, size_t length);
+        Request& bytes(const std::vector<CK_BYTE>& value) { return bytes(value.data(), value.size()); }
+        Request& str(const std::string& value) { return bytes(value.data(), value.size()); }
+
+        // Appends a byte string of `length` and returns where its contents go,
+        // e.g. read(fd, request.reserveBytes(n), n); nullptr on overflow
+        uint8_t* reserveBytes(size_t length);
+
+        bool overflowed() const { return overflow_; }
+
+    private:
+        friend class SharedChannel;
+        Request& raw(const void* data, size_t length);
+
+        Broker::Op op_ = Broker::Op::Hello;
+        CK_SLOT_ID slot_ = 0;
+        uint8_t* args_ = nullptr;
+        size_t capacity_ = 0;
+        size_t length_ = 0;
+        uint64_t block_ = 0;
+        uint64_t argsOffset_ = 0;
+        uint64_t resultOffset_ = 0;
+        uint32_t resultCapacity_ = 0;
+        bool overflow_ = false;
+    };
+
+    struct Completion {
+        uint32_t requestId;
+        Status status;
+        CK_RV rv;
+        std::string errorMessage;
+        size_t resultNeeded;        // with ERROR_BUFFER_TOO_SMALL: the capacity to retry with
+        const uint8_t* result;      // result fields in the arena, valid until release()
+        size_t resultLength;
+
+        bool isOk() const { return status == Status::OK; }
+        Broker::Reader reader() const { return Broker::Reader(result, resultLength); }
+    };
+
+    SharedChannel();
+    ~SharedChannel();
+
+    SharedChannel(const SharedChannel&) = delete;
+    SharedChannel& operator=(const SharedChannel&) = delete;
+
+    // Requests target the client's selected slot, or selectSlot()
+    Result<void> open(BrokerClient& client, uint32_t entries = 256, uint64_t arenaBytes = 64ull << 20);
+    void close();
+    bool isOpen() const { return base_ != nullptr; }
+    void selectSlot(CK_SLOT_ID slot) { slot_ = slot; }
+    // Priority of later submissions; channels usually carry bulk work
+    void setPriority(Priority priority) { priority_ = priority; }
+
+    // Reserves arena space for a request's arguments and its result
+    Result<Request> prepare(Broker::Op op, size_t argsCapacity, size_t resultCapacity);
+    // Returns the space of a prepared request that will not be submitted
+    void discard(const Request& request);
+
+    // Returns the request id
+    Result<uint32_t> submit(const Request& request);
+
+    // Next completion; timeoutMs -1 waits indefinitely
+    Result<Completion> wait(int timeoutMs = -1);
+
+    // Frees a completed request's arena space
+    void release(uint32_t requestId);
+
+    size_t inFlight() const { return pending_.size(); }
+
+private:
+    struct Pending {
+        uint64_t block;
+        uint64_t resultOffset;
+        uint32_t resultCapacity;
+        bool completed;
+    };
+
+    Result<uint64_t> allocate(uint64_t size);
+    void free(uint64_t offset);
+
+    uint8_t* base_;
+    size_t size_;
+    Broker::SharedChannelHeader* header_;
+    Broker::SharedSubmission* submissions_;
+    Broker::SharedCompletion* completions_;
+    uint8_t* arena_;
+    uint32_t entries_;
+    int submitFd_;
+    int completeFd_;
+    BrokerClient* client_;
+    CK_SLOT_ID slot_;
+    Priority priority_;
+    uint32_t nextRequestId_;
+
+    std::map<uint64_t, uint64_t> free_;     // arena offset -> size
+    std::map<uint64_t, uint64_t> blocks_;   // allocated offset -> size
+    std::map<uint32_t, Pending> pending_;   // submitted, not yet released
+};
+
+} // namespace PKCS11Lib
@@ -0,0 +1,1106 @@
+// token-broker: owns the PKCS#11 tokens on this machine on behalf of all
+// local processes.
+//
+// The broker loads the module once, opens one session per token and logs
+// each token in once. Clients (BrokerClient) connect over a Unix socket and
+// send requests in the protocol of broker_protocol.h, so a request costs one
+// socket round trip instead of dlopen + C_Initialize + C_OpenSession + C_Login.
+//
+// Build and run, e.g.
+//   g++ -O2 -std=gnu++17 -IToken/include -o token-broker Token/broker/token_broker.cpp Token/src/*.cpp -ldl -lcrypto -lpthread
+//   ./token-broker --library /usr/lib/libshuttle_p11v220.so.1.0.0
+// Options:
+//   --library PATH        PKCS#11 module (required)
+//   --socket PATH         listening socket (default Broker::defaultSocketPath())
+//   --queue-depth N       pending requests per token before new ones are refused (default 256)
+//   --aging-ms N          a queued request moves up one priority class per N ms
+//                         waited, so bulk work is not starved (default 2000, 0 disables)
+//   --call-timeout-ms N   fail a request with ERROR_TIMEOUT once the token has
+//                         spent N ms on it (default 0: no limit)
+//   --allow-uid UID       also accept this user (repeatable); by default only
+//                         the broker's own user may connect
+//
+// Each token has one worker thread (a TokenScheduler), so the library's
+// per-token session is never shared between two calls. Its queue is ordered
+// by the priority in the request flags: an interactive request waits for the
+// operation in progress, not for the bulk requests queued ahead of it. Each client
+// connection has a reader thread that parses frames and queues them; replies
+// are written by the worker. A client proves the PIN once per connection:
+// the first Login logs the token in, later ones are checked against the PIN
+// the broker holds (which it also uses to log in again after re-insertion).
+// After MAX_PIN_MISMATCHES wrong PINs the broker logs the token out so that
+// further guesses reach the token and count against its retry counter.
+//
+// Read results (certificate and key lists, certificate values, attributes)
+// are cached per token and dropped on any request that may change objects.
+//
+// For bulk work a connection can open a shared-memory channel (OpenChannel,
+// SharedChannel on the client side): arguments and results are passed by
+// offset in a memfd arena instead of through the socket.
+
+#include "broker_protocol.h"
+
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+using namespace PKCS11Lib;
+using namespace PKCS11Lib::Broker;
+
+namespace {
+
+constexpr int MAX_PIN_MISMATCHES = 3;
+constexpr size_t CACHE_LIMIT = 4u << 20;
+// A client that stops reading must not stall the token worker replying to it
+constexpr int SEND_TIMEOUT_SECONDS = 5;
+
+struct Options {
+    std::string library;
+    std::string socketPath = defaultSocketPath();
+    SchedulerConfig scheduler;
+    std::chrono::milliseconds callTimeout{0};
+    std::set<uid_t> allowedUids;
+};
+
+// ---- connections -------------------------------------------------------------
+
+class Connection {
+public:
+    Connection(int fd, uid_t uid, pid_t pid) : fd_(fd), uid_(uid), pid_(pid) {}
+    ~Connection() { close(fd_); }
+
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    int fd() const { return fd_; }
+    uid_t uid() const { return uid_; }
+    pid_t pid() const { return pid_; }
+
+    void reply(const FrameHeader& request, const std::vector<uint8_t>& payload,
+               const int* fds = nullptr, size_t fdCount = 0) {
+        FrameHeader header = request;
+        header.length = static_cast<uint32_t>(payload.size());
+        std::lock_guard<std::mutex> lock(writeMutex_);
+        if (!sendFrame(fd_, header, payload.data(), fds, fdCount)) {
+            // Also ends the reader thread
+            shutdown(fd_, SHUT_RDWR);
+        }
+    }
+
+    // Authorization is per token and tied to the token's login generation,
+    // so a broker-side logout revokes every connection at once
+    void authorize(CK_SLOT_ID slot, uint64_t generation) {
+        std::lock_guard<std::mutex> lock(authMutex_);
+        authorized_[slot] = generation;
+    }
+
+    void revoke(CK_SLOT_ID slot) {
+        std::lock_guard<std::mutex> lock(authMutex_);
+        authorized_.erase(slot);
+    }
+
+    bool isAuthorized(CK_SLOT_ID slot, uint64_t generation) const {
+        std::lock_guard<std::mutex> lock(authMutex_);
+        auto it = authorized_.find(slot);
+        return it != authorized_.end() && it->second == generation;
+    }
+
+private:
+    int fd_;
+    uid_t uid_;
+    pid_t pid_;
+    std::mutex writeMutex_;
+    mutable std::mutex authMutex_;
+    std::map<CK_SLOT_ID, uint64_t> authorized_;
+};
+
+class ChannelServer;
+
+struct Job {
+    std::shared_ptr<Connection> connection;
+    FrameHeader header;
+    std::vector<uint8_t> payload;              // socket request arguments
+
+    // Shared-memory request: arguments and result live in the channel's arena
+    std::shared_ptr<ChannelServer> channel;
+    SharedSubmission submission{};
+};
+
+// Queues a job on its token: an empty Writer when queued, otherwise the
+// error response to send instead
+using Router = std::function<Writer(Job&&)>;
+
+template<typename T>
+Writer responseHeader(const Result<T>& result) {
+    Writer w;
+    w.u32(static_cast<uint32_t>(result.errorCode)).u64(result.pkcs11Error);
+    if (!result.isOk()) {
+        w.str(result.errorMessage);
+    }
+    return w;
+}
+
+Writer respond(const Result<void>& result) {
+    return responseHeader(result);
+}
+
+template<typename T, typename Encode>
+Writer respond(const Result<T>& result, Encode encode) {
+    Writer w = responseHeader(result);
+    if (result.isOk()) {
+        encode(w, result.value);
+    }
+    return w;
+}
+
+Writer respondError(Status status, const std::string& message, CK_RV rv = CKR_OK) {
+    return respond(Result<void>::Error(status, message, rv));
+}
+
+void writeBytes(Writer& w, const std::vector<CK_BYTE>& value) {
+    w.bytes(value);
+}
+
+void writeKeyPair(Writer& w, const KeyPair& pair) {
+    writeKeyInfo(w, pair.publicKey);
+    writeKeyInfo(w, pair.privateKey);
+}
+
+// Constant time in the contents, so response timing does not reveal a prefix
+bool sameSecret(const std::string& a, const std::string& b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    unsigned char difference = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        difference |= static_cast<unsigned char>(a[i] ^ b[i]);
+    }
+    return difference == 0;
+}
+
+// ---- shared-memory channels --------------------------------------------------
+
+// Broker end of a client's shared-memory channel. A thread per channel moves
+// submissions onto the token queues; token workers write results straight
+// into the arena and post completions. The broker keeps its own copies of
+// the indices it produces and checks everything the client writes, so a
+// misbehaving client can only break its own channel.
+class ChannelServer {
+public:
+    static std::shared_ptr<ChannelServer> create(uint32_t entries, uint64_t arenaBytes, std::string& error) {
+        if (entries == 0 || entries > CHANNEL_MAX_ENTRIES || (entries & (entries - 1)) != 0 ||
+            arenaBytes == 0 || arenaBytes > CHANNEL_MAX_ARENA) {
+            error = "Channel size out of range";
+            return nullptr;
+        }
+        std::shared_ptr<ChannelServer> channel(new ChannelServer());
+        ChannelLayout layout = channelLayout(entries, arenaBytes);
+
+        channel->memFd_ = memfd_create("token-broker-channel", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        channel->submitFd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        channel->completeFd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        channel->stopFd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (channel->memFd_ < 0 || channel->submitFd_ < 0 || channel->completeFd_ < 0 || channel->stopFd_ < 0 ||
+            ftruncate(channel->memFd_, static_cast<off_t>(layout.totalSize)) != 0 ||
+            // The client must not be able to shrink the file under the broker's mapping
+            fcntl(channel->memFd_, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+            error = "Cannot create channel: " + std::string(strerror(errno));
+            return nullptr;
+        }
+        void* base = mmap(nullptr, layout.totalSize, PROT_READ | PROT_WRITE, MAP_SHARED, channel->memFd_, 0);
+        if (base == MAP_FAILED) {
+            error = "Cannot map channel: " + std::string(strerror(errno));
+            return nullptr;
+        }
+
+        channel->base_ = static_cast<uint8_t*>(base);
+        channel->size_ = layout.totalSize;
+        channel->entries_ = entries;
+        channel->arenaSize_ = arenaBytes;
+        channel->header_ = new (base) SharedChannelHeader();
+        channel->header_->magic = CHANNEL_MAGIC;
+        channel->header_->entries = entries;
+        channel->header_->submissionsOffset = layout.submissionsOffset;
+        channel->header_->completionsOffset = layout.completionsOffset;
+        channel->header_->arenaOffset = layout.arenaOffset;
+        channel->header_->arenaSize = arenaBytes;
+        channel->submissions_ = reinterpret_cast<SharedSubmission*>(channel->base_ + layout.submissionsOffset);
+        channel->completions_ = reinterpret_cast<SharedCompletion*>(channel->base_ + layout.completionsOffset);
+        channel->arena_ = channel->base_ + layout.arenaOffset;
+        channel->self_ = channel;
+        return channel;
+    }
+
+    ~ChannelServer() {
+        stop();
+        if (base_) {
+            munmap(base_, size_);
+        }
+        for (int fd : {memFd_, submitFd_, completeFd_, stopFd_}) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    ChannelServer(const ChannelServer&) = delete;
+    ChannelServer& operator=(const ChannelServer&) = delete;
+
+    int memFd() const { return memFd_; }
+    int submitFd() const { return submitFd_; }
+    int completeFd() const { return completeFd_; }
+
+    void start(std::shared_ptr<Connection> connection, Router router) {
+        // The client has its own copy now
+        close(memFd_);
+        memFd_ = -1;
+        thread_ = std::thread(&ChannelServer::run, this, std::move(connection), std::move(router));
+    }
+
+    void stop() {
+        if (thread_.joinable()) {
+            uint64_t one = 1;
+            if (write(stopFd_, &one, sizeof(one)) < 0) {
+                // Nonblocking eventfd, only fails when already signalled
+            }
+            thread_.join();
+        }
+    }
+
+    const uint8_t* args(const SharedSubmission& submission) const {
+        return arena_ + submission.argsOffset;
+    }
+
+    // Called by token workers
+    void complete(const SharedSubmission& submission, const std::vector<uint8_t>& response) {
+        std::lock_guard<std::mutex> lock(completeMutex_);
+        SharedCompletion completion{submission.requestId, static_cast<uint32_t>(Status::OK),
+                                    static_cast<uint32_t>(response.size()), 0};
+        if (response.size() > submission.resultCapacity) {
+            completion.status = static_cast<uint32_t>(Status::ERROR_BUFFER_TOO_SMALL);
+        } else {
+            memcpy(arena_ + submission.resultOffset, response.data(), response.size());
+        }
+        post(completion);
+    }
+
+private:
+    ChannelServer()
+        : base_(nullptr), size_(0), header_(nullptr), submissions_(nullptr), completions_(nullptr),
+          arena_(nullptr), arenaSize_(0), entries_(0), memFd_(-1), submitFd_(-1), completeFd_(-1),
+          stopFd_(-1), completeHead_(0), inFlight_(0) {}
+
+    // completeMutex_ held
+    void post(const SharedCompletion& completion) {
+        uint32_t head = completeHead_.load(std::memory_order_relaxed);
+        completions_[head & (entries_ - 1)] = completion;
+        completeHead_.store(head + 1, std::memory_order_relaxed);
+        header_->completeHead.store(head + 1, std::memory_order_seq_cst);
+        inFlight_.fetch_sub(1, std::memory_order_relaxed);
+        if (header_->clientSleeping.load(std::memory_order_seq_cst)) {
+            uint64_t one = 1;
+            if (write(completeFd_, &one, sizeof(one)) < 0) {
+                // Counter saturated: the client is already due to wake
+            }
+        }
+    }
+
+    bool validSubmission(const SharedSubmission& submission) const {
+        return submission.argsOffset <= arenaSize_ && submission.argsLength <= arenaSize_ - submission.argsOffset &&
+               submission.resultOffset <= arenaSize_ &&
+               submission.resultCapacity <= arenaSize_ - submission.resultOffset;
+    }
+
+    bool wait(int timeoutMs) {
+        pollfd fds[2] = {{submitFd_, POLLIN, 0}, {stopFd_, POLLIN, 0}};
+        poll(fds, 2, timeoutMs);
+        uint64_t value;
+        if (read(submitFd_, &value, sizeof(value)) < 0) {
+            // Nothing signalled
+        }
+        return !(fds[1].revents & POLLIN);
+    }
+
+    void run(std::shared_ptr<Connection> connection, Router router) {
+        uint32_t tail = 0;
+        for (;;) {
+            uint32_t head = header_->submitHead.load(std::memory_order_acquire);
+            uint32_t pending = head - tail;
+            uint32_t unread = completeHead_.load(std::memory_order_relaxed) -
+                              header_->completeTail.load(std::memory_order_acquire);
+            if (pending > entries_ || unread > entries_) {
+                fprintf(stderr, "[token-broker] pid %d corrupted its channel, closing it\n", connection->pid());
+                shutdown(connection->fd(), SHUT_RDWR);
+                return;
+            }
+
+            if (pending == 0) {
+                header_->brokerSleeping.store(1, std::memory_order_seq_cst);
+                bool idle = header_->submitHead.load(std::memory_order_seq_cst) == tail;
+                if (idle && !wait(-1)) {
+                    return;
+                }
+                header_->brokerSleeping.store(0, std::memory_order_relaxed);
+                continue;
+            }
+            if (unread + inFlight_.load(std::memory_order_relaxed) >= entries_) {
+                // Every request taken must have a completion slot; wait for the
+                // client to drain the completion ring
+                if (!wait(1)) {
+                    return;
+                }
+                continue;
+            }
+
+            SharedSubmission submission = submissions_[tail & (entries_ - 1)];
+            tail++;
+            header_->submitTail.store(tail, std::memory_order_release);
+            inFlight_.fetch_add(1, std::memory_order_relaxed);
+
+            if (!validSubmission(submission)) {
+                std::lock_guard<std::mutex> lock(completeMutex_);
+                post({submission.requestId, static_cast<uint32_t>(Status::ERROR_ARGUMENTS_BAD), 0, 0});
+                continue;
+            }
+
+            Job job;
+            job.connection = connection;
+            job.header.op = submission.op;
+            job.header.requestId = submission.requestId;
+            job.header.slot = submission.slot;
+            job.channel = self_.lock();
+            job.submission = submission;
+            Writer refused = router(std::move(job));
+            if (!refused.data().empty()) {
+                complete(submission, refused.data());
+            }
+        }
+    }
+
+    uint8_t* base_;
+    size_t size_;
+    SharedChannelHeader* header_;
+    SharedSubmission* submissions_;
+    SharedCompletion* completions_;
+    uint8_t* arena_;
+    uint64_t arenaSize_;
+    uint32_t entries_;
+
+    int memFd_;
+    int submitFd_;
+    int completeFd_;
+    int stopFd_;
+
+    std::mutex completeMutex_;
+    std::atomic<uint32_t> completeHead_;    // broker's copy; the shared one is only written
+    std::atomic<uint32_t> inFlight_;        // taken from the submission ring, not yet completed
+    std::weak_ptr<ChannelServer> self_;
+    std::thread thread_;
+};
+
+// ---- tokens ------------------------------------------------------------------
+
+class TokenWorker {
+public:
+    TokenWorker(CK_SLOT_ID slot, const SchedulerConfig& config, std::chrono::milliseconds callTimeout)
+        : slot_(slot), callTimeout_(callTimeout), scheduler_(config), stopping_(false), generation_(1),
+          mismatches_(0), cacheBytes_(0) {}
+
+    ~TokenWorker() { stop(); }
+
+    Result<void> open(const std::string& library) {
+        auto initialized = lib_.initialize(library);
+        if (!initialized.isOk()) {
+            return initialized;
+        }
+        auto opened = lib_.openSession(slot_);
+        if (!opened.isOk()) {
+            return opened;
+        }
+        auto info = lib_.getTokenInfo(slot_);
+        if (info.isOk()) {
+            info_ = info.value;
+        }
+
+        RecoveryPolicy recovery;
+        recovery.enabled = true;
+        lib_.setRecoveryPolicy(recovery);
+        lib_.setCredentialProvider([this]() -> std::optional<std::string> {
+            if (pin_.empty()) {
+                return std::nullopt;
+            }
+            return pin_;
+        });
+
+        scheduler_.start();
+        return Result<void>::Ok();
+    }
+
+    void stop() {
+        if (stopping_.exchange(true)) {
+            return;
+        }
+        scheduler_.stop();
+        for (const PriorityStats& stats : scheduler_.stats()) {
+            if (stats.submitted > 0) {
+                fprintf(stderr, "[token-broker] slot %lu: %s: %llu done, %llu expired, %llu refused, "
+                        "wait p99 %.1f ms, latency p99 %.1f ms\n", slot_, priorityName(stats.priority),
+                        static_cast<unsigned long long>(stats.completed),
+                        static_cast<unsigned long long>(stats.expired),
+                        static_cast<unsigned long long>(stats.rejected),
+                        stats.waitP99Nanos / 1e6, stats.latencyP99Nanos / 1e6);
+            }
+        }
+        lib_.logout();
+        lib_.closeSession();
+    }
+
+    // Runs the job on the worker thread once the token is free, in priority
+    // order; a job whose budget runs out first is refused instead of run
+    bool enqueue(Job job) {
+        uint16_t flags = job.channel ? job.submission.flags : job.header.flags;
+        auto deadline = TokenScheduler::NO_DEADLINE;
+        if (!job.channel && job.header.budgetMs > 0) {
+            deadline = TokenScheduler::Clock::now() + std::chrono::milliseconds(job.header.budgetMs);
+        }
+        auto shared = std::make_shared<Job>(std::move(job));
+        return scheduler_.submit(framePriority(flags),
+            [this, shared] { run(*shared); },
+            [shared] {
+                auto refused = respondError(Status::ERROR_FUNCTION_CANCELED,
+                                            "Token busy past the request's budget").take();
+                if (shared->channel) {
+                    shared->channel->complete(shared->submission, refused);
+                } else {
+                    shared->connection->reply(shared->header, refused);
+                }
+            },
+            deadline);
+    }
+
+    CK_SLOT_ID slot() const { return slot_; }
+    const TokenInfo& info() const { return info_; }
+    bool isLoggedIn() const { return lib_.isLoggedIn(); }
+    std::array<PriorityStats, PRIORITY_CLASSES> queueStats() const { return scheduler_.stats(); }
+
+private:
+    void run(Job& job) {
+        // A token that stops answering costs one request, not the worker
+        std::optional<OperationScope> limit;
+        if (callTimeout_.count() > 0) {
+            limit.emplace(lib_, OperationContext::within(callTimeout_));
+        }
+        Op op = static_cast<Op>(job.header.op);
+        if (job.channel) {
+            auto response = execute(*job.connection, op, job.channel->args(job.submission),
+                                    job.submission.argsLength);
+            job.channel->complete(job.submission, response);
+        } else {
+            auto response = execute(*job.connection, op, job.payload.data(), job.payload.size());
+            job.connection->reply(job.header, response);
+        }
+    }
+
+    std::vector<uint8_t> execute(Connection& connection, Op op, const uint8_t* payload, size_t size) {
+        Reader args(payload, size);
+        switch (op) {
+            case Op::Login:
+                return login(connection, args.str()).take();
+            case Op::Logout:
+                connection.revoke(slot_);
+                return respond(Result<void>::Ok()).take();
+            case Op::GetTokenInfo:
+                return respond(lib_.getTokenInfo(slot_), writeTokenInfo).take();
+            case Op::GetPinInfo:
+                return respond(lib_.getPinInfo(), writePinInfo).take();
+            default:
+                break;
+        }
+
+        if (!connection.isAuthorized(slot_, generation_)) {
+            return respondError(Status::ERROR_USER_NOT_LOGGED_IN, "Login required", CKR_USER_NOT_LOGGED_IN).take();
+        }
+
+        bool cacheable = op == Op::FindCertificates || op == Op::FindKeys ||
+                         op == Op::ExportCertificate || op == Op::GetAttribute;
+        CacheKey key;
+        if (cacheable) {
+            key = {static_cast<uint16_t>(op), std::vector<uint8_t>(payload, payload + size)};
+            auto cached = cache_.find(key);
+            if (cached != cache_.end()) {
+                return cached->second;
+            }
+        }
+
+        std::vector<uint8_t> response = dispatch(op, args).take();
+        uint32_t status;
+        uint64_t rv;
+        memcpy(&status, response.data(), sizeof(status));
+        memcpy(&rv, response.data() + sizeof(status), sizeof(rv));
+
+        if (PKCS11Library::isConnectionLoss(rv) || mutates(op)) {
+            // Objects may have changed, or the token was swapped
+            clearCache();
+        } else if (cacheable && status == static_cast<uint32_t>(Status::OK)) {
+            size_t size = key.second.size() + response.size();
+            if (cacheBytes_ + size > CACHE_LIMIT) {
+                clearCache();
+            }
+            cacheBytes_ += size;
+            cache_.emplace(std::move(key), response);
+        }
+        return response;
+    }
+
+    static bool mutates(Op op) {
+        return op == Op::SetAttribute || op == Op::DestroyObject || op == Op::GenerateRSAKeyPair ||
+               op == Op::GenerateECKeyPair || op == Op::TransmitAPDU;
+    }
+
+    void clearCache() {
+        cache_.clear();
+        cacheBytes_ = 0;
+    }
+
+    Writer login(Connection& connection, const std::string& pin) {
+        if (!lib_.isLoggedIn()) {
+            auto result = lib_.login(pin);
+            if (result.isOk()) {
+                pin_ = pin;
+                mismatches_ = 0;
+                generation_++;
+                clearCache(); // Private objects are visible now
+                connection.authorize(slot_, generation_);
+            }
+            return respond(result);
+        }
+
+        if (!pin_.empty() && sameSecret(pin, pin_)) {
+            mismatches_ = 0;
+            connection.authorize(slot_, generation_);
+            return respond(Result<void>::Ok());
+        }
+
+        if (++mismatches_ >= MAX_PIN_MISMATCHES) {
+            fprintf(stderr, "[token-broker] slot %lu: %d wrong PINs (last from pid %d), logging the token out\n",
+                    slot_, mismatches_, connection.pid());
+            lib_.logout();
+            pin_.clear();
+            mismatches_ = 0;
+            generation_++;
+            clearCache();
+        }
+        return respondError(Status::ERROR_PIN_INCORRECT, "Incorrect PIN", CKR_PIN_INCORRECT);
+    }
+
+    Writer dispatch(Op op, Reader& args) {
+        switch (op) {
+            case Op::FindCertificates:
+                return respond(lib_.findCertificates(), writeList<CertificateInfo, writeCertificateInfo>);
+            case Op::FindKeys: {
+                CK_OBJECT_CLASS keyClass = args.u64();
+                if (!args.atEnd()) break;
+                return respond(lib_.findKeys(keyClass), writeList<KeyInfo, writeKeyInfo>);
+            }
+            case Op::ExportCertificate: {
+                CK_OBJECT_HANDLE handle = args.u64();
+                if (!args.atEnd()) break;
+                return respond(lib_.exportCertificate(handle), writeBytes);
+            }
+            case Op::GetAttribute: {
+                CK_OBJECT_HANDLE handle = args.u64();
+                CK_ATTRIBUTE_TYPE type = args.u64();
+                if (!args.atEnd()) break;
+                return respond(lib_.getObjectAttribute(handle, type), writeBytes);
+            }
+            case Op::SetAttribute: {
+                CK_OBJECT_HANDLE handle = args.u64();
+                CK_ATTRIBUTE_TYPE type = args.u64();
+                auto value = args.bytes();
+                if (!args.atEnd()) break;
+                return respond(lib_.setObjectAttribute(handle, type, value));
+            }
+            case Op::DestroyObject: {
+                CK_OBJECT_HANDLE handle = args.u64();
+                if (!args.atEnd()) break;
+                return respond(lib_.destroyObject(handle));
+            }
+            case Op::Sign: {
+                CK_OBJECT_HANDLE key = args.u64();
+                auto hash = static_cast<HashAlgorithm>(args.u32());
+                auto data = args.bytes();
+                if (!args.atEnd()) break;
+                return respond(lib_.sign(key, data, hash), writeBytes);
+            }
+            case Op::Verify: {
+                CK_OBJECT_HANDLE key = args.u64();
+                auto hash = static_cast<HashAlgorithm>(args.u32());
+                auto data = args.bytes();
+                auto signature = args.bytes();
+                if (!args.atEnd()) break;
+                return respond(lib_.verify(key, data, signature, hash));
+            }
+            case Op::SignECDSA: {
+                CK_OBJECT_HANDLE key = args.u64();
+                auto hash = static_cast<HashAlgorithm>(args.u32());
+                auto encoding = static_cast<SignatureEncoding>(args.u32());
+                auto data = args.bytes();
+                if (!args.atEnd()) break;
+                return respond(lib_.signECDSA(key, data, hash, encoding), writeBytes);
+            }
+            case Op::VerifyECDSA: {
+                CK_OBJECT_HANDLE key = args.u64();
+                auto hash = static_cast<HashAlgorithm>(args.u32());
+                auto encoding = static_cast<SignatureEncoding>(args.u32());
+                auto data = args.bytes();
+                auto signature = args.bytes();
+                if (!args.atEnd()) break;
+                return respond(lib_.verifyECDSA(key, data, signature, hash, encoding));
+            }
+            case Op::Encrypt:
+            case Op::Decrypt: {
+                CK_OBJECT_HANDLE key = args.u64();
+                auto algorithm = static_cast<SymmetricAlgorithm>(args.u32());
+                auto mode = static_cast<CipherMode>(args.u32());
+                auto iv = args.bytes();
+                auto data = args.bytes();
+                if (!args.atEnd()) break;
+                if (op == Op::Encrypt) {
+                    return respond(lib_.encrypt(key, data, algorithm, mode, iv), writeBytes);
+                }
+                return respond(lib_.decrypt(key, data, algorithm, mode, iv), writeBytes);
+            }
+            case Op::EncryptRSA:
+            case Op::DecryptRSA: {
+                CK_OBJECT_HANDLE key = args.u64();
+                auto data = args.bytes();
+                if (!args.atEnd()) break;
+                if (op == Op::EncryptRSA) {
+                    return respond(lib_.encryptRSA(key, data), writeBytes);
+                }
+                return respond(lib_.decryptRSA(key, data), writeBytes);
+            }
+            case Op::GenerateRSAKeyPair: {
+                CK_ULONG bits = args.u64();
+                auto label = args.str();
+                bool tokenObject = args.u32() != 0;
+                if (!args.atEnd()) break;
+                return respond(lib_.generateRSAKeyPair(bits, label, tokenObject), writeKeyPair);
+            }
+            case Op::GenerateECKeyPair: {
+                auto label = args.str();
+                bool tokenObject = args.u32() != 0;
+                if (!args.atEnd()) break;
+                return respond(lib_.generateECKeyPair(label, tokenObject), writeKeyPair);
+            }
+            case Op::TransmitAPDU: {
+                auto command = args.bytes();
+                if (!args.atEnd()) break;
+                return respond(lib_.transmitAPDU(command), writeBytes);
+            }
+            default:
+                return respondError(Status::ERROR_UNSUPPORTED_OPERATION, "Unknown operation");
+        }
+        return respondError(Status::ERROR_ARGUMENTS_BAD, "Malformed request");
+    }
+
+    template<typename T, void (*Encode)(Writer&, const T&)>
+    static void writeList(Writer& w, const std::vector<T>& items) {
+        w.u32(static_cast<uint32_t>(items.size()));
+        for (const auto& item : items) {
+            Encode(w, item);
+        }
+    }
+
+    using CacheKey = std::pair<uint16_t, std::vector<uint8_t>>;
+
+    PKCS11Library lib_;
+    CK_SLOT_ID slot_;
+    TokenInfo info_{};
+    std::chrono::milliseconds callTimeout_;
+
+    TokenScheduler scheduler_;
+    std::atomic<bool> stopping_;
+
+    // Worker thread only
+    std::string pin_;
+    uint64_t generation_;
+    int mismatches_;
+    std::map<CacheKey, std::vector<uint8_t>> cache_; // request -> encoded response
+    size_t cacheBytes_;
+};
+
+// ---- broker ------------------------------------------------------------------
+
+class TokenBroker {
+public:
+    explicit TokenBroker(const Options& options) : options_(options), listenFd_(-1) {}
+
+    ~TokenBroker() {
+        if (listenFd_ >= 0) {
+            close(listenFd_);
+            unlink(options_.socketPath.c_str());
+        }
+    }
+
+    bool start() {
+        if (!listen()) {
+            return false;
+        }
+        auto initialized = discovery_.initialize(options_.library);
+        if (!initialized.isOk()) {
+            fprintf(stderr, "[token-broker] cannot load %s: %s\n", options_.library.c_str(),
+                    initialized.errorMessage.c_str());
+            return false;
+        }
+        scanTokens();
+        return true;
+    }
+
+    // Accepts clients until SIGINT/SIGTERM arrives on signalFd
+    void run(int signalFd) {
+        for (;;) {
+            pollfd fds[2] = {{listenFd_, POLLIN, 0}, {signalFd, POLLIN, 0}};
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            if (fds[1].revents & POLLIN) {
+                break;
+            }
+            if (fds[0].revents & POLLIN) {
+                accept();
+            }
+        }
+        shutdownClients();
+
+        std::lock_guard<std::mutex> lock(registryMutex_);
+        for (auto& entry : workers_) {
+            entry.second->stop();
+        }
+    }
+
+private:
+    struct Client {
+        std::thread reader;
+        std::weak_ptr<Connection> connection;
+        std::shared_ptr<std::atomic<bool>> done;
+    };
+
+    // Opens a worker for every token that is not served yet
+    void scanTokens() {
+        std::lock_guard<std::mutex> lock(registryMutex_);
+        auto slots = discovery_.getSlotList(true);
+        if (!slots.isOk()) {
+            return;
+        }
+        for (CK_SLOT_ID slot : slots.value) {
+            if (workers_.count(slot)) {
+                continue;
+            }
+            // Workers share discovery_'s initialization of the module, so a
+            // worker that fails to open only drops its own use of it
+            auto worker = std::make_unique<TokenWorker>(slot, options_.scheduler, options_.callTimeout);
+            auto opened = worker->open(options_.library);
+            if (!opened.isOk()) {
+                fprintf(stderr, "[token-broker] slot %lu: %s\n", slot, opened.errorMessage.c_str());
+                continue;
+            }
+            fprintf(stderr, "[token-broker] slot %lu: serving token %s\n", slot,
+                    worker->info().serialNumber.c_str());
+            workers_.emplace(slot, std::move(worker));
+        }
+    }
+
+    TokenWorker* findWorker(CK_SLOT_ID slot) {
+        std::lock_guard<std::mutex> lock(registryMutex_);
+        auto it = workers_.find(slot);
+        return it != workers_.end() ? it->second.get() : nullptr;
+    }
+
+    bool listen() {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (options_.socketPath.size() >= sizeof(address.sun_path)) {
+            fprintf(stderr, "[token-broker] socket path too long\n");
+            return false;
+        }
+        strncpy(address.sun_path, options_.socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+        // Only replace the socket of a broker that is no longer running
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe >= 0 && connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+            close(probe);
+            fprintf(stderr, "[token-broker] another broker is listening on %s\n", options_.socketPath.c_str());
+            return false;
+        }
+        if (probe >= 0) {
+            close(probe);
+        }
+        unlink(options_.socketPath.c_str());
+
+        listenFd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        mode_t previous = umask(0077);
+        bool bound = listenFd_ >= 0 &&
+                     bind(listenFd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+        umask(previous);
+        if (!bound || ::listen(listenFd_, 64) != 0) {
+            fprintf(stderr, "[token-broker] cannot listen on %s: %s\n", options_.socketPath.c_str(), strerror(errno));
+            return false;
+        }
+        if (!options_.allowedUids.empty()) {
+            // Other users need to reach the socket; the peer check decides
+            chmod(options_.socketPath.c_str(), 0666);
+        }
+        fprintf(stderr, "[token-broker] listening on %s\n", options_.socketPath.c_str());
+        return true;
+    }
+
+    void accept() {
+        int fd = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+
+        ucred peer{};
+        socklen_t length = sizeof(peer);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0 ||
+            (peer.uid != geteuid() && !options_.allowedUids.count(peer.uid))) {
+            fprintf(stderr, "[token-broker] refused pid %d uid %u\n", peer.pid, peer.uid);
+            close(fd);
+            return;
+        }
+
+        timeval timeout{SEND_TIMEOUT_SECONDS, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        auto connection = std::make_shared<Connection>(fd, peer.uid, peer.pid);
+        auto done = std::make_shared<std::atomic<bool>>(false);
+
+        std::lock_guard<std::mutex> lock(clientsMutex_);
+        reapClients();
+        clients_.push_back({std::thread([this, connection, done] {
+            serve(connection);
+            *done = true;
+        }), connection, done});
+    }
+
+    // Reader thread of one connection: broker-level requests are answered
+    // here, token requests go to the token's queue
+    void serve(const std::shared_ptr<Connection>& connection) {
+        std::shared_ptr<ChannelServer> channel;
+        FrameHeader header;
+        std::vector<uint8_t> payload;
+        while (readFrame(connection->fd(), header, payload)) {
+            Reader args(payload.data(), payload.size());
+            switch (static_cast<Op>(header.op)) {
+                case Op::Hello: {
+                    uint32_t version = args.u32();
+                    if (version != PROTOCOL_VERSION) {
+                        connection->reply(header, respondError(Status::ERROR_UNSUPPORTED_OPERATION,
+                                                               "Protocol version mismatch").take());
+                        break;
+                    }
+                    Writer w = respond(Result<void>::Ok());
+                    w.u32(PROTOCOL_VERSION).u32(MAX_PAYLOAD);
+                    connection->reply(header, w.take());
+                    break;
+                }
+                case Op::ListTokens:
+                    connection->reply(header, listTokens());
+                    break;
+                case Op::GetQueueStats:
+                    connection->reply(header, queueStats(header.slot));
+                    break;
+                case Op::OpenChannel: {
+                    uint32_t entries = args.u32();
+                    uint64_t arenaBytes = args.u64();
+                    if (channel || !args.atEnd()) {
+                        connection->reply(header, respondError(Status::ERROR_ARGUMENTS_BAD,
+                                                               "Channel already open or malformed request").take());
+                        break;
+                    }
+                    std::string error;
+                    channel = ChannelServer::create(entries, arenaBytes, error);
+                    if (!channel) {
+                        connection->reply(header, respondError(Status::ERROR_MEMORY, error).take());
+                        break;
+                    }
+                    Writer w = respond(Result<void>::Ok());
+                    w.u32(entries).u64(arenaBytes);
+                    int fds[3] = {channel->memFd(), channel->submitFd(), channel->completeFd()};
+                    connection->reply(header, w.take(), fds, 3);
+                    channel->start(connection, [this](Job&& job) { return route(std::move(job)); });
+                    break;
+                }
+                default: {
+                    Job job;
+                    job.connection = connection;
+                    job.header = header;
+                    job.payload = std::move(payload);
+                    Writer refused = route(std::move(job));
+                    if (!refused.data().empty()) {
+                        connection->reply(header, refused.take());
+                    }
+                    payload = std::vector<uint8_t>();
+                    break;
+                }
+            }
+        }
+        shutdown(connection->fd(), SHUT_RDWR);
+        if (channel) {
+            channel->stop();
+        }
+    }
+
+    Writer route(Job&& job) {
+        TokenWorker* worker = findWorker(job.header.slot);
+        if (!worker) {
+            return respondError(Status::ERROR_SLOT_ID_INVALID, "No such token", CKR_SLOT_ID_INVALID);
+        }
+        if (!worker->enqueue(std::move(job))) {
+            return respondError(Status::ERROR_FUNCTION_FAILED, "Token queue full");
+        }
+        return Writer();
+    }
+
+    std::vector<uint8_t> queueStats(CK_SLOT_ID slot) {
+        TokenWorker* worker = findWorker(slot);
+        if (!worker) {
+            return respondError(Status::ERROR_SLOT_ID_INVALID, "No such token", CKR_SLOT_ID_INVALID).take();
+        }
+        auto stats = worker->queueStats();
+        Writer w = respond(Result<void>::Ok());
+        w.u32(static_cast<uint32_t>(stats.size()));
+        for (const PriorityStats& entry : stats) {
+            writeQueueStats(w, entry);
+        }
+        return w.take();
+    }
+
+    std::vector<uint8_t> listTokens() {
+        scanTokens();
+        Writer w = respond(Result<void>::Ok());
+        std::lock_guard<std::mutex> lock(registryMutex_);
+        w.u32(static_cast<uint32_t>(workers_.size()));
+        for (const auto& entry : workers_) {
+            const TokenInfo& info = entry.second->info();
+            w.u64(entry.first).str(info.label).str(info.serialNumber).str(info.model);
+            w.u32(entry.second->isLoggedIn() ? 1 : 0);
+        }
+        return w.take();
+    }
+
+    // clientsMutex_ held
+    void reapClients() {
+        for (auto it = clients_.begin(); it != clients_.end();) {
+            if (*it->done) {
+                it->reader.join();
+                it = clients_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void shutdownClients() {
+        std::lock_guard<std::mutex> lock(clientsMutex_);
+        for (auto& client : clients_) {
+            if (auto connection = client.connection.lock()) {
+                shutdown(connection->fd(), SHUT_RDWR);
+            }
+        }
+        for (auto& client : clients_) {
+            client.reader.join();
+        }
+        clients_.clear();
+    }
+
+    Options options_;
+    PKCS11Library discovery_;
+    int listenFd_;
+
+    std::mutex registryMutex_;
+    std::map<CK_SLOT_ID, std::unique_ptr<TokenWorker>> workers_;
+
+    std::mutex clientsMutex_;
+    std::vector<Client> clients_;
+};
+
+bool parseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "missing value for %s\n", arg.c_str());
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--library") {
+            options.library = value;
+        } else if (arg == "--socket") {
+            options.socketPath = value;
+        } else if (arg == "--queue-depth") {
+            options.scheduler.queueDepth = std::max(1ull, strtoull(value.c_str(), nullptr, 10));
+        } else if (arg == "--aging-ms") {
+            options.scheduler.agingInterval = std::chrono::milliseconds(strtoull(value.c_str(), nullptr, 10));
+        } else if (arg == "--call-timeout-ms") {
+            options.callTimeout = std::chrono::milliseconds(strtoull(value.c_str(), nullptr, 10));
+        } else if (arg == "--allow-uid") {
+            options.allowedUids.insert(static_cast<uid_t>(strtoul(value.c_str(), nullptr, 10)));
+        } else {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return false;
+        }
+    }
+    if (options.library.empty()) {
+        fprintf(stderr, "--library is required\n");
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        return 2;
+    }
+
+    // Blocked before any thread starts, so that only the signalfd sees them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    int signalFd = signalfd(-1, &signals, SFD_CLOEXEC);
+
+    TokenBroker broker(options);
+    if (signalFd < 0 || !broker.start()) {
+        return 1;
+    }
+    broker.run(signalFd);
+    close(signalFd);
+    return 0;
+}
@@ -0,0 +1,204 @@
+// Round-trip check of TokenKeyValueStore against the in-tree software token.
+//
+// Build and run, e.g.
+//   g++ -O2 -std=gnu++17 -IToken/include Token/check/token_kv_check.cpp Token/src/*.cpp -ldl -lcrypto -lpthread
+//   ./a.out --library ./libsofttoken.so
+// Options:
+//   --library PATH        PKCS#11 module (default libsofttoken.so)
+//   --pin PIN             user PIN (default 1234, the softtoken default)
+//
+// Writes an empty, a multi-chunk and a compressible value, reads them back
+// through a second store so that the values come from the token and not
+// from the first store's cache, then replaces and removes one and checks
+// that no stale chunks are left behind, and that a value replaced twice in
+// quick succession by two separate stores carries a higher write stamp and
+// reads back as the second write.
+// Prints one line per check; exits 1
+// if any fails. Uses its own CKA_APPLICATION and removes what it wrote.
+
+#include "token_kv_store.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace PKCS11Lib;
+
+namespace {
+
+const char* const APPLICATION = "token-kv-check";
+
+int failures = 0;
+
+void check(const char* name, bool passed, const std::string& detail = std::string()) {
+    printf("%-36s %s%s%s\n", name, passed ? "ok" : "FAIL", detail.empty() ? "" : ": ", detail.c_str());
+    if (!passed) {
+        failures++;
+    }
+}
+
+template<typename T>
+std::string describe(const Result<T>& result) {
+    return result.isOk() ? std::string() : result.errorMessage + " (status " +
+                                           std::to_string(static_cast<int>(result.errorCode)) + ")";
+}
+
+// Every chunk object of the check's store on the token
+size_t chunkCount(PKCS11Library& lib, const std::string& key) {
+    CK_OBJECT_CLASS dataClass = CKO_DATA;
+    std::vector<CK_ATTRIBUTE> search = {
+        {CKA_CLASS, &dataClass, sizeof(dataClass)},
+        {CKA_APPLICATION, (void*)APPLICATION, strlen(APPLICATION)},
+        {CKA_LABEL, (void*)key.data(), key.size()}
+    };
+    auto found = lib.findObjects(search);
+    return found.isOk() ? found.value.size() : 0;
+}
+
+// Highest write stamp among the key's chunks (header bytes 12-15)
+uint32_t chunkStamp(PKCS11Library& lib, const std::string& key) {
+    CK_OBJECT_CLASS dataClass = CKO_DATA;
+    std::vector<CK_ATTRIBUTE> search = {
+        {CKA_CLASS, &dataClass, sizeof(dataClass)},
+        {CKA_APPLICATION, (void*)APPLICATION, strlen(APPLICATION)},
+        {CKA_LABEL, (void*)key.data(), key.size()}
+    };
+    uint32_t highest = 0;
+    auto found = lib.findObjects(search);
+    for (CK_OBJECT_HANDLE handle : found.isOk() ? found.value : std::vector<CK_OBJECT_HANDLE>()) {
+        auto chunk = lib.getObjectAttribute(handle, CKA_VALUE);
+        if (chunk.isOk() && chunk.value.size() >= 16) {
+            const CK_BYTE* stamp = &chunk.value[12];
+            highest = std::max(highest, uint32_t(stamp[0]) << 24 | uint32_t(stamp[1]) << 16 |
+                                        uint32_t(stamp[2]) << 8 | stamp[3]);
+        }
+    }
+    return highest;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::string library = "libsofttoken.so";
+    std::string pin = "1234";
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "--library") {
+            library = argv[i + 1];
+        } else if (arg == "--pin") {
+            pin = argv[i + 1];
+        } else {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return 2;
+        }
+    }
+
+    PKCS11Library lib;
+    auto initialized = lib.initialize(library);
+    if (!initialized.isOk()) {
+        fprintf(stderr, "cannot initialize %s: %s\n", library.c_str(), initialized.errorMessage.c_str());
+        return 1;
+    }
+    auto slots = lib.getSlotList(true);
+    if (!slots.isOk() || slots.value.empty() || !lib.openSession(slots.value[0]).isOk() || !lib.login(pin).isOk()) {
+        fprintf(stderr, "cannot open a logged-in session\n");
+        return 1;
+    }
+
+    KeyValueStoreConfig config;
+    config.application = APPLICATION;
+    config.chunkSize = 256;
+
+    const std::vector<CK_BYTE> empty;
+    std::vector<CK_BYTE> random(config.chunkSize * 5 + 17);
+    std::mt19937 generator(49);
+    for (auto& byte : random) {
+        byte = static_cast<CK_BYTE>(generator());
+    }
+    std::string text;
+    while (text.size() < config.chunkSize * 8) {
+        text += "{\"feature\":\"export\",\"enabled\":true},";
+    }
+    const std::vector<CK_BYTE> compressible(text.begin(), text.end());
+
+    {
+        TokenKeyValueStore store(lib, config);
+        for (const auto& key : store.keys().value) {
+            store.remove(key);
+        }
+        bool put = store.put("empty", empty).isOk() && store.put("random", random).isOk() &&
+                   store.put("text", compressible).isOk();
+        check("put", put);
+        auto flushed = store.flush();
+        check("flush", flushed.isOk(), describe(flushed));
+    }
+    check("empty value is one chunk", chunkCount(lib, "empty") == 1);
+    check("random value spans chunks", chunkCount(lib, "random") == 6);
+    check("text value is compressed", chunkCount(lib, "text") < compressible.size() / config.chunkSize);
+
+    {
+        TokenKeyValueStore store(lib, config);
+        auto value = store.get("empty");
+        check("empty value reads back", value.isOk() && value.value.empty(), describe(value));
+        value = store.get("random");
+        check("multi-chunk value reads back", value.isOk() && value.value == random, describe(value));
+        value = store.get("text");
+        check("compressed value reads back", value.isOk() && value.value == compressible, describe(value));
+        auto keys = store.keys();
+        check("keys lists all three", keys.isOk() && keys.value == std::vector<std::string>{"empty", "random", "text"});
+
+        std::vector<CK_BYTE> shorter(random.begin(), random.begin() + 40);
+        auto replaced = store.put("random", shorter);
+        auto removed = store.remove("text");
+        auto flushed = store.flush();
+        check("replace and remove flush", replaced.isOk() && removed.isOk() && flushed.isOk(), describe(flushed));
+    }
+    check("replace leaves no stale chunks", chunkCount(lib, "random") == 1);
+    check("remove destroys every chunk", chunkCount(lib, "text") == 0);
+
+    {
+        TokenKeyValueStore store(lib, config);
+        auto value = store.get("random");
+        check("replaced value reads back", value.isOk() &&
+              value.value == std::vector<CK_BYTE>(random.begin(), random.begin() + 40), describe(value));
+        value = store.get("text");
+        check("removed key is missing", value.errorCode == Status::ERROR_OBJECT_NOT_FOUND, describe(value));
+        auto keys = store.keys();
+        check("keys drops the removed key", keys.isOk() && keys.value == std::vector<std::string>{"empty", "random"});
+    }
+
+    {
+        // Each store writes without having read the key: the second write
+        // must still win over the first, within the same second
+        TokenKeyValueStore first(lib, config);
+        TokenKeyValueStore second(lib, config);
+        std::vector<CK_BYTE> older(random.begin(), random.begin() + config.chunkSize * 2);
+        std::vector<CK_BYTE> newer(random.rbegin(), random.rbegin() + config.chunkSize * 3);
+        bool written = first.put("random", older).isOk() && first.flush().isOk();
+        uint32_t firstStamp = chunkStamp(lib, "random");
+        written = written && second.put("random", newer).isOk() && second.flush().isOk();
+        check("second store stamps above the first", chunkStamp(lib, "random") > firstStamp);
+        TokenKeyValueStore reader(lib, config);
+        auto value = reader.get("random");
+        check("second store's write wins", written && value.isOk() && value.value == newer, describe(value));
+    }
+
+    {
+        TokenKeyValueStore store(lib, config);
+        store.remove("empty");
+        store.remove("random");
+        auto flushed = store.flush();
+        check("cleanup", flushed.isOk() && chunkCount(lib, "empty") + chunkCount(lib, "random") == 0,
+              describe(flushed));
+    }
+
+    lib.logout();
+    lib.closeSession();
+    lib.finalize();
+    printf("%s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "pkcs11_lib.h"
+
+namespace PKCS11Lib {
+
+// Envelope encryption for large files. The payload is encrypted on the host
+// with a fresh AES-256-GCM data key; only that 32-byte key crosses the USB link,
+// wrapped under an RSA key on the token. File throughput is then bound by disk
+// speed instead of token speed.
+//
+// File layout (integers big-endian):
+//   "P11ENV1\0" | u32 wrappedKeyLen | wrappedKey | iv[12] | ciphertext | tag[16]
+// The header up to and including the IV is authenticated as GCM AAD.
+class EnvelopeCipher {
+public:
+    static constexpr size_t CHUNK_SIZE = 1 << 20;
+
+    explicit EnvelopeCipher(PKCS11Library& lib) : lib_(lib) {}
+
+    Result<void> encryptFile(CK_OBJECT_HANDLE publicKeyHandle, const std::string& inputPath,
+                             const std::string& outputPath);
+    Result<void> decryptFile(CK_OBJECT_HANDLE privateKeyHandle, const std::string& inputPath,
+                             const std::string& outputPath);
+
+    static bool isEnvelopeFile(const std::string& path);
+
+private:
+    PKCS11Library& lib_;
+};
+
+} // namespace PKCS11Lib
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+#include "pkcs11_lib.h"
+
+namespace PKCS11Lib {
+
+// Host-side cryptography (OpenSSL). Used where pushing bulk data through the
+// token would make throughput bound by the USB link rather than the host.
+namespace HostCrypto {
+
+constexpr size_t AES256_KEY_LEN = 32;
+constexpr size_t GCM_IV_LEN = 12;
+constexpr size_t GCM_TAG_LEN = 16;
+
+Result<std::vector<CK_BYTE>> randomBytes(size_t count);
+
+Result<std::vector<CK_BYTE>> digest(HashAlgorithm algorithm, const std::vector<CK_BYTE>& data);
+
+// Overwrite sensitive material in a way the optimiser cannot elide
+void cleanse(std::vector<CK_BYTE>& buffer);
+
+// Streaming AES-256-GCM. OpenSSL dispatches to AES-NI/PCLMULQDQ when present.
+class AesGcm {
+public:
+    enum class Direction {
+        Encrypt,
+        Decrypt
+    };
+
+    AesGcm();
+    ~AesGcm();
+
+    AesGcm(const AesGcm&) = delete;
+    AesGcm& operator=(const AesGcm&) = delete;
+
+    Result<void> init(Direction direction, const std::vector<CK_BYTE>& key, const std::vector<CK_BYTE>& iv);
+    Result<void> addAAD(const CK_BYTE* data, size_t length);
+
+    // Output buffer must hold at least `length` bytes (GCM does not expand)
+    Result<void> update(const CK_BYTE* in, size_t length, CK_BYTE* out);
+
+    Result<std::vector<CK_BYTE>> finishEncrypt();
+    Result<void> finishDecrypt(const std::vector<CK_BYTE>& tag);
+
+private:
+    void* ctx_;
+    Direction direction_;
+};
+
+} // namespace HostCrypto
+
+} // namespace PKCS11Lib
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+
+#include "pkcs11_lib.h"
+
+namespace PKCS11Lib {
+
+struct KeyPoolConfig {
+    enum class KeyKind {
+        RSA,
+        EC_P256
+    };
+
+    KeyKind kind = KeyKind::RSA;
+    CK_ULONG modulusBits = 2048;
+
+    size_t depth = 2;                  // ready pairs to keep on hand
+    size_t capacity = 8;               // never hold more pooled pairs than this
+    bool tokenObjects = true;          // false: session keys, gone when the session closes
+
+    // A refill only starts while freePrivateMemory stays above
+    // reservedPrivateMemory + estimatedPairSize
+    CK_ULONG estimatedPairSize = 1300;
+    CK_ULONG reservedPrivateMemory = 4096;
+
+    // The token must be idle (no module call from other callers) this long
+    std::chrono::milliseconds idleDelay{500};
+
+    // Pooled pairs carry this label until claimed; token pairs left over from
+    // a previous run are adopted on start
+    std::string labelPrefix = "keypool-";
+};
+
+// Pre-generates key pairs while the token is idle so that enrollment only
+// costs a label write. The pool shares the caller's session: it must be open
+// (and logged in for private keys) while the pool is running.
+class KeyPairPool {
+public:
+    KeyPairPool(PKCS11Library& lib, const KeyPoolConfig& config = KeyPoolConfig());
+    ~KeyPairPool();
+
+    KeyPairPool(const KeyPairPool&) = delete;
+    KeyPairPool& operator=(const KeyPairPool&) = delete;
+
+    Result<void> start();
+    void stop();
+
+    // Hand out a ready pair relabelled to `label`. Falls back to generating
+    // one in the foreground when the pool is empty.
+    Result<KeyPair> claim(const std::string& label);
+
+    size_t available() const;
+    size_t capacity() const { return config_.capacity; }
+
+private:
+    PKCS11Library& lib_;
+    KeyPoolConfig config_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::deque<KeyPair> ready_;
+    std::thread filler_;
+    bool running_;
+
+    void fillerLoop();
+    bool hasRoomOnToken(CK_SLOT_ID slotId);
+    Result<KeyPair> generate(const std::string& label);
+    Result<void> relabel(KeyPair& pair, const std::string& label);
+    void adoptExisting();
+    std::string nextPoolLabel();
+};
+
+} // namespace PKCS11Lib
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "pkcs11_lib.h"
+
+namespace PKCS11Lib {
+
+class KeyPairPool;
+
+struct MetricsExporterConfig {
+    std::string socketPath;     // Unix socket to serve scrapes on (empty: none)
+    std::string filePath;       // text file rewritten every interval (empty: none)
+    std::chrono::milliseconds interval{15000};
+
+    // Optional sources for the pool gauges
+    const KeyPairPool* keyPool = nullptr;
+};
+
+// Background exporter of token health in Prometheus text exposition format
+// (version 0.0.4), either served on a Unix socket (a plain connection gets the
+// text; an HTTP GET gets an HTTP response) or written to a file, e.g. for the
+// node_exporter textfile collector.
+//
+// Call metrics come from TokenMetrics, which start() enables. Token state
+// (PIN retry counters, free memory) is sampled once per interval, and only
+// when the library mutex is free: the exporter never queues behind a caller.
+// A busy token keeps the previous sample, whose age is exported. Scrapes only
+// read the metrics snapshot and the cached sample, never the token. The
+// sampling calls themselves show up in the call metrics.
+class MetricsExporter {
+public:
+    MetricsExporter(PKCS11Library& lib, const MetricsExporterConfig& config);
+    ~MetricsExporter();
+
+    MetricsExporter(const MetricsExporter&) = delete;
+    MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+    Result<void> start();
+    void stop();
+
+    // Current exposition text
+    std::string render();
+
+private:
+    struct TokenSample {
+        bool valid = false;
+        std::chrono::steady_clock::time_point takenAt;
+        bool sessionOpen = false;
+        bool loggedIn = false;
+        bool havePinInfo = false;
+        PinInfo pinInfo{};
+        bool haveTokenInfo = false;
+        TokenInfo tokenInfo{};
+    };
+
+    struct RateState {
+        std::chrono::steady_clock::time_point at;
+        std::map<P11Function, uint64_t> calls;
+        std::map<P11Function, double> perSecond;
+    };
+
+    PKCS11Library& lib_;
+    MetricsExporterConfig config_;
+
+    std::mutex mutex_;          // sample_ and rates_
+    TokenSample sample_;
+    RateState rates_;
+
+    std::thread thread_;
+    int listenFd_;
+    int wakeFd_;
+    std::atomic<bool> running_;
+
+    void run();
+    void sampleToken();
+    void updateRates(const MetricsSnapshot& snapshot);
+    void serveClient(int fd);
+    void writeFile();
+};
+
+} // namespace PKCS11Lib
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+#include "result.h"
+
+namespace PKCS11Lib {
+
+// Cancellation flag shared by all copies: the caller keeps one copy and
+// cancels it from any thread, the operation holds another.
+class CancellationToken {
+public:
+    CancellationToken() : cancelled_(std::make_shared<std::atomic<bool>>(false)) {}
+
+    void cancel() { cancelled_->store(true); }
+    bool isCancelled() const { return cancelled_->load(); }
+
+private:
+    std::shared_ptr<std::atomic<bool>> cancelled_;
+};
+
+// Deadline and cancellation for the library calls made under an
+// OperationScope. Nested scopes keep the outer limits: the tighter deadline
+// applies and either token cancels.
+struct OperationContext {
+    using Clock = std::chrono::steady_clock;
+
+    Clock::time_point deadline = Clock::time_point::max();
+    CancellationToken cancellation;
+    const OperationContext* parent = nullptr;      // set by OperationScope
+
+    static OperationContext within(std::chrono::milliseconds timeout,
+                                   CancellationToken cancellation = CancellationToken()) {
+        OperationContext context;
+        context.deadline = Clock::now() + timeout;
+        context.cancellation = cancellation;
+        return context;
+    }
+
+    Clock::time_point effectiveDeadline() const {
+        return parent ? std::min(deadline, parent->effectiveDeadline()) : deadline;
+    }
+
+    // OK while calls may go ahead, otherwise ERROR_FUNCTION_CANCELED or ERROR_TIMEOUT
+    Status check() const {
+        for (const OperationContext* context = this; context; context = context->parent) {
+            if (context->cancellation.isCancelled()) {
+                return Status::ERROR_FUNCTION_CANCELED;
+            }
+        }
+        return Clock::now() >= effectiveDeadline() ? Status::ERROR_TIMEOUT : Status::OK;
+    }
+};
+
+} // namespace PKCS11Lib
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+extern "C" {
+    #include "cryptoki_ext.h"
+    #include "auxiliary.h"
+}
+
+namespace PKCS11Lib {
+
+// Vendor aux entry points: X(typedef name, slot in AUX_FUNC_LIST::pFunc)
+#define P11_AUX_FUNCTIONS(X) \
+    X(EP_InitTokenPrivate, EP_INIT_TOKEN_PRIVATE) \
+    X(EP_SetTokenLabel, EP_SET_TOKEN_LABEL) \
+    X(EP_GetPinInfo, EP_GET_PIN_INFO) \
+    X(EP_WaitForSlotEvent, EP_WAITFORSLOTEVENT) \
+    X(EP_ParseComboCertificate, EP_PARSE_COMBO_CERT) \
+    X(EP_SetTokenTimeout, EP_SET_TOKEN_TIMEOUT) \
+    X(EP_GetTokenTimeout, EP_GET_TOKEN_TIMEOUT) \
+    X(EP_GetTokenState, EP_GET_TOKEN_STATE) \
+    X(EP_BlankToken, EP_BLANK_TOKEN) \
+    X(EP_GetDevInfo, EP_GET_DEV_INFO) \
+    X(EP_BeginTransaction, EP_BEGIN_TRANS_APDU) \
+    X(EP_TransmitAPDU, EP_TRANSEMIT_APDU) \
+    X(EP_EndTransaction, EP_END_TRANS_APDU)
+
+// Stable identifiers for every PKCS#11 and vendor aux entry point, used by
+// instrumentation and tracing. The standard entries are generated from
+// pkcs11f.h in CK_FUNCTION_LIST order.
+enum class P11Function : uint16_t {
+#define CK_PKCS11_FUNCTION_INFO(name) name,
+#include "pkcs11f.h"
+#undef CK_PKCS11_FUNCTION_INFO
+#define P11_AUX_ENUM(name, index) name,
+    P11_AUX_FUNCTIONS(P11_AUX_ENUM)
+#undef P11_AUX_ENUM
+    Count
+};
+
+constexpr size_t P11_FUNCTION_COUNT = static_cast<size_t>(P11Function::Count);
+
+inline const char* p11FunctionName(P11Function function) {
+    static const char* const names[] = {
+#define CK_PKCS11_FUNCTION_INFO(name) #name,
+#include "pkcs11f.h"
+#undef CK_PKCS11_FUNCTION_INFO
+#define P11_AUX_NAME(name, index) #name,
+        P11_AUX_FUNCTIONS(P11_AUX_NAME)
+#undef P11_AUX_NAME
+    };
+    size_t index = static_cast<size_t>(function);
+    return index < P11_FUNCTION_COUNT ? names[index] : "unknown";
+}
+
+} // namespace PKCS11Lib
@@ -0,0 +1,370 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "p11_functions.h"
+
+// Shared between the tracing shim (Token/shim), which records what a module
+// returned, and the replay module (Token/replay), which writes it back. Both
+// walk a call's output arguments through visitOutputs() in the same order, so
+// the recorded payload is just the sequence of items the visitor produced.
+// The argument and data length capture is also used by PKCS11Library's probes.
+
+namespace PKCS11Lib {
+
+template<P11Function F>
+struct FunctionTag {};
+
+class PayloadVisitor {
+public:
+    virtual ~PayloadVisitor() = default;
+
+    // A single CK_ULONG written by the callee (handles, counts, timeouts)
+    virtual void scalar(CK_ULONG* value) = 0;
+
+    // An array of `elementSize` elements whose count is returned in *count.
+    // `capacity` is the caller's buffer size in elements. `data` may be null
+    // for a size query.
+    virtual void array(void* data, CK_ULONG* count, size_t elementSize, CK_ULONG capacity) = 0;
+
+    // A fixed-size output structure or buffer
+    virtual void fixed(void* data, size_t size) = 0;
+
+    // A C_GetAttributeValue template: lengths and values
+    virtual void attributes(CK_ATTRIBUTE_PTR attributes, CK_ULONG count) = 0;
+
+    // Helper for the common (CK_BYTE_PTR, CK_ULONG_PTR) output pair
+    void bytes(CK_BYTE_PTR data, CK_ULONG_PTR length) {
+        array(data, length, 1, length ? *length : 0);
+    }
+};
+
+// Functions without outputs (or whose outputs are not recorded)
+template<P11Function F, typename... A>
+void visitOutputs(FunctionTag<F>, PayloadVisitor&, A...) {}
+
+#define P11_OUTPUTS(name) inline void visitOutputs(FunctionTag<P11Function::name>, PayloadVisitor& v,
+
+P11_OUTPUTS(C_GetInfo) CK_INFO_PTR pInfo) { v.fixed(pInfo, sizeof(*pInfo)); }
+P11_OUTPUTS(C_GetSlotList) CK_BBOOL, CK_SLOT_ID_PTR pSlotList, CK_ULONG_PTR pulCount) {
+    v.array(pSlotList, pulCount, sizeof(CK_SLOT_ID), pulCount ? *pulCount : 0);
+}
+P11_OUTPUTS(C_GetSlotInfo) CK_SLOT_ID, CK_SLOT_INFO_PTR pInfo) { v.fixed(pInfo, sizeof(*pInfo)); }
+P11_OUTPUTS(C_GetTokenInfo) CK_SLOT_ID, CK_TOKEN_INFO_PTR pInfo) { v.fixed(pInfo, sizeof(*pInfo)); }
+P11_OUTPUTS(C_GetMechanismList) CK_SLOT_ID, CK_MECHANISM_TYPE_PTR pList, CK_ULONG_PTR pulCount) {
+    v.array(pList, pulCount, sizeof(CK_MECHANISM_TYPE), pulCount ? *pulCount : 0);
+}
+P11_OUTPUTS(C_GetMechanismInfo) CK_SLOT_ID, CK_MECHANISM_TYPE, CK_MECHANISM_INFO_PTR pInfo) {
+    v.fixed(pInfo, sizeof(*pInfo));
+}
+P11_OUTPUTS(C_OpenSession) CK_SLOT_ID, CK_FLAGS, CK_VOID_PTR, CK_NOTIFY, CK_SESSION_HANDLE_PTR phSession) {
+    v.scalar(phSession);
+}
+P11_OUTPUTS(C_GetSessionInfo) CK_SESSION_HANDLE, CK_SESSION_INFO_PTR pInfo) { v.fixed(pInfo, sizeof(*pInfo)); }
+P11_OUTPUTS(C_GetOperationState) CK_SESSION_HANDLE, CK_BYTE_PTR pState, CK_ULONG_PTR pulLen) {
+    v.bytes(pState, pulLen);
+}
+P11_OUTPUTS(C_CreateObject) CK_SESSION_HANDLE, CK_ATTRIBUTE_PTR, CK_ULONG, CK_OBJECT_HANDLE_PTR phObject) {
+    v.scalar(phObject);
+}
+P11_OUTPUTS(C_CopyObject) CK_SESSION_HANDLE, CK_OBJECT_HANDLE, CK_ATTRIBUTE_PTR, CK_ULONG,
+                          CK_OBJECT_HANDLE_PTR phNewObject) {
+    v.scalar(phNewObject);
+}
+P11_OUTPUTS(C_GetObjectSize) CK_SESSION_HANDLE, CK_OBJECT_HANDLE, CK_ULONG_PTR pulSize) { v.scalar(pulSize); }
+P11_OUTPUTS(C_GetAttributeValue) CK_SESSION_HANDLE, CK_OBJECT_HANDLE, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount) {
+    v.attributes(pTemplate, ulCount);
+}
+P11_OUTPUTS(C_FindObjects) CK_SESSION_HANDLE, CK_OBJECT_HANDLE_PTR phObject, CK_ULONG ulMaxObjectCount,
+                           CK_ULONG_PTR pulObjectCount) {
+    v.array(phObject, pulObjectCount, sizeof(CK_OBJECT_HANDLE), ulMaxObjectCount);
+}
+
+#define P11_BYTES_OUTPUT(name, ...) \
+    P11_OUTPUTS(name) __VA_ARGS__, CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen) { v.bytes(pOut, pulOutLen); }
+
+P11_BYTES_OUTPUT(C_Encrypt, CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG)
+P11_BYTES_OUTPUT(C_EncryptUpdate, CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG)
+P11_BYTES_OUTPUT(C_EncryptFinal, CK_SESSION_HANDLE)
+P11_BYTES_OUTPUT(C_Decrypt, CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG)
+P11_BYTES_OUTPUT(C_DecryptUpdate, CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG)
+P11_BYTES_OUTPUT(C_DecryptFinal, CK_SESSION_HANDLE)
+P11_BYTES_OUTPUT(C_Digest, CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG)
+P11_BYTES_OUTPUT(C_DigestFinal, CK_SESSION_HANDLE)
+P11_BYTES_OUTPUT(C_Sign, CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG)
+P11_BYTES_OUTPUT(C_SignFinal, CK_SESSION_HANDLE)
+P11_BYTES_OUTPUT(C_SignRecover, CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG)
+P11_BYTES_OUTPUT(C_VerifyRecover, CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG)
+P11_BYTES_OUTPUT(C_DigestEncryptUpdate, CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG)
+P11_BYTES_OUTPUT(C_DecryptDigestUpdate, CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG)
+P11_BYTES_OUTPUT(C_SignEncryptUpdate, CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG)
+P11_BYTES_OUTPUT(C_DecryptVerifyUpdate, CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG)
+P11_BYTES_OUTPUT(C_WrapKey, CK_SESSION_HANDLE, CK_MECHANISM_PTR, CK_OBJECT_HANDLE, CK_OBJECT_HANDLE)
+
+#undef P11_BYTES_OUTPUT
+
+P11_OUTPUTS(C_GenerateKey) CK_SESSION_HANDLE, CK_MECHANISM_PTR, CK_ATTRIBUTE_PTR, CK_ULONG,
+                           CK_OBJECT_HANDLE_PTR phKey) {
+    v.scalar(phKey);
+}
+P11_OUTPUTS(C_GenerateKeyPair) CK_SESSION_HANDLE, CK_MECHANISM_PTR, CK_ATTRIBUTE_PTR, CK_ULONG,
+                               CK_ATTRIBUTE_PTR, CK_ULONG, CK_OBJECT_HANDLE_PTR phPublicKey,
+                               CK_OBJECT_HANDLE_PTR phPrivateKey) {
+    v.scalar(phPublicKey);
+    v.scalar(phPrivateKey);
+}
+P11_OUTPUTS(C_UnwrapKey) CK_SESSION_HANDLE, CK_MECHANISM_PTR, CK_OBJECT_HANDLE, CK_BYTE_PTR, CK_ULONG,
+                         CK_ATTRIBUTE_PTR, CK_ULONG, CK_OBJECT_HANDLE_PTR phKey) {
+    v.scalar(phKey);
+}
+P11_OUTPUTS(C_DeriveKey) CK_SESSION_HANDLE, CK_MECHANISM_PTR, CK_OBJECT_HANDLE, CK_ATTRIBUTE_PTR, CK_ULONG,
+                         CK_OBJECT_HANDLE_PTR phKey) {
+    v.scalar(phKey);
+}
+P11_OUTPUTS(C_GenerateRandom) CK_SESSION_HANDLE, CK_BYTE_PTR pRandom, CK_ULONG ulRandomLen) {
+    v.fixed(pRandom, ulRandomLen);
+}
+P11_OUTPUTS(C_WaitForSlotEvent) CK_FLAGS, CK_SLOT_ID_PTR pSlot, CK_VOID_PTR) { v.scalar(pSlot); }
+
+// Aux functions
+P11_OUTPUTS(EP_GetPinInfo) CK_SLOT_ID, AUX_PIN_INFO_PTR pPinInfo) { v.fixed(pPinInfo, sizeof(*pPinInfo)); }
+P11_OUTPUTS(EP_WaitForSlotEvent) CK_FLAGS, CK_SLOT_ID_PTR pSlotId, CK_ULONG* pulEvent, CK_ULONG* pulExtData,
+                                 CK_VOID_PTR) {
+    v.scalar(pSlotId);
+    v.scalar(pulEvent);
+    v.scalar(pulExtData);
+}
+P11_OUTPUTS(EP_GetTokenTimeout) CK_SLOT_ID, CK_ULONG_PTR pulTimeout) { v.scalar(pulTimeout); }
+P11_OUTPUTS(EP_GetTokenState) CK_SLOT_ID, CK_BBOOL, CK_VOID_PTR pState, CK_ULONG_PTR pulStateLen) {
+    v.bytes(static_cast<CK_BYTE_PTR>(pState), pulStateLen);
+}
+P11_OUTPUTS(EP_GetDevInfo) CK_SLOT_ID, DEV_INFO_PTR pDevInfo) { v.fixed(pDevInfo, sizeof(*pDevInfo)); }
+P11_OUTPUTS(EP_TransmitAPDU) CK_SLOT_ID, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR pbRecvBuf, CK_ULONG_PTR pulRecvLen,
+                             CK_FLAGS, CK_BYTE_PTR, CK_ULONG) {
+    v.bytes(pbRecvBuf, pulRecvLen);
+}
+
+#undef P11_OUTPUTS
+
+// ---- scalar argument capture -------------------------------------------------
+
+// The first three integral arguments (handles, slot IDs, flags, lengths), with
+// a CK_MECHANISM_PTR standing in for its mechanism type
+template<typename T>
+constexpr bool isScalarArg() {
+    return std::is_integral<T>::value || std::is_same<T, CK_MECHANISM_PTR>::value;
+}
+
+template<typename T>
+uint64_t scalarValue(T value) {
+    if constexpr (std::is_same<T, CK_MECHANISM_PTR>::value) {
+        return value ? value->mechanism : ~uint64_t(0);
+    } else {
+        return static_cast<uint64_t>(value);
+    }
+}
+
+template<typename... A>
+void captureScalarArgs(uint64_t (&out)[3], A... args) {
+    size_t captured = 0;
+    auto capture = [&](auto value) {
+        if constexpr (isScalarArg<decltype(value)>()) {
+            if (captured < 3) {
+                out[captured++] = scalarValue(value);
+            }
+        }
+    };
+    (capture(args), ...);
+}
+
+// ---- data length capture ---------------------------------------------------
+
+struct CallBytes {
+    uint64_t in = 0;
+    uint64_t out = 0;
+};
+
+inline uint64_t attributeBytes(CK_ATTRIBUTE_PTR attrs, CK_ULONG count) {
+    uint64_t total = 0;
+    for (CK_ULONG i = 0; attrs && i < count; i++) {
+        if (attrs[i].pValue && attrs[i].ulValueLen != CK_UNAVAILABLE_INFORMATION) {
+            total += attrs[i].ulValueLen;
+        }
+    }
+    return total;
+}
+
+// Data lengths are recognised by argument shape: (CK_BYTE_PTR, integer) is
+// input, (CK_BYTE_PTR, CK_ULONG_PTR) is output, (CK_ATTRIBUTE_PTR, integer) is
+// an attribute template, read back by C_GetAttributeValue and written otherwise
+template<size_t I, typename Tuple>
+void measurePair(const Tuple& args, CK_RV rv, bool attributesOut, CallBytes& bytes) {
+    if constexpr (I + 1 < std::tuple_size<Tuple>::value) {
+        using A = std::tuple_element_t<I, Tuple>;
+        using B = std::tuple_element_t<I + 1, Tuple>;
+        if constexpr (std::is_same<A, CK_BYTE_PTR>::value && std::is_integral<B>::value) {
+            if (std::get<I>(args)) {
+                bytes.in += std::get<I + 1>(args);
+            }
+        } else if constexpr (std::is_same<A, CK_BYTE_PTR>::value && std::is_same<B, CK_ULONG_PTR>::value) {
+            if (rv == CKR_OK && std::get<I>(args) && std::get<I + 1>(args)) {
+                bytes.out += *std::get<I + 1>(args);
+            }
+        } else if constexpr (std::is_same<A, CK_ATTRIBUTE_PTR>::value && std::is_integral<B>::value) {
+            uint64_t length = attributeBytes(std::get<I>(args), std::get<I + 1>(args));
+            (attributesOut ? bytes.out : bytes.in) += length;
+        }
+    }
+}
+
+template<typename Tuple, size_t... I>
+CallBytes measureTuple(const Tuple& args, P11Function function, CK_RV rv, std::index_sequence<I...>) {
+    CallBytes bytes;
+    (measurePair<I>(args, rv, function == P11Function::C_GetAttributeValue, bytes), ...);
+    return bytes;
+}
+
+// Call after the function returned, so output lengths are filled in
+template<typename... A>
+CallBytes measureCallBytes(P11Function function, CK_RV rv, const A&... args) {
+    return measureTuple(std::make_tuple(std::decay_t<A>(args)...), function, rv, std::index_sequence_for<A...>());
+}
+
+// ---- payload streams ---------------------------------------------------------
+
+// Payload stream encoding: each visitor item is a little length prefix
+// (uint32_t, ~0 for "no buffer") followed by that many bytes.
+class PayloadWriter : public PayloadVisitor {
+public:
+    explicit PayloadWriter(bool succeeded) : succeeded_(succeeded) {}
+
+    const std::vector<uint8_t>& data() const { return data_; }
+
+    void scalar(CK_ULONG* value) override {
+        put(value, value ? sizeof(*value) : NO_BUFFER);
+    }
+
+    void array(void* data, CK_ULONG* count, size_t elementSize, CK_ULONG) override {
+        // Buffer contents are only meaningful when the call succeeded
+        bool hasData = data && count && succeeded_;
+        put(data, hasData ? *count * elementSize : NO_BUFFER);
+        scalar(count);
+    }
+
+    void fixed(void* data, size_t size) override {
+        put(data, data && succeeded_ ? size : NO_BUFFER);
+    }
+
+    void attributes(CK_ATTRIBUTE_PTR attributes, CK_ULONG count) override {
+        for (CK_ULONG i = 0; attributes && i < count; i++) {
+            CK_ULONG length = attributes[i].ulValueLen;
+            bool hasValue = attributes[i].pValue && length != CK_UNAVAILABLE_INFORMATION;
+            put(attributes[i].pValue, hasValue ? length : NO_BUFFER);
+            scalar(&attributes[i].ulValueLen);
+        }
+    }
+
+private:
+    static constexpr uint32_t NO_BUFFER = ~uint32_t(0);
+
+    void put(const void* data, size_t size) {
+        uint32_t length = static_cast<uint32_t>(size);
+        const uint8_t* prefix = reinterpret_cast<const uint8_t*>(&length);
+        data_.insert(data_.end(), prefix, prefix + sizeof(length));
+        if (length != NO_BUFFER && length) {
+            const uint8_t* bytes = static_cast<const uint8_t*>(data);
+            data_.insert(data_.end(), bytes, bytes + length);
+        }
+    }
+
+    bool succeeded_;
+    std::vector<uint8_t> data_;
+};
+
+// Writes a recorded payload back into a caller's output arguments. Returns
+// false from complete() if the payload did not fit the caller's call shape.
+class PayloadReader : public PayloadVisitor {
+public:
+    PayloadReader(const uint8_t* data, size_t size) : data_(data), size_(size), offset_(0), ok_(true) {}
+
+    bool complete() const { return ok_ && offset_ == size_; }
+
+    void scalar(CK_ULONG* value) override {
+        const uint8_t* item = nullptr;
+        uint32_t length = 0;
+        if (next(item, length) && value && length == sizeof(*value)) {
+            memcpy(value, item, sizeof(*value));
+        }
+    }
+
+    void array(void* data, CK_ULONG* count, size_t elementSize, CK_ULONG capacity) override {
+        const uint8_t* item = nullptr;
+        uint32_t length = 0;
+        bool hasData = next(item, length) && length != NO_BUFFER;
+        if (hasData && data && length <= capacity * elementSize) {
+            memcpy(data, item, length);
+        } else if (hasData && data) {
+            ok_ = false;
+        }
+        scalar(count);
+    }
+
+    void fixed(void* data, size_t size) override {
+        const uint8_t* item = nullptr;
+        uint32_t length = 0;
+        if (next(item, length) && length != NO_BUFFER && data) {
+            memcpy(data, item, length < size ? length : size);
+        }
+    }
+
+    void attributes(CK_ATTRIBUTE_PTR attributes, CK_ULONG count) override {
+        for (CK_ULONG i = 0; attributes && i < count; i++) {
+            const uint8_t* item = nullptr;
+            uint32_t length = 0;
+            CK_ULONG capacity = attributes[i].ulValueLen;
+            if (next(item, length) && length != NO_BUFFER && attributes[i].pValue) {
+                if (length <= capacity) {
+                    memcpy(attributes[i].pValue, item, length);
+                } else {
+                    ok_ = false;
+                }
+            }
+            scalar(&attributes[i].ulValueLen);
+        }
+    }
+
+private:
+    static constexpr uint32_t NO_BUFFER = ~uint32_t(0);
+
+    bool next(const uint8_t*& item, uint32_t& length) {
+        if (offset_ + sizeof(length) > size_) {
+            ok_ = false;
+            return false;
+        }
+        memcpy(&length, data_ + offset_, sizeof(length));
+        offset_ += sizeof(length);
+        if (length == NO_BUFFER) {
+            item = nullptr;
+            return true;
+        }
+        if (offset_ + length > size_) {
+            ok_ = false;
+            return false;
+        }
+        item = data_ + offset_;
+        offset_ += length;
+        return true;
+    }
+
+    const uint8_t* data_;
+    size_t size_;
+    size_t offset_;
+    bool ok_;
+};
+
+} // namespace PKCS11Lib
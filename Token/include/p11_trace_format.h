@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "p11_functions.h"
+
+namespace PKCS11Lib {
+
+// On-disk format of PKCS#11 call traces written by the interposer shim
+// (Token/shim). A file is a TraceFileHeader followed by fixed-size
+// TraceRecords in the order calls completed. All fields are host-endian.
+//
+// Version 2 adds optional Payload records: when output capture is enabled a
+// Call is followed by TracePayloadRecords from the same thread carrying the
+// call's outputs (see p11_trace_capture.h), which is what the replay module
+// (Token/replay) returns to its callers. Records of different threads may
+// interleave, so readers pair payloads with the preceding Call by threadId.
+
+constexpr char TRACE_MAGIC[8] = {'P', '1', '1', 'T', 'R', 'A', 'C', 'E'};
+constexpr uint32_t TRACE_VERSION = 2;
+constexpr uint32_t TRACE_MIN_VERSION = 1;
+
+struct TraceFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;        // sizeof(TraceRecord)
+    uint64_t startRealtimeNs;   // wall clock at trace start
+    uint32_t pid;
+    uint32_t droppedRecords;    // ring overflows, filled in when the trace is closed
+    char targetLibrary[232];    // NUL-terminated path of the traced module
+};
+
+enum class TraceRecordKind : uint16_t {
+    Call = 1,
+    Payload = 2
+};
+
+// Up to three leading scalar arguments are captured (slot, session and object
+// handles, flags, mechanism type for CK_MECHANISM_PTR); buffer contents are not.
+// bytesIn/bytesOut are the data lengths passed in and returned.
+struct TraceRecord {
+    uint64_t startNs;           // monotonic, relative to trace start
+    uint64_t durationNs;
+    uint32_t threadId;
+    uint16_t function;          // P11Function
+    uint16_t kind;              // TraceRecordKind
+    uint64_t rv;
+    uint64_t args[3];
+    uint32_t bytesIn;
+    uint32_t bytesOut;
+};
+
+// One chunk of a call's output payload. threadId, function and kind sit at the
+// same offsets as in TraceRecord so a reader can dispatch on either.
+struct TracePayloadRecord {
+    uint32_t totalLength;       // size of the whole payload
+    uint32_t offset;            // position of data[0] within it
+    uint64_t reserved;
+    uint32_t threadId;
+    uint16_t function;          // P11Function
+    uint16_t kind;              // TraceRecordKind::Payload
+    uint8_t data[40];
+};
+
+constexpr size_t TRACE_PAYLOAD_CHUNK = sizeof(TracePayloadRecord::data);
+
+static_assert(sizeof(TraceFileHeader) == 264, "trace header layout changed");
+static_assert(sizeof(TraceRecord) == 64, "trace record layout changed");
+static_assert(sizeof(TracePayloadRecord) == sizeof(TraceRecord), "payload record must fill a record slot");
+static_assert(offsetof(TracePayloadRecord, threadId) == offsetof(TraceRecord, threadId) &&
+              offsetof(TracePayloadRecord, kind) == offsetof(TraceRecord, kind),
+              "payload record header must overlay TraceRecord");
+
+} // namespace PKCS11Lib
@@ -6,9 +6,16 @@
 #include <optional>
 #include <functional>
 #include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <set>
 
 // Include result template
 #include "result.h"
+#include "operation_context.h"
+#include "token_metrics.h"
+#include "token_trace.h"
 
 // Include PKCS#11 headers
 extern "C" {
@@ -55,6 +62,21 @@ struct PinInfo {
     CK_FLAGS pinFlags;
 };
 
+// probeToken() result. generation identifies the insertion: the time, in
+// microseconds since the epoch, at which the library first saw this insertion
+// (0 while absent). A new generation means handles from before may be stale.
+// A removal between two probes is caught by the open session dying with it,
+// or, with no session open, by a different hardwareSerial; the same token
+// re-inserted while no session is open keeps its generation.
+struct TokenProbe {
+    bool present = false;
+    bool userLoggedIn = false;
+    bool soLoggedIn = false;
+    uint64_t generation = 0;
+    std::vector<CK_BYTE> hardwareSerial;    // EP_GET_DEV_INFO
+    bool busy = false;                      // another call held the library: values are the last probe's
+};
+
 struct CertificateInfo {
     CK_OBJECT_HANDLE handle;
     std::string label;
@@ -116,21 +138,156 @@ enum class CipherMode {
     CBC_PAD
 };
 
+// ECDSA signature wire format: RAW is r || s (64 bytes for P-256),
+// DER is the X.509/ASN.1 Ecdsa-Sig-Value SEQUENCE
+enum class SignatureEncoding {
+    RAW,
+    DER
+};
+
+// Public key export format: DER SubjectPublicKeyInfo, or the same armoured
+// as a PEM "PUBLIC KEY" block
+enum class KeyFormat {
+    DER,
+    PEM
+};
+
+// Objects created by a PKCS#12 import. The key pair and its certificate share
+// CKA_ID (SHA-1 of the modulus); certificate is CK_INVALID_HANDLE when the
+// file carries none. chain lists only the CA certificates that were not on
+// the token yet.
+struct Pkcs12Import {
+    std::string label;
+    std::vector<CK_BYTE> id;
+    CK_OBJECT_HANDLE certificate = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE privateKey = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE publicKey = CK_INVALID_HANDLE;
+    std::vector<CK_OBJECT_HANDLE> chain;
+    bool parsedByToken = false;     // EP_ParseComboCertificate rather than host parsing
+};
+
+struct Pkcs12FileImport {
+    std::string path;
+    Result<Pkcs12Import> result;
+};
+
+// One step of executeBatch(). Attribute values are only read during the call
+// and stay owned by the caller, as with createObject().
+struct BatchOperation {
+    enum class Kind {
+        Create,
+        Destroy,
+        SetAttributes
+    };
+
+    Kind kind = Kind::Create;
+    CK_OBJECT_HANDLE handle = CK_INVALID_HANDLE;    // Destroy, SetAttributes
+    std::vector<CK_ATTRIBUTE> attributes;           // Create template, or the values to set
+
+    static BatchOperation create(std::vector<CK_ATTRIBUTE> attributes) {
+        return {Kind::Create, CK_INVALID_HANDLE, std::move(attributes)};
+    }
+    static BatchOperation destroy(CK_OBJECT_HANDLE handle) {
+        return {Kind::Destroy, handle, {}};
+    }
+    static BatchOperation setAttributes(CK_OBJECT_HANDLE handle, std::vector<CK_ATTRIBUTE> attributes) {
+        return {Kind::SetAttributes, handle, std::move(attributes)};
+    }
+};
+
+namespace Pkcs12 {
+struct Contents;
+}
+
+// Supplies the PIN for re-login after the token was re-inserted.
+// Return std::nullopt to refuse (recovery then fails with the original error).
+using CredentialProvider = std::function<std::optional<std::string>()>;
+
+// Transparent recovery after CKR_DEVICE_REMOVED / CKR_TOKEN_NOT_PRESENT /
+// CKR_SESSION_HANDLE_INVALID: wait for the same token (by serial number) to
+// come back, reopen the session, log in again and replay the idempotent
+// operation once. Only searches and token queries are replayed: an operation
+// on object handles fails with ERROR_HANDLES_INVALIDATED instead, since
+// session objects are gone and token objects may have new handles. The wait
+// for the token runs without the library mutex. A caller that holds it (a
+// TokenTransaction, an OperationScope, its own lock) gets one look at the
+// slots and then ERROR_TOKEN_NOT_PRESENT rather than keep other threads out;
+// an expired or cancelled OperationScope gets ERROR_TIMEOUT or
+// ERROR_FUNCTION_CANCELED without a look. A session that stays lost is
+// reopened by the next call that needs it.
+struct RecoveryPolicy {
+    bool enabled = false;
+    std::chrono::milliseconds reinsertTimeout{30000};
+    std::chrono::milliseconds pollInterval{250};
+};
+
+// The library mutex: recursive, and counting how many levels its owner holds
+// so that a wait which has to drop it can tell whether an outer frame still
+// holds it. depth() is meaningful only to the owning thread.
+class LibraryMutex {
+public:
+    void lock() { mutex_.lock(); depth_++; }
+    bool try_lock() {
+        if (!mutex_.try_lock()) {
+            return false;
+        }
+        depth_++;
+        return true;
+    }
+    void unlock() { depth_--; mutex_.unlock(); }
+    int depth() const { return depth_; }
+
+private:
+    std::recursive_mutex mutex_;
+    int depth_ = 0;
+};
+
 // Main PKCS11 Library class
 class PKCS11Library {
 public:
     PKCS11Library();
     ~PKCS11Library();
 
-    // Library management
+    // Library management. The module is initialized for OS locking when it
+    // accepts it, which lets an expired OperationScope interrupt a call.
+    // Instances on the same module share its initialization: only the first
+    // initialize() reaches C_Initialize and only the last finalize() reaches
+    // C_Finalize, so instances can come and go independently.
     Result<void> initialize(const std::string& libraryPath = "");
     Result<void> finalize();
     bool isInitialized() const { return initialized_; }
 
+    // Every public call serialises on this mutex. Hold it to run several calls
+    // as one unit from a multi-threaded caller; try_lock tells whether the
+    // token is busy.
+    LibraryMutex& mutex() { return mutex_; }
+
+    // Per-function call counts, errors, bytes and latency histograms for every
+    // C_* and aux call. Disabled by default; enable with metrics().setEnabled(true).
+    TokenMetrics& metrics() { return metrics_; }
+
+    // Chrome trace-event spans for library methods and the C_* calls they
+    // make. Disabled by default; enable with trace().start([path]).
+    TokenTrace& trace() { return trace_; }
+
+    // When the last module call returned, from any thread. Unlike try_lock on
+    // mutex(), this also sees the short calls made between two looks.
+    std::chrono::steady_clock::time_point lastCallTime() const {
+        return std::chrono::steady_clock::time_point(
+            std::chrono::steady_clock::duration(lastCall_.load(std::memory_order_relaxed)));
+    }
+
     // Slot and token management
     Result<std::vector<CK_SLOT_ID>> getSlotList(bool tokenPresent = true);
     Result<SlotInfo> getSlotInfo(CK_SLOT_ID slotId);
     Result<TokenInfo> getTokenInfo(CK_SLOT_ID slotId);
+
+    // Cheap liveness check of the current slot for frequent health polling:
+    // one EP_GET_TOKEN_STATE call (C_GetSlotInfo without the aux list), plus
+    // C_GetSessionInfo, or EP_GET_DEV_INFO with no session open, to notice a
+    // re-insertion since the last probe. Does not wait behind a call in
+    // progress on another thread.
+    Result<TokenProbe> probeToken();
     
     // Session management
     Result<void> openSession(CK_SLOT_ID slotId, bool readWrite = true);
@@ -138,6 +295,13 @@ public:
     Result<void> login(const std::string& pin, CK_USER_TYPE userType = CKU_USER);
     Result<void> logout();
     bool isLoggedIn() const { return loggedIn_; }
+    bool isSessionOpen() const { return sessionOpen_; }
+    CK_SLOT_ID currentSlotId() const { return currentSlotId_; }
+
+    // Session recovery
+    void setRecoveryPolicy(const RecoveryPolicy& policy);
+    void setCredentialProvider(CredentialProvider provider);
+    static bool isConnectionLoss(CK_RV rv);
 
     // PIN management
     Result<PinInfo> getPinInfo();
@@ -154,13 +318,23 @@ public:
     Result<std::vector<CertificateInfo>> findCertificates();
     Result<std::vector<KeyInfo>> findKeys(CK_OBJECT_CLASS keyClass = CKO_PUBLIC_KEY);
     Result<std::vector<CK_OBJECT_HANDLE>> findDataObjects();
+    // Objects matching an arbitrary template; the attribute values are only read
+    Result<std::vector<CK_OBJECT_HANDLE>> findObjects(const std::vector<CK_ATTRIBUTE>& attributes);
 
     // Certificate operations
     Result<std::vector<CK_BYTE>> exportCertificate(CK_OBJECT_HANDLE certHandle);
     Result<void> exportCertificateToFile(CK_OBJECT_HANDLE certHandle, const std::string& filename);
 
+    // SubjectPublicKeyInfo of an RSA or EC key, from the public key or, for
+    // RSA, the private key object. Memoized per token serial and CKA_ID, so
+    // the token is read once per key until it is removed or this instance
+    // creates, generates, changes or destroys objects.
+    Result<std::vector<CK_BYTE>> exportPublicKey(CK_OBJECT_HANDLE keyHandle, KeyFormat format = KeyFormat::DER);
+
     // Key generation
-    Result<KeyPair> generateRSAKeyPair(CK_ULONG modulusBits, const std::string& label);
+    Result<KeyPair> generateRSAKeyPair(CK_ULONG modulusBits, const std::string& label,
+                                       bool tokenObject = true);
+    Result<KeyPair> generateECKeyPair(const std::string& label, bool tokenObject = true); // NIST P-256
     Result<KeyInfo> generateSymmetricKey(SymmetricAlgorithm algorithm, CK_ULONG keyLength, 
                                         const std::string& label);
 
@@ -179,26 +353,85 @@ public:
                                         SymmetricAlgorithm algorithm = SymmetricAlgorithm::DES,
                                         CipherMode mode = CipherMode::CBC, const std::vector<CK_BYTE>& iv = {});
 
+    // ECDSA with host-side hashing: only the digest is sent to the token
+    Result<std::vector<CK_BYTE>> signECDSA(CK_OBJECT_HANDLE privateKeyHandle, const std::vector<CK_BYTE>& data,
+                                          HashAlgorithm hashAlg = HashAlgorithm::SHA256,
+                                          SignatureEncoding encoding = SignatureEncoding::RAW);
+
+    Result<void> verifyECDSA(CK_OBJECT_HANDLE publicKeyHandle, const std::vector<CK_BYTE>& data,
+                            const std::vector<CK_BYTE>& signature, HashAlgorithm hashAlg = HashAlgorithm::SHA256,
+                            SignatureEncoding encoding = SignatureEncoding::RAW);
+
     Result<std::vector<CK_BYTE>> encryptRSA(CK_OBJECT_HANDLE publicKeyHandle, 
                                            const std::vector<CK_BYTE>& plaintext);
     
     Result<std::vector<CK_BYTE>> decryptRSA(CK_OBJECT_HANDLE privateKeyHandle, 
                                            const std::vector<CK_BYTE>& ciphertext);
 
+    // PKCS#12 import (RSA keys). The file is parsed by the module's
+    // EP_ParseComboCertificate when it has one and on the host otherwise; the
+    // objects are then created under one card transaction and destroyed again
+    // if any creation fails; one that cannot be makes the result
+    // ERROR_ROLLBACK_FAILED with the surviving handles in its value. label
+    // defaults to the file's friendly name.
+    Result<Pkcs12Import> importPkcs12(const std::vector<CK_BYTE>& blob, const std::string& password,
+                                      const std::string& label = "");
+    // Imports every *.p12 / *.pfx in directory, in name order, with all files
+    // parsed first and all objects created under a single transaction. A file
+    // that fails leaves nothing behind and does not stop the others; files
+    // without a friendly name are labelled with their file name stem. A
+    // failed rollback is reported per file as for importPkcs12().
+    Result<std::vector<Pkcs12FileImport>> importPkcs12Directory(const std::string& directory,
+                                                                const std::string& password);
+
     // Object management
+    Result<CK_OBJECT_HANDLE> createObject(const std::vector<CK_ATTRIBUTE>& attributes);
     Result<void> destroyObject(CK_OBJECT_HANDLE objectHandle);
     Result<std::vector<CK_BYTE>> getObjectAttribute(CK_OBJECT_HANDLE objectHandle, CK_ATTRIBUTE_TYPE attrType);
-
-    // Event handling
+    Result<void> setObjectAttribute(CK_OBJECT_HANDLE objectHandle, CK_ATTRIBUTE_TYPE attrType,
+                                    const std::vector<CK_BYTE>& value);
+    // Runs the operations in order in the open session under one card
+    // transaction and returns one result per operation: the new handle for a
+    // create, the operation's handle otherwise. With rollbackOnFailure the
+    // first failure destroys the objects the batch created so far and the
+    // remaining operations are not run (both reported as
+    // ERROR_FUNCTION_CANCELED); destroys and attribute changes already done
+    // cannot be undone. A create whose object could not be destroyed again is
+    // reported as ERROR_ROLLBACK_FAILED with the object's handle as value.
+    // Without it every operation is attempted. The outer result fails only if
+    // nothing could be run.
+    Result<std::vector<Result<CK_OBJECT_HANDLE>>> executeBatch(const std::vector<BatchOperation>& operations,
+                                                               bool rollbackOnFailure = true);
+
+    // Event handling. A blocking wait polls and releases the library mutex
+    // between polls, so other threads keep working; under an OperationScope
+    // the deadline and cancellation are honoured.
     Result<std::pair<CK_SLOT_ID, CK_ULONG>> waitForSlotEvent(bool blocking = true);
 
+    // Card transactions (vendor APDU extension). Calls nest; only the outermost
+    // begin/end pair reaches the token, so a group of operations pays the card
+    // acquisition once.
+    Result<void> beginTransaction();
+    Result<void> endTransaction();
+    bool inTransaction() const { return transactionDepth_ > 0; }
+    Result<std::vector<CK_BYTE>> transmitAPDU(const std::vector<CK_BYTE>& command);
+
     // Utility functions
     std::string getErrorString(CK_RV rv) const;
     static std::string bytesToHex(const std::vector<CK_BYTE>& bytes);
     static std::vector<CK_BYTE> hexToBytes(const std::string& hex);
+    static std::vector<CK_BYTE> ecdsaRawToDer(const std::vector<CK_BYTE>& raw);
+    static std::vector<CK_BYTE> ecdsaDerToRaw(const std::vector<CK_BYTE>& der, size_t coordinateLen);
 
 private:
+    friend class OperationScope;
+    class Watchdog;
+
     // Internal state
+    LibraryMutex mutex_;
+    TokenMetrics metrics_;
+    TokenTrace trace_;
+    std::atomic<std::chrono::steady_clock::rep> lastCall_{0};
     bool initialized_;
     bool sessionOpen_;
     bool loggedIn_;
@@ -207,6 +440,39 @@ private:
     AUX_FUNC_LIST_PTR auxFunctionList_;
     CK_SESSION_HANDLE session_;
     CK_SLOT_ID currentSlotId_;
+    CK_ULONG transactionDepth_;
+
+    // exportPublicKey memo: "<serial>/<CKA_ID hex>" -> DER. keySerial_ is the
+    // session token's serial, read on first use per session.
+    std::map<std::string, std::vector<CK_BYTE>> publicKeyCache_;
+    std::string keySerial_;
+
+    // probeToken state. Written under mutex_; probeMutex_ lets a probe read
+    // lastProbe_ while another thread holds mutex_. probeGeneration_ is the
+    // latest generation handed out and survives removals; probeStale_ is set
+    // when the session saw the token go away or moved to another slot.
+    std::mutex probeMutex_;
+    TokenProbe lastProbe_;
+    uint64_t probeGeneration_;
+    bool probeStale_;
+
+    // Recovery state: enough to reopen the same session on the same token
+    RecoveryPolicy recoveryPolicy_;
+    CredentialProvider credentialProvider_;
+    std::string sessionSerial_;
+    bool sessionReadWrite_;
+    bool loginWanted_;
+    CK_USER_TYPE loginUserType_;
+
+    // Deadline state: the innermost OperationScope's context, why its calls
+    // are being refused (OK while they are not), and whether the session was
+    // already reset for it. osLocking_: the module may be called from the
+    // watchdog thread while another call is in progress.
+    const OperationContext* context_;
+    Status abandoned_;
+    bool sessionReset_;
+    bool osLocking_;
+    std::unique_ptr<Watchdog> watchdog_;
 
     // Internal helper methods
     Result<void> loadLibrary(const std::string& path);
@@ -215,6 +481,39 @@ private:
                                const std::vector<CK_BYTE>& iv);
     CK_MECHANISM createHashMechanism(HashAlgorithm hashAlg, AsymmetricAlgorithm asymAlg);
     Status convertPKCS11Error(CK_RV rv);
+    void handleConnectionLoss();
+    Result<void> recoverSession(std::unique_lock<LibraryMutex>& lock);
+    bool sessionLost();
+    void rememberSessionToken();
+    void forgetProbe();
+    Result<std::vector<CK_BYTE>> publicKeyDer(CK_OBJECT_HANDLE keyHandle);
+    Result<Pkcs12::Contents> parsePkcs12(const std::vector<CK_BYTE>& blob, const std::string& password,
+                                         bool& parsedByToken);
+    Result<Pkcs12::Contents> parseComboCertificate(const std::vector<CK_BYTE>& blob, const std::string& password);
+    Result<Pkcs12Import> storePkcs12(const Pkcs12::Contents& contents, const std::string& label,
+                                     std::set<std::vector<CK_BYTE>>& knownCertificates);
+    Result<CK_OBJECT_HANDLE> createCertificate(const std::vector<CK_BYTE>& der, const std::string& label,
+                                               const std::vector<CK_BYTE>& id);
+    Result<bool> hasCertificate(const std::vector<CK_BYTE>& der);
+    CK_RV interruptCall(CK_SESSION_HANDLE session);
+    void abandon(Status reason, bool resetSession);
+
+    // How withRecovery treats an operation once the session is back
+    enum class Replay {
+        Allowed,        // searches and token queries
+        Refused         // operations on object handles taken before the loss
+    };
+
+    template<typename Op>
+    auto withRecovery(std::unique_lock<LibraryMutex>& lock, Replay replay, Op op) -> decltype(op());
+
+    // Every module entry point goes through here so it can be measured
+    template<typename Fn, typename... Args>
+    CK_RV call(P11Function function, Fn fn, Args&&... args);
+    template<typename Fn, typename... Args>
+    CK_RV instrumentedCall(P11Function function, Fn fn, Args&... args);
+    template<typename Fn, typename... Args>
+    CK_RV guardedCall(P11Function function, Fn fn, Args&... args);
     std::string trimString(const char* str, size_t maxLen);
 
     // Template helpers
@@ -254,4 +553,65 @@ private:
     bool success_;
 };
 
+// RAII card transaction helper. Holds the card for the lifetime of the guard so
+// that e.g. enumerate + read + sign, or a batch of signatures, share a single
+// card acquisition. If the token does not support transactions the guard is
+// inactive and the operations simply run unbatched.
+class TokenTransaction {
+public:
+    explicit TokenTransaction(PKCS11Library& lib)
+        : lib_(lib), lock_(lib.mutex()), active_(lib_.beginTransaction().isOk()) {
+    }
+
+    ~TokenTransaction() {
+        if (active_) {
+            lib_.endTransaction();
+        }
+    }
+
+    TokenTransaction(const TokenTransaction&) = delete;
+    TokenTransaction& operator=(const TokenTransaction&) = delete;
+
+    bool isActive() const { return active_; }
+
+private:
+    PKCS11Library& lib_;
+    std::unique_lock<LibraryMutex> lock_; // other threads wait for the batch
+    bool active_;
+};
+
+// Applies a deadline and cancellation token to every library call made while
+// the scope lives, holding the library mutex meanwhile. Once the context
+// expires, calls fail with ERROR_TIMEOUT (or ERROR_FUNCTION_CANCELED) instead
+// of reaching the module; a call already in progress is interrupted with
+// C_CancelFunction, or by closing its session, where the module allows it.
+// A session left mid-operation is closed; with session recovery enabled the
+// next call after the scope opens it and logs in again, so it starts from a
+// clean session.
+//
+//   CancellationToken cancel;                    // cancel.cancel() from the UI thread
+//   OperationScope scope(lib, OperationContext::within(std::chrono::seconds(30), cancel));
+//   auto pair = lib.generateRSAKeyPair(2048, "signing");
+//   if (pair.errorCode == Status::ERROR_TIMEOUT) ...
+//
+// A module that neither cancels nor tolerates a concurrent C_CloseSession
+// keeps the caller until its call returns; the result is then still reported
+// as timed out unless the call succeeded.
+class OperationScope {
+public:
+    OperationScope(PKCS11Library& lib, const OperationContext& context);
+    ~OperationScope();
+
+    OperationScope(const OperationScope&) = delete;
+    OperationScope& operator=(const OperationScope&) = delete;
+
+private:
+    PKCS11Library& lib_;
+    std::unique_lock<LibraryMutex> lock_;
+    OperationContext context_;
+    const OperationContext* previous_;
+    Status previousAbandoned_;
+    bool previousSessionReset_;
+};
+
 } // namespace PKCS11Lib
\ No newline at end of file
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "pkcs11_lib.h"
+
+namespace PKCS11Lib {
+
+// PKCS#12 contents in the form they are stored on the token. RSA only, like
+// the vendor's AUX_PRIVATE_KEY.
+namespace Pkcs12 {
+
+// Big integers are unsigned big-endian without leading zeros. Every copy
+// overwrites its private components before their memory is released, so
+// contents can be passed around in Results without leaving key material in
+// freed heap blocks.
+struct Contents {
+    std::string friendlyName;                       // empty if the file has none
+    std::vector<CK_BYTE> certificate;               // DER, the key's certificate
+    std::vector<std::vector<CK_BYTE>> chain;        // DER, the other certificates
+    std::vector<CK_BYTE> modulus;
+    std::vector<CK_BYTE> publicExponent;
+    std::vector<CK_BYTE> privateExponent;
+    std::vector<CK_BYTE> prime1;
+    std::vector<CK_BYTE> prime2;
+    std::vector<CK_BYTE> exponent1;
+    std::vector<CK_BYTE> exponent2;
+    std::vector<CK_BYTE> coefficient;
+
+    Contents() = default;
+    Contents(const Contents&) = default;
+    Contents(Contents&&) = default;
+    Contents& operator=(const Contents& other);
+    Contents& operator=(Contents&& other);
+    ~Contents() { cleanse(); }
+
+    // Overwrites the private components
+    void cleanse();
+};
+
+// Host-side parsing with OpenSSL. ERROR_PIN_INCORRECT for a wrong password,
+// ERROR_UNSUPPORTED_ALGORITHM for non-RSA keys.
+Result<Contents> parse(const std::vector<CK_BYTE>& blob, const std::string& password);
+
+struct CertificateFields {
+    std::vector<CK_BYTE> subject;       // DER Name
+    std::vector<CK_BYTE> issuer;        // DER Name
+    std::vector<CK_BYTE> serialNumber;  // DER INTEGER
+    std::vector<CK_BYTE> modulus;       // subject key's, empty unless RSA
+};
+
+Result<CertificateFields> certificateFields(const std::vector<CK_BYTE>& der);
+
+// Checks that the CRT components belong together (n = pq, e·dP = 1 mod p-1,
+// d = dP mod p-1, q·qInv = 1 mod p). Guards against buffers filled by the
+// module in an unexpected layout.
+bool isConsistent(const Contents& contents);
+
+// Splits back-to-back DER certificates, as in AUX_CERTIFICATE::cert_buff.
+// Stops at the first malformed element.
+std::vector<std::vector<CK_BYTE>> splitDer(const CK_BYTE* data, size_t length);
+
+// Strips leading zero bytes of a fixed-width big-endian buffer
+std::vector<CK_BYTE> trimInteger(const CK_BYTE* data, size_t length);
+
+} // namespace Pkcs12
+
+} // namespace PKCS11Lib
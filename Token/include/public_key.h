@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "pkcs11_lib.h"
+
+namespace PKCS11Lib {
+
+// X.509 SubjectPublicKeyInfo encoding of token public keys, for any RSA
+// modulus size and any named EC curve.
+namespace PublicKey {
+
+// RSA from CKA_MODULUS and CKA_PUBLIC_EXPONENT (unsigned big-endian)
+std::vector<CK_BYTE> rsaSpki(const std::vector<CK_BYTE>& modulus, const std::vector<CK_BYTE>& publicExponent);
+
+// EC from CKA_EC_PARAMS (the DER curve OID) and CKA_EC_POINT, which modules
+// return either DER-wrapped in an OCTET STRING or as the bare point.
+// Empty if either is malformed.
+std::vector<CK_BYTE> ecSpki(const std::vector<CK_BYTE>& ecParams, const std::vector<CK_BYTE>& ecPoint);
+
+std::string base64(const std::vector<CK_BYTE>& data);
+
+// "-----BEGIN <label>-----", base64 in 64-column lines, "-----END <label>-----",
+// each line ending in a newline as OpenSSL writes it
+std::string pem(const std::vector<CK_BYTE>& der, const std::string& label = "PUBLIC KEY");
+
+} // namespace PublicKey
+
+} // namespace PKCS11Lib
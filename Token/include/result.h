@@ -155,7 +155,10 @@ enum class Status {
     ERROR_MEMORY = 254,
     ERROR_FILE_IO = 255,
     ERROR_UNSUPPORTED_ALGORITHM = 256,
-    ERROR_UNSUPPORTED_OPERATION = 257
+    ERROR_UNSUPPORTED_OPERATION = 257,
+    ERROR_TIMEOUT = 258,            // OperationContext deadline passed
+    ERROR_HANDLES_INVALIDATED = 259, // session recovered; earlier object handles are stale
+    ERROR_ROLLBACK_FAILED = 260     // an object created by a failed batch is still on the token
 };
 
 template<typename T>
@@ -313,6 +316,9 @@ public:
             case Status::ERROR_FILE_IO: return "File I/O error";
             case Status::ERROR_UNSUPPORTED_ALGORITHM: return "Unsupported algorithm";
             case Status::ERROR_UNSUPPORTED_OPERATION: return "Unsupported operation";
+            case Status::ERROR_TIMEOUT: return "Operation deadline exceeded";
+            case Status::ERROR_HANDLES_INVALIDATED: return "Object handles invalidated by session recovery";
+            case Status::ERROR_ROLLBACK_FAILED: return "Rollback failed; object left on token";
             default: return "Unknown error";
         }
     }
@@ -473,6 +479,9 @@ public:
             case Status::ERROR_FILE_IO: return "File I/O error";
             case Status::ERROR_UNSUPPORTED_ALGORITHM: return "Unsupported algorithm";
             case Status::ERROR_UNSUPPORTED_OPERATION: return "Unsupported operation";
+            case Status::ERROR_TIMEOUT: return "Operation deadline exceeded";
+            case Status::ERROR_HANDLES_INVALIDATED: return "Object handles invalidated by session recovery";
+            case Status::ERROR_ROLLBACK_FAILED: return "Rollback failed; object left on token";
             default: return "Unknown error";
         }
     }
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "result.h"
+
+namespace PKCS11Lib {
+
+// Coalesces concurrent identical calls without blocking anyone. The first
+// caller for a key leads: it makes the call and hands the result to
+// finish(). Callers that arrive with the same key meanwhile leave a waiter
+// instead of making their own token round trip, and finish() calls each
+// waiter with the leader's result, so no thread sits waiting for another's
+// call. Nothing is remembered once finish() returns, so a later caller
+// always leads anew.
+//
+//   SingleFlight<std::string, TokenInfo> flights;
+//   if (!flights.join(key, [](const Result<TokenInfo>& info) { ... })) {
+//       flights.finish(key, lib.getTokenInfo(slot));
+//   }
+template<typename Key, typename T>
+class SingleFlight {
+public:
+    using Waiter = std::function<void(const Result<T>&)>;
+
+    // True if a call for key is in flight; waiter then gets its result.
+    // False makes the caller the leader, which must call finish(); waiter
+    // is dropped.
+    bool join(const Key& key, Waiter waiter) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto existing = flights_.find(key);
+        if (existing != flights_.end()) {
+            existing->second.push_back(std::move(waiter));
+            return true;
+        }
+        flights_.emplace(key, std::vector<Waiter>());
+        return false;
+    }
+
+    // Ends the flight; its waiters run on the calling thread
+    void finish(const Key& key, const Result<T>& result) {
+        std::vector<Waiter> waiters;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto flight = flights_.find(key);
+            if (flight == flights_.end()) {
+                return;
+            }
+            waiters = std::move(flight->second);
+            flights_.erase(flight);
+        }
+        for (const Waiter& waiter : waiters) {
+            waiter(result);
+        }
+    }
+
+    size_t inFlight() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return flights_.size();
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::map<Key, std::vector<Waiter>> flights_;
+};
+
+} // namespace PKCS11Lib
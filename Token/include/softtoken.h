@@ -0,0 +1,40 @@
+#pragma once
+
+// Control interface of the in-tree software token (libsofttoken.so).
+//
+// The module is a regular PKCS#11 library: load it with
+//   PKCS11Library::initialize("libsofttoken.so")
+// It implements the subset of Cryptoki and the ePass aux functions that
+// PKCS11Library uses, and sleeps according to a latency model so that
+// benchmarks see timings shaped like a real ePass3003.
+//
+// Environment:
+//   SOFTTOKEN_CONFIG         path to a key = value profile (syntax in softtoken/latency_model.h)
+//   SOFTTOKEN_LATENCY_SCALE  multiplier applied to every modelled delay; 0 disables
+//   SOFTTOKEN_SEED           seed for latency jitter (default: fixed, runs are repeatable)
+//
+// The functions below are exported in addition to C_GetFunctionList and
+// E_GetAuxFunctionList, and are meant to be looked up with dlsym by tests
+// that need to simulate events a physical token would produce.
+
+extern "C" {
+#include "cryptoki_ext.h"
+}
+
+extern "C" {
+
+// Simulate removal (CK_FALSE) or re-insertion (CK_TRUE) of the token. Removal
+// invalidates all sessions and raises a slot event.
+typedef CK_RV (*SoftToken_SetTokenPresent_t)(CK_SLOT_ID slotID, CK_BBOOL present);
+
+// Change the latency multiplier at runtime (same meaning as SOFTTOKEN_LATENCY_SCALE)
+typedef CK_RV (*SoftToken_SetLatencyScale_t)(double scale);
+
+// Drop all objects and restore PINs and counters to the configured defaults
+typedef CK_RV (*SoftToken_Reset_t)(CK_SLOT_ID slotID);
+
+CK_RV SoftToken_SetTokenPresent(CK_SLOT_ID slotID, CK_BBOOL present);
+CK_RV SoftToken_SetLatencyScale(double scale);
+CK_RV SoftToken_Reset(CK_SLOT_ID slotID);
+
+}
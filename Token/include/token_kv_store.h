@@ -0,0 +1,98 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <optional>
+
+#include "pkcs11_lib.h"
+
+namespace PKCS11Lib {
+
+struct KeyValueStoreConfig {
+    // Every object of the store carries this CKA_APPLICATION; the key is the
+    // CKA_LABEL. Stores with different applications do not see each other.
+    std::string application = "kvstore";
+
+    size_t chunkSize = 960;             // value bytes per CKO_DATA object
+    bool compress = true;               // LZF, kept only when it saves space
+    bool privateObjects = false;        // CKA_PRIVATE: readable after login only
+
+    // Writes that would leave less free token memory than this fail with
+    // ERROR_DEVICE_MEMORY before anything is written. objectOverhead is the
+    // estimated per-object cost on top of value, label and application.
+    CK_ULONG reservedMemory = 2048;
+    CK_ULONG objectOverhead = 96;
+
+    size_t maxDirty = 16;               // put/remove flush once this many keys are pending
+};
+
+// Key-value store over CKO_DATA objects, e.g. for license blobs and small
+// configuration. A value is split into chunks of chunkSize, each one object
+// with a 16-byte header (magic, version, flags, index, count, length and a
+// write stamp that tells a new set of chunks from a stale one). A write takes
+// the stamp one above the highest among the key's chunks on the token, so it
+// does not depend on the clock or on which store wrote last.
+//
+// Reads go through a host cache: only the first get of a key touches the
+// token. Writes are cached and batched: put/remove mark the key dirty, and
+// flush() writes all pending keys under one card transaction, creating the
+// new chunks before destroying the old ones so that a failed write keeps the
+// previous value. The store shares the library's open session.
+class TokenKeyValueStore {
+public:
+    TokenKeyValueStore(PKCS11Library& lib, const KeyValueStoreConfig& config = KeyValueStoreConfig());
+    ~TokenKeyValueStore();      // flushes; errors are dropped
+
+    TokenKeyValueStore(const TokenKeyValueStore&) = delete;
+    TokenKeyValueStore& operator=(const TokenKeyValueStore&) = delete;
+
+    // ERROR_OBJECT_NOT_FOUND for a missing key
+    Result<std::vector<CK_BYTE>> get(const std::string& key);
+    Result<void> put(const std::string& key, const std::vector<CK_BYTE>& value);
+    Result<void> remove(const std::string& key);
+    Result<std::vector<std::string>> keys();
+
+    Result<void> flush();
+    size_t pending() const;
+
+    // Drops cached values that are already on the token, e.g. after
+    // probeToken() reports a new generation. Pending writes are kept.
+    void invalidate();
+
+private:
+    enum class State {
+        Absent,         // no such key (known from a search or removed)
+        Unloaded,       // chunk handles known, value not read yet
+        Loaded
+    };
+
+    struct Entry {
+        State state = State::Absent;
+        bool dirty = false;
+        bool handlesKnown = false;
+        std::vector<CK_BYTE> value;
+        std::vector<CK_OBJECT_HANDLE> handles;      // chunks on the token
+        std::optional<uint32_t> stamp;              // highest stamp among handles, once read
+    };
+
+    PKCS11Library& lib_;
+    KeyValueStoreConfig config_;
+
+    mutable std::mutex mutex_;
+    std::map<std::string, Entry> entries_;
+    bool indexed_;              // every key on the token has an entry
+    size_t dirty_;
+
+    Result<void> flushLocked();
+    Result<Entry*> lookup(const std::string& key);
+    Result<void> load(Entry& entry);
+    Result<std::vector<CK_OBJECT_HANDLE>> findChunks(const std::string* key);
+    std::vector<std::vector<CK_BYTE>> encode(const std::vector<CK_BYTE>& value);
+    Result<uint32_t> nextStamp(Entry& entry);
+    Result<CK_ULONG> freeMemory();
+    void markDirty(Entry& entry);
+};
+
+} // namespace PKCS11Lib
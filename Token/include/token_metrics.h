@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "p11_functions.h"
+
+namespace PKCS11Lib {
+
+struct FunctionStats {
+    P11Function function;
+    uint64_t calls = 0;
+    uint64_t errors = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    uint64_t totalNanos = 0;
+    uint64_t maxNanos = 0;
+    uint64_t p50Nanos = 0;
+    uint64_t p90Nanos = 0;
+    uint64_t p99Nanos = 0;
+    std::map<CK_RV, uint64_t> errorsByRv;
+
+    const char* name() const { return p11FunctionName(function); }
+    double meanNanos() const { return calls ? static_cast<double>(totalNanos) / calls : 0.0; }
+};
+
+struct MetricsSnapshot {
+    std::vector<FunctionStats> functions; // only functions that were called
+
+    const FunctionStats* find(P11Function function) const;
+    uint64_t totalCalls() const;
+};
+
+// Per-function call/error/byte counters and latency histograms for every
+// PKCS#11 and aux call made through PKCS11Library. Each thread writes to its
+// own shard with relaxed atomics, so recording never takes a lock; snapshot()
+// merges the shards. When disabled the cost is a single relaxed load.
+//
+// Histograms are log-linear (HDR style): 8 linear sub-buckets per power of
+// two, i.e. quantiles are accurate to within 12.5%.
+class TokenMetrics {
+public:
+    static constexpr unsigned SUB_BUCKET_BITS = 3;
+    static constexpr size_t SUB_BUCKETS = size_t(1) << SUB_BUCKET_BITS;
+    static constexpr size_t BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    TokenMetrics();
+    ~TokenMetrics();
+
+    TokenMetrics(const TokenMetrics&) = delete;
+    TokenMetrics& operator=(const TokenMetrics&) = delete;
+
+    void setEnabled(bool enabled) { enabled_.store(enabled, std::memory_order_relaxed); }
+    bool isEnabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+    void record(P11Function function, CK_RV rv, uint64_t nanos);
+    void addBytes(P11Function function, uint64_t bytesIn, uint64_t bytesOut);
+
+    MetricsSnapshot snapshot() const;
+    void reset();
+
+    static size_t bucketIndex(uint64_t nanos);
+    static uint64_t bucketUpperBound(size_t index);
+
+private:
+    struct Counters;
+    struct Shard;
+
+    Counters& localCounters(P11Function function);
+
+    std::atomic<bool> enabled_;
+    const uint64_t id_;
+    mutable std::mutex shardsMutex_; // registration and snapshot only
+    std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+} // namespace PKCS11Lib
@@ -0,0 +1,123 @@
+#pragma once
+
+// USDT (SystemTap/DTrace-style) static probes for PKCS11Library.
+//
+// Provider "pkcs11lib":
+//   api__entry(const char* method, CK_SLOT_ID slot)
+//   api__return(const char* method, CK_SLOT_ID slot, CK_RV rv)
+//       around every public PKCS11Library method that talks to the token.
+//       rv is the last CK_RV the module returned during the method (CKR_OK
+//       if it failed before reaching the module).
+//   call__entry(uint16_t function, const char* name, CK_SLOT_ID slot, uint64_t bytesIn)
+//   call__return(uint16_t function, const char* name, CK_SLOT_ID slot, CK_RV rv,
+//                uint64_t bytesIn, uint64_t bytesOut)
+//       around every C_* and aux call; function is the P11Function value.
+//
+// e.g. bpftrace -e 'usdt:./libtoken.so:pkcs11lib:call__entry { @start[tid] = nsecs; }
+//                   usdt:./libtoken.so:pkcs11lib:call__return /@start[tid]/ {
+//                       @us[str(arg1)] = hist((nsecs - @start[tid]) / 1000); delete(@start[tid]); }'
+//
+// A probe site is a single nop until a tracer attaches. Argument preparation
+// (byte counts, names) is guarded by the probe's semaphore, which the tracer
+// sets while attached. Probes are compiled in whenever <sys/sdt.h> is
+// available; define PKCS11LIB_NO_PROBES to leave them out.
+
+#include "token_trace.h"
+
+extern "C" {
+    #include "cryptoki_ext.h"
+}
+
+#if !defined(PKCS11LIB_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define PKCS11LIB_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef PKCS11LIB_HAVE_PROBES
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define PKCS11LIB_PROBE_SEMAPHORES(X) \
+    X(api__entry) \
+    X(api__return) \
+    X(call__entry) \
+    X(call__return)
+
+#define PKCS11LIB_DECLARE_SEMAPHORE(name) \
+    extern unsigned short pkcs11lib_##name##_semaphore __attribute__((section(".probes")));
+extern "C" {
+PKCS11LIB_PROBE_SEMAPHORES(PKCS11LIB_DECLARE_SEMAPHORE)
+}
+#undef PKCS11LIB_DECLARE_SEMAPHORE
+
+// Expanded once, in pkcs11_lib.cpp
+#define PKCS11LIB_DEFINE_SEMAPHORE(name) \
+    unsigned short pkcs11lib_##name##_semaphore __attribute__((section(".probes"))) = 0;
+#define PKCS11LIB_DEFINE_PROBE_SEMAPHORES() \
+    extern "C" { PKCS11LIB_PROBE_SEMAPHORES(PKCS11LIB_DEFINE_SEMAPHORE) }
+
+#define PKCS11LIB_PROBE_ENABLED(name) __builtin_expect(pkcs11lib_##name##_semaphore != 0, 0)
+#define PKCS11LIB_PROBE2(name, a, b) DTRACE_PROBE2(pkcs11lib, name, a, b)
+#define PKCS11LIB_PROBE3(name, a, b, c) DTRACE_PROBE3(pkcs11lib, name, a, b, c)
+#define PKCS11LIB_PROBE4(name, a, b, c, d) DTRACE_PROBE4(pkcs11lib, name, a, b, c, d)
+#define PKCS11LIB_PROBE6(name, a, b, c, d, e, f) DTRACE_PROBE6(pkcs11lib, name, a, b, c, d, e, f)
+
+#else
+
+#define PKCS11LIB_DEFINE_PROBE_SEMAPHORES()
+#define PKCS11LIB_PROBE_ENABLED(name) false
+#define PKCS11LIB_PROBE2(name, a, b) do {} while (0)
+#define PKCS11LIB_PROBE3(name, a, b, c) do {} while (0)
+#define PKCS11LIB_PROBE4(name, a, b, c, d) do {} while (0)
+#define PKCS11LIB_PROBE6(name, a, b, c, d, e, f) do {} while (0)
+
+#endif // PKCS11LIB_HAVE_PROBES
+
+namespace PKCS11Lib {
+
+namespace TokenProbes {
+
+// Last CK_RV returned by the module on this thread, reported by api__return
+// and on api trace spans
+inline thread_local CK_RV lastRv = CKR_OK;
+
+inline void noteRv(CK_RV rv) {
+    lastRv = rv;
+}
+
+} // namespace TokenProbes
+
+// Fires api__entry/api__return around a public library method and records
+// it as an "api" span when the library's TokenTrace is enabled
+class ApiScope {
+public:
+    ApiScope(TokenTrace& trace, const char* method, CK_SLOT_ID slot)
+        : trace_(trace), method_(method), slot_(slot), startNs_(0) {
+        TokenProbes::lastRv = CKR_OK;
+        if (trace_.isEnabled()) {
+            startNs_ = TokenTrace::nowNanos();
+        }
+        PKCS11LIB_PROBE2(api__entry, method_, slot_);
+    }
+
+    ~ApiScope() {
+        PKCS11LIB_PROBE3(api__return, method_, slot_, TokenProbes::lastRv);
+        if (startNs_ && trace_.isEnabled()) {
+            trace_.record({method_, "api", startNs_, TokenTrace::nowNanos() - startNs_,
+                           TokenTrace::currentThreadId(), slot_, TokenProbes::lastRv, false, 0, 0});
+        }
+    }
+
+    ApiScope(const ApiScope&) = delete;
+    ApiScope& operator=(const ApiScope&) = delete;
+
+private:
+    TokenTrace& trace_;
+    const char* method_;
+    CK_SLOT_ID slot_;
+    uint64_t startNs_;
+};
+
+} // namespace PKCS11Lib
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "token_metrics.h"
+
+namespace PKCS11Lib {
+
+// Scheduling class of a token operation. Lower runs first.
+enum class Priority : uint8_t {
+    Interactive = 0,    // a user is waiting: license check, verify button
+    Normal = 1,
+    Bulk = 2            // batch signing, backups
+};
+
+constexpr size_t PRIORITY_CLASSES = 3;
+
+const char* priorityName(Priority priority);
+
+struct SchedulerConfig {
+    size_t queueDepth = 256;                        // pending operations across all classes
+    // A waiting operation is promoted one class per interval, so bulk work
+    // still progresses under a steady interactive load
+    std::chrono::milliseconds agingInterval{2000};
+};
+
+struct PriorityStats {
+    Priority priority;
+    uint64_t submitted = 0;
+    uint64_t completed = 0;
+    uint64_t expired = 0;       // deadline passed while queued
+    uint64_t rejected = 0;      // queue full or scheduler stopped
+    uint64_t promoted = 0;      // started ahead of their class by aging
+    size_t pending = 0;
+    // Queue wait and queue-plus-run latency, from TokenMetrics-style histograms
+    uint64_t waitP50Nanos = 0;
+    uint64_t waitP99Nanos = 0;
+    uint64_t waitMaxNanos = 0;
+    uint64_t latencyP50Nanos = 0;
+    uint64_t latencyP99Nanos = 0;
+    uint64_t latencyMaxNanos = 0;
+};
+
+// Runs the operations for one token on one thread, in priority order rather
+// than arrival order. Bulk jobs submit one operation per item, so an
+// interactive request waits for at most the operation in progress, never for
+// the rest of the batch.
+//
+// Order: the lowest effective class first (the class minus one per full
+// agingInterval waited), then, among operations submitted in the same class,
+// the earliest deadline, then arrival. A promoted operation has no deadline
+// to compare with the class it joined, so it is ordered against that class
+// by arrival. An operation whose deadline passes before it starts is not
+// run; its expired callback is called instead.
+class TokenScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Task = std::function<void()>;
+
+    static constexpr Clock::time_point NO_DEADLINE = Clock::time_point::max();
+
+    explicit TokenScheduler(const SchedulerConfig& config = SchedulerConfig());
+    ~TokenScheduler();
+
+    TokenScheduler(const TokenScheduler&) = delete;
+    TokenScheduler& operator=(const TokenScheduler&) = delete;
+
+    void start();
+    // Runs what is already queued, then joins the thread
+    void stop();
+
+    // False when the queue is full or the scheduler is stopping
+    bool submit(Priority priority, Task task, Task expired = Task(),
+                Clock::time_point deadline = NO_DEADLINE);
+
+    size_t pending() const;
+    std::array<PriorityStats, PRIORITY_CLASSES> stats() const;
+
+private:
+    struct Entry {
+        Priority priority;
+        Clock::time_point deadline;
+        Clock::time_point enqueued;
+        uint64_t sequence;
+        Task task;
+        Task expired;
+    };
+
+    struct Histogram {
+        std::vector<uint64_t> buckets = std::vector<uint64_t>(TokenMetrics::BUCKET_COUNT);
+        uint64_t count = 0;
+        uint64_t max = 0;
+
+        void record(uint64_t nanos);
+        uint64_t quantile(double q) const;
+    };
+
+    struct ClassCounters {
+        uint64_t submitted = 0;
+        uint64_t completed = 0;
+        uint64_t expired = 0;
+        uint64_t rejected = 0;
+        uint64_t promoted = 0;
+        size_t pending = 0;
+        Histogram wait;
+        Histogram latency;
+    };
+
+    void run();
+    // Index into queue_ of the entry to run next; queue_ must not be empty
+    size_t pick(Clock::time_point now) const;
+    int effectiveClass(const Entry& entry, Clock::time_point now) const;
+
+    const SchedulerConfig config_;
+    mutable std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::vector<Entry> queue_;
+    std::array<ClassCounters, PRIORITY_CLASSES> counters_;
+    uint64_t nextSequence_;
+    bool stopping_;
+    std::thread thread_;
+};
+
+} // namespace PKCS11Lib
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+extern "C" {
+    #include "cryptoki_ext.h"
+}
+
+namespace PKCS11Lib {
+
+struct TraceSpan {
+    std::string name;
+    const char* category;       // "api" for library methods, "pkcs11" for module calls, "app" for Span
+    uint64_t startNs;           // CLOCK_MONOTONIC
+    uint64_t durationNs;
+    uint32_t threadId;
+    CK_SLOT_ID slot;
+    CK_RV rv;
+    bool hasBytes;
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+};
+
+// Records nested spans, from public PKCS11Library methods down to individual
+// C_* calls, in Chrome Trace Event format for chrome://tracing and Perfetto.
+// Spans are "complete" (ph "X") events; viewers nest them by time on each
+// thread. Timestamps are CLOCK_MONOTONIC microseconds, the clock Chrome and
+// Electron use on Linux, so a token trace lines up with a browser trace of
+// the same run.
+//
+// The last ringCapacity spans are kept in memory (toJson, writeJson). When
+// started with a path, every span is also appended to that file as it ends,
+// in the JSON array format. Disabled by default; when disabled the cost is a
+// single relaxed load per span.
+class TokenTrace {
+public:
+    explicit TokenTrace(size_t ringCapacity = 16384);
+    ~TokenTrace();
+
+    TokenTrace(const TokenTrace&) = delete;
+    TokenTrace& operator=(const TokenTrace&) = delete;
+
+    // Returns false if the file cannot be created (the ring still records)
+    bool start(const std::string& path = "");
+    void stop();
+    bool isEnabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+    void record(TraceSpan span);
+
+    std::vector<TraceSpan> snapshot() const;
+    void clear();
+
+    // Ring contents as a {"traceEvents": [...]} document
+    std::string toJson() const;
+    bool writeJson(const std::string& path) const;
+
+    static uint64_t nowNanos();
+    static uint32_t currentThreadId();
+
+    // Application-level span, e.g. around a request that makes several
+    // library calls:
+    //   TokenTrace::Span span(lib.trace(), "verify-license");
+    class Span {
+    public:
+        Span(TokenTrace& trace, std::string name, const char* category = "app");
+        ~Span();
+
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+
+    private:
+        TokenTrace& trace_;
+        std::string name_;
+        const char* category_;
+        uint64_t startNs_;
+        bool active_;
+    };
+
+private:
+    void writeEvent(FILE* out, const TraceSpan& span, uint32_t pid) const;
+    void writeDocument(FILE* out) const;
+
+    std::atomic<bool> enabled_;
+    mutable std::mutex mutex_;
+    std::vector<TraceSpan> ring_;
+    size_t capacity_;
+    size_t next_;
+    FILE* file_;
+};
+
+} // namespace PKCS11Lib
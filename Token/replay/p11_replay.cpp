@@ -0,0 +1,419 @@
+// PKCS#11 module that replays a trace recorded by the interposer shim.
+//
+// Record a workload against a real token through libp11trace.so with output
+// capture enabled (P11_TRACE_PAYLOADS=1, P11_TRACE_FILE=workload.bin),
+// then run the same application against this module:
+//   P11_REPLAY_TRACE=workload.bin  <app loading libp11replay.so>
+// Environment:
+//   P11_REPLAY_TRACE       trace file to replay (required)
+//   P11_REPLAY_TIME_SCALE  multiplier for recorded call durations (default 1,
+//                          0 returns immediately)
+//   P11_REPLAY_REPORT      path for the JSON report written on C_Finalize
+//                          (default stderr)
+//
+// Calls are matched per function in recorded order: the n-th C_Sign gets the
+// n-th recorded C_Sign's return value, outputs and duration. The token is a
+// single channel, so replayed durations are serialised on one device lock
+// (slot event waits excepted) and kept to the recorded total: each call
+// sleeps until an absolute due time that takes off what earlier sleeps
+// overran, and a delay within the timer slack is not slept but carried over
+// to the next call. A call with nothing left to replay fails with
+// CKR_FUNCTION_FAILED and is counted as a miss; calls whose scalar arguments
+// differ from the recording are replayed but counted, so the report shows
+// where a workload diverged.
+
+#include "p11_trace_capture.h"
+#include "p11_trace_format.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <time.h>
+
+#define P11_REPLAY_EXPORT __attribute__((visibility("default")))
+
+using namespace PKCS11Lib;
+
+namespace {
+
+// Sleeps shorter than this overrun by about as much as they last (the
+// kernel's default timer slack); they are added to the next call instead
+constexpr std::chrono::microseconds TIMER_SLACK(50);
+
+uint64_t monotonicNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+struct RecordedCall {
+    TraceRecord record;
+    std::vector<uint8_t> payload;
+    uint32_t payloadLength = 0;
+    bool hasPayload = false;
+
+    bool payloadComplete() const { return hasPayload && payload.size() == payloadLength; }
+};
+
+struct FunctionStats {
+    uint64_t calls = 0;
+    uint64_t misses = 0;
+    uint64_t recordedNs = 0;
+    uint64_t replayedNs = 0;
+};
+
+class Replayer {
+public:
+    CK_RV load() {
+        std::call_once(loadOnce_, [this] { loadResult_ = doLoad(); });
+        return loadResult_;
+    }
+
+    CK_FUNCTION_LIST_PTR functionList() { return &functionList_; }
+    AUX_FUNC_LIST_PTR auxFunctionList() { return &auxFunctionList_; }
+
+    template<P11Function Id, typename... A>
+    CK_RV replay(A... args);
+
+    CK_RV initialize() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (initialized_) {
+            return CKR_CRYPTOKI_ALREADY_INITIALIZED;
+        }
+        initialized_ = true;
+        return CKR_OK;
+    }
+
+    CK_RV finalize() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!initialized_) {
+            return CKR_CRYPTOKI_NOT_INITIALIZED;
+        }
+        initialized_ = false;
+        writeReport();
+        return CKR_OK;
+    }
+
+private:
+    std::once_flag loadOnce_;
+    CK_RV loadResult_ = CKR_GENERAL_ERROR;
+    CK_FUNCTION_LIST functionList_{};
+    AUX_FUNC_LIST auxFunctionList_{};
+
+    std::string tracePath_;
+    double timeScale_ = 1.0;
+    uint32_t droppedRecords_ = 0;
+
+    std::mutex mutex_;          // Queues and statistics
+    std::mutex deviceMutex_;    // Held while a replayed call "runs"
+    // Device time slept beyond the recording (negative: still owed), under
+    // deviceMutex_
+    std::chrono::steady_clock::duration deviceLag_{};
+    bool initialized_ = false;
+    std::deque<RecordedCall> queues_[P11_FUNCTION_COUNT];
+    FunctionStats stats_[P11_FUNCTION_COUNT];
+    uint64_t argumentMismatches_ = 0;
+    uint64_t payloadMismatches_ = 0;
+
+    CK_RV doLoad();
+    bool readTrace(FILE* file);
+    void buildFunctionLists();
+    void writeReport();
+    void runDevice(std::chrono::nanoseconds delay);
+};
+
+Replayer replayer;
+
+// ---- replay -----------------------------------------------------------------
+
+bool isSlotEventWait(P11Function function) {
+    return function == P11Function::C_WaitForSlotEvent || function == P11Function::EP_WaitForSlotEvent;
+}
+
+template<P11Function Id, typename... A>
+CK_RV Replayer::replay(A... args) {
+    constexpr size_t index = static_cast<size_t>(Id);
+
+    RecordedCall call;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!initialized_ && Id != P11Function::C_GetInfo) {
+            return CKR_CRYPTOKI_NOT_INITIALIZED;
+        }
+        stats_[index].calls++;
+        if (queues_[index].empty()) {
+            stats_[index].misses++;
+            return CKR_FUNCTION_FAILED;
+        }
+        call = std::move(queues_[index].front());
+        queues_[index].pop_front();
+
+        uint64_t actual[3] = {};
+        captureScalarArgs(actual, args...);
+        if (memcmp(actual, call.record.args, sizeof(actual)) != 0) {
+            argumentMismatches_++;
+        }
+    }
+
+    uint64_t start = monotonicNs();
+    auto delay = std::chrono::nanoseconds(static_cast<int64_t>(call.record.durationNs * timeScale_));
+    if (delay.count() > 0) {
+        if (isSlotEventWait(Id)) {
+            std::this_thread::sleep_for(delay);
+        } else {
+            runDevice(delay);
+        }
+    }
+
+    bool payloadMatched = true;
+    if (call.payloadComplete()) {
+        PayloadReader reader(call.payload.data(), call.payload.size());
+        visitOutputs(FunctionTag<Id>(), reader, args...);
+        payloadMatched = reader.complete();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_[index].recordedNs += call.record.durationNs;
+    stats_[index].replayedNs += monotonicNs() - start;
+    if (call.hasPayload && (!payloadMatched || !call.payloadComplete())) {
+        payloadMismatches_++;
+    }
+    return static_cast<CK_RV>(call.record.rv);
+}
+
+void Replayer::runDevice(std::chrono::nanoseconds delay) {
+    std::lock_guard<std::mutex> device(deviceMutex_);
+    auto now = std::chrono::steady_clock::now();
+    auto due = now + delay - deviceLag_;
+    if (due - now > TIMER_SLACK) {
+        std::this_thread::sleep_until(due);
+        now = std::chrono::steady_clock::now();
+    }
+    deviceLag_ = now - due;
+}
+
+// ---- function lists ---------------------------------------------------------
+
+template<typename F, F CK_FUNCTION_LIST::*Member, P11Function Id>
+struct Thunk;
+
+template<typename... A, CK_RV (*CK_FUNCTION_LIST::*Member)(A...), P11Function Id>
+struct Thunk<CK_RV (*)(A...), Member, Id> {
+    static CK_RV invoke(A... args) {
+        return replayer.replay<Id>(args...);
+    }
+};
+
+template<typename F, P11Function Id>
+struct AuxThunk;
+
+template<typename... A, P11Function Id>
+struct AuxThunk<CK_RV (*)(A...), Id> {
+    static CK_RV invoke(A... args) {
+        return replayer.replay<Id>(args...);
+    }
+};
+
+CK_RV replayInitialize(CK_VOID_PTR) {
+    return replayer.initialize();
+}
+
+CK_RV replayFinalize(CK_VOID_PTR pReserved) {
+    if (pReserved) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    return replayer.finalize();
+}
+
+// ---- Replayer ---------------------------------------------------------------
+
+CK_RV Replayer::doLoad() {
+    const char* path = getenv("P11_REPLAY_TRACE");
+    if (!path || !*path) {
+        fprintf(stderr, "[p11replay] P11_REPLAY_TRACE is not set\n");
+        return CKR_GENERAL_ERROR;
+    }
+    tracePath_ = path;
+
+    if (const char* env = getenv("P11_REPLAY_TIME_SCALE")) {
+        double scale = strtod(env, nullptr);
+        timeScale_ = scale < 0 ? 0 : scale;
+    }
+
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "[p11replay] cannot open %s\n", path);
+        return CKR_GENERAL_ERROR;
+    }
+    bool loaded = readTrace(file);
+    fclose(file);
+    if (!loaded) {
+        fprintf(stderr, "[p11replay] %s is not a usable trace\n", path);
+        return CKR_GENERAL_ERROR;
+    }
+
+    buildFunctionLists();
+    return CKR_OK;
+}
+
+bool Replayer::readTrace(FILE* file) {
+    TraceFileHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version < TRACE_MIN_VERSION || header.version > TRACE_VERSION ||
+        header.recordSize != sizeof(TraceRecord)) {
+        return false;
+    }
+    droppedRecords_ = header.droppedRecords;
+
+    // Most recent call per thread, which payload chunks attach to. Elements of
+    // a deque stay put while others are appended.
+    std::map<uint32_t, RecordedCall*> lastCall;
+    bool sawPayload = false;
+
+    TraceRecord record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.function >= P11_FUNCTION_COUNT) {
+            continue;
+        }
+
+        bool local = record.function == static_cast<uint16_t>(P11Function::C_Initialize) ||
+                     record.function == static_cast<uint16_t>(P11Function::C_Finalize);
+
+        if (record.kind == static_cast<uint16_t>(TraceRecordKind::Call) && local) {
+            lastCall.erase(record.threadId); // Handled by the replay module itself
+        } else if (record.kind == static_cast<uint16_t>(TraceRecordKind::Call)) {
+            queues_[record.function].push_back(RecordedCall{record, {}, 0, false});
+            lastCall[record.threadId] = &queues_[record.function].back();
+        } else if (record.kind == static_cast<uint16_t>(TraceRecordKind::Payload)) {
+            TracePayloadRecord chunk;
+            memcpy(&chunk, &record, sizeof(chunk));
+            sawPayload = true;
+
+            auto it = lastCall.find(chunk.threadId);
+            if (it == lastCall.end() || it->second->record.function != chunk.function) {
+                continue;
+            }
+            RecordedCall& call = *it->second;
+            if (!call.hasPayload) {
+                call.hasPayload = true;
+                call.payloadLength = chunk.totalLength;
+            }
+            // A dropped chunk leaves the payload short; payloadComplete() then
+            // keeps it from being applied
+            if (chunk.offset == call.payload.size() && chunk.offset < call.payloadLength) {
+                size_t length = std::min<size_t>(TRACE_PAYLOAD_CHUNK, call.payloadLength - chunk.offset);
+                call.payload.insert(call.payload.end(), chunk.data, chunk.data + length);
+            }
+        }
+    }
+
+    if (!sawPayload) {
+        fprintf(stderr, "[p11replay] %s has no payloads (recorded without P11_TRACE_PAYLOADS=1), "
+                "only return values and timing are replayed\n", tracePath_.c_str());
+    }
+    return true;
+}
+
+void Replayer::buildFunctionLists() {
+    functionList_.version = {2, 20};
+#define CK_PKCS11_FUNCTION_INFO(name) \
+    functionList_.name = &Thunk<decltype(CK_FUNCTION_LIST::name), &CK_FUNCTION_LIST::name, P11Function::name>::invoke;
+#include "pkcs11f.h"
+#undef CK_PKCS11_FUNCTION_INFO
+    functionList_.C_Initialize = replayInitialize;
+    functionList_.C_Finalize = replayFinalize;
+    functionList_.C_GetFunctionList = C_GetFunctionList;
+
+    auxFunctionList_.version = {1, 0};
+#define P11_AUX_REPLAY(name, index) \
+    auxFunctionList_.pFunc[index] = reinterpret_cast<void*>(&AuxThunk<name, P11Function::name>::invoke);
+    P11_AUX_FUNCTIONS(P11_AUX_REPLAY)
+#undef P11_AUX_REPLAY
+}
+
+void Replayer::writeReport() {
+    FILE* out = stderr;
+    const char* path = getenv("P11_REPLAY_REPORT");
+    if (path && *path) {
+        out = fopen(path, "w");
+        if (!out) {
+            fprintf(stderr, "[p11replay] cannot write report to %s\n", path);
+            out = stderr;
+        }
+    }
+
+    FunctionStats total;
+    uint64_t unreplayed = 0;
+    for (size_t i = 0; i < P11_FUNCTION_COUNT; i++) {
+        total.calls += stats_[i].calls;
+        total.misses += stats_[i].misses;
+        total.recordedNs += stats_[i].recordedNs;
+        total.replayedNs += stats_[i].replayedNs;
+        unreplayed += queues_[i].size();
+    }
+
+    fprintf(out, "{\"trace\":\"%s\",\"timeScale\":%g,\"droppedRecords\":%u,", tracePath_.c_str(), timeScale_,
+            droppedRecords_);
+    fprintf(out, "\"calls\":%llu,\"misses\":%llu,\"unreplayed\":%llu,\"argumentMismatches\":%llu,",
+            (unsigned long long)total.calls, (unsigned long long)total.misses, (unsigned long long)unreplayed,
+            (unsigned long long)argumentMismatches_);
+    fprintf(out, "\"payloadMismatches\":%llu,\"recordedNs\":%llu,\"replayedNs\":%llu,",
+            (unsigned long long)payloadMismatches_, (unsigned long long)total.recordedNs, (unsigned long long)total.replayedNs);
+    fprintf(out, "\"functions\":{");
+    bool first = true;
+    for (size_t i = 0; i < P11_FUNCTION_COUNT; i++) {
+        const FunctionStats& s = stats_[i];
+        if (!s.calls) {
+            continue;
+        }
+        fprintf(out, "%s\"%s\":{\"calls\":%llu,\"misses\":%llu,\"recordedNs\":%llu,\"replayedNs\":%llu}",
+                first ? "" : ",", p11FunctionName(static_cast<P11Function>(i)), (unsigned long long)s.calls,
+                (unsigned long long)s.misses, (unsigned long long)s.recordedNs, (unsigned long long)s.replayedNs);
+        first = false;
+    }
+    fprintf(out, "}}\n");
+
+    if (out != stderr) {
+        fclose(out);
+    }
+}
+
+} // namespace
+
+extern "C" {
+
+P11_REPLAY_EXPORT CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList) {
+    if (!ppFunctionList) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    CK_RV rv = replayer.load();
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    *ppFunctionList = replayer.functionList();
+    return CKR_OK;
+}
+
+P11_REPLAY_EXPORT CK_RV E_GetAuxFunctionList(AUX_FUNC_LIST_PTR_PTR pAuxFunc) {
+    if (!pAuxFunc) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    CK_RV rv = replayer.load();
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    *pAuxFunc = replayer.auxFunctionList();
+    return CKR_OK;
+}
+
+} // extern "C"
@@ -0,0 +1,1113 @@
+// token-serve: persistent request server over one initialized PKCS11Library.
+//
+// Spawning a CLI per command pays process start, dlopen, C_Initialize, token
+// discovery and login every time. token-serve does that once and then
+// answers requests until its input closes, so N commands cost one start-up.
+//
+// Build and run, e.g.
+//   g++ -O2 -std=gnu++17 -IToken/include -o token-serve Token/serve/token_serve.cpp Token/src/*.cpp -ldl -lcrypto -lpthread
+//   token-serve --library /usr/lib/libshuttle_p11v220.so.1.0.0
+// Options:
+//   --library PATH        PKCS#11 module (required)
+//   --socket PATH         serve clients on this Unix socket, one at a time,
+//                         instead of stdin/stdout
+//
+// Framing: every request and response is a 4-byte little-endian length
+// followed by that many bytes of UTF-8 JSON.
+//   request:  {"id": 7, "method": "sign", "params": {"key": 3, "data": "00ff", "hash": "SHA256"}}
+//   response: {"id": 7, "ok": true, "result": {"signature": "..."}}
+//             {"id": 7, "ok": false, "error": {"status": 100, "rv": 160, "message": "..."}}
+// Byte strings are hex. Requests may be pipelined: they run in order and
+// every response carries its request's id. A request may carry "timeoutMs":
+// past it the token call is abandoned and the request fails with status 258
+// (ERROR_TIMEOUT). Diagnostics go to stderr only.
+//
+// Methods (params):
+//   getSlotList (tokenPresent)            getTokenInfo (slot)
+//   probeToken
+//   openSession (slot, readWrite)         closeSession
+//   login (pin, userType)                 logout
+//   getPinInfo                            getTokenTimeout
+//   findCertificates                      findKeys (class)
+//   exportCertificate (handle)            destroyObject (handle)
+//   exportPublicKey (handle, [format])    format "DER" (hex, default) or "PEM"
+//   getAttribute (handle, type)           setAttribute (handle, type, value)
+//   batch (operations, [rollback])        each {op, [handle], [attributes]}, op
+//                                         "create", "destroy" or "setAttributes",
+//                                         attributes [{type, value}]; rollback
+//                                         defaults to true
+//   destroyByLabel (label, [class])       the public, private and secret keys
+//                                         with that label, or only the objects
+//                                         of class; one batch
+//   sign / verify (key, data, hash, [signature])
+//   signECDSA / verifyECDSA (key, data, hash, encoding, [signature])
+//   encryptRSA / decryptRSA (key, data)
+//   generateRSAKeyPair (bits, label, tokenObject)
+//   generateECKeyPair (label, tokenObject)
+//   importPkcs12 (data, password, [label])
+//   importPkcs12Directory (path, password)
+//   transmitAPDU (command)
+//   kvGet (key, [application])            kvPut (key, value, [application])
+//   kvRemove (key, [application])         kvKeys ([application])
+//   kvFlush ([application])               TokenKeyValueStore per application
+//                                         (default "kvstore"); puts and removes
+//                                         are written on kvFlush, once enough
+//                                         are pending, or when the session
+//                                         changes
+
+#include "pkcs11_lib.h"
+#include "token_kv_store.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+using namespace PKCS11Lib;
+
+namespace {
+
+constexpr uint32_t MAX_REQUEST = 16u << 20;
+
+// ---- JSON --------------------------------------------------------------------
+
+struct Json {
+    enum class Type { Null, Bool, Number, String, Array, Object };
+
+    Type type = Type::Null;
+    bool boolean = false;
+    double number = 0;
+    bool isInteger = false;
+    uint64_t integer = 0;       // when isInteger and not negative
+    std::string string;
+    std::vector<Json> array;
+    std::vector<std::pair<std::string, Json>> object;
+
+    const Json* get(const char* key) const {
+        if (type != Type::Object) {
+            return nullptr;
+        }
+        for (const auto& member : object) {
+            if (member.first == key) {
+                return &member.second;
+            }
+        }
+        return nullptr;
+    }
+};
+
+class JsonParser {
+public:
+    explicit JsonParser(const std::string& text) : text_(text), pos_(0) {}
+
+    bool parse(Json& out) {
+        if (!value(out, 0)) {
+            return false;
+        }
+        skipSpace();
+        return pos_ == text_.size();
+    }
+
+private:
+    static constexpr int MAX_DEPTH = 32;
+
+    void skipSpace() {
+        while (pos_ < text_.size() && strchr(" \t\r\n", text_[pos_])) {
+            pos_++;
+        }
+    }
+
+    bool literal(const char* word) {
+        size_t length = strlen(word);
+        if (text_.compare(pos_, length, word) != 0) {
+            return false;
+        }
+        pos_ += length;
+        return true;
+    }
+
+    bool value(Json& out, int depth) {
+        if (depth > MAX_DEPTH) {
+            return false;
+        }
+        skipSpace();
+        if (pos_ >= text_.size()) {
+            return false;
+        }
+        char c = text_[pos_];
+        if (c == '{') {
+            out.type = Json::Type::Object;
+            pos_++;
+            skipSpace();
+            if (pos_ < text_.size() && text_[pos_] == '}') {
+                pos_++;
+                return true;
+            }
+            for (;;) {
+                skipSpace();
+                std::string key;
+                if (!string(key)) {
+                    return false;
+                }
+                skipSpace();
+                if (pos_ >= text_.size() || text_[pos_++] != ':') {
+                    return false;
+                }
+                Json member;
+                if (!value(member, depth + 1)) {
+                    return false;
+                }
+                out.object.emplace_back(std::move(key), std::move(member));
+                skipSpace();
+                if (pos_ < text_.size() && text_[pos_] == ',') {
+                    pos_++;
+                    continue;
+                }
+                return pos_ < text_.size() && text_[pos_++] == '}';
+            }
+        }
+        if (c == '[') {
+            out.type = Json::Type::Array;
+            pos_++;
+            skipSpace();
+            if (pos_ < text_.size() && text_[pos_] == ']') {
+                pos_++;
+                return true;
+            }
+            for (;;) {
+                Json element;
+                if (!value(element, depth + 1)) {
+                    return false;
+                }
+                out.array.push_back(std::move(element));
+                skipSpace();
+                if (pos_ < text_.size() && text_[pos_] == ',') {
+                    pos_++;
+                    continue;
+                }
+                return pos_ < text_.size() && text_[pos_++] == ']';
+            }
+        }
+        if (c == '"') {
+            out.type = Json::Type::String;
+            return string(out.string);
+        }
+        if (literal("true")) {
+            out.type = Json::Type::Bool;
+            out.boolean = true;
+            return true;
+        }
+        if (literal("false")) {
+            out.type = Json::Type::Bool;
+            return true;
+        }
+        if (literal("null")) {
+            return true;
+        }
+        return number(out);
+    }
+
+    bool number(Json& out) {
+        size_t start = pos_;
+        if (pos_ < text_.size() && text_[pos_] == '-') {
+            pos_++;
+        }
+        bool integral = true;
+        while (pos_ < text_.size() && strchr("0123456789.eE+-", text_[pos_])) {
+            if (strchr(".eE", text_[pos_])) {
+                integral = false;
+            }
+            pos_++;
+        }
+        std::string token = text_.substr(start, pos_ - start);
+        if (token.empty() || token == "-") {
+            return false;
+        }
+        char* end = nullptr;
+        out.type = Json::Type::Number;
+        out.number = strtod(token.c_str(), &end);
+        if (*end != '\0') {
+            return false;
+        }
+        if (integral && token[0] != '-') {
+            errno = 0;
+            out.integer = strtoull(token.c_str(), nullptr, 10);
+            out.isInteger = errno == 0;
+        }
+        return true;
+    }
+
+    bool string(std::string& out) {
+        if (pos_ >= text_.size() || text_[pos_] != '"') {
+            return false;
+        }
+        pos_++;
+        while (pos_ < text_.size()) {
+            char c = text_[pos_++];
+            if (c == '"') {
+                return true;
+            }
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (pos_ >= text_.size()) {
+                return false;
+            }
+            char escape = text_[pos_++];
+            switch (escape) {
+                case '"': case '\\': case '/': out += escape; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': {
+                    if (pos_ + 4 > text_.size()) {
+                        return false;
+                    }
+                    unsigned code = static_cast<unsigned>(strtoul(text_.substr(pos_, 4).c_str(), nullptr, 16));
+                    pos_ += 4;
+                    // BMP only; enough for labels and PINs
+                    if (code < 0x80) {
+                        out += static_cast<char>(code);
+                    } else if (code < 0x800) {
+                        out += static_cast<char>(0xc0 | (code >> 6));
+                        out += static_cast<char>(0x80 | (code & 0x3f));
+                    } else {
+                        out += static_cast<char>(0xe0 | (code >> 12));
+                        out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+                        out += static_cast<char>(0x80 | (code & 0x3f));
+                    }
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        return false;
+    }
+
+    const std::string& text_;
+    size_t pos_;
+};
+
+class JsonWriter {
+public:
+    JsonWriter& beginObject() { separator(); out_ += '{'; first_ = true; return *this; }
+    JsonWriter& endObject() { out_ += '}'; first_ = false; return *this; }
+    JsonWriter& beginArray() { separator(); out_ += '['; first_ = true; return *this; }
+    JsonWriter& endArray() { out_ += ']'; first_ = false; return *this; }
+
+    JsonWriter& key(const char* name) {
+        separator();
+        quoted(name);
+        out_ += ':';
+        first_ = true; // the value follows without a comma
+        return *this;
+    }
+
+    JsonWriter& value(const std::string& text) { separator(); quoted(text); return *this; }
+    JsonWriter& value(const char* text) { return value(std::string(text)); }
+    JsonWriter& value(bool flag) { separator(); out_ += flag ? "true" : "false"; return *this; }
+    JsonWriter& value(unsigned long long number) { separator(); out_ += std::to_string(number); return *this; }
+    JsonWriter& value(unsigned long number) { return value(static_cast<unsigned long long>(number)); }
+    JsonWriter& value(unsigned number) { return value(static_cast<unsigned long long>(number)); }
+    JsonWriter& value(int number) { separator(); out_ += std::to_string(number); return *this; }
+    JsonWriter& hex(const std::vector<CK_BYTE>& bytes) { return value(PKCS11Library::bytesToHex(bytes)); }
+    JsonWriter& null() { separator(); out_ += "null"; return *this; }
+
+    template<typename T>
+    JsonWriter& field(const char* name, const T& v) { key(name); return value(v); }
+    JsonWriter& hexField(const char* name, const std::vector<CK_BYTE>& bytes) { key(name); return hex(bytes); }
+
+    std::string take() { return std::move(out_); }
+
+private:
+    void separator() {
+        if (!first_) {
+            out_ += ',';
+        }
+        first_ = false;
+    }
+
+    void quoted(const std::string& text) {
+        out_ += '"';
+        for (unsigned char c : text) {
+            if (c == '"' || c == '\\') {
+                out_ += '\\';
+                out_ += static_cast<char>(c);
+            } else if (c < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out_ += escaped;
+            } else {
+                out_ += static_cast<char>(c);
+            }
+        }
+        out_ += '"';
+    }
+
+    std::string out_;
+    bool first_ = true;
+};
+
+// ---- params ------------------------------------------------------------------
+
+// Typed access to a request's params; the first missing or mistyped
+// parameter is remembered and reported instead of running the method
+class Params {
+public:
+    // A nested Params (an element of an array parameter) reports its errors
+    // through parent
+    explicit Params(const Json* params, Params* parent = nullptr) : params_(params), parent_(parent) {}
+
+    uint64_t u64(const char* name) {
+        const Json* v = find(name);
+        if (v && v->type == Json::Type::Number && v->isInteger) {
+            return v->integer;
+        }
+        fail(name, "an unsigned integer");
+        return 0;
+    }
+
+    uint64_t u64(const char* name, uint64_t fallback) {
+        return find(name) ? u64(name) : fallback;
+    }
+
+    std::string str(const char* name) {
+        const Json* v = find(name);
+        if (v && v->type == Json::Type::String) {
+            return v->string;
+        }
+        fail(name, "a string");
+        return std::string();
+    }
+
+    std::string str(const char* name, const std::string& fallback) {
+        return find(name) ? str(name) : fallback;
+    }
+
+    bool flag(const char* name, bool fallback) {
+        const Json* v = find(name);
+        if (!v) {
+            return fallback;
+        }
+        if (v->type != Json::Type::Bool) {
+            fail(name, "a boolean");
+        }
+        return v->boolean;
+    }
+
+    std::vector<const Json*> array(const char* name) {
+        const Json* v = find(name);
+        std::vector<const Json*> elements;
+        if (v && v->type == Json::Type::Array) {
+            for (const auto& element : v->array) {
+                elements.push_back(&element);
+            }
+        } else {
+            fail(name, "an array");
+        }
+        return elements;
+    }
+
+    std::vector<CK_BYTE> hex(const char* name) {
+        std::string text = str(name);
+        if (text.size() % 2 != 0 || text.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+            fail(name, "a hex string");
+            return {};
+        }
+        return PKCS11Library::hexToBytes(text);
+    }
+
+    HashAlgorithm hash(const char* name, HashAlgorithm fallback) {
+        if (!find(name)) {
+            return fallback;
+        }
+        std::string text = str(name);
+        static const std::pair<const char*, HashAlgorithm> names[] = {
+            {"SHA1", HashAlgorithm::SHA1}, {"SHA224", HashAlgorithm::SHA224}, {"SHA256", HashAlgorithm::SHA256},
+            {"SHA384", HashAlgorithm::SHA384}, {"SHA512", HashAlgorithm::SHA512}, {"MD5", HashAlgorithm::MD5}};
+        for (const auto& entry : names) {
+            if (text == entry.first) {
+                return entry.second;
+            }
+        }
+        fail(name, "SHA1, SHA224, SHA256, SHA384, SHA512 or MD5");
+        return fallback;
+    }
+
+    SignatureEncoding encoding(const char* name) {
+        if (!find(name)) {
+            return SignatureEncoding::RAW;
+        }
+        std::string text = str(name);
+        if (text == "RAW" || text == "DER") {
+            return text == "DER" ? SignatureEncoding::DER : SignatureEncoding::RAW;
+        }
+        fail(name, "RAW or DER");
+        return SignatureEncoding::RAW;
+    }
+
+    bool ok() const { return error_.empty(); }
+    const std::string& error() const { return error_; }
+
+    void fail(const char* name, const char* expected) {
+        if (parent_) {
+            parent_->fail(name, expected);
+        } else if (error_.empty()) {
+            error_ = std::string("Parameter '") + name + "' must be " + expected;
+        }
+    }
+
+private:
+    const Json* find(const char* name) const {
+        return params_ ? params_->get(name) : nullptr;
+    }
+
+    const Json* params_;
+    Params* parent_;
+    std::string error_;
+};
+
+// ---- results -----------------------------------------------------------------
+
+void writeCertificate(JsonWriter& w, const CertificateInfo& info) {
+    w.beginObject();
+    w.field("handle", info.handle).field("label", info.label);
+    w.hexField("subject", info.subject).hexField("id", info.id).hexField("value", info.value);
+    w.field("type", info.type);
+    w.endObject();
+}
+
+void writeKey(JsonWriter& w, const KeyInfo& info) {
+    w.beginObject();
+    w.field("handle", info.handle).field("label", info.label);
+    w.field("keyType", info.keyType).field("class", info.objectClass).hexField("id", info.id);
+    w.field("canEncrypt", info.canEncrypt).field("canDecrypt", info.canDecrypt);
+    w.field("canSign", info.canSign).field("canVerify", info.canVerify);
+    w.field("canWrap", info.canWrap).field("canUnwrap", info.canUnwrap).field("canDerive", info.canDerive);
+    w.field("sensitive", info.isSensitive).field("extractable", info.isExtractable);
+    w.endObject();
+}
+
+void writeKeyPair(JsonWriter& w, const KeyPair& pair) {
+    w.beginObject();
+    w.key("publicKey");
+    writeKey(w, pair.publicKey);
+    w.key("privateKey");
+    writeKey(w, pair.privateKey);
+    w.endObject();
+}
+
+void writePkcs12Import(JsonWriter& w, const Pkcs12Import& imported) {
+    w.beginObject();
+    w.field("label", imported.label).hexField("id", imported.id);
+    w.field("certificate", imported.certificate).field("privateKey", imported.privateKey);
+    w.field("publicKey", imported.publicKey);
+    w.key("chain").beginArray();
+    for (CK_OBJECT_HANDLE handle : imported.chain) {
+        w.value(handle);
+    }
+    w.endArray();
+    w.field("parsedByToken", imported.parsedByToken);
+    w.endObject();
+}
+
+// Failed items carry the operation's handle, or 0 for a create, except a
+// create whose rollback failed: that carries the object left on the token
+void writeBatchResults(JsonWriter& w, const std::vector<BatchOperation>& operations,
+                       const std::vector<Result<CK_OBJECT_HANDLE>>& results) {
+    w.beginArray();
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto& result = results[i];
+        w.beginObject().field("ok", result.isOk());
+        w.field("handle", result.value != CK_INVALID_HANDLE ? result.value : operations[i].handle);
+        if (!result.isOk()) {
+            w.key("error").beginObject();
+            w.field("status", static_cast<int>(result.errorCode));
+            w.field("rv", result.pkcs11Error).field("message", result.errorMessage);
+            w.endObject();
+        }
+        w.endObject();
+    }
+    w.endArray();
+}
+
+// ---- server ------------------------------------------------------------------
+
+class Server {
+public:
+    Result<void> initialize(const std::string& library) {
+        return lib_.initialize(library);
+    }
+
+    // One request in, one response out
+    std::string handle(const std::string& text) {
+        Json request;
+        if (!JsonParser(text).parse(request) || request.type != Json::Type::Object) {
+            return error(nullptr, Status::ERROR_ARGUMENTS_BAD, "Request is not a JSON object", 0);
+        }
+        const Json* id = request.get("id");
+        const Json* method = request.get("method");
+        if (!method || method->type != Json::Type::String) {
+            return error(id, Status::ERROR_ARGUMENTS_BAD, "Missing method", 0);
+        }
+
+        // Optional per-request limit; the request fails with ERROR_TIMEOUT
+        const Json* timeout = request.get("timeoutMs");
+        std::optional<OperationScope> limit;
+        if (timeout && timeout->type == Json::Type::Number && timeout->isInteger && timeout->integer > 0) {
+            limit.emplace(lib_, OperationContext::within(std::chrono::milliseconds(timeout->integer)));
+        }
+
+        Params params(request.get("params"));
+        JsonWriter result;
+        Result<void> outcome = dispatch(method->string, params, result);
+        if (!params.ok()) {
+            return error(id, Status::ERROR_ARGUMENTS_BAD, params.error(), 0);
+        }
+        if (!outcome.isOk()) {
+            return error(id, outcome.errorCode, outcome.errorMessage, outcome.pkcs11Error);
+        }
+
+        JsonWriter w;
+        w.beginObject();
+        writeId(w, id);
+        w.field("ok", true);
+        w.key("result");
+        std::string body = w.take();
+        std::string value = result.take();
+        body += value.empty() ? "null" : value;
+        body += '}';
+        return body;
+    }
+
+private:
+    static void writeId(JsonWriter& w, const Json* id) {
+        w.key("id");
+        if (id && id->type == Json::Type::Number && id->isInteger) {
+            w.value(static_cast<unsigned long long>(id->integer));
+        } else if (id && id->type == Json::Type::String) {
+            w.value(id->string);
+        } else {
+            w.null();
+        }
+    }
+
+    static std::string error(const Json* id, Status status, const std::string& message, unsigned long rv) {
+        JsonWriter w;
+        w.beginObject();
+        writeId(w, id);
+        w.field("ok", false);
+        w.key("error").beginObject();
+        w.field("status", static_cast<int>(status)).field("rv", rv).field("message", message);
+        w.endObject().endObject();
+        return w.take();
+    }
+
+    // Converts a call's outcome, writing its value with encode on success
+    template<typename T, typename Encode>
+    static Result<void> finish(const Params& params, const Result<T>& result, JsonWriter& w, Encode encode) {
+        if (!params.ok()) {
+            return Result<void>::Ok();
+        }
+        if (!result.isOk()) {
+            return Result<void>::Error(result.errorCode, result.errorMessage, result.pkcs11Error);
+        }
+        encode(w, result.value);
+        return Result<void>::Ok();
+    }
+
+    static Result<void> finish(const Params&, const Result<void>& result, JsonWriter&) {
+        return result;
+    }
+
+    static void hexResult(JsonWriter& w, const char* name, const std::vector<CK_BYTE>& bytes) {
+        w.beginObject().hexField(name, bytes).endObject();
+    }
+
+    Result<void> dispatch(const std::string& method, Params& p, JsonWriter& w) {
+        auto hexAs = [](const char* name) {
+            return [name](JsonWriter& out, const std::vector<CK_BYTE>& bytes) { hexResult(out, name, bytes); };
+        };
+
+        if (method == "getSlotList") {
+            bool present = p.flag("tokenPresent", true);
+            if (!p.ok()) return Result<void>::Ok();
+            return finish(p, lib_.getSlotList(present), w,
+                          [](JsonWriter& out, const std::vector<CK_SLOT_ID>& slots) {
+                out.beginArray();
+                for (CK_SLOT_ID slot : slots) {
+                    out.value(slot);
+                }
+                out.endArray();
+            });
+        }
+        if (method == "getTokenInfo") {
+            CK_SLOT_ID slot = p.u64("slot", lib_.currentSlotId());
+            if (!p.ok()) return Result<void>::Ok();
+            return finish(p, lib_.getTokenInfo(slot), w, [](JsonWriter& out, const TokenInfo& info) {
+                out.beginObject();
+                out.field("label", info.label).field("manufacturerId", info.manufacturerId);
+                out.field("model", info.model).field("serialNumber", info.serialNumber);
+                out.field("flags", info.flags).field("sessionCount", info.sessionCount);
+                out.field("maxSessionCount", info.maxSessionCount);
+                out.field("freePublicMemory", info.freePublicMemory).field("totalPublicMemory", info.totalPublicMemory);
+                out.field("freePrivateMemory", info.freePrivateMemory);
+                out.field("totalPrivateMemory", info.totalPrivateMemory);
+                out.endObject();
+            });
+        }
+        if (method == "probeToken") {
+            return finish(p, lib_.probeToken(), w, [](JsonWriter& out, const TokenProbe& probe) {
+                out.beginObject();
+                out.field("present", probe.present).field("userLoggedIn", probe.userLoggedIn);
+                out.field("soLoggedIn", probe.soLoggedIn).field("generation", static_cast<unsigned long long>(probe.generation));
+                out.hexField("hardwareSerial", probe.hardwareSerial).field("busy", probe.busy);
+                out.endObject();
+            });
+        }
+        if (method == "openSession" || method == "closeSession") {
+            // Pending store writes belong to the token they were made on: write
+            // them out first, and keep the session (and the stores) if that fails
+            for (auto& entry : stores_) {
+                auto flushed = entry.second->flush();
+                if (!flushed.isOk()) {
+                    return flushed;
+                }
+            }
+            stores_.clear();
+        }
+        if (method == "openSession") {
+            CK_SLOT_ID slot = p.u64("slot");
+            bool readWrite = p.flag("readWrite", true);
+            return p.ok() ? lib_.openSession(slot, readWrite) : Result<void>::Ok();
+        }
+        if (method == "closeSession") {
+            return lib_.closeSession();
+        }
+        if (method == "login") {
+            std::string pin = p.str("pin");
+            CK_USER_TYPE userType = p.u64("userType", CKU_USER);
+            return p.ok() ? lib_.login(pin, userType) : Result<void>::Ok();
+        }
+        if (method == "logout") {
+            return lib_.logout();
+        }
+        if (method == "getPinInfo") {
+            return finish(p, lib_.getPinInfo(), w, [](JsonWriter& out, const PinInfo& info) {
+                out.beginObject();
+                out.field("userMaxRetries", info.userMaxRetries).field("userRetriesLeft", info.userCurCounter);
+                out.field("soMaxRetries", info.soMaxRetries).field("soRetriesLeft", info.soCurCounter);
+                out.field("flags", info.pinFlags);
+                out.endObject();
+            });
+        }
+        if (method == "getTokenTimeout") {
+            return finish(p, lib_.getTokenTimeout(), w, [](JsonWriter& out, CK_ULONG seconds) {
+                out.beginObject().field("seconds", seconds).endObject();
+            });
+        }
+        if (method == "findCertificates") {
+            return finish(p, lib_.findCertificates(), w, [](JsonWriter& out, const std::vector<CertificateInfo>& certs) {
+                out.beginArray();
+                for (const auto& cert : certs) {
+                    writeCertificate(out, cert);
+                }
+                out.endArray();
+            });
+        }
+        if (method == "findKeys") {
+            CK_OBJECT_CLASS keyClass = p.u64("class", CKO_PUBLIC_KEY);
+            if (!p.ok()) return Result<void>::Ok();
+            return finish(p, lib_.findKeys(keyClass), w, [](JsonWriter& out, const std::vector<KeyInfo>& keys) {
+                out.beginArray();
+                for (const auto& key : keys) {
+                    writeKey(out, key);
+                }
+                out.endArray();
+            });
+        }
+        if (method == "exportCertificate") {
+            CK_OBJECT_HANDLE handle = p.u64("handle");
+            if (!p.ok()) return Result<void>::Ok();
+            return finish(p, lib_.exportCertificate(handle), w, hexAs("value"));
+        }
+        if (method == "exportPublicKey") {
+            CK_OBJECT_HANDLE handle = p.u64("handle");
+            bool pem = p.str("format", "DER") == "PEM";
+            if (!p.ok()) return Result<void>::Ok();
+            return finish(p, lib_.exportPublicKey(handle, pem ? KeyFormat::PEM : KeyFormat::DER), w,
+                          [pem](JsonWriter& out, const std::vector<CK_BYTE>& key) {
+                out.beginObject();
+                if (pem) {
+                    out.field("pem", std::string(key.begin(), key.end()));
+                } else {
+                    out.hexField("der", key);
+                }
+                out.endObject();
+            });
+        }
+        if (method == "destroyObject") {
+            CK_OBJECT_HANDLE handle = p.u64("handle");
+            return p.ok() ? lib_.destroyObject(handle) : Result<void>::Ok();
+        }
+        if (method == "getAttribute") {
+            CK_OBJECT_HANDLE handle = p.u64("handle");
+            CK_ATTRIBUTE_TYPE type = p.u64("type");
+            if (!p.ok()) return Result<void>::Ok();
+            return finish(p, lib_.getObjectAttribute(handle, type), w, hexAs("value"));
+        }
+        if (method == "setAttribute") {
+            CK_OBJECT_HANDLE handle = p.u64("handle");
+            CK_ATTRIBUTE_TYPE type = p.u64("type");
+            auto value = p.hex("value");
+            return p.ok() ? lib_.setObjectAttribute(handle, type, value) : Result<void>::Ok();
+        }
+        if (method == "batch") {
+            std::vector<BatchOperation> operations;
+            std::deque<std::vector<CK_BYTE>> values;    // owns what the attributes point to
+            for (const Json* element : p.array("operations")) {
+                Params item(element, &p);
+                std::string op = item.str("op");
+                BatchOperation operation;
+                if (op == "create") {
+                    operation.kind = BatchOperation::Kind::Create;
+                } else if (op == "destroy" || op == "setAttributes") {
+                    operation.kind = op == "destroy" ? BatchOperation::Kind::Destroy
+                                                     : BatchOperation::Kind::SetAttributes;
+                    operation.handle = item.u64("handle");
+                } else {
+                    item.fail("op", "create, destroy or setAttributes");
+                }
+                if (operation.kind != BatchOperation::Kind::Destroy) {
+                    for (const Json* attribute : item.array("attributes")) {
+                        Params field(attribute, &p);
+                        CK_ATTRIBUTE_TYPE type = field.u64("type");
+                        values.push_back(field.hex("value"));
+                        operation.attributes.push_back({type, values.back().data(), values.back().size()});
+                    }
+                }
+                operations.push_back(std::move(operation));
+            }
+            bool rollback = p.flag("rollback", true);
+            if (!p.ok()) return Result<void>::Ok();
+            return finish(p, lib_.executeBatch(operations, rollback), w,
+                          [&operations](JsonWriter& out, const std::vector<Result<CK_OBJECT_HANDLE>>& results) {
+                writeBatchResults(out, operations, results);
+            });
+        }
+        if (method == "destroyByLabel") {
+            std::string label = p.str("label");
+            CK_OBJECT_CLASS objectClass = p.u64("class", CK_UNAVAILABLE_INFORMATION);
+            if (!p.ok()) return Result<void>::Ok();
+            // Keys only unless a class is named: certificates and data objects
+            // (the key-value store's chunks among them) often share a key's label.
+            // One search per class, then one batch; a failed destroy does not
+            // stop the others
+            std::vector<CK_OBJECT_CLASS> classes = {CKO_PUBLIC_KEY, CKO_PRIVATE_KEY, CKO_SECRET_KEY};
+            if (objectClass != CK_UNAVAILABLE_INFORMATION) {
+                classes = {objectClass};
+            }
+            std::vector<BatchOperation> operations;
+            for (CK_OBJECT_CLASS searched : classes) {
+                CK_ATTRIBUTE search[] = {
+                    {CKA_CLASS, &searched, sizeof(searched)},
+                    {CKA_LABEL, (void*)label.data(), label.size()}
+                };
+                auto found = lib_.findObjects(std::vector<CK_ATTRIBUTE>(std::begin(search), std::end(search)));
+                if (!found.isOk()) {
+                    return Result<void>::Error(found.errorCode, found.errorMessage, found.pkcs11Error);
+                }
+                for (CK_OBJECT_HANDLE handle : found.value) {
+                    operations.push_back(BatchOperation::destroy(handle));
+                }
+            }
+            return finish(p, lib_.executeBatch(operations, false), w,
+                          [&operations](JsonWriter& out, const std::vector<Result<CK_OBJECT_HANDLE>>& results) {
+                writeBatchResults(out, operations, results);
+            });
+        }
+        if (method == "sign" || method == "verify") {
+            CK_OBJECT_HANDLE key = p.u64("key");
+            auto data = p.hex("data");
+            HashAlgorithm hash = p.hash("hash", HashAlgorithm::SHA1);
+            if (method == "verify") {
+                auto signature = p.hex("signature");
+                return p.ok() ? lib_.verify(key, data, signature, hash) : Result<void>::Ok();
+            }
+            if (!p.ok()) return Result<void>::Ok();
+            return finish(p, lib_.sign(key, data, hash), w, hexAs("signature"));
+        }
+        if (method == "signECDSA" || method == "verifyECDSA") {
+            CK_OBJECT_HANDLE key = p.u64("key");
+            auto data = p.hex("data");
+            HashAlgorithm hash = p.hash("hash", HashAlgorithm::SHA256);
+            SignatureEncoding encoding = p.encoding("encoding");
+            if (method == "verifyECDSA") {
+                auto signature = p.hex("signature");
+                return p.ok() ? lib_.verifyECDSA(key, data, signature, hash, encoding) : Result<void>::Ok();
+            }
+            if (!p.ok()) return Result<void>::Ok();
+            return finish(p, lib_.signECDSA(key, data, hash, encoding), w, hexAs("signature"));
+        }
+        if (method == "encryptRSA" || method == "decryptRSA") {
+            CK_OBJECT_HANDLE key = p.u64("key");
+            auto data = p.hex("data");
+            if (!p.ok()) return Result<void>::Ok();
+            if (method == "encryptRSA") {
+                return finish(p, lib_.encryptRSA(key, data), w, hexAs("data"));
+            }
+            return finish(p, lib_.decryptRSA(key, data), w, hexAs("data"));
+        }
+        if (method == "generateRSAKeyPair") {
+            CK_ULONG bits = p.u64("bits", 2048);
+            std::string label = p.str("label");
+            bool tokenObject = p.flag("tokenObject", true);
+            if (!p.ok()) return Result<void>::Ok();
+            return finish(p, lib_.generateRSAKeyPair(bits, label, tokenObject), w, writeKeyPair);
+        }
+        if (method == "generateECKeyPair") {
+            std::string label = p.str("label");
+            bool tokenObject = p.flag("tokenObject", true);
+            if (!p.ok()) return Result<void>::Ok();
+            return finish(p, lib_.generateECKeyPair(label, tokenObject), w, writeKeyPair);
+        }
+        if (method == "importPkcs12") {
+            auto data = p.hex("data");
+            std::string password = p.str("password");
+            std::string label = p.str("label", "");
+            if (!p.ok()) return Result<void>::Ok();
+            return finish(p, lib_.importPkcs12(data, password, label), w, writePkcs12Import);
+        }
+        if (method == "importPkcs12Directory") {
+            std::string path = p.str("path");
+            std::string password = p.str("password");
+            if (!p.ok()) return Result<void>::Ok();
+            return finish(p, lib_.importPkcs12Directory(path, password), w,
+                          [](JsonWriter& out, const std::vector<Pkcs12FileImport>& files) {
+                out.beginArray();
+                for (const auto& file : files) {
+                    out.beginObject().field("path", file.path).field("ok", file.result.isOk());
+                    if (file.result.isOk()) {
+                        out.key("result");
+                        writePkcs12Import(out, file.result.value);
+                    } else {
+                        out.key("error").beginObject();
+                        out.field("status", static_cast<int>(file.result.errorCode));
+                        out.field("rv", file.result.pkcs11Error).field("message", file.result.errorMessage);
+                        out.endObject();
+                    }
+                    out.endObject();
+                }
+                out.endArray();
+            });
+        }
+        if (method == "transmitAPDU") {
+            auto command = p.hex("command");
+            if (!p.ok()) return Result<void>::Ok();
+            return finish(p, lib_.transmitAPDU(command), w, hexAs("response"));
+        }
+        if (method.compare(0, 2, "kv") == 0) {
+            return dispatchStore(method, p, w);
+        }
+        return Result<void>::Error(Status::ERROR_UNSUPPORTED_OPERATION, "Unknown method " + method);
+    }
+
+    Result<void> dispatchStore(const std::string& method, Params& p, JsonWriter& w) {
+        std::string application = p.str("application", KeyValueStoreConfig().application);
+        if (method == "kvGet") {
+            std::string key = p.str("key");
+            if (!p.ok()) return Result<void>::Ok();
+            return finish(p, store(application).get(key), w, [](JsonWriter& out, const std::vector<CK_BYTE>& value) {
+                hexResult(out, "value", value);
+            });
+        }
+        if (method == "kvPut") {
+            std::string key = p.str("key");
+            auto value = p.hex("value");
+            return p.ok() ? store(application).put(key, value) : Result<void>::Ok();
+        }
+        if (method == "kvRemove") {
+            std::string key = p.str("key");
+            return p.ok() ? store(application).remove(key) : Result<void>::Ok();
+        }
+        if (method == "kvKeys") {
+            if (!p.ok()) return Result<void>::Ok();
+            return finish(p, store(application).keys(), w, [](JsonWriter& out, const std::vector<std::string>& keys) {
+                out.beginArray();
+                for (const auto& key : keys) {
+                    out.value(key);
+                }
+                out.endArray();
+            });
+        }
+        if (method == "kvFlush") {
+            return p.ok() ? store(application).flush() : Result<void>::Ok();
+        }
+        return Result<void>::Error(Status::ERROR_UNSUPPORTED_OPERATION, "Unknown method " + method);
+    }
+
+    TokenKeyValueStore& store(const std::string& application) {
+        auto& slot = stores_[application];
+        if (!slot) {
+            KeyValueStoreConfig config;
+            config.application = application;
+            slot = std::make_unique<TokenKeyValueStore>(lib_, config);
+        }
+        return *slot;
+    }
+
+    PKCS11Library lib_;
+    // After lib_: destroyed first, flushing into the still open session
+    std::map<std::string, std::unique_ptr<TokenKeyValueStore>> stores_;
+};
+
+// ---- framing -----------------------------------------------------------------
+
+bool readFull(int fd, void* data, size_t length) {
+    uint8_t* p = static_cast<uint8_t*>(data);
+    while (length > 0) {
+        ssize_t got = read(fd, p, length);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        p += got;
+        length -= static_cast<size_t>(got);
+    }
+    return true;
+}
+
+bool writeFull(int fd, const void* data, size_t length) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    while (length > 0) {
+        ssize_t sent = write(fd, p, length);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        p += sent;
+        length -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+// Serves one stream until it closes; false on a framing error
+bool serveStream(Server& server, int in, int out) {
+    std::string request;
+    for (;;) {
+        uint8_t prefix[4];
+        if (!readFull(in, prefix, sizeof(prefix))) {
+            return true;
+        }
+        uint32_t length = prefix[0] | prefix[1] << 8 | prefix[2] << 16 | uint32_t(prefix[3]) << 24;
+        if (length > MAX_REQUEST) {
+            fprintf(stderr, "[token-serve] request of %u bytes exceeds the limit\n", length);
+            return false;
+        }
+        request.resize(length);
+        if (length && !readFull(in, &request[0], length)) {
+            return false;
+        }
+
+        std::string response = server.handle(request);
+        uint32_t size = static_cast<uint32_t>(response.size());
+        uint8_t header[4] = {uint8_t(size), uint8_t(size >> 8), uint8_t(size >> 16), uint8_t(size >> 24)};
+        if (!writeFull(out, header, sizeof(header)) || !writeFull(out, response.data(), response.size())) {
+            return false;
+        }
+    }
+}
+
+int serveSocket(Server& server, const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        fprintf(stderr, "[token-serve] socket path too long\n");
+        return 1;
+    }
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path.c_str());
+    mode_t previous = umask(0077);
+    bool bound = listenFd >= 0 && bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+    umask(previous);
+    if (!bound || listen(listenFd, 4) != 0) {
+        fprintf(stderr, "[token-serve] cannot listen on %s: %s\n", path.c_str(), strerror(errno));
+        return 1;
+    }
+
+    for (;;) {
+        int client = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        serveStream(server, client, client);
+        close(client);
+    }
+    close(listenFd);
+    unlink(path.c_str());
+    return 1;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::string library;
+    std::string socketPath;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "missing value for %s\n", arg.c_str());
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--library") {
+            library = value;
+        } else if (arg == "--socket") {
+            socketPath = value;
+        } else {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return 2;
+        }
+    }
+    if (library.empty()) {
+        fprintf(stderr, "--library is required\n");
+        return 2;
+    }
+
+    Server server;
+    auto initialized = server.initialize(library);
+    if (!initialized.isOk()) {
+        fprintf(stderr, "[token-serve] cannot initialize %s: %s\n", library.c_str(), initialized.errorMessage.c_str());
+        return 1;
+    }
+
+    if (!socketPath.empty()) {
+        return serveSocket(server, socketPath);
+    }
+    return serveStream(server, STDIN_FILENO, STDOUT_FILENO) ? 0 : 1;
+}
@@ -0,0 +1,418 @@
+// PKCS#11 interposer that records every call to a binary trace file.
+//
+// Build as a shared library and load it in place of the vendor module, e.g.
+//   PKCS11Library::initialize("/usr/local/lib/libp11trace.so")
+// Environment:
+//   P11_TRACE_TARGET     real module (default libshuttle_p11v220.so.1.0.0)
+//   P11_TRACE_FILE       output path (default /tmp/p11trace-<pid>.bin)
+//   P11_TRACE_RING_SIZE  records buffered in memory (power of two, default 65536)
+//   P11_TRACE_PAYLOADS   1 to also record call outputs, so the trace can be
+//                        replayed with libp11replay.so (Token/replay)
+//
+// Calling threads only push a 64-byte record into a lock-free ring; a
+// background thread drains it to disk. If the ring is full the record is
+// dropped (and counted) rather than stalling the token caller.
+
+#include "p11_trace_capture.h"
+#include "p11_trace_format.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dlfcn.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define P11_SHIM_EXPORT __attribute__((visibility("default")))
+
+using namespace PKCS11Lib;
+
+namespace {
+
+uint64_t monotonicNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t realtimeNs() {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+uint32_t currentThreadId() {
+    thread_local uint32_t tid = static_cast<uint32_t>(syscall(SYS_gettid));
+    return tid;
+}
+
+// Bounded multi-producer / single-consumer ring (Vyukov sequence cells)
+class TraceRing {
+public:
+    explicit TraceRing(size_t capacity) : cells_(capacity), mask_(capacity - 1),
+                                          enqueuePos_(0), dequeuePos_(0) {
+        for (size_t i = 0; i < capacity; i++) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool push(const TraceRecord& record) {
+        size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false; // Full
+            } else {
+                pos = enqueuePos_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->record = record;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(TraceRecord& record) {
+        Cell* cell = &cells_[dequeuePos_ & mask_];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        if (static_cast<intptr_t>(sequence) - static_cast<intptr_t>(dequeuePos_ + 1) < 0) {
+            return false; // Empty
+        }
+        record = cell->record;
+        cell->sequence.store(dequeuePos_ + mask_ + 1, std::memory_order_release);
+        dequeuePos_++;
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        TraceRecord record;
+    };
+
+    std::vector<Cell> cells_;
+    const size_t mask_;
+    alignas(64) std::atomic<size_t> enqueuePos_;
+    alignas(64) size_t dequeuePos_;
+};
+
+class Tracer {
+public:
+    ~Tracer() {
+        stop();
+        if (library_) {
+            dlclose(library_);
+        }
+    }
+
+    CK_RV load() {
+        std::call_once(loadOnce_, [this] { loadResult_ = doLoad(); });
+        return loadResult_;
+    }
+
+    CK_FUNCTION_LIST_PTR real() const { return realList_; }
+    AUX_FUNC_LIST_PTR realAux() const { return realAux_; }
+    CK_FUNCTION_LIST_PTR wrapped() { return &wrappedList_; }
+    AUX_FUNC_LIST_PTR wrappedAux() { return realAux_ ? &wrappedAux_ : nullptr; }
+
+    void emit(const TraceRecord& record) {
+        if (!ring_ || !ring_->push(record)) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t start() const { return startNs_; }
+    bool capturePayloads() const { return capturePayloads_; }
+
+    void flush() {
+        std::lock_guard<std::mutex> lock(writeMutex_);
+        drain();
+        if (file_) {
+            fflush(file_);
+        }
+    }
+
+private:
+    std::once_flag loadOnce_;
+    CK_RV loadResult_ = CKR_GENERAL_ERROR;
+    void* library_ = nullptr;
+    CK_FUNCTION_LIST_PTR realList_ = nullptr;
+    AUX_FUNC_LIST_PTR realAux_ = nullptr;
+    CK_FUNCTION_LIST wrappedList_{};
+    AUX_FUNC_LIST wrappedAux_{};
+
+    std::unique_ptr<TraceRing> ring_;
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<bool> running_{false};
+    std::thread writer_;
+    std::mutex writeMutex_;
+    FILE* file_ = nullptr;
+    uint64_t startNs_ = 0;
+    bool capturePayloads_ = false;
+
+    CK_RV doLoad();
+    void buildWrappedLists();
+    void writerLoop();
+    void drain();
+    void stop();
+};
+
+Tracer tracer;
+
+// ---- argument capture -------------------------------------------------------
+
+// Splits a serialized payload into records that follow the call record
+void emitPayload(P11Function function, const std::vector<uint8_t>& payload) {
+    for (size_t offset = 0; offset < payload.size(); offset += TRACE_PAYLOAD_CHUNK) {
+        TracePayloadRecord chunk{};
+        chunk.totalLength = static_cast<uint32_t>(payload.size());
+        chunk.offset = static_cast<uint32_t>(offset);
+        chunk.threadId = currentThreadId();
+        chunk.function = static_cast<uint16_t>(function);
+        chunk.kind = static_cast<uint16_t>(TraceRecordKind::Payload);
+        memcpy(chunk.data, payload.data() + offset, std::min(TRACE_PAYLOAD_CHUNK, payload.size() - offset));
+
+        TraceRecord record;
+        memcpy(&record, &chunk, sizeof(record));
+        tracer.emit(record);
+    }
+}
+
+template<P11Function Id, typename... A>
+void emitCall(uint64_t start, uint64_t end, CK_RV rv, A... args) {
+    TraceRecord record{};
+    record.startNs = start - tracer.start();
+    record.durationNs = end - start;
+    record.threadId = currentThreadId();
+    record.function = static_cast<uint16_t>(Id);
+    record.kind = static_cast<uint16_t>(TraceRecordKind::Call);
+    record.rv = rv;
+    captureScalarArgs(record.args, args...);
+    CallBytes bytes = measureCallBytes(Id, rv, args...);
+    record.bytesIn = static_cast<uint32_t>(std::min<uint64_t>(bytes.in, UINT32_MAX));
+    record.bytesOut = static_cast<uint32_t>(std::min<uint64_t>(bytes.out, UINT32_MAX));
+    tracer.emit(record);
+
+    if (tracer.capturePayloads()) {
+        PayloadWriter writer(rv == CKR_OK);
+        visitOutputs(FunctionTag<Id>(), writer, args...);
+        emitPayload(Id, writer.data());
+    }
+}
+
+// ---- thunks -----------------------------------------------------------------
+
+template<typename F, F CK_FUNCTION_LIST::*Member, P11Function Id>
+struct Thunk;
+
+template<typename... A, CK_RV (*CK_FUNCTION_LIST::*Member)(A...), P11Function Id>
+struct Thunk<CK_RV (*)(A...), Member, Id> {
+    static CK_RV invoke(A... args) {
+        CK_FUNCTION_LIST_PTR real = tracer.real();
+        if (!real || !(real->*Member)) {
+            return CKR_FUNCTION_NOT_SUPPORTED;
+        }
+        uint64_t start = monotonicNs();
+        CK_RV rv = (real->*Member)(args...);
+        emitCall<Id>(start, monotonicNs(), rv, args...);
+        if (Id == P11Function::C_Finalize) {
+            tracer.flush();
+        }
+        return rv;
+    }
+};
+
+template<typename F, size_t Index, P11Function Id>
+struct AuxThunk;
+
+template<typename... A, size_t Index, P11Function Id>
+struct AuxThunk<CK_RV (*)(A...), Index, Id> {
+    static CK_RV invoke(A... args) {
+        auto real = reinterpret_cast<CK_RV (*)(A...)>(tracer.realAux()->pFunc[Index]);
+        uint64_t start = monotonicNs();
+        CK_RV rv = real(args...);
+        emitCall<Id>(start, monotonicNs(), rv, args...);
+        return rv;
+    }
+};
+
+// ---- Tracer -----------------------------------------------------------------
+
+CK_RV Tracer::doLoad() {
+    const char* target = getenv("P11_TRACE_TARGET");
+    if (!target || !*target) {
+        target = "libshuttle_p11v220.so.1.0.0";
+    }
+
+    library_ = dlopen(target, RTLD_NOW | RTLD_LOCAL);
+    if (!library_) {
+        fprintf(stderr, "[p11trace] failed to load %s: %s\n", target, dlerror());
+        return CKR_GENERAL_ERROR;
+    }
+
+    auto getFunctionList = (CK_C_GetFunctionList)dlsym(library_, "C_GetFunctionList");
+    if (!getFunctionList || getFunctionList(&realList_) != CKR_OK || !realList_) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    auto getAuxFunctionList = (EP_GetAuxFunctionList)dlsym(library_, "E_GetAuxFunctionList");
+    if (getAuxFunctionList && getAuxFunctionList(&realAux_) != CKR_OK) {
+        realAux_ = nullptr;
+    }
+
+    buildWrappedLists();
+
+    size_t ringSize = 65536;
+    if (const char* env = getenv("P11_TRACE_RING_SIZE")) {
+        size_t requested = strtoull(env, nullptr, 10);
+        if (requested >= 2) {
+            ringSize = 1;
+            while (ringSize < requested) {
+                ringSize <<= 1;
+            }
+        }
+    }
+    ring_.reset(new TraceRing(ringSize));
+
+    if (const char* env = getenv("P11_TRACE_PAYLOADS")) {
+        capturePayloads_ = env[0] == '1';
+    }
+
+    std::string path;
+    if (const char* env = getenv("P11_TRACE_FILE")) {
+        path = env;
+    } else {
+        path = "/tmp/p11trace-" + std::to_string(getpid()) + ".bin";
+    }
+
+    file_ = fopen(path.c_str(), "wb");
+    if (!file_) {
+        fprintf(stderr, "[p11trace] cannot open %s, tracing disabled\n", path.c_str());
+        return CKR_OK; // Still forward calls
+    }
+
+    TraceFileHeader header{};
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.recordSize = sizeof(TraceRecord);
+    header.startRealtimeNs = realtimeNs();
+    header.pid = static_cast<uint32_t>(getpid());
+    strncpy(header.targetLibrary, target, sizeof(header.targetLibrary) - 1);
+    fwrite(&header, sizeof(header), 1, file_);
+
+    startNs_ = monotonicNs();
+    running_ = true;
+    writer_ = std::thread(&Tracer::writerLoop, this);
+    return CKR_OK;
+}
+
+void Tracer::buildWrappedLists() {
+    wrappedList_.version = realList_->version;
+#define CK_PKCS11_FUNCTION_INFO(name) \
+    wrappedList_.name = &Thunk<decltype(CK_FUNCTION_LIST::name), &CK_FUNCTION_LIST::name, P11Function::name>::invoke;
+#include "pkcs11f.h"
+#undef CK_PKCS11_FUNCTION_INFO
+    wrappedList_.C_GetFunctionList = C_GetFunctionList;
+
+    if (realAux_) {
+        wrappedAux_.version = realAux_->version;
+#define P11_AUX_WRAP(name, index) \
+        wrappedAux_.pFunc[index] = realAux_->pFunc[index] ? \
+            reinterpret_cast<void*>(&AuxThunk<name, index, P11Function::name>::invoke) : nullptr;
+        P11_AUX_FUNCTIONS(P11_AUX_WRAP)
+#undef P11_AUX_WRAP
+    }
+}
+
+void Tracer::drain() {
+    if (!ring_) {
+        return;
+    }
+    TraceRecord batch[256];
+    size_t count;
+    do {
+        count = 0;
+        while (count < 256 && ring_->pop(batch[count])) {
+            count++;
+        }
+        if (count && file_) {
+            fwrite(batch, sizeof(TraceRecord), count, file_);
+        }
+    } while (count == 256);
+}
+
+void Tracer::writerLoop() {
+    while (running_.load(std::memory_order_acquire)) {
+        {
+            std::lock_guard<std::mutex> lock(writeMutex_);
+            drain();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+}
+
+void Tracer::stop() {
+    if (running_.exchange(false) && writer_.joinable()) {
+        writer_.join();
+    }
+
+    std::lock_guard<std::mutex> lock(writeMutex_);
+    drain();
+    if (file_) {
+        uint32_t dropped = static_cast<uint32_t>(dropped_.load());
+        fseek(file_, offsetof(TraceFileHeader, droppedRecords), SEEK_SET);
+        fwrite(&dropped, sizeof(dropped), 1, file_);
+        fclose(file_);
+        file_ = nullptr;
+    }
+}
+
+} // namespace
+
+extern "C" {
+
+P11_SHIM_EXPORT CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList) {
+    if (!ppFunctionList) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    CK_RV rv = tracer.load();
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    *ppFunctionList = tracer.wrapped();
+    return CKR_OK;
+}
+
+P11_SHIM_EXPORT CK_RV E_GetAuxFunctionList(AUX_FUNC_LIST_PTR_PTR pAuxFunc) {
+    if (!pAuxFunc) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    CK_RV rv = tracer.load();
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!tracer.wrappedAux()) {
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    }
+    *pAuxFunc = tracer.wrappedAux();
+    return CKR_OK;
+}
+
+} // extern "C"
@@ -0,0 +1,138 @@
+#include "latency_model.h"
+
+#include <cstdlib>
+#include <thread>
+
+namespace SoftToken {
+
+namespace {
+
+struct DefaultCost {
+    const char* operation;
+    OperationCost cost;
+};
+
+// Rough ePass3003 figures over USB full-speed CCID. RSA private operations
+// dominate, key generation varies widely with the prime search, and every
+// command pays a round trip plus ~25 KB/s of APDU transfer.
+const DefaultCost DEFAULT_PROFILE[] = {
+    {"transport",          {1200, 40000, 10}},
+    {"transport.txn",      {700, 40000, 10}},  // No reselect/reauth inside a card transaction
+    {"info",               {300, 0, 5}},
+    {"session",            {2000, 0, 10}},
+    {"login",              {35000, 0, 10}},
+    {"pin",                {60000, 0, 10}},    // PIN change rewrites EEPROM
+    {"find",               {4000, 0, 10}},
+    {"find.object",        {1500, 0, 10}},
+    {"attribute.get",      {2000, 0, 10}},
+    {"attribute.set",      {25000, 0, 10}},
+    {"object.create",      {60000, 0, 15}},
+    {"object.destroy",     {30000, 0, 15}},
+    {"keygen.rsa.1024",    {2500000, 0, 60}},
+    {"keygen.rsa.2048",    {14000000, 0, 60}},
+    {"keygen.rsa",         {14000000, 0, 60}},
+    {"keygen.ec",          {600000, 0, 20}},
+    {"keygen.secret",      {40000, 0, 10}},
+    {"sign.rsa.1024",      {110000, 0, 5}},
+    {"sign.rsa.2048",      {420000, 0, 5}},
+    {"sign.rsa",           {420000, 0, 5}},
+    {"sign.ec",            {160000, 0, 5}},
+    {"verify.rsa",         {25000, 0, 5}},
+    {"verify.ec",          {180000, 0, 5}},
+    {"encrypt.rsa",        {25000, 0, 5}},
+    {"decrypt.rsa.1024",   {110000, 0, 5}},
+    {"decrypt.rsa.2048",   {420000, 0, 5}},
+    {"decrypt.rsa",        {420000, 0, 5}},
+    {"encrypt.secret",     {3000, 5000, 5}},
+    {"decrypt.secret",     {3000, 5000, 5}},
+    {"random",             {2000, 2000, 5}},
+    {"apdu",               {1000, 0, 10}},
+};
+
+} // namespace
+
+LatencyModel::LatencyModel() : scale_(1.0), rng_(0x5EED) {
+    for (const auto& entry : DEFAULT_PROFILE) {
+        costs_[entry.operation] = entry.cost;
+    }
+}
+
+bool LatencyModel::set(const std::string& key, const std::string& value) {
+    char* end = nullptr;
+    double number = strtod(value.c_str(), &end);
+    if (value.empty() || end == value.c_str()) {
+        return false;
+    }
+
+    if (key == "scale") {
+        setScale(number);
+        return true;
+    }
+
+    size_t dot = key.rfind('.');
+    if (dot == std::string::npos || dot == 0) {
+        return false;
+    }
+
+    std::string operation = key.substr(0, dot);
+    std::string field = key.substr(dot + 1);
+    OperationCost& cost = costs_[operation];
+    if (field == "fixed_us") {
+        cost.fixedUs = number;
+    } else if (field == "per_byte_ns") {
+        cost.perByteNs = number;
+    } else if (field == "jitter_pct") {
+        cost.jitterPct = number;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const OperationCost* LatencyModel::lookup(std::string operation) const {
+    while (!operation.empty()) {
+        auto it = costs_.find(operation);
+        if (it != costs_.end()) {
+            return &it->second;
+        }
+        size_t dot = operation.rfind('.');
+        if (dot == std::string::npos) {
+            break;
+        }
+        operation.resize(dot);
+    }
+    return nullptr;
+}
+
+double LatencyModel::sample(const OperationCost& cost, size_t bytes) {
+    double nanos = cost.fixedUs * 1000.0 + cost.perByteNs * static_cast<double>(bytes);
+    if (cost.jitterPct > 0) {
+        std::uniform_real_distribution<double> jitter(-cost.jitterPct / 100.0, cost.jitterPct / 100.0);
+        nanos *= 1.0 + jitter(rng_);
+    }
+    return nanos > 0 ? nanos : 0;
+}
+
+std::chrono::nanoseconds LatencyModel::cost(const std::string& operation, size_t bytes, bool inTransaction) {
+    if (scale_ == 0) {
+        return std::chrono::nanoseconds(0);
+    }
+
+    double nanos = 0;
+    if (const OperationCost* transport = lookup(inTransaction ? "transport.txn" : "transport")) {
+        nanos += sample(*transport, bytes);
+    }
+    if (const OperationCost* op = lookup(operation)) {
+        nanos += sample(*op, bytes);
+    }
+    return std::chrono::nanoseconds(static_cast<long long>(nanos * scale_));
+}
+
+void LatencyModel::apply(const std::string& operation, size_t bytes, bool inTransaction) {
+    auto delay = cost(operation, bytes, inTransaction);
+    if (delay.count() > 0) {
+        std::this_thread::sleep_for(delay);
+    }
+}
+
+} // namespace SoftToken
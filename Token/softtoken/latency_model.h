@@ -0,0 +1,56 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <random>
+#include <string>
+
+namespace SoftToken {
+
+// Cost of one token operation: a fixed part (command processing, EEPROM
+// writes, on-card crypto) plus a per-byte part (the USB/APDU link).
+struct OperationCost {
+    double fixedUs = 0;
+    double perByteNs = 0;
+    double jitterPct = 0;
+};
+
+// Maps operation names to costs. Names are dotted and looked up from the most
+// specific form down, so "sign.rsa.2048" falls back to "sign.rsa" and then
+// "sign". The "transport" cost (or "transport.txn" while a card transaction is
+// held) is added to every operation that reaches the device.
+//
+// Profile syntax, one setting per line, '#' starts a comment:
+//   scale = 0.5
+//   sign.rsa.2048.fixed_us = 420000
+//   transport.per_byte_ns = 40000
+//   keygen.rsa.jitter_pct = 60
+// The same file also carries token.* settings (see TokenConfig).
+class LatencyModel {
+public:
+    LatencyModel();
+
+    // Returns false if `key` is not a latency setting or `value` does not parse
+    bool set(const std::string& key, const std::string& value);
+
+    void setScale(double scale) { scale_ = scale < 0 ? 0 : scale; }
+    double scale() const { return scale_; }
+
+    void seed(unsigned long long value) { rng_.seed(value); }
+
+    std::chrono::nanoseconds cost(const std::string& operation, size_t bytes, bool inTransaction);
+
+    // Blocks the calling thread for cost(...)
+    void apply(const std::string& operation, size_t bytes, bool inTransaction);
+
+private:
+    const OperationCost* lookup(std::string operation) const;
+    double sample(const OperationCost& cost, size_t bytes);
+
+    std::map<std::string, OperationCost> costs_;
+    double scale_;
+    std::mt19937_64 rng_;
+};
+
+} // namespace SoftToken
@@ -0,0 +1,478 @@
+#include "soft_crypto.h"
+
+#include <openssl/bn.h>
+#include <openssl/core_names.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/param_build.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+
+#include <cstring>
+
+namespace SoftToken {
+
+const Bytes P256_EC_PARAMS = {0x06, 0x08, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x03, 0x01, 0x07};
+
+namespace {
+
+struct PkeyCtxDeleter {
+    void operator()(EVP_PKEY_CTX* ctx) const { EVP_PKEY_CTX_free(ctx); }
+};
+struct MdCtxDeleter {
+    void operator()(EVP_MD_CTX* ctx) const { EVP_MD_CTX_free(ctx); }
+};
+struct CipherCtxDeleter {
+    void operator()(EVP_CIPHER_CTX* ctx) const { EVP_CIPHER_CTX_free(ctx); }
+};
+struct BnDeleter {
+    void operator()(BIGNUM* bn) const { BN_clear_free(bn); }
+};
+struct ParamBldDeleter {
+    void operator()(OSSL_PARAM_BLD* bld) const { OSSL_PARAM_BLD_free(bld); }
+};
+struct ParamDeleter {
+    void operator()(OSSL_PARAM* params) const { OSSL_PARAM_free(params); }
+};
+
+using PkeyCtx = std::unique_ptr<EVP_PKEY_CTX, PkeyCtxDeleter>;
+using MdCtx = std::unique_ptr<EVP_MD_CTX, MdCtxDeleter>;
+using CipherCtx = std::unique_ptr<EVP_CIPHER_CTX, CipherCtxDeleter>;
+using BigNum = std::unique_ptr<BIGNUM, BnDeleter>;
+
+KeyPtr wrapKey(EVP_PKEY* key) {
+    return KeyPtr(key, EVP_PKEY_free);
+}
+
+BigNum toBigNum(const Bytes& bytes) {
+    return BigNum(BN_bin2bn(bytes.data(), static_cast<int>(bytes.size()), nullptr));
+}
+
+Bytes fromBigNum(const BIGNUM* bn) {
+    Bytes bytes(BN_num_bytes(bn));
+    BN_bn2bin(bn, bytes.data());
+    return bytes;
+}
+
+const EVP_MD* mechanismDigest(CK_MECHANISM_TYPE mechanism) {
+    switch (mechanism) {
+        case CKM_MD5_RSA_PKCS: return EVP_md5();
+        case CKM_SHA1_RSA_PKCS: return EVP_sha1();
+        case CKM_SHA224_RSA_PKCS: return EVP_sha224();
+        case CKM_SHA256_RSA_PKCS: return EVP_sha256();
+        case CKM_SHA384_RSA_PKCS: return EVP_sha384();
+        case CKM_SHA512_RSA_PKCS: return EVP_sha512();
+        default: return nullptr;
+    }
+}
+
+CK_RV fromData(const char* type, int selection, OSSL_PARAM_BLD* bld, KeyPtr& key) {
+    std::unique_ptr<OSSL_PARAM, ParamDeleter> params(OSSL_PARAM_BLD_to_param(bld));
+    PkeyCtx ctx(EVP_PKEY_CTX_new_from_name(nullptr, type, nullptr));
+    EVP_PKEY* pkey = nullptr;
+    if (!params || !ctx || EVP_PKEY_fromdata_init(ctx.get()) != 1 ||
+        EVP_PKEY_fromdata(ctx.get(), &pkey, selection, params.get()) != 1) {
+        return CKR_ATTRIBUTE_VALUE_INVALID;
+    }
+    key = wrapKey(pkey);
+    return CKR_OK;
+}
+
+// ECDSA_SIG <-> fixed-width r || s
+bool derToRaw(const Bytes& der, Bytes& raw) {
+    const unsigned char* p = der.data();
+    ECDSA_SIG* sig = d2i_ECDSA_SIG(nullptr, &p, static_cast<long>(der.size()));
+    if (!sig) {
+        return false;
+    }
+    raw.assign(P256_SIGNATURE_LEN, 0);
+    const BIGNUM* r = ECDSA_SIG_get0_r(sig);
+    const BIGNUM* s = ECDSA_SIG_get0_s(sig);
+    bool ok = BN_bn2binpad(r, raw.data(), 32) == 32 && BN_bn2binpad(s, raw.data() + 32, 32) == 32;
+    ECDSA_SIG_free(sig);
+    return ok;
+}
+
+bool rawToDer(const Bytes& raw, Bytes& der) {
+    ECDSA_SIG* sig = ECDSA_SIG_new();
+    BIGNUM* r = BN_bin2bn(raw.data(), 32, nullptr);
+    BIGNUM* s = BN_bin2bn(raw.data() + 32, 32, nullptr);
+    if (!sig || !r || !s || ECDSA_SIG_set0(sig, r, s) != 1) {
+        BN_free(r);
+        BN_free(s);
+        ECDSA_SIG_free(sig);
+        return false;
+    }
+    int len = i2d_ECDSA_SIG(sig, nullptr);
+    der.resize(len > 0 ? len : 0);
+    unsigned char* p = der.data();
+    bool ok = len > 0 && i2d_ECDSA_SIG(sig, &p) == len;
+    ECDSA_SIG_free(sig);
+    return ok;
+}
+
+const EVP_CIPHER* symmetricCipher(CK_MECHANISM_TYPE mechanism, size_t keyLen) {
+    switch (mechanism) {
+        case CKM_AES_ECB:
+            return keyLen == 16 ? EVP_aes_128_ecb() : keyLen == 24 ? EVP_aes_192_ecb() :
+                   keyLen == 32 ? EVP_aes_256_ecb() : nullptr;
+        case CKM_AES_CBC:
+        case CKM_AES_CBC_PAD:
+            return keyLen == 16 ? EVP_aes_128_cbc() : keyLen == 24 ? EVP_aes_192_cbc() :
+                   keyLen == 32 ? EVP_aes_256_cbc() : nullptr;
+        case CKM_DES3_ECB:
+            return keyLen == 24 ? EVP_des_ede3_ecb() : nullptr;
+        case CKM_DES3_CBC:
+        case CKM_DES3_CBC_PAD:
+            return keyLen == 24 ? EVP_des_ede3_cbc() : nullptr;
+        default:
+            return nullptr;
+    }
+}
+
+size_t blockSize(CK_MECHANISM_TYPE mechanism) {
+    switch (mechanism) {
+        case CKM_DES3_ECB:
+        case CKM_DES3_CBC:
+        case CKM_DES3_CBC_PAD:
+            return 8;
+        default:
+            return 16;
+    }
+}
+
+bool isPadded(CK_MECHANISM_TYPE mechanism) {
+    return mechanism == CKM_AES_CBC_PAD || mechanism == CKM_DES3_CBC_PAD;
+}
+
+bool isEcb(CK_MECHANISM_TYPE mechanism) {
+    return mechanism == CKM_AES_ECB || mechanism == CKM_DES3_ECB;
+}
+
+} // namespace
+
+CK_RV generateRsaKey(CK_ULONG modulusBits, const Bytes& publicExponent, KeyPtr& key) {
+    PkeyCtx ctx(EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr));
+    if (!ctx || EVP_PKEY_keygen_init(ctx.get()) != 1 ||
+        EVP_PKEY_CTX_set_rsa_keygen_bits(ctx.get(), static_cast<int>(modulusBits)) != 1) {
+        return CKR_FUNCTION_FAILED;
+    }
+
+    if (!publicExponent.empty()) {
+        BIGNUM* e = BN_bin2bn(publicExponent.data(), static_cast<int>(publicExponent.size()), nullptr);
+        // set1 takes a copy, so e is ours to free either way
+        if (!e || EVP_PKEY_CTX_set1_rsa_keygen_pubexp(ctx.get(), e) != 1) {
+            BN_free(e);
+            return CKR_TEMPLATE_INCONSISTENT;
+        }
+        BN_free(e);
+    }
+
+    EVP_PKEY* pkey = nullptr;
+    if (EVP_PKEY_keygen(ctx.get(), &pkey) != 1) {
+        return CKR_FUNCTION_FAILED;
+    }
+    key = wrapKey(pkey);
+    return CKR_OK;
+}
+
+CK_RV generateEcKey(KeyPtr& key) {
+    PkeyCtx ctx(EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr));
+    if (!ctx || EVP_PKEY_keygen_init(ctx.get()) != 1 ||
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx.get(), NID_X9_62_prime256v1) != 1) {
+        return CKR_FUNCTION_FAILED;
+    }
+
+    EVP_PKEY* pkey = nullptr;
+    if (EVP_PKEY_keygen(ctx.get(), &pkey) != 1) {
+        return CKR_FUNCTION_FAILED;
+    }
+    key = wrapKey(pkey);
+    return CKR_OK;
+}
+
+CK_RV rsaComponents(EVP_PKEY* key, Bytes& modulus, Bytes& publicExponent) {
+    BIGNUM* n = nullptr;
+    BIGNUM* e = nullptr;
+    if (EVP_PKEY_get_bn_param(key, OSSL_PKEY_PARAM_RSA_N, &n) != 1 ||
+        EVP_PKEY_get_bn_param(key, OSSL_PKEY_PARAM_RSA_E, &e) != 1) {
+        BN_free(n);
+        return CKR_FUNCTION_FAILED;
+    }
+    modulus = fromBigNum(n);
+    publicExponent = fromBigNum(e);
+    BN_free(n);
+    BN_free(e);
+    return CKR_OK;
+}
+
+CK_RV ecPoint(EVP_PKEY* key, Bytes& point) {
+    size_t len = 0;
+    if (EVP_PKEY_get_octet_string_param(key, OSSL_PKEY_PARAM_PUB_KEY, nullptr, 0, &len) != 1 || len > 127) {
+        return CKR_FUNCTION_FAILED;
+    }
+
+    point.assign(2 + len, 0);
+    point[0] = 0x04; // OCTET STRING
+    point[1] = static_cast<CK_BYTE>(len);
+    if (EVP_PKEY_get_octet_string_param(key, OSSL_PKEY_PARAM_PUB_KEY, point.data() + 2, len, &len) != 1) {
+        return CKR_FUNCTION_FAILED;
+    }
+    return CKR_OK;
+}
+
+CK_RV importRsaPublicKey(const Bytes& modulus, const Bytes& publicExponent, KeyPtr& key) {
+    std::unique_ptr<OSSL_PARAM_BLD, ParamBldDeleter> bld(OSSL_PARAM_BLD_new());
+    BigNum n = toBigNum(modulus);
+    BigNum e = toBigNum(publicExponent);
+    if (!bld || !n || !e ||
+        OSSL_PARAM_BLD_push_BN(bld.get(), OSSL_PKEY_PARAM_RSA_N, n.get()) != 1 ||
+        OSSL_PARAM_BLD_push_BN(bld.get(), OSSL_PKEY_PARAM_RSA_E, e.get()) != 1) {
+        return CKR_HOST_MEMORY;
+    }
+    return fromData("RSA", EVP_PKEY_PUBLIC_KEY, bld.get(), key);
+}
+
+CK_RV importRsaPrivateKey(const Bytes& modulus, const Bytes& publicExponent, const Bytes& privateExponent,
+                          const Bytes& prime1, const Bytes& prime2, const Bytes& exponent1,
+                          const Bytes& exponent2, const Bytes& coefficient, KeyPtr& key) {
+    std::unique_ptr<OSSL_PARAM_BLD, ParamBldDeleter> bld(OSSL_PARAM_BLD_new());
+    if (!bld) {
+        return CKR_HOST_MEMORY;
+    }
+
+    const std::pair<const char*, const Bytes*> components[] = {
+        {OSSL_PKEY_PARAM_RSA_N, &modulus},
+        {OSSL_PKEY_PARAM_RSA_E, &publicExponent},
+        {OSSL_PKEY_PARAM_RSA_D, &privateExponent},
+        {OSSL_PKEY_PARAM_RSA_FACTOR1, &prime1},
+        {OSSL_PKEY_PARAM_RSA_FACTOR2, &prime2},
+        {OSSL_PKEY_PARAM_RSA_EXPONENT1, &exponent1},
+        {OSSL_PKEY_PARAM_RSA_EXPONENT2, &exponent2},
+        {OSSL_PKEY_PARAM_RSA_COEFFICIENT1, &coefficient},
+    };
+
+    // The builder references the BIGNUMs until to_param, so keep them alive
+    std::vector<BigNum> values;
+    for (const auto& component : components) {
+        if (component.second->empty()) {
+            continue; // CRT parameters are optional
+        }
+        values.push_back(toBigNum(*component.second));
+        if (!values.back() || OSSL_PARAM_BLD_push_BN(bld.get(), component.first, values.back().get()) != 1) {
+            return CKR_HOST_MEMORY;
+        }
+    }
+    return fromData("RSA", EVP_PKEY_KEYPAIR, bld.get(), key);
+}
+
+CK_RV importEcPublicKey(const Bytes& point, KeyPtr& key) {
+    // Accept both the DER OCTET STRING form and a bare uncompressed point
+    Bytes raw = point;
+    if (raw.size() == 67 && raw[0] == 0x04 && raw[1] == 65) {
+        raw.erase(raw.begin(), raw.begin() + 2);
+    }
+    if (raw.size() != 65 || raw[0] != 0x04) {
+        return CKR_ATTRIBUTE_VALUE_INVALID;
+    }
+
+    std::unique_ptr<OSSL_PARAM_BLD, ParamBldDeleter> bld(OSSL_PARAM_BLD_new());
+    if (!bld ||
+        OSSL_PARAM_BLD_push_utf8_string(bld.get(), OSSL_PKEY_PARAM_GROUP_NAME, "prime256v1", 0) != 1 ||
+        OSSL_PARAM_BLD_push_octet_string(bld.get(), OSSL_PKEY_PARAM_PUB_KEY, raw.data(), raw.size()) != 1) {
+        return CKR_HOST_MEMORY;
+    }
+    return fromData("EC", EVP_PKEY_PUBLIC_KEY, bld.get(), key);
+}
+
+size_t outputLength(EVP_PKEY* key) {
+    if (EVP_PKEY_get_base_id(key) == EVP_PKEY_EC) {
+        return P256_SIGNATURE_LEN;
+    }
+    return static_cast<size_t>(EVP_PKEY_get_size(key));
+}
+
+CK_ULONG keyBits(EVP_PKEY* key) {
+    return static_cast<CK_ULONG>(EVP_PKEY_get_bits(key));
+}
+
+CK_RV sign(EVP_PKEY* key, CK_MECHANISM_TYPE mechanism, const Bytes& data, Bytes& signature) {
+    if (mechanism == CKM_RSA_PKCS || mechanism == CKM_ECDSA) {
+        PkeyCtx ctx(EVP_PKEY_CTX_new(key, nullptr));
+        if (!ctx || EVP_PKEY_sign_init(ctx.get()) != 1) {
+            return CKR_FUNCTION_FAILED;
+        }
+        if (mechanism == CKM_RSA_PKCS) {
+            if (data.size() + 11 > outputLength(key)) {
+                return CKR_DATA_LEN_RANGE;
+            }
+            EVP_PKEY_CTX_set_rsa_padding(ctx.get(), RSA_PKCS1_PADDING);
+        }
+
+        size_t len = 0;
+        if (EVP_PKEY_sign(ctx.get(), nullptr, &len, data.data(), data.size()) != 1) {
+            return CKR_FUNCTION_FAILED;
+        }
+        Bytes out(len);
+        if (EVP_PKEY_sign(ctx.get(), out.data(), &len, data.data(), data.size()) != 1) {
+            return CKR_FUNCTION_FAILED;
+        }
+        out.resize(len);
+
+        if (mechanism == CKM_ECDSA) {
+            return derToRaw(out, signature) ? CKR_OK : CKR_FUNCTION_FAILED;
+        }
+        signature.swap(out);
+        return CKR_OK;
+    }
+
+    const EVP_MD* md = mechanismDigest(mechanism);
+    if (!md) {
+        return CKR_MECHANISM_INVALID;
+    }
+
+    MdCtx ctx(EVP_MD_CTX_new());
+    size_t len = 0;
+    if (!ctx || EVP_DigestSignInit(ctx.get(), nullptr, md, nullptr, key) != 1 ||
+        EVP_DigestSign(ctx.get(), nullptr, &len, data.data(), data.size()) != 1) {
+        return CKR_FUNCTION_FAILED;
+    }
+    signature.resize(len);
+    if (EVP_DigestSign(ctx.get(), signature.data(), &len, data.data(), data.size()) != 1) {
+        return CKR_FUNCTION_FAILED;
+    }
+    signature.resize(len);
+    return CKR_OK;
+}
+
+CK_RV verify(EVP_PKEY* key, CK_MECHANISM_TYPE mechanism, const Bytes& data, const Bytes& signature) {
+    if (signature.size() != outputLength(key)) {
+        return CKR_SIGNATURE_LEN_RANGE;
+    }
+
+    if (mechanism == CKM_RSA_PKCS || mechanism == CKM_ECDSA) {
+        Bytes sig = signature;
+        if (mechanism == CKM_ECDSA && !rawToDer(signature, sig)) {
+            return CKR_SIGNATURE_INVALID;
+        }
+
+        PkeyCtx ctx(EVP_PKEY_CTX_new(key, nullptr));
+        if (!ctx || EVP_PKEY_verify_init(ctx.get()) != 1) {
+            return CKR_FUNCTION_FAILED;
+        }
+        if (mechanism == CKM_RSA_PKCS) {
+            EVP_PKEY_CTX_set_rsa_padding(ctx.get(), RSA_PKCS1_PADDING);
+        }
+        return EVP_PKEY_verify(ctx.get(), sig.data(), sig.size(), data.data(), data.size()) == 1
+            ? CKR_OK : CKR_SIGNATURE_INVALID;
+    }
+
+    const EVP_MD* md = mechanismDigest(mechanism);
+    if (!md) {
+        return CKR_MECHANISM_INVALID;
+    }
+
+    MdCtx ctx(EVP_MD_CTX_new());
+    if (!ctx || EVP_DigestVerifyInit(ctx.get(), nullptr, md, nullptr, key) != 1) {
+        return CKR_FUNCTION_FAILED;
+    }
+    return EVP_DigestVerify(ctx.get(), signature.data(), signature.size(), data.data(), data.size()) == 1
+        ? CKR_OK : CKR_SIGNATURE_INVALID;
+}
+
+CK_RV rsaEncrypt(EVP_PKEY* key, const Bytes& in, Bytes& out) {
+    if (in.size() + 11 > outputLength(key)) {
+        return CKR_DATA_LEN_RANGE;
+    }
+
+    PkeyCtx ctx(EVP_PKEY_CTX_new(key, nullptr));
+    size_t len = 0;
+    if (!ctx || EVP_PKEY_encrypt_init(ctx.get()) != 1 ||
+        EVP_PKEY_CTX_set_rsa_padding(ctx.get(), RSA_PKCS1_PADDING) != 1 ||
+        EVP_PKEY_encrypt(ctx.get(), nullptr, &len, in.data(), in.size()) != 1) {
+        return CKR_FUNCTION_FAILED;
+    }
+    out.resize(len);
+    if (EVP_PKEY_encrypt(ctx.get(), out.data(), &len, in.data(), in.size()) != 1) {
+        return CKR_FUNCTION_FAILED;
+    }
+    out.resize(len);
+    return CKR_OK;
+}
+
+CK_RV rsaDecrypt(EVP_PKEY* key, const Bytes& in, Bytes& out) {
+    if (in.size() != outputLength(key)) {
+        return CKR_ENCRYPTED_DATA_LEN_RANGE;
+    }
+
+    PkeyCtx ctx(EVP_PKEY_CTX_new(key, nullptr));
+    size_t len = 0;
+    if (!ctx || EVP_PKEY_decrypt_init(ctx.get()) != 1 ||
+        EVP_PKEY_CTX_set_rsa_padding(ctx.get(), RSA_PKCS1_PADDING) != 1 ||
+        EVP_PKEY_decrypt(ctx.get(), nullptr, &len, in.data(), in.size()) != 1) {
+        return CKR_FUNCTION_FAILED;
+    }
+    out.resize(len);
+    if (EVP_PKEY_decrypt(ctx.get(), out.data(), &len, in.data(), in.size()) != 1) {
+        return CKR_ENCRYPTED_DATA_INVALID;
+    }
+    out.resize(len);
+    return CKR_OK;
+}
+
+bool isSymmetricMechanism(CK_MECHANISM_TYPE mechanism) {
+    return symmetricCipher(mechanism, mechanism == CKM_DES3_ECB || mechanism == CKM_DES3_CBC ||
+                                      mechanism == CKM_DES3_CBC_PAD ? 24 : 16) != nullptr;
+}
+
+size_t symmetricOutputLength(CK_MECHANISM_TYPE mechanism, bool encrypt, size_t inputLen) {
+    if (encrypt && isPadded(mechanism)) {
+        size_t block = blockSize(mechanism);
+        return (inputLen / block + 1) * block;
+    }
+    return inputLen;
+}
+
+CK_RV symmetricCrypt(CK_MECHANISM_TYPE mechanism, const Bytes& key, const Bytes& iv, bool encrypt,
+                     const Bytes& in, Bytes& out) {
+    const EVP_CIPHER* cipher = symmetricCipher(mechanism, key.size());
+    if (!cipher) {
+        return CKR_KEY_SIZE_RANGE;
+    }
+
+    size_t block = blockSize(mechanism);
+    if (!isEcb(mechanism) && iv.size() != block) {
+        return CKR_MECHANISM_PARAM_INVALID;
+    }
+    if ((!encrypt || !isPadded(mechanism)) && in.size() % block != 0) {
+        return encrypt ? CKR_DATA_LEN_RANGE : CKR_ENCRYPTED_DATA_LEN_RANGE;
+    }
+
+    CipherCtx ctx(EVP_CIPHER_CTX_new());
+    if (!ctx || EVP_CipherInit_ex(ctx.get(), cipher, nullptr, key.data(),
+                                  isEcb(mechanism) ? nullptr : iv.data(), encrypt ? 1 : 0) != 1) {
+        return CKR_FUNCTION_FAILED;
+    }
+    EVP_CIPHER_CTX_set_padding(ctx.get(), isPadded(mechanism) ? 1 : 0);
+
+    out.resize(in.size() + block);
+    int len = 0;
+    int finalLen = 0;
+    if (EVP_CipherUpdate(ctx.get(), out.data(), &len, in.data(), static_cast<int>(in.size())) != 1) {
+        return CKR_FUNCTION_FAILED;
+    }
+    if (EVP_CipherFinal_ex(ctx.get(), out.data() + len, &finalLen) != 1) {
+        return encrypt ? CKR_FUNCTION_FAILED : CKR_ENCRYPTED_DATA_INVALID;
+    }
+    out.resize(len + finalLen);
+    return CKR_OK;
+}
+
+CK_RV randomBytes(CK_BYTE_PTR out, size_t length) {
+    if (length == 0) {
+        return CKR_OK;
+    }
+    return RAND_bytes(out, static_cast<int>(length)) == 1 ? CKR_OK : CKR_RANDOM_NO_RNG;
+}
+
+} // namespace SoftToken
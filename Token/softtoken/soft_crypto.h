@@ -0,0 +1,61 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+extern "C" {
+#include "cryptoki_ext.h"
+}
+
+typedef struct evp_pkey_st EVP_PKEY;
+
+namespace SoftToken {
+
+using Bytes = std::vector<CK_BYTE>;
+using KeyPtr = std::shared_ptr<EVP_PKEY>;
+
+// DER encoding of the P-256 named curve OID, as carried in CKA_EC_PARAMS
+extern const Bytes P256_EC_PARAMS;
+
+// Raw r || s length for P-256
+constexpr size_t P256_SIGNATURE_LEN = 64;
+
+// All functions return a Cryptoki code so the entry points can pass it on.
+
+CK_RV generateRsaKey(CK_ULONG modulusBits, const Bytes& publicExponent, KeyPtr& key);
+CK_RV generateEcKey(KeyPtr& key);
+
+CK_RV rsaComponents(EVP_PKEY* key, Bytes& modulus, Bytes& publicExponent);
+
+// CKA_EC_POINT value: DER OCTET STRING wrapping the uncompressed point
+CK_RV ecPoint(EVP_PKEY* key, Bytes& point);
+
+CK_RV importRsaPublicKey(const Bytes& modulus, const Bytes& publicExponent, KeyPtr& key);
+CK_RV importRsaPrivateKey(const Bytes& modulus, const Bytes& publicExponent, const Bytes& privateExponent,
+                          const Bytes& prime1, const Bytes& prime2, const Bytes& exponent1,
+                          const Bytes& exponent2, const Bytes& coefficient, KeyPtr& key);
+CK_RV importEcPublicKey(const Bytes& point, KeyPtr& key);
+
+// Size of a signature or RSA block produced with `key`
+size_t outputLength(EVP_PKEY* key);
+CK_ULONG keyBits(EVP_PKEY* key);
+
+// CKM_RSA_PKCS, CKM_<hash>_RSA_PKCS and CKM_ECDSA (over a caller-supplied digest)
+CK_RV sign(EVP_PKEY* key, CK_MECHANISM_TYPE mechanism, const Bytes& data, Bytes& signature);
+CK_RV verify(EVP_PKEY* key, CK_MECHANISM_TYPE mechanism, const Bytes& data, const Bytes& signature);
+
+// CKM_RSA_PKCS encryption
+CK_RV rsaEncrypt(EVP_PKEY* key, const Bytes& in, Bytes& out);
+CK_RV rsaDecrypt(EVP_PKEY* key, const Bytes& in, Bytes& out);
+
+// AES and DES3 in ECB, CBC and CBC_PAD
+bool isSymmetricMechanism(CK_MECHANISM_TYPE mechanism);
+CK_RV symmetricCrypt(CK_MECHANISM_TYPE mechanism, const Bytes& key, const Bytes& iv, bool encrypt,
+                     const Bytes& in, Bytes& out);
+
+// Upper bound on the output of symmetricCrypt for `inputLen` bytes
+size_t symmetricOutputLength(CK_MECHANISM_TYPE mechanism, bool encrypt, size_t inputLen);
+
+CK_RV randomBytes(CK_BYTE_PTR out, size_t length);
+
+} // namespace SoftToken
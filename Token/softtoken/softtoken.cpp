@@ -0,0 +1,2047 @@
+// Software PKCS#11 module (libsofttoken.so).
+//
+// Implements the Cryptoki subset and the ePass aux functions that
+// PKCS11Library relies on, with OpenSSL doing the cryptography and a latency
+// model standing in for the device. Token objects live for the lifetime of the
+// process; there is no persistent storage.
+
+#include "token_state.h"
+#include "softtoken.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace SoftToken;
+
+namespace {
+
+using Lock = std::unique_lock<std::mutex>;
+
+struct MechanismEntry {
+    CK_MECHANISM_TYPE type;
+    CK_ULONG minKeySize;
+    CK_ULONG maxKeySize; // 0 means token.max_rsa_bits
+    CK_FLAGS flags;
+};
+
+const MechanismEntry MECHANISMS[] = {
+    {CKM_RSA_PKCS_KEY_PAIR_GEN, 512, 0, CKF_HW | CKF_GENERATE_KEY_PAIR},
+    {CKM_RSA_PKCS, 512, 0, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT | CKF_SIGN | CKF_VERIFY},
+    {CKM_MD5_RSA_PKCS, 512, 0, CKF_HW | CKF_SIGN | CKF_VERIFY},
+    {CKM_SHA1_RSA_PKCS, 512, 0, CKF_HW | CKF_SIGN | CKF_VERIFY},
+    {CKM_SHA224_RSA_PKCS, 512, 0, CKF_HW | CKF_SIGN | CKF_VERIFY},
+    {CKM_SHA256_RSA_PKCS, 512, 0, CKF_HW | CKF_SIGN | CKF_VERIFY},
+    {CKM_SHA384_RSA_PKCS, 512, 0, CKF_HW | CKF_SIGN | CKF_VERIFY},
+    {CKM_SHA512_RSA_PKCS, 512, 0, CKF_HW | CKF_SIGN | CKF_VERIFY},
+    {CKM_EC_KEY_PAIR_GEN, 256, 256, CKF_HW | CKF_GENERATE_KEY_PAIR},
+    {CKM_ECDSA, 256, 256, CKF_HW | CKF_SIGN | CKF_VERIFY},
+    {CKM_AES_KEY_GEN, 16, 32, CKF_HW | CKF_GENERATE},
+    {CKM_AES_ECB, 16, 32, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT},
+    {CKM_AES_CBC, 16, 32, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT},
+    {CKM_AES_CBC_PAD, 16, 32, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT},
+    {CKM_DES3_KEY_GEN, 24, 24, CKF_HW | CKF_GENERATE},
+    {CKM_DES3_ECB, 24, 24, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT},
+    {CKM_DES3_CBC, 24, 24, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT},
+    {CKM_DES3_CBC_PAD, 24, 24, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT},
+};
+
+// Attributes that can never be changed once an object exists
+const CK_ATTRIBUTE_TYPE READ_ONLY_ATTRIBUTES[] = {
+    CKA_CLASS, CKA_KEY_TYPE, CKA_TOKEN, CKA_PRIVATE, CKA_MODIFIABLE, CKA_CERTIFICATE_TYPE,
+    CKA_MODULUS, CKA_MODULUS_BITS, CKA_PUBLIC_EXPONENT, CKA_EC_PARAMS, CKA_EC_POINT,
+    CKA_VALUE_LEN, CKA_LOCAL, CKA_KEY_GEN_MECHANISM, CKA_ALWAYS_SENSITIVE, CKA_NEVER_EXTRACTABLE,
+};
+
+// Private key components that are consumed on import and never reported back
+const CK_ATTRIBUTE_TYPE RSA_PRIVATE_COMPONENTS[] = {
+    CKA_PRIVATE_EXPONENT, CKA_PRIME_1, CKA_PRIME_2, CKA_EXPONENT_1, CKA_EXPONENT_2, CKA_COEFFICIENT,
+};
+
+void padCopy(CK_UTF8CHAR* dst, size_t size, const std::string& src) {
+    memset(dst, ' ', size);
+    memcpy(dst, src.data(), std::min(size, src.size()));
+}
+
+CK_RV copyOut(const Bytes& data, CK_BYTE_PTR out, CK_ULONG_PTR outLen) {
+    if (!outLen) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (!out) {
+        *outLen = data.size();
+        return CKR_OK;
+    }
+    if (*outLen < data.size()) {
+        *outLen = data.size();
+        return CKR_BUFFER_TOO_SMALL;
+    }
+    if (!data.empty()) {
+        memcpy(out, data.data(), data.size());
+    }
+    *outLen = data.size();
+    return CKR_OK;
+}
+
+Bytes toBytes(const void* data, CK_ULONG length) {
+    auto p = static_cast<const CK_BYTE*>(data);
+    return p ? Bytes(p, p + length) : Bytes();
+}
+
+Bytes attributeValue(const SoftObject& object, CK_ATTRIBUTE_TYPE type) {
+    auto it = object.attributes.find(type);
+    return it != object.attributes.end() ? it->second : Bytes();
+}
+
+bool contains(const CK_ATTRIBUTE_TYPE* list, size_t count, CK_ATTRIBUTE_TYPE type) {
+    return std::find(list, list + count, type) != list + count;
+}
+
+bool checkPin(const std::string& expected, CK_UTF8CHAR_PTR pin, CK_ULONG length) {
+    return pin && expected.size() == length && memcmp(expected.data(), pin, length) == 0;
+}
+
+CK_FLAGS tokenFlags(const TokenState& t) {
+    CK_FLAGS flags = CKF_RNG | CKF_LOGIN_REQUIRED | CKF_USER_PIN_INITIALIZED | CKF_TOKEN_INITIALIZED;
+    if (t.userPinCounter == 0) {
+        flags |= CKF_USER_PIN_LOCKED;
+    } else if (t.userPinCounter == 1) {
+        flags |= CKF_USER_PIN_FINAL_TRY;
+    } else if (t.userPinCounter < t.config.userPinRetries) {
+        flags |= CKF_USER_PIN_COUNT_LOW;
+    }
+    if (t.soPinCounter == 0) {
+        flags |= CKF_SO_PIN_LOCKED;
+    } else if (t.soPinCounter == 1) {
+        flags |= CKF_SO_PIN_FINAL_TRY;
+    } else if (t.soPinCounter < t.config.soPinRetries) {
+        flags |= CKF_SO_PIN_COUNT_LOW;
+    }
+    return flags;
+}
+
+// Checks a PIN against the retry counter the way the card does: a wrong PIN
+// costs a try, a right one restores the counter.
+CK_RV verifyPin(TokenState& t, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pin, CK_ULONG length) {
+    bool so = userType == CKU_SO;
+    CK_BYTE& counter = so ? t.soPinCounter : t.userPinCounter;
+    if (counter == 0) {
+        return CKR_PIN_LOCKED;
+    }
+    if (!checkPin(so ? t.soPin : t.userPin, pin, length)) {
+        counter--;
+        return counter == 0 ? CKR_PIN_LOCKED : CKR_PIN_INCORRECT;
+    }
+    counter = so ? t.config.soPinRetries : t.config.userPinRetries;
+    return CKR_OK;
+}
+
+CK_RV checkSlot(TokenState& t, CK_SLOT_ID slotId, bool needToken = true) {
+    if (!t.initialized) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    if (slotId != t.config.slotId) {
+        return CKR_SLOT_ID_INVALID;
+    }
+    if (needToken && !t.present) {
+        return CKR_TOKEN_NOT_PRESENT;
+    }
+    return CKR_OK;
+}
+
+CK_RV getSession(TokenState& t, CK_SESSION_HANDLE handle, SoftSession*& session) {
+    if (!t.initialized) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    if (!t.present) {
+        return CKR_DEVICE_REMOVED;
+    }
+    auto it = t.sessions.find(handle);
+    if (it == t.sessions.end()) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    session = &it->second;
+    return CKR_OK;
+}
+
+CK_RV getObject(TokenState& t, CK_OBJECT_HANDLE handle, SoftObject*& object) {
+    auto it = t.objects.find(handle);
+    if (it == t.objects.end() || !t.canSee(it->second)) {
+        return CKR_OBJECT_HANDLE_INVALID;
+    }
+    object = &it->second;
+    return CKR_OK;
+}
+
+bool isReadWrite(const SoftSession& session) {
+    return (session.flags & CKF_RW_SESSION) != 0;
+}
+
+CK_RV checkWritable(const TokenState& t, const SoftSession& session, const SoftObject& object) {
+    if (object.isTokenObject() && !isReadWrite(session)) {
+        return CKR_SESSION_READ_ONLY;
+    }
+    if (object.isPrivate() && !t.isUserLoggedIn()) {
+        return CKR_USER_NOT_LOGGED_IN;
+    }
+    return CKR_OK;
+}
+
+bool matches(const SoftObject& object, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG count) {
+    for (CK_ULONG i = 0; i < count; i++) {
+        auto it = object.attributes.find(pTemplate[i].type);
+        if (it == object.attributes.end() || it->second != toBytes(pTemplate[i].pValue, pTemplate[i].ulValueLen)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+CK_RV applyTemplate(SoftObject& object, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG count) {
+    if (count && !pTemplate) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    for (CK_ULONG i = 0; i < count; i++) {
+        if (!pTemplate[i].pValue && pTemplate[i].ulValueLen) {
+            return CKR_ATTRIBUTE_VALUE_INVALID;
+        }
+        object.attributes[pTemplate[i].type] = toBytes(pTemplate[i].pValue, pTemplate[i].ulValueLen);
+    }
+    return CKR_OK;
+}
+
+template<typename T>
+void putDefault(SoftObject& object, CK_ATTRIBUTE_TYPE type, T value) {
+    if (!object.has(type)) {
+        object.put(type, value);
+    }
+}
+
+// Fill in what the caller left out, per class
+void applyDefaults(SoftObject& object, CK_OBJECT_CLASS objectClass) {
+    bool isKey = objectClass == CKO_PUBLIC_KEY || objectClass == CKO_PRIVATE_KEY || objectClass == CKO_SECRET_KEY;
+    bool isSecret = objectClass == CKO_PRIVATE_KEY || objectClass == CKO_SECRET_KEY;
+
+    object.put(CKA_CLASS, objectClass);
+    putDefault<CK_BBOOL>(object, CKA_TOKEN, CK_FALSE);
+    putDefault<CK_BBOOL>(object, CKA_PRIVATE, isSecret ? CK_TRUE : CK_FALSE);
+    putDefault<CK_BBOOL>(object, CKA_MODIFIABLE, CK_TRUE);
+    if (!object.has(CKA_LABEL)) {
+        object.attributes[CKA_LABEL] = Bytes();
+    }
+
+    if (isKey) {
+        if (!object.has(CKA_ID)) {
+            object.attributes[CKA_ID] = Bytes();
+        }
+        putDefault<CK_BBOOL>(object, CKA_DERIVE, CK_FALSE);
+        putDefault<CK_BBOOL>(object, CKA_LOCAL, CK_FALSE);
+    }
+
+    switch (objectClass) {
+        case CKO_PUBLIC_KEY:
+            putDefault<CK_BBOOL>(object, CKA_ENCRYPT, CK_TRUE);
+            putDefault<CK_BBOOL>(object, CKA_VERIFY, CK_TRUE);
+            putDefault<CK_BBOOL>(object, CKA_WRAP, CK_FALSE);
+            break;
+        case CKO_PRIVATE_KEY:
+            putDefault<CK_BBOOL>(object, CKA_SENSITIVE, CK_TRUE);
+            putDefault<CK_BBOOL>(object, CKA_EXTRACTABLE, CK_FALSE);
+            putDefault<CK_BBOOL>(object, CKA_DECRYPT, CK_TRUE);
+            putDefault<CK_BBOOL>(object, CKA_SIGN, CK_TRUE);
+            putDefault<CK_BBOOL>(object, CKA_UNWRAP, CK_FALSE);
+            break;
+        case CKO_SECRET_KEY:
+            putDefault<CK_BBOOL>(object, CKA_SENSITIVE, CK_FALSE);
+            putDefault<CK_BBOOL>(object, CKA_EXTRACTABLE, CK_TRUE);
+            putDefault<CK_BBOOL>(object, CKA_ENCRYPT, CK_TRUE);
+            putDefault<CK_BBOOL>(object, CKA_DECRYPT, CK_TRUE);
+            break;
+        case CKO_CERTIFICATE:
+            putDefault<CK_CERTIFICATE_TYPE>(object, CKA_CERTIFICATE_TYPE, CKC_X_509);
+            break;
+        case CKO_DATA:
+            if (!object.has(CKA_APPLICATION)) {
+                object.attributes[CKA_APPLICATION] = Bytes();
+            }
+            if (!object.has(CKA_VALUE)) {
+                object.attributes[CKA_VALUE] = Bytes();
+            }
+            break;
+    }
+
+    if (objectClass == CKO_PRIVATE_KEY || objectClass == CKO_SECRET_KEY) {
+        putDefault<CK_BBOOL>(object, CKA_ALWAYS_SENSITIVE, object.flag(CKA_SENSITIVE) ? CK_TRUE : CK_FALSE);
+        putDefault<CK_BBOOL>(object, CKA_NEVER_EXTRACTABLE, object.flag(CKA_EXTRACTABLE) ? CK_FALSE : CK_TRUE);
+    }
+}
+
+// Approximate EEPROM usage: attribute values plus key material held in files
+CK_ULONG footprintOf(const SoftObject& object) {
+    CK_ULONG total = 0;
+    for (const auto& attribute : object.attributes) {
+        total += 8 + attribute.second.size();
+    }
+    total += object.secret.size();
+    if (object.key && object.objectClass() == CKO_PRIVATE_KEY) {
+        total += outputLength(object.key.get()) * 5 / 2; // d, p, q, dp, dq, qinv
+    }
+    return total;
+}
+
+CK_RV storeObject(TokenState& t, SoftObject& object, CK_SESSION_HANDLE session, CK_OBJECT_HANDLE& handle) {
+    object.owner = session;
+    CK_RV rv = t.charge(object, footprintOf(object));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    handle = t.nextObject++;
+    t.objects[handle] = std::move(object);
+    return CKR_OK;
+}
+
+std::string keyOperation(const char* verb, const SoftObject& key) {
+    if (!key.key) {
+        return std::string(verb) + ".secret";
+    }
+    if (key.get<CK_KEY_TYPE>(CKA_KEY_TYPE, CKK_RSA) == CKK_EC) {
+        return std::string(verb) + ".ec";
+    }
+    return std::string(verb) + ".rsa." + std::to_string(keyBits(key.key.get()));
+}
+
+bool mechanismFitsKey(CK_MECHANISM_TYPE mechanism, const SoftObject& key) {
+    CK_KEY_TYPE keyType = key.get<CK_KEY_TYPE>(CKA_KEY_TYPE, CK_UNAVAILABLE_INFORMATION);
+    switch (mechanism) {
+        case CKM_RSA_PKCS:
+        case CKM_MD5_RSA_PKCS:
+        case CKM_SHA1_RSA_PKCS:
+        case CKM_SHA224_RSA_PKCS:
+        case CKM_SHA256_RSA_PKCS:
+        case CKM_SHA384_RSA_PKCS:
+        case CKM_SHA512_RSA_PKCS:
+            return keyType == CKK_RSA && key.key;
+        case CKM_ECDSA:
+            return keyType == CKK_EC && key.key;
+        case CKM_AES_ECB:
+        case CKM_AES_CBC:
+        case CKM_AES_CBC_PAD:
+            return keyType == CKK_AES;
+        case CKM_DES3_ECB:
+        case CKM_DES3_CBC:
+        case CKM_DES3_CBC_PAD:
+            return keyType == CKK_DES3;
+        default:
+            return false;
+    }
+}
+
+// Shared by the four *Init functions
+CK_RV beginOperation(TokenState& t, CryptoOperation& op, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey,
+                     CK_ATTRIBUTE_TYPE permission, std::initializer_list<CK_OBJECT_CLASS> classes) {
+    if (op.active) {
+        return CKR_OPERATION_ACTIVE;
+    }
+    if (!pMechanism) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    SoftObject* key = nullptr;
+    if (getObject(t, hKey, key) != CKR_OK) {
+        return CKR_KEY_HANDLE_INVALID;
+    }
+    if (std::find(classes.begin(), classes.end(), key->objectClass()) == classes.end()) {
+        return CKR_KEY_TYPE_INCONSISTENT;
+    }
+    if (!key->flag(permission)) {
+        return CKR_KEY_FUNCTION_NOT_PERMITTED;
+    }
+    if (!mechanismFitsKey(pMechanism->mechanism, *key)) {
+        return CKR_KEY_TYPE_INCONSISTENT;
+    }
+
+    op.reset();
+    op.active = true;
+    op.mechanism = pMechanism->mechanism;
+    op.key = hKey;
+    op.parameter = toBytes(pMechanism->pParameter, pMechanism->ulParameterLen);
+    t.simulate("info");
+    return CKR_OK;
+}
+
+// Resolves the key of an active operation, ending the operation if it is gone
+CK_RV operationKey(TokenState& t, CryptoOperation& op, SoftObject*& key) {
+    if (!op.active) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+    if (getObject(t, op.key, key) != CKR_OK) {
+        op.reset();
+        return CKR_KEY_HANDLE_INVALID;
+    }
+    return CKR_OK;
+}
+
+CK_RV finishSign(TokenState& t, CryptoOperation& op, const Bytes& data,
+                 CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen) {
+    SoftObject* key = nullptr;
+    CK_RV rv = operationKey(t, op, key);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!pulSignatureLen) {
+        op.reset();
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    size_t length = outputLength(key->key.get());
+    if (!pSignature) {
+        *pulSignatureLen = length;
+        return CKR_OK;
+    }
+    if (*pulSignatureLen < length) {
+        *pulSignatureLen = length;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    t.simulate(keyOperation("sign", *key), data.size() + length);
+    Bytes signature;
+    rv = sign(key->key.get(), op.mechanism, data, signature);
+    op.reset();
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    memcpy(pSignature, signature.data(), signature.size());
+    *pulSignatureLen = signature.size();
+    return CKR_OK;
+}
+
+CK_RV finishVerify(TokenState& t, CryptoOperation& op, const Bytes& data, const Bytes& signature) {
+    SoftObject* key = nullptr;
+    CK_RV rv = operationKey(t, op, key);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    t.simulate(keyOperation("verify", *key), data.size() + signature.size());
+    rv = verify(key->key.get(), op.mechanism, data, signature);
+    op.reset();
+    return rv;
+}
+
+CK_RV runCipher(TokenState& t, CryptoOperation& op, bool encrypt, const Bytes& in,
+                CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen) {
+    SoftObject* key = nullptr;
+    CK_RV rv = operationKey(t, op, key);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!pulOutLen) {
+        op.reset();
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    size_t bound = key->key ? outputLength(key->key.get()) : symmetricOutputLength(op.mechanism, encrypt, in.size());
+    if (!pOut) {
+        *pulOutLen = bound;
+        return CKR_OK;
+    }
+
+    Bytes out;
+    if (key->key) {
+        rv = encrypt ? rsaEncrypt(key->key.get(), in, out) : rsaDecrypt(key->key.get(), in, out);
+    } else {
+        rv = symmetricCrypt(op.mechanism, key->secret, op.parameter, encrypt, in, out);
+    }
+    if (rv == CKR_OK && *pulOutLen < out.size()) {
+        // The caller may retry with a larger buffer; the operation stays active
+        *pulOutLen = out.size();
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    t.simulate(keyOperation(encrypt ? "encrypt" : "decrypt", *key), in.size() + out.size());
+    op.reset();
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    memcpy(pOut, out.data(), out.size());
+    *pulOutLen = out.size();
+    return CKR_OK;
+}
+
+CK_RV createKeyFromTemplate(SoftObject& object) {
+    CK_OBJECT_CLASS objectClass = object.objectClass();
+    CK_KEY_TYPE keyType = object.get<CK_KEY_TYPE>(CKA_KEY_TYPE, CK_UNAVAILABLE_INFORMATION);
+
+    if (objectClass == CKO_SECRET_KEY) {
+        if (keyType != CKK_AES && keyType != CKK_DES3) {
+            return CKR_TEMPLATE_INCONSISTENT;
+        }
+        object.secret = attributeValue(object, CKA_VALUE);
+        object.attributes.erase(CKA_VALUE);
+        if (object.secret.empty()) {
+            return CKR_TEMPLATE_INCOMPLETE;
+        }
+        object.put<CK_ULONG>(CKA_VALUE_LEN, object.secret.size());
+        return CKR_OK;
+    }
+
+    if (keyType == CKK_RSA) {
+        Bytes modulus = attributeValue(object, CKA_MODULUS);
+        Bytes exponent = attributeValue(object, CKA_PUBLIC_EXPONENT);
+        if (modulus.empty() || exponent.empty()) {
+            return CKR_TEMPLATE_INCOMPLETE;
+        }
+
+        CK_RV rv;
+        if (objectClass == CKO_PUBLIC_KEY) {
+            rv = importRsaPublicKey(modulus, exponent, object.key);
+        } else {
+            Bytes d = attributeValue(object, CKA_PRIVATE_EXPONENT);
+            if (d.empty()) {
+                return CKR_TEMPLATE_INCOMPLETE;
+            }
+            rv = importRsaPrivateKey(modulus, exponent, d,
+                                     attributeValue(object, CKA_PRIME_1), attributeValue(object, CKA_PRIME_2),
+                                     attributeValue(object, CKA_EXPONENT_1), attributeValue(object, CKA_EXPONENT_2),
+                                     attributeValue(object, CKA_COEFFICIENT), object.key);
+            for (CK_ATTRIBUTE_TYPE type : RSA_PRIVATE_COMPONENTS) {
+                auto it = object.attributes.find(type);
+                if (it != object.attributes.end()) {
+                    std::fill(it->second.begin(), it->second.end(), 0);
+                    object.attributes.erase(it);
+                }
+            }
+        }
+        if (rv == CKR_OK && objectClass == CKO_PUBLIC_KEY) {
+            object.put<CK_ULONG>(CKA_MODULUS_BITS, keyBits(object.key.get()));
+        }
+        return rv;
+    }
+
+    if (keyType == CKK_EC && objectClass == CKO_PUBLIC_KEY) {
+        if (attributeValue(object, CKA_EC_PARAMS) != P256_EC_PARAMS) {
+            return CKR_DOMAIN_PARAMS_INVALID;
+        }
+        return importEcPublicKey(attributeValue(object, CKA_EC_POINT), object.key);
+    }
+
+    return CKR_TEMPLATE_INCONSISTENT;
+}
+
+// ---- aux functions ----------------------------------------------------------
+
+CK_RV auxGetPinInfo(CK_SLOT_ID slotID, AUX_PIN_INFO_PTR pPinInfo) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    CK_RV rv = checkSlot(t, slotID);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!pPinInfo) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    t.simulate("info");
+    pPinInfo->bSOPinMaxRetries = t.config.soPinRetries;
+    pPinInfo->bSOPinCurCounter = t.soPinCounter;
+    pPinInfo->bUserPinMaxRetries = t.config.userPinRetries;
+    pPinInfo->bUserPinCurCounter = t.userPinCounter;
+    pPinInfo->pinflags = tokenFlags(t);
+    return CKR_OK;
+}
+
+CK_RV auxWaitForSlotEvent(CK_FLAGS flags, CK_SLOT_ID_PTR pSlotId, CK_ULONG* pulEvent, CK_ULONG* pulExtData,
+                          CK_VOID_PTR) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    if (!t.initialized) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    if (!pSlotId || !pulEvent) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    if (t.pendingEvents.empty()) {
+        if (flags & CKF_DONT_BLOCK) {
+            return CKR_NO_EVENT;
+        }
+        t.slotEvent.wait(lock, [&t] { return !t.pendingEvents.empty() || !t.initialized; });
+        if (!t.initialized) {
+            return CKR_CRYPTOKI_NOT_INITIALIZED;
+        }
+    }
+
+    *pSlotId = t.pendingEvents.front().first;
+    *pulEvent = t.pendingEvents.front().second;
+    if (pulExtData) {
+        *pulExtData = 0;
+    }
+    t.pendingEvents.pop_front();
+    return CKR_OK;
+}
+
+CK_RV auxSetTokenLabel(CK_SLOT_ID slotID, CK_USER_TYPE userType, CK_CHAR_PTR pPin, CK_ULONG ulPinLen,
+                       CK_CHAR_PTR pLabel) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    CK_RV rv = checkSlot(t, slotID);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!pLabel) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    if (pPin && ulPinLen) {
+        rv = verifyPin(t, userType, pPin, ulPinLen);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+    } else if (t.loggedInAs == CK_UNAVAILABLE_INFORMATION) {
+        return CKR_USER_NOT_LOGGED_IN;
+    }
+
+    t.simulate("attribute.set", 32);
+    std::string label(reinterpret_cast<const char*>(pLabel), strnlen(reinterpret_cast<const char*>(pLabel), 32));
+    label.erase(label.find_last_not_of(' ') + 1);
+    t.label = label;
+    return CKR_OK;
+}
+
+CK_RV auxSetTokenTimeout(CK_SLOT_ID slotID, CK_ULONG ulTimeout) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    CK_RV rv = checkSlot(t, slotID);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    t.simulate("attribute.set");
+    t.tokenTimeoutMs = ulTimeout;
+    return CKR_OK;
+}
+
+CK_RV auxGetTokenTimeout(CK_SLOT_ID slotID, CK_ULONG_PTR pulTimeout) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    CK_RV rv = checkSlot(t, slotID);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!pulTimeout) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    t.simulate("info");
+    *pulTimeout = t.tokenTimeoutMs;
+    return CKR_OK;
+}
+
+// State is one byte: bit 0 token present, bit 1 user logged in, bit 2 SO logged in
+CK_RV auxGetTokenState(CK_SLOT_ID slotID, CK_BBOOL, CK_VOID_PTR pState, CK_ULONG_PTR pulStateLen) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    CK_RV rv = checkSlot(t, slotID, false);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    Bytes state(1, 0);
+    if (t.present) {
+        state[0] |= 0x01;
+        t.simulate("info");
+    }
+    if (t.loggedInAs == CKU_USER) {
+        state[0] |= 0x02;
+    } else if (t.loggedInAs == CKU_SO) {
+        state[0] |= 0x04;
+    }
+    return copyOut(state, static_cast<CK_BYTE_PTR>(pState), pulStateLen);
+}
+
+CK_RV auxBlankToken(CK_SLOT_ID slotID, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    CK_RV rv = checkSlot(t, slotID);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    rv = verifyPin(t, CKU_SO, pPin, ulPinLen);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    t.simulate("object.destroy", 0);
+    t.objects.clear();
+    t.usedPublicMemory = 0;
+    t.usedPrivateMemory = 0;
+    t.label = t.config.label;
+    t.userPin = t.config.userPin;
+    t.userPinCounter = t.config.userPinRetries;
+    t.loggedInAs = CK_UNAVAILABLE_INFORMATION;
+    for (auto& entry : t.sessions) {
+        SoftSession& session = entry.second;
+        session.findActive = false;
+        session.sign.reset();
+        session.verify.reset();
+        session.encrypt.reset();
+        session.decrypt.reset();
+    }
+    return CKR_OK;
+}
+
+CK_RV auxGetDevInfo(CK_SLOT_ID slotID, DEV_INFO_PTR pDevInfo) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    CK_RV rv = checkSlot(t, slotID);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!pDevInfo) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    static const CK_BYTE ATR[] = {0x3B, 0x9F, 0x95, 0x81, 0x31, 0xFE, 0x9F, 0x00, 0x65, 0x46, 0x53};
+
+    t.simulate("info");
+    pDevInfo->ucProductType = 0x01; // PKI
+    pDevInfo->ucFrequency = 0;
+    pDevInfo->hardwareVersion = {1, 0};
+    memset(pDevInfo->ucAtr, 0, sizeof(pDevInfo->ucAtr));
+    memcpy(pDevInfo->ucAtr, ATR, sizeof(ATR));
+    pDevInfo->ulAtrLen = sizeof(ATR);
+    memset(pDevInfo->ucDate, 0, sizeof(pDevInfo->ucDate));
+    memset(pDevInfo->ucSerialNumber, 0, sizeof(pDevInfo->ucSerialNumber));
+    size_t serialLen = std::min(t.config.serial.size(), sizeof(pDevInfo->ucSerialNumber));
+    memcpy(pDevInfo->ucSerialNumber, t.config.serial.data(), serialLen);
+    pDevInfo->ulSNLen = serialLen;
+    pDevInfo->ulTotalSpace = t.config.totalPublicMemory + t.config.totalPrivateMemory;
+    return CKR_OK;
+}
+
+CK_RV auxBeginTransaction(CK_SLOT_ID slotID) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    CK_RV rv = checkSlot(t, slotID);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    t.simulate("apdu");
+    t.inTransaction = true;
+    return CKR_OK;
+}
+
+CK_RV auxEndTransaction(CK_SLOT_ID slotID) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    CK_RV rv = checkSlot(t, slotID);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    t.inTransaction = false;
+    return CKR_OK;
+}
+
+// Answers GET CHALLENGE (00 84 00 00 Le) with random bytes and everything else
+// with 6D00 (instruction not supported)
+CK_RV auxTransmitAPDU(CK_SLOT_ID slotID, CK_BYTE_PTR pbSendBuf, CK_ULONG ulSendLen, CK_BYTE_PTR pbRecvBuf,
+                      CK_ULONG_PTR pulRecvLen, CK_FLAGS, CK_BYTE_PTR, CK_ULONG) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    CK_RV rv = checkSlot(t, slotID);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!pbSendBuf || ulSendLen < 4 || !pulRecvLen) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    Bytes response;
+    if (ulSendLen == 5 && pbSendBuf[0] == 0x00 && pbSendBuf[1] == 0x84) {
+        response.resize(pbSendBuf[4] ? pbSendBuf[4] : 256);
+        randomBytes(response.data(), response.size());
+        response.push_back(0x90);
+        response.push_back(0x00);
+    } else {
+        response = {0x6D, 0x00};
+    }
+
+    t.simulate("apdu", ulSendLen + response.size());
+    return copyOut(response, pbRecvBuf, pulRecvLen);
+}
+
+AUX_FUNC_LIST auxFunctionList = [] {
+    AUX_FUNC_LIST list{};
+    list.version = {1, 0};
+    list.pFunc[EP_GET_PIN_INFO] = reinterpret_cast<void*>(&auxGetPinInfo);
+    list.pFunc[EP_WAITFORSLOTEVENT] = reinterpret_cast<void*>(&auxWaitForSlotEvent);
+    list.pFunc[EP_SET_TOKEN_LABEL] = reinterpret_cast<void*>(&auxSetTokenLabel);
+    list.pFunc[EP_SET_TOKEN_TIMEOUT] = reinterpret_cast<void*>(&auxSetTokenTimeout);
+    list.pFunc[EP_GET_TOKEN_TIMEOUT] = reinterpret_cast<void*>(&auxGetTokenTimeout);
+    list.pFunc[EP_GET_TOKEN_STATE] = reinterpret_cast<void*>(&auxGetTokenState);
+    list.pFunc[EP_BLANK_TOKEN] = reinterpret_cast<void*>(&auxBlankToken);
+    list.pFunc[EP_GET_DEV_INFO] = reinterpret_cast<void*>(&auxGetDevInfo);
+    list.pFunc[EP_BEGIN_TRANS_APDU] = reinterpret_cast<void*>(&auxBeginTransaction);
+    list.pFunc[EP_TRANSEMIT_APDU] = reinterpret_cast<void*>(&auxTransmitAPDU);
+    list.pFunc[EP_END_TRANS_APDU] = reinterpret_cast<void*>(&auxEndTransaction);
+    return list;
+}();
+
+} // namespace
+
+extern "C" {
+
+// ---- general purpose --------------------------------------------------------
+
+CK_RV C_Initialize(CK_VOID_PTR pInitArgs) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    if (t.initialized) {
+        return CKR_CRYPTOKI_ALREADY_INITIALIZED;
+    }
+
+    if (pInitArgs) {
+        auto args = static_cast<CK_C_INITIALIZE_ARGS_PTR>(pInitArgs);
+        if (args->pReserved) {
+            return CKR_ARGUMENTS_BAD;
+        }
+        bool anyMutexFunction = args->CreateMutex || args->DestroyMutex || args->LockMutex || args->UnlockMutex;
+        bool allMutexFunctions = args->CreateMutex && args->DestroyMutex && args->LockMutex && args->UnlockMutex;
+        if (anyMutexFunction && !allMutexFunctions) {
+            return CKR_ARGUMENTS_BAD;
+        }
+        // Native locking is always used, which CKF_OS_LOCKING_OK permits
+        if (allMutexFunctions && !(args->flags & CKF_OS_LOCKING_OK)) {
+            return CKR_CANT_LOCK;
+        }
+    }
+
+    t.configure();
+    t.initialized = true;
+    return CKR_OK;
+}
+
+CK_RV C_Finalize(CK_VOID_PTR pReserved) {
+    if (pReserved) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    if (!t.initialized) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+
+    for (const auto& entry : t.sessions) {
+        t.destroySessionObjects(entry.first);
+    }
+    t.sessions.clear();
+    t.loggedInAs = CK_UNAVAILABLE_INFORMATION;
+    t.inTransaction = false;
+    t.initialized = false;
+    t.slotEvent.notify_all();
+    return CKR_OK;
+}
+
+CK_RV C_GetInfo(CK_INFO_PTR pInfo) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    if (!t.initialized) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    if (!pInfo) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    pInfo->cryptokiVersion = {2, 20};
+    padCopy(pInfo->manufacturerID, sizeof(pInfo->manufacturerID), "Software");
+    pInfo->flags = 0;
+    padCopy(pInfo->libraryDescription, sizeof(pInfo->libraryDescription), "Software token");
+    pInfo->libraryVersion = {1, 0};
+    return CKR_OK;
+}
+
+CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList);
+
+// ---- slot and token management ----------------------------------------------
+
+CK_RV C_GetSlotList(CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList, CK_ULONG_PTR pulCount) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    if (!t.initialized) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    if (!pulCount) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_ULONG count = (tokenPresent && !t.present) ? 0 : 1;
+    if (pSlotList) {
+        if (*pulCount < count) {
+            *pulCount = count;
+            return CKR_BUFFER_TOO_SMALL;
+        }
+        if (count) {
+            pSlotList[0] = t.config.slotId;
+        }
+    }
+    *pulCount = count;
+    return CKR_OK;
+}
+
+CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    CK_RV rv = checkSlot(t, slotID, false);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!pInfo) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    padCopy(pInfo->slotDescription, sizeof(pInfo->slotDescription), "Software token slot");
+    padCopy(pInfo->manufacturerID, sizeof(pInfo->manufacturerID), "Software");
+    pInfo->flags = CKF_REMOVABLE_DEVICE | CKF_HW_SLOT | (t.present ? CKF_TOKEN_PRESENT : 0);
+    pInfo->hardwareVersion = {1, 0};
+    pInfo->firmwareVersion = {1, 0};
+    return CKR_OK;
+}
+
+CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    CK_RV rv = checkSlot(t, slotID);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!pInfo) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    t.simulate("info");
+    CK_ULONG rwSessions = std::count_if(t.sessions.begin(), t.sessions.end(),
+                                        [](const std::pair<const CK_SESSION_HANDLE, SoftSession>& entry) {
+                                            return isReadWrite(entry.second);
+                                        });
+
+    padCopy(pInfo->label, sizeof(pInfo->label), t.label);
+    padCopy(pInfo->manufacturerID, sizeof(pInfo->manufacturerID), "Software");
+    padCopy(pInfo->model, sizeof(pInfo->model), "SoftToken");
+    padCopy(pInfo->serialNumber, sizeof(pInfo->serialNumber), t.config.serial);
+    pInfo->flags = tokenFlags(t);
+    pInfo->ulMaxSessionCount = t.config.maxSessions;
+    pInfo->ulSessionCount = t.sessions.size();
+    pInfo->ulMaxRwSessionCount = t.config.maxSessions;
+    pInfo->ulRwSessionCount = rwSessions;
+    pInfo->ulMaxPinLen = t.config.maxPinLen;
+    pInfo->ulMinPinLen = t.config.minPinLen;
+    pInfo->ulTotalPublicMemory = t.config.totalPublicMemory;
+    pInfo->ulFreePublicMemory = t.config.totalPublicMemory - t.usedPublicMemory;
+    pInfo->ulTotalPrivateMemory = t.config.totalPrivateMemory;
+    pInfo->ulFreePrivateMemory = t.config.totalPrivateMemory - t.usedPrivateMemory;
+    pInfo->hardwareVersion = {1, 0};
+    pInfo->firmwareVersion = {1, 0};
+    padCopy(pInfo->utcTime, sizeof(pInfo->utcTime), "");
+    return CKR_OK;
+}
+
+CK_RV C_GetMechanismList(CK_SLOT_ID slotID, CK_MECHANISM_TYPE_PTR pMechanismList, CK_ULONG_PTR pulCount) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    CK_RV rv = checkSlot(t, slotID);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!pulCount) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_ULONG count = sizeof(MECHANISMS) / sizeof(MECHANISMS[0]);
+    if (pMechanismList) {
+        if (*pulCount < count) {
+            *pulCount = count;
+            return CKR_BUFFER_TOO_SMALL;
+        }
+        for (CK_ULONG i = 0; i < count; i++) {
+            pMechanismList[i] = MECHANISMS[i].type;
+        }
+    }
+    *pulCount = count;
+    return CKR_OK;
+}
+
+CK_RV C_GetMechanismInfo(CK_SLOT_ID slotID, CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_PTR pInfo) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    CK_RV rv = checkSlot(t, slotID);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!pInfo) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    for (const auto& entry : MECHANISMS) {
+        if (entry.type == type) {
+            pInfo->ulMinKeySize = entry.minKeySize;
+            pInfo->ulMaxKeySize = entry.maxKeySize ? entry.maxKeySize : t.config.maxRsaBits;
+            pInfo->flags = entry.flags;
+            return CKR_OK;
+        }
+    }
+    return CKR_MECHANISM_INVALID;
+}
+
+CK_RV C_InitToken(CK_SLOT_ID slotID, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen, CK_UTF8CHAR_PTR pLabel) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    CK_RV rv = checkSlot(t, slotID);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!t.sessions.empty()) {
+        return CKR_SESSION_EXISTS;
+    }
+
+    rv = verifyPin(t, CKU_SO, pPin, ulPinLen);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    t.simulate("object.destroy");
+    std::string soPin = t.soPin;
+    t.resetToken();
+    t.soPin = soPin;
+    if (pLabel) {
+        std::string label(reinterpret_cast<const char*>(pLabel), 32);
+        label.erase(label.find_last_not_of(' ') + 1);
+        t.label = label;
+    }
+    return CKR_OK;
+}
+
+CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (t.loggedInAs != CKU_SO || !isReadWrite(*session)) {
+        return CKR_USER_NOT_LOGGED_IN;
+    }
+    if (!pPin || ulPinLen < t.config.minPinLen || ulPinLen > t.config.maxPinLen) {
+        return CKR_PIN_LEN_RANGE;
+    }
+
+    t.simulate("pin", ulPinLen);
+    t.userPin.assign(reinterpret_cast<const char*>(pPin), ulPinLen);
+    t.userPinCounter = t.config.userPinRetries;
+    return CKR_OK;
+}
+
+CK_RV C_SetPIN(CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pOldPin, CK_ULONG ulOldLen,
+               CK_UTF8CHAR_PTR pNewPin, CK_ULONG ulNewLen) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!isReadWrite(*session)) {
+        return CKR_SESSION_READ_ONLY;
+    }
+    if (!pNewPin || ulNewLen < t.config.minPinLen || ulNewLen > t.config.maxPinLen) {
+        return CKR_PIN_LEN_RANGE;
+    }
+
+    CK_USER_TYPE userType = t.loggedInAs == CKU_SO ? CKU_SO : CKU_USER;
+    t.simulate("pin", ulOldLen + ulNewLen);
+    rv = verifyPin(t, userType, pOldPin, ulOldLen);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    (userType == CKU_SO ? t.soPin : t.userPin).assign(reinterpret_cast<const char*>(pNewPin), ulNewLen);
+    return CKR_OK;
+}
+
+// ---- session management -----------------------------------------------------
+
+CK_RV C_OpenSession(CK_SLOT_ID slotID, CK_FLAGS flags, CK_VOID_PTR, CK_NOTIFY, CK_SESSION_HANDLE_PTR phSession) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    CK_RV rv = checkSlot(t, slotID);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!phSession) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (!(flags & CKF_SERIAL_SESSION)) {
+        return CKR_SESSION_PARALLEL_NOT_SUPPORTED;
+    }
+    if (t.sessions.size() >= t.config.maxSessions) {
+        return CKR_SESSION_COUNT;
+    }
+    if (t.loggedInAs == CKU_SO && !(flags & CKF_RW_SESSION)) {
+        return CKR_SESSION_READ_WRITE_SO_EXISTS;
+    }
+
+    t.simulate("session");
+    SoftSession session;
+    session.slotId = slotID;
+    session.flags = flags;
+    *phSession = t.nextSession++;
+    t.sessions[*phSession] = session;
+    return CKR_OK;
+}
+
+CK_RV C_CloseSession(CK_SESSION_HANDLE hSession) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    t.simulate("session");
+    t.destroySessionObjects(hSession);
+    t.sessions.erase(hSession);
+    if (t.sessions.empty()) {
+        t.loggedInAs = CK_UNAVAILABLE_INFORMATION;
+    }
+    return CKR_OK;
+}
+
+CK_RV C_CloseAllSessions(CK_SLOT_ID slotID) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    CK_RV rv = checkSlot(t, slotID);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    t.simulate("session");
+    for (const auto& entry : t.sessions) {
+        t.destroySessionObjects(entry.first);
+    }
+    t.sessions.clear();
+    t.loggedInAs = CK_UNAVAILABLE_INFORMATION;
+    return CKR_OK;
+}
+
+CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!pInfo) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    bool rw = isReadWrite(*session);
+    pInfo->slotID = session->slotId;
+    pInfo->flags = session->flags;
+    pInfo->ulDeviceError = 0;
+    if (t.loggedInAs == CKU_SO) {
+        pInfo->state = CKS_RW_SO_FUNCTIONS;
+    } else if (t.loggedInAs == CKU_USER) {
+        pInfo->state = rw ? CKS_RW_USER_FUNCTIONS : CKS_RO_USER_FUNCTIONS;
+    } else {
+        pInfo->state = rw ? CKS_RW_PUBLIC_SESSION : CKS_RO_PUBLIC_SESSION;
+    }
+    return CKR_OK;
+}
+
+CK_RV C_GetOperationState(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG_PTR) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_SetOperationState(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG, CK_OBJECT_HANDLE, CK_OBJECT_HANDLE) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_Login(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (userType != CKU_USER && userType != CKU_SO) {
+        return CKR_USER_TYPE_INVALID;
+    }
+    if (t.loggedInAs == userType) {
+        return CKR_USER_ALREADY_LOGGED_IN;
+    }
+    if (t.loggedInAs != CK_UNAVAILABLE_INFORMATION) {
+        return CKR_USER_ANOTHER_ALREADY_LOGGED_IN;
+    }
+    if (userType == CKU_SO) {
+        for (const auto& entry : t.sessions) {
+            if (!isReadWrite(entry.second)) {
+                return CKR_SESSION_READ_ONLY_EXISTS;
+            }
+        }
+    }
+
+    t.simulate("login", ulPinLen);
+    rv = verifyPin(t, userType, pPin, ulPinLen);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    t.loggedInAs = userType;
+    return CKR_OK;
+}
+
+CK_RV C_Logout(CK_SESSION_HANDLE hSession) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (t.loggedInAs == CK_UNAVAILABLE_INFORMATION) {
+        return CKR_USER_NOT_LOGGED_IN;
+    }
+
+    t.simulate("session");
+    t.loggedInAs = CK_UNAVAILABLE_INFORMATION;
+    return CKR_OK;
+}
+
+// ---- object management ------------------------------------------------------
+
+CK_RV C_CreateObject(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount,
+                     CK_OBJECT_HANDLE_PTR phObject) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!phObject) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    SoftObject object;
+    rv = applyTemplate(object, pTemplate, ulCount);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_OBJECT_CLASS objectClass = object.objectClass();
+    switch (objectClass) {
+        case CKO_DATA:
+            break;
+        case CKO_CERTIFICATE:
+            if (!object.has(CKA_VALUE)) {
+                return CKR_TEMPLATE_INCOMPLETE;
+            }
+            break;
+        case CKO_PUBLIC_KEY:
+        case CKO_PRIVATE_KEY:
+        case CKO_SECRET_KEY:
+            rv = createKeyFromTemplate(object);
+            if (rv != CKR_OK) {
+                return rv;
+            }
+            break;
+        case CK_UNAVAILABLE_INFORMATION:
+            return CKR_TEMPLATE_INCOMPLETE;
+        default:
+            return CKR_ATTRIBUTE_VALUE_INVALID;
+    }
+    applyDefaults(object, objectClass);
+
+    rv = checkWritable(t, *session, object);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    size_t bytes = 0;
+    for (CK_ULONG i = 0; i < ulCount; i++) {
+        bytes += pTemplate[i].ulValueLen;
+    }
+    t.simulate("object.create", bytes);
+    return storeObject(t, object, hSession, *phObject);
+}
+
+CK_RV C_CopyObject(CK_SESSION_HANDLE, CK_OBJECT_HANDLE, CK_ATTRIBUTE_PTR, CK_ULONG, CK_OBJECT_HANDLE_PTR) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DestroyObject(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    SoftObject* object = nullptr;
+    rv = getObject(t, hObject, object);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    rv = checkWritable(t, *session, *object);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    t.simulate("object.destroy");
+    t.release(*object);
+    t.objects.erase(hObject);
+    return CKR_OK;
+}
+
+CK_RV C_GetObjectSize(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ULONG_PTR pulSize) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    SoftObject* object = nullptr;
+    rv = getObject(t, hObject, object);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!pulSize) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    *pulSize = footprintOf(*object);
+    return CKR_OK;
+}
+
+CK_RV C_GetAttributeValue(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate,
+                          CK_ULONG ulCount) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    SoftObject* object = nullptr;
+    rv = getObject(t, hObject, object);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (ulCount && !pTemplate) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    size_t bytes = 0;
+    CK_OBJECT_CLASS objectClass = object->objectClass();
+    for (CK_ULONG i = 0; i < ulCount; i++) {
+        CK_ATTRIBUTE& attribute = pTemplate[i];
+
+        const Bytes* value = nullptr;
+        auto it = object->attributes.find(attribute.type);
+        if (it != object->attributes.end()) {
+            value = &it->second;
+        } else if (objectClass == CKO_SECRET_KEY && attribute.type == CKA_VALUE) {
+            if (object->flag(CKA_SENSITIVE) || !object->flag(CKA_EXTRACTABLE)) {
+                attribute.ulValueLen = CK_UNAVAILABLE_INFORMATION;
+                rv = CKR_ATTRIBUTE_SENSITIVE;
+                continue;
+            }
+            value = &object->secret;
+        } else if (objectClass == CKO_PRIVATE_KEY &&
+                   (contains(RSA_PRIVATE_COMPONENTS, sizeof(RSA_PRIVATE_COMPONENTS) / sizeof(CK_ATTRIBUTE_TYPE),
+                             attribute.type) || attribute.type == CKA_VALUE)) {
+            attribute.ulValueLen = CK_UNAVAILABLE_INFORMATION;
+            rv = CKR_ATTRIBUTE_SENSITIVE;
+            continue;
+        }
+
+        if (!value) {
+            attribute.ulValueLen = CK_UNAVAILABLE_INFORMATION;
+            rv = CKR_ATTRIBUTE_TYPE_INVALID;
+            continue;
+        }
+        if (!attribute.pValue) {
+            attribute.ulValueLen = value->size();
+            continue;
+        }
+        if (attribute.ulValueLen < value->size()) {
+            attribute.ulValueLen = CK_UNAVAILABLE_INFORMATION;
+            rv = CKR_BUFFER_TOO_SMALL;
+            continue;
+        }
+        if (!value->empty()) {
+            memcpy(attribute.pValue, value->data(), value->size());
+        }
+        attribute.ulValueLen = value->size();
+        bytes += value->size();
+    }
+
+    t.simulate("attribute.get", bytes);
+    return rv;
+}
+
+CK_RV C_SetAttributeValue(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate,
+                          CK_ULONG ulCount) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    SoftObject* object = nullptr;
+    rv = getObject(t, hObject, object);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    rv = checkWritable(t, *session, *object);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (ulCount && !pTemplate) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (!object->flag(CKA_MODIFIABLE)) {
+        return CKR_ATTRIBUTE_READ_ONLY;
+    }
+
+    // Validate everything first so a rejected template leaves the object untouched
+    SoftObject updated = *object;
+    size_t bytes = 0;
+    for (CK_ULONG i = 0; i < ulCount; i++) {
+        const CK_ATTRIBUTE& attribute = pTemplate[i];
+        Bytes value = toBytes(attribute.pValue, attribute.ulValueLen);
+        if (contains(READ_ONLY_ATTRIBUTES, sizeof(READ_ONLY_ATTRIBUTES) / sizeof(CK_ATTRIBUTE_TYPE), attribute.type) &&
+            value != attributeValue(*object, attribute.type)) {
+            return CKR_ATTRIBUTE_READ_ONLY;
+        }
+        if (attribute.type == CKA_VALUE && object->objectClass() != CKO_DATA) {
+            return CKR_ATTRIBUTE_READ_ONLY;
+        }
+        if (attribute.type == CKA_SENSITIVE && object->flag(CKA_SENSITIVE) && value != Bytes{CK_TRUE}) {
+            return CKR_ATTRIBUTE_READ_ONLY;
+        }
+        if (attribute.type == CKA_EXTRACTABLE && !object->flag(CKA_EXTRACTABLE) && value != Bytes{CK_FALSE}) {
+            return CKR_ATTRIBUTE_READ_ONLY;
+        }
+        updated.attributes[attribute.type] = value;
+        bytes += value.size();
+    }
+
+    rv = t.charge(updated, footprintOf(updated));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    t.simulate("attribute.set", bytes);
+    *object = std::move(updated);
+    return CKR_OK;
+}
+
+CK_RV C_FindObjectsInit(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (session->findActive) {
+        return CKR_OPERATION_ACTIVE;
+    }
+    if (ulCount && !pTemplate) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    t.simulate("find");
+    session->findResults.clear();
+    for (const auto& entry : t.objects) {
+        if (t.canSee(entry.second) && matches(entry.second, pTemplate, ulCount)) {
+            session->findResults.push_back(entry.first);
+        }
+    }
+    session->findPosition = 0;
+    session->findActive = true;
+    return CKR_OK;
+}
+
+CK_RV C_FindObjects(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject, CK_ULONG ulMaxObjectCount,
+                    CK_ULONG_PTR pulObjectCount) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!session->findActive) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+    if (!phObject || !pulObjectCount) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_ULONG count = 0;
+    while (count < ulMaxObjectCount && session->findPosition < session->findResults.size()) {
+        CK_OBJECT_HANDLE handle = session->findResults[session->findPosition++];
+        if (t.objects.count(handle)) { // Skip objects destroyed since the search started
+            t.simulate("find.object");
+            phObject[count++] = handle;
+        }
+    }
+    *pulObjectCount = count;
+    return CKR_OK;
+}
+
+CK_RV C_FindObjectsFinal(CK_SESSION_HANDLE hSession) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!session->findActive) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+
+    session->findActive = false;
+    session->findResults.clear();
+    return CKR_OK;
+}
+
+// ---- encryption and decryption ----------------------------------------------
+
+CK_RV C_EncryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    return beginOperation(t, session->encrypt, pMechanism, hKey, CKA_ENCRYPT, {CKO_PUBLIC_KEY, CKO_SECRET_KEY});
+}
+
+CK_RV C_Encrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+                CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    return runCipher(t, session->encrypt, true, toBytes(pData, ulDataLen), pEncryptedData, pulEncryptedDataLen);
+}
+
+CK_RV C_EncryptUpdate(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_EncryptFinal(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG_PTR) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    return beginOperation(t, session->decrypt, pMechanism, hKey, CKA_DECRYPT, {CKO_PRIVATE_KEY, CKO_SECRET_KEY});
+}
+
+CK_RV C_Decrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen,
+                CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    return runCipher(t, session->decrypt, false, toBytes(pEncryptedData, ulEncryptedDataLen), pData, pulDataLen);
+}
+
+CK_RV C_DecryptUpdate(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DecryptFinal(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG_PTR) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+// ---- message digesting (host side only, not offered) ------------------------
+
+CK_RV C_DigestInit(CK_SESSION_HANDLE, CK_MECHANISM_PTR) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_Digest(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DigestUpdate(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DigestKey(CK_SESSION_HANDLE, CK_OBJECT_HANDLE) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DigestFinal(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG_PTR) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+// ---- signing and verification -----------------------------------------------
+
+CK_RV C_SignInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    return beginOperation(t, session->sign, pMechanism, hKey, CKA_SIGN, {CKO_PRIVATE_KEY});
+}
+
+CK_RV C_Sign(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+             CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    return finishSign(t, session->sign, toBytes(pData, ulDataLen), pSignature, pulSignatureLen);
+}
+
+CK_RV C_SignUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!session->sign.active) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+
+    Bytes part = toBytes(pPart, ulPartLen);
+    session->sign.buffered.insert(session->sign.buffered.end(), part.begin(), part.end());
+    return CKR_OK;
+}
+
+CK_RV C_SignFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    Bytes data = session->sign.buffered;
+    return finishSign(t, session->sign, data, pSignature, pulSignatureLen);
+}
+
+CK_RV C_SignRecoverInit(CK_SESSION_HANDLE, CK_MECHANISM_PTR, CK_OBJECT_HANDLE) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_SignRecover(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    return beginOperation(t, session->verify, pMechanism, hKey, CKA_VERIFY, {CKO_PUBLIC_KEY});
+}
+
+CK_RV C_Verify(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+               CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    return finishVerify(t, session->verify, toBytes(pData, ulDataLen), toBytes(pSignature, ulSignatureLen));
+}
+
+CK_RV C_VerifyUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!session->verify.active) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+
+    Bytes part = toBytes(pPart, ulPartLen);
+    session->verify.buffered.insert(session->verify.buffered.end(), part.begin(), part.end());
+    return CKR_OK;
+}
+
+CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    Bytes data = session->verify.buffered;
+    return finishVerify(t, session->verify, data, toBytes(pSignature, ulSignatureLen));
+}
+
+CK_RV C_VerifyRecoverInit(CK_SESSION_HANDLE, CK_MECHANISM_PTR, CK_OBJECT_HANDLE) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_VerifyRecover(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+// ---- dual-function operations (not offered) ---------------------------------
+
+CK_RV C_DigestEncryptUpdate(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DecryptDigestUpdate(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_SignEncryptUpdate(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DecryptVerifyUpdate(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+// ---- key management ---------------------------------------------------------
+
+CK_RV C_GenerateKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pTemplate,
+                    CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phKey) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!pMechanism || !phKey) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    SoftObject object;
+    rv = applyTemplate(object, pTemplate, ulCount);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (object.objectClass() != CK_UNAVAILABLE_INFORMATION && object.objectClass() != CKO_SECRET_KEY) {
+        return CKR_TEMPLATE_INCONSISTENT;
+    }
+
+    CK_KEY_TYPE keyType;
+    CK_ULONG keyLength = object.get<CK_ULONG>(CKA_VALUE_LEN, 0);
+    switch (pMechanism->mechanism) {
+        case CKM_AES_KEY_GEN:
+            keyType = CKK_AES;
+            if (keyLength != 16 && keyLength != 24 && keyLength != 32) {
+                return keyLength ? CKR_KEY_SIZE_RANGE : CKR_TEMPLATE_INCOMPLETE;
+            }
+            break;
+        case CKM_DES3_KEY_GEN:
+            keyType = CKK_DES3;
+            keyLength = 24;
+            break;
+        default:
+            return CKR_MECHANISM_INVALID;
+    }
+    if (object.get<CK_KEY_TYPE>(CKA_KEY_TYPE, keyType) != keyType) {
+        return CKR_TEMPLATE_INCONSISTENT;
+    }
+
+    object.put(CKA_KEY_TYPE, keyType);
+    object.put(CKA_VALUE_LEN, keyLength);
+    object.put<CK_BBOOL>(CKA_LOCAL, CK_TRUE);
+    object.put(CKA_KEY_GEN_MECHANISM, pMechanism->mechanism);
+    applyDefaults(object, CKO_SECRET_KEY);
+
+    rv = checkWritable(t, *session, object);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    t.simulate("keygen.secret");
+    object.secret.resize(keyLength);
+    rv = randomBytes(object.secret.data(), keyLength);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    return storeObject(t, object, hSession, *phKey);
+}
+
+CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+                        CK_ATTRIBUTE_PTR pPublicKeyTemplate, CK_ULONG ulPublicKeyAttributeCount,
+                        CK_ATTRIBUTE_PTR pPrivateKeyTemplate, CK_ULONG ulPrivateKeyAttributeCount,
+                        CK_OBJECT_HANDLE_PTR phPublicKey, CK_OBJECT_HANDLE_PTR phPrivateKey) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!pMechanism || !phPublicKey || !phPrivateKey) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    SoftObject publicKey;
+    SoftObject privateKey;
+    rv = applyTemplate(publicKey, pPublicKeyTemplate, ulPublicKeyAttributeCount);
+    if (rv == CKR_OK) {
+        rv = applyTemplate(privateKey, pPrivateKeyTemplate, ulPrivateKeyAttributeCount);
+    }
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if ((publicKey.objectClass() != CK_UNAVAILABLE_INFORMATION && publicKey.objectClass() != CKO_PUBLIC_KEY) ||
+        (privateKey.objectClass() != CK_UNAVAILABLE_INFORMATION && privateKey.objectClass() != CKO_PRIVATE_KEY)) {
+        return CKR_TEMPLATE_INCONSISTENT;
+    }
+
+    KeyPtr key;
+    CK_KEY_TYPE keyType;
+    std::string operation;
+    switch (pMechanism->mechanism) {
+        case CKM_RSA_PKCS_KEY_PAIR_GEN: {
+            keyType = CKK_RSA;
+            CK_ULONG bits = publicKey.get<CK_ULONG>(CKA_MODULUS_BITS, 0);
+            if (!bits) {
+                return CKR_TEMPLATE_INCOMPLETE;
+            }
+            if (bits < 512 || bits > t.config.maxRsaBits || bits % 8) {
+                return CKR_KEY_SIZE_RANGE;
+            }
+            operation = "keygen.rsa." + std::to_string(bits);
+            rv = generateRsaKey(bits, attributeValue(publicKey, CKA_PUBLIC_EXPONENT), key);
+            break;
+        }
+        case CKM_EC_KEY_PAIR_GEN:
+            keyType = CKK_EC;
+            if (attributeValue(publicKey, CKA_EC_PARAMS) != P256_EC_PARAMS) {
+                return publicKey.has(CKA_EC_PARAMS) ? CKR_DOMAIN_PARAMS_INVALID : CKR_TEMPLATE_INCOMPLETE;
+            }
+            operation = "keygen.ec";
+            rv = generateEcKey(key);
+            break;
+        default:
+            return CKR_MECHANISM_INVALID;
+    }
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    for (SoftObject* object : {&publicKey, &privateKey}) {
+        if (object->get<CK_KEY_TYPE>(CKA_KEY_TYPE, keyType) != keyType) {
+            return CKR_TEMPLATE_INCONSISTENT;
+        }
+        object->key = key;
+        object->put(CKA_KEY_TYPE, keyType);
+        object->put<CK_BBOOL>(CKA_LOCAL, CK_TRUE);
+        object->put(CKA_KEY_GEN_MECHANISM, pMechanism->mechanism);
+    }
+
+    if (keyType == CKK_RSA) {
+        Bytes modulus;
+        Bytes exponent;
+        rv = rsaComponents(key.get(), modulus, exponent);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+        for (SoftObject* object : {&publicKey, &privateKey}) {
+            object->attributes[CKA_MODULUS] = modulus;
+            object->attributes[CKA_PUBLIC_EXPONENT] = exponent;
+        }
+    } else {
+        Bytes point;
+        rv = ecPoint(key.get(), point);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+        publicKey.attributes[CKA_EC_POINT] = point;
+        privateKey.attributes[CKA_EC_PARAMS] = P256_EC_PARAMS;
+    }
+
+    applyDefaults(publicKey, CKO_PUBLIC_KEY);
+    applyDefaults(privateKey, CKO_PRIVATE_KEY);
+    rv = checkWritable(t, *session, publicKey);
+    if (rv == CKR_OK) {
+        rv = checkWritable(t, *session, privateKey);
+    }
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    t.simulate(operation);
+    rv = storeObject(t, publicKey, hSession, *phPublicKey);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    rv = storeObject(t, privateKey, hSession, *phPrivateKey);
+    if (rv != CKR_OK) {
+        t.release(t.objects[*phPublicKey]);
+        t.objects.erase(*phPublicKey);
+    }
+    return rv;
+}
+
+CK_RV C_WrapKey(CK_SESSION_HANDLE, CK_MECHANISM_PTR, CK_OBJECT_HANDLE, CK_OBJECT_HANDLE, CK_BYTE_PTR, CK_ULONG_PTR) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_UnwrapKey(CK_SESSION_HANDLE, CK_MECHANISM_PTR, CK_OBJECT_HANDLE, CK_BYTE_PTR, CK_ULONG,
+                  CK_ATTRIBUTE_PTR, CK_ULONG, CK_OBJECT_HANDLE_PTR) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DeriveKey(CK_SESSION_HANDLE, CK_MECHANISM_PTR, CK_OBJECT_HANDLE, CK_ATTRIBUTE_PTR, CK_ULONG,
+                  CK_OBJECT_HANDLE_PTR) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+// ---- random number generation -----------------------------------------------
+
+CK_RV C_SeedRandom(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG) {
+    return CKR_RANDOM_SEED_NOT_SUPPORTED;
+}
+
+CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR RandomData, CK_ULONG ulRandomLen) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    SoftSession* session = nullptr;
+    CK_RV rv = getSession(t, hSession, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (!RandomData && ulRandomLen) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    t.simulate("random", ulRandomLen);
+    return randomBytes(RandomData, ulRandomLen);
+}
+
+// ---- parallel function management (legacy) ----------------------------------
+
+CK_RV C_GetFunctionStatus(CK_SESSION_HANDLE) {
+    return CKR_FUNCTION_NOT_PARALLEL;
+}
+
+CK_RV C_CancelFunction(CK_SESSION_HANDLE) {
+    return CKR_FUNCTION_NOT_PARALLEL;
+}
+
+CK_RV C_WaitForSlotEvent(CK_FLAGS flags, CK_SLOT_ID_PTR pSlot, CK_VOID_PTR pReserved) {
+    if (pReserved) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    CK_ULONG event = 0;
+    return auxWaitForSlotEvent(flags, pSlot, &event, nullptr, nullptr);
+}
+
+// ---- entry points -----------------------------------------------------------
+
+CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList) {
+    static CK_FUNCTION_LIST functionList = {
+        {2, 20},
+#define CK_PKCS11_FUNCTION_INFO(name) name,
+#include "pkcs11f.h"
+#undef CK_PKCS11_FUNCTION_INFO
+    };
+
+    if (!ppFunctionList) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    *ppFunctionList = &functionList;
+    return CKR_OK;
+}
+
+CK_RV E_GetAuxFunctionList(AUX_FUNC_LIST_PTR_PTR pAuxFunc) {
+    if (!pAuxFunc) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    *pAuxFunc = &auxFunctionList;
+    return CKR_OK;
+}
+
+// ---- test control -----------------------------------------------------------
+
+CK_RV SoftToken_SetTokenPresent(CK_SLOT_ID slotID, CK_BBOOL present) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    t.configure();
+    if (slotID != t.config.slotId) {
+        return CKR_SLOT_ID_INVALID;
+    }
+    if (present) {
+        t.insertToken();
+    } else {
+        t.removeToken();
+    }
+    return CKR_OK;
+}
+
+CK_RV SoftToken_SetLatencyScale(double scale) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    t.configure();
+    t.latency.setScale(scale);
+    return CKR_OK;
+}
+
+CK_RV SoftToken_Reset(CK_SLOT_ID slotID) {
+    TokenState& t = token();
+    Lock lock(t.mutex);
+    t.configure();
+    if (slotID != t.config.slotId) {
+        return CKR_SLOT_ID_INVALID;
+    }
+    t.resetToken();
+    return CKR_OK;
+}
+
+} // extern "C"
@@ -0,0 +1,189 @@
+#include "token_state.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+namespace SoftToken {
+
+namespace {
+
+std::string trim(const std::string& s) {
+    size_t begin = s.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos) {
+        return std::string();
+    }
+    size_t end = s.find_last_not_of(" \t\r\n");
+    return s.substr(begin, end - begin + 1);
+}
+
+void loadProfile(const char* path, TokenConfig& config, LatencyModel& latency) {
+    std::ifstream in(path);
+    if (!in) {
+        fprintf(stderr, "[softtoken] cannot read profile %s, using defaults\n", path);
+        return;
+    }
+
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(in, line)) {
+        lineNumber++;
+        size_t hash = line.find('#');
+        if (hash != std::string::npos) {
+            line.resize(hash);
+        }
+        line = trim(line);
+        if (line.empty()) {
+            continue;
+        }
+
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) {
+            fprintf(stderr, "[softtoken] %s:%d: expected key = value\n", path, lineNumber);
+            continue;
+        }
+
+        std::string key = trim(line.substr(0, eq));
+        std::string value = trim(line.substr(eq + 1));
+        if (!config.set(key, value) && !latency.set(key, value)) {
+            fprintf(stderr, "[softtoken] %s:%d: unknown setting '%s'\n", path, lineNumber, key.c_str());
+        }
+    }
+}
+
+} // namespace
+
+bool TokenConfig::set(const std::string& key, const std::string& value) {
+    if (key.compare(0, 6, "token.") != 0) {
+        return false;
+    }
+
+    std::string name = key.substr(6);
+    unsigned long number = strtoul(value.c_str(), nullptr, 0);
+    if (name == "slot_id") slotId = number;
+    else if (name == "label") label = value;
+    else if (name == "serial") serial = value;
+    else if (name == "user_pin") userPin = value;
+    else if (name == "so_pin") soPin = value;
+    else if (name == "user_pin_retries") userPinRetries = static_cast<CK_BYTE>(number);
+    else if (name == "so_pin_retries") soPinRetries = static_cast<CK_BYTE>(number);
+    else if (name == "min_pin_len") minPinLen = number;
+    else if (name == "max_pin_len") maxPinLen = number;
+    else if (name == "public_memory") totalPublicMemory = number;
+    else if (name == "private_memory") totalPrivateMemory = number;
+    else if (name == "max_rsa_bits") maxRsaBits = number;
+    else if (name == "max_sessions") maxSessions = number;
+    else if (name == "present") present = number != 0 || value == "true";
+    else return false;
+    return true;
+}
+
+TokenState& token() {
+    static TokenState state;
+    return state;
+}
+
+void TokenState::configure() {
+    if (configured) {
+        return;
+    }
+
+    if (const char* path = getenv("SOFTTOKEN_CONFIG")) {
+        loadProfile(path, config, latency);
+    }
+    if (const char* scale = getenv("SOFTTOKEN_LATENCY_SCALE")) {
+        latency.setScale(strtod(scale, nullptr));
+    }
+    if (const char* seed = getenv("SOFTTOKEN_SEED")) {
+        latency.seed(strtoull(seed, nullptr, 0));
+    }
+
+    resetToken();
+    present = config.present;
+    configured = true;
+}
+
+void TokenState::resetToken() {
+    objects.clear();
+    sessions.clear();
+    usedPublicMemory = 0;
+    usedPrivateMemory = 0;
+    label = config.label;
+    userPin = config.userPin;
+    soPin = config.soPin;
+    userPinCounter = config.userPinRetries;
+    soPinCounter = config.soPinRetries;
+    loggedInAs = CK_UNAVAILABLE_INFORMATION;
+    inTransaction = false;
+}
+
+void TokenState::removeToken() {
+    if (!present) {
+        return;
+    }
+
+    present = false;
+    for (auto it = objects.begin(); it != objects.end();) {
+        if (!it->second.isTokenObject()) {
+            it = objects.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    sessions.clear();
+    loggedInAs = CK_UNAVAILABLE_INFORMATION;
+    inTransaction = false;
+
+    pendingEvents.emplace_back(config.slotId, EVENT_TOKEN_REMOVED);
+    slotEvent.notify_all();
+}
+
+void TokenState::insertToken() {
+    if (present) {
+        return;
+    }
+
+    present = true;
+    pendingEvents.emplace_back(config.slotId, EVENT_TOKEN_INSERTED);
+    slotEvent.notify_all();
+}
+
+CK_RV TokenState::charge(SoftObject& object, CK_ULONG footprint) {
+    if (!object.isTokenObject()) {
+        object.footprint = 0;
+        return CKR_OK;
+    }
+
+    bool isPrivateMemory = object.isPrivate();
+    CK_ULONG& used = isPrivateMemory ? usedPrivateMemory : usedPublicMemory;
+    CK_ULONG total = isPrivateMemory ? config.totalPrivateMemory : config.totalPublicMemory;
+    CK_ULONG available = total - used + object.footprint;
+    if (footprint > available) {
+        return CKR_DEVICE_MEMORY;
+    }
+
+    used = used - object.footprint + footprint;
+    object.footprint = footprint;
+    return CKR_OK;
+}
+
+void TokenState::release(const SoftObject& object) {
+    if (!object.isTokenObject()) {
+        return;
+    }
+    CK_ULONG& used = object.isPrivate() ? usedPrivateMemory : usedPublicMemory;
+    used -= std::min(used, object.footprint);
+}
+
+void TokenState::destroySessionObjects(CK_SESSION_HANDLE session) {
+    for (auto it = objects.begin(); it != objects.end();) {
+        if (!it->second.isTokenObject() && it->second.owner == session) {
+            it = objects.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+} // namespace SoftToken
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "latency_model.h"
+#include "soft_crypto.h"
+
+extern "C" {
+#include "cryptoki_ext.h"
+#include "auxiliary.h"
+}
+
+namespace SoftToken {
+
+// Values reported through EP_WaitForSlotEvent
+constexpr CK_ULONG EVENT_TOKEN_INSERTED = 1;
+constexpr CK_ULONG EVENT_TOKEN_REMOVED = 2;
+
+struct TokenConfig {
+    CK_SLOT_ID slotId = 0;
+    std::string label = "SoftToken";
+    std::string serial = "5F0000000001";
+    std::string userPin = "1234";
+    std::string soPin = "rockey";
+    CK_BYTE userPinRetries = 6;
+    CK_BYTE soPinRetries = 6;
+    CK_ULONG minPinLen = 4;
+    CK_ULONG maxPinLen = 16;
+    CK_ULONG totalPublicMemory = 32 * 1024;
+    CK_ULONG totalPrivateMemory = 32 * 1024;
+    CK_ULONG maxRsaBits = 2048;
+    CK_ULONG maxSessions = 16;
+    bool present = true;
+
+    // Returns false if `key` is not a token setting
+    bool set(const std::string& key, const std::string& value);
+};
+
+struct SoftObject {
+    std::map<CK_ATTRIBUTE_TYPE, Bytes> attributes;
+    KeyPtr key;              // RSA/EC key material
+    Bytes secret;            // Secret key value (never stored as an attribute)
+    CK_SESSION_HANDLE owner = 0; // Owning session for session objects
+    CK_ULONG footprint = 0;  // Bytes charged against token memory
+
+    bool has(CK_ATTRIBUTE_TYPE type) const { return attributes.count(type) != 0; }
+
+    template<typename T>
+    T get(CK_ATTRIBUTE_TYPE type, T fallback) const {
+        auto it = attributes.find(type);
+        if (it == attributes.end() || it->second.size() != sizeof(T)) {
+            return fallback;
+        }
+        T value;
+        memcpy(&value, it->second.data(), sizeof(T));
+        return value;
+    }
+
+    template<typename T>
+    void put(CK_ATTRIBUTE_TYPE type, T value) {
+        Bytes bytes(sizeof(T));
+        memcpy(bytes.data(), &value, sizeof(T));
+        attributes[type] = bytes;
+    }
+
+    bool flag(CK_ATTRIBUTE_TYPE type) const { return get<CK_BBOOL>(type, CK_FALSE) == CK_TRUE; }
+    CK_OBJECT_CLASS objectClass() const { return get<CK_OBJECT_CLASS>(CKA_CLASS, CK_UNAVAILABLE_INFORMATION); }
+    bool isTokenObject() const { return flag(CKA_TOKEN); }
+    bool isPrivate() const { return flag(CKA_PRIVATE); }
+};
+
+struct CryptoOperation {
+    bool active = false;
+    CK_MECHANISM_TYPE mechanism = 0;
+    CK_OBJECT_HANDLE key = 0;
+    Bytes parameter;
+    Bytes buffered; // Accumulated input for the multi-part calls
+
+    void reset() { *this = CryptoOperation(); }
+};
+
+struct SoftSession {
+    CK_SLOT_ID slotId = 0;
+    CK_FLAGS flags = 0;
+
+    bool findActive = false;
+    std::vector<CK_OBJECT_HANDLE> findResults;
+    size_t findPosition = 0;
+
+    CryptoOperation sign;
+    CryptoOperation verify;
+    CryptoOperation encrypt;
+    CryptoOperation decrypt;
+};
+
+// The whole token. One instance per process; every entry point takes `mutex`
+// for its full duration, including the modelled delay, so concurrent callers
+// queue behind each other exactly as they would on the single-channel device.
+struct TokenState {
+    std::mutex mutex;
+    std::condition_variable slotEvent;
+
+    bool configured = false;
+    bool initialized = false;
+    TokenConfig config;
+    LatencyModel latency;
+
+    bool present = true;
+    std::string label;
+    std::string userPin;
+    std::string soPin;
+    CK_BYTE userPinCounter = 0;
+    CK_BYTE soPinCounter = 0;
+    CK_ULONG loggedInAs = CK_UNAVAILABLE_INFORMATION;
+    CK_ULONG tokenTimeoutMs = 0;
+    bool inTransaction = false;
+
+    std::map<CK_OBJECT_HANDLE, SoftObject> objects;
+    CK_OBJECT_HANDLE nextObject = 1;
+    std::map<CK_SESSION_HANDLE, SoftSession> sessions;
+    CK_SESSION_HANDLE nextSession = 1;
+    CK_ULONG usedPublicMemory = 0;
+    CK_ULONG usedPrivateMemory = 0;
+
+    std::deque<std::pair<CK_SLOT_ID, CK_ULONG>> pendingEvents;
+
+    void configure();
+    void resetToken();
+    void removeToken();
+    void insertToken();
+
+    // Sleep for the modelled cost of `operation` moving `bytes` over the link
+    void simulate(const std::string& operation, size_t bytes = 0) {
+        latency.apply(operation, bytes, inTransaction);
+    }
+
+    bool isUserLoggedIn() const { return loggedInAs == CKU_USER; }
+    bool canSee(const SoftObject& object) const { return !object.isPrivate() || isUserLoggedIn(); }
+
+    CK_RV charge(SoftObject& object, CK_ULONG footprint);
+    void release(const SoftObject& object);
+    void destroySessionObjects(CK_SESSION_HANDLE session);
+};
+
+TokenState& token();
+
+} // namespace SoftToken
@@ -0,0 +1,204 @@
+#include "envelope.h"
+#include "host_crypto.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+namespace PKCS11Lib {
+
+namespace {
+
+const char ENVELOPE_MAGIC[8] = {'P', '1', '1', 'E', 'N', 'V', '1', '\0'};
+
+void putU32(std::vector<CK_BYTE>& out, uint32_t value) {
+    out.push_back(static_cast<CK_BYTE>(value >> 24));
+    out.push_back(static_cast<CK_BYTE>(value >> 16));
+    out.push_back(static_cast<CK_BYTE>(value >> 8));
+    out.push_back(static_cast<CK_BYTE>(value));
+}
+
+uint32_t getU32(const CK_BYTE* in) {
+    return (uint32_t(in[0]) << 24) | (uint32_t(in[1]) << 16) | (uint32_t(in[2]) << 8) | uint32_t(in[3]);
+}
+
+} // namespace
+
+bool EnvelopeCipher::isEnvelopeFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    char magic[sizeof(ENVELOPE_MAGIC)];
+    return file.read(magic, sizeof(magic)) && std::memcmp(magic, ENVELOPE_MAGIC, sizeof(magic)) == 0;
+}
+
+Result<void> EnvelopeCipher::encryptFile(CK_OBJECT_HANDLE publicKeyHandle, const std::string& inputPath,
+                                         const std::string& outputPath) {
+    std::ifstream input(inputPath, std::ios::binary);
+    if (!input) {
+        return Result<void>::Error(Status::ERROR_FILE_IO, "Failed to open input file");
+    }
+
+    auto dataKey = HostCrypto::randomBytes(HostCrypto::AES256_KEY_LEN);
+    auto iv = HostCrypto::randomBytes(HostCrypto::GCM_IV_LEN);
+    if (!dataKey.isOk() || !iv.isOk()) {
+        return Result<void>::Error(Status::ERROR_RANDOM_NO_RNG, "Failed to generate data key");
+    }
+
+    // The only token round trip: wrap the data key
+    auto wrapped = lib_.encryptRSA(publicKeyHandle, dataKey.value);
+    if (!wrapped.isOk()) {
+        HostCrypto::cleanse(dataKey.value);
+        return Result<void>::Error(wrapped.errorCode, "Failed to wrap data key: " + wrapped.errorMessage,
+                                   wrapped.pkcs11Error);
+    }
+
+    std::vector<CK_BYTE> header(ENVELOPE_MAGIC, ENVELOPE_MAGIC + sizeof(ENVELOPE_MAGIC));
+    putU32(header, static_cast<uint32_t>(wrapped.value.size()));
+    header.insert(header.end(), wrapped.value.begin(), wrapped.value.end());
+    header.insert(header.end(), iv.value.begin(), iv.value.end());
+
+    HostCrypto::AesGcm cipher;
+    auto result = cipher.init(HostCrypto::AesGcm::Direction::Encrypt, dataKey.value, iv.value);
+    HostCrypto::cleanse(dataKey.value);
+    if (result.isOk()) {
+        result = cipher.addAAD(header.data(), header.size());
+    }
+    if (!result.isOk()) {
+        return result;
+    }
+
+    std::ofstream output(outputPath, std::ios::binary | std::ios::trunc);
+    if (!output || !output.write(reinterpret_cast<const char*>(header.data()), header.size())) {
+        return Result<void>::Error(Status::ERROR_FILE_IO, "Failed to open output file");
+    }
+
+    std::vector<CK_BYTE> in(CHUNK_SIZE), out(CHUNK_SIZE);
+    while (input) {
+        input.read(reinterpret_cast<char*>(in.data()), in.size());
+        size_t got = static_cast<size_t>(input.gcount());
+        if (got == 0) {
+            break;
+        }
+        result = cipher.update(in.data(), got, out.data());
+        if (!result.isOk()) {
+            output.close();
+            std::remove(outputPath.c_str());
+            return result;
+        }
+        if (!output.write(reinterpret_cast<const char*>(out.data()), got)) {
+            output.close();
+            std::remove(outputPath.c_str());
+            return Result<void>::Error(Status::ERROR_FILE_IO, "Failed to write ciphertext");
+        }
+    }
+    if (input.bad()) {
+        output.close();
+        std::remove(outputPath.c_str());
+        return Result<void>::Error(Status::ERROR_FILE_IO, "Failed to read input file");
+    }
+
+    auto tag = cipher.finishEncrypt();
+    if (!tag.isOk() || !output.write(reinterpret_cast<const char*>(tag.value.data()), tag.value.size())) {
+        output.close();
+        std::remove(outputPath.c_str());
+        return Result<void>::Error(Status::ERROR_FILE_IO, "Failed to finalize envelope");
+    }
+
+    // A full disk may only show when the buffered tail is written out
+    output.close();
+    if (output.fail()) {
+        std::remove(outputPath.c_str());
+        return Result<void>::Error(Status::ERROR_FILE_IO, "Failed to write ciphertext");
+    }
+    return Result<void>::Ok();
+}
+
+Result<void> EnvelopeCipher::decryptFile(CK_OBJECT_HANDLE privateKeyHandle, const std::string& inputPath,
+                                         const std::string& outputPath) {
+    std::ifstream input(inputPath, std::ios::binary | std::ios::ate);
+    if (!input) {
+        return Result<void>::Error(Status::ERROR_FILE_IO, "Failed to open input file");
+    }
+    const uint64_t fileSize = static_cast<uint64_t>(input.tellg());
+    input.seekg(0);
+
+    std::vector<CK_BYTE> header(sizeof(ENVELOPE_MAGIC) + 4);
+    if (!input.read(reinterpret_cast<char*>(header.data()), header.size()) ||
+        std::memcmp(header.data(), ENVELOPE_MAGIC, sizeof(ENVELOPE_MAGIC)) != 0) {
+        return Result<void>::Error(Status::ERROR_ENCRYPTED_DATA_INVALID, "Not an envelope file");
+    }
+
+    uint32_t wrappedLen = getU32(header.data() + sizeof(ENVELOPE_MAGIC));
+    const uint64_t fixedLen = header.size() + HostCrypto::GCM_IV_LEN + HostCrypto::GCM_TAG_LEN;
+    if (wrappedLen == 0 || wrappedLen > 4096 || fileSize < fixedLen + wrappedLen) {
+        return Result<void>::Error(Status::ERROR_ENCRYPTED_DATA_LEN_RANGE, "Malformed envelope header");
+    }
+
+    size_t prefix = header.size();
+    header.resize(prefix + wrappedLen + HostCrypto::GCM_IV_LEN);
+    if (!input.read(reinterpret_cast<char*>(header.data() + prefix), header.size() - prefix)) {
+        return Result<void>::Error(Status::ERROR_FILE_IO, "Failed to read envelope header");
+    }
+
+    std::vector<CK_BYTE> wrapped(header.begin() + prefix, header.begin() + prefix + wrappedLen);
+    std::vector<CK_BYTE> iv(header.end() - HostCrypto::GCM_IV_LEN, header.end());
+
+    // Unwrap once, then stream the payload on the host
+    auto dataKey = lib_.decryptRSA(privateKeyHandle, wrapped);
+    if (!dataKey.isOk()) {
+        return Result<void>::Error(dataKey.errorCode, "Failed to unwrap data key: " + dataKey.errorMessage,
+                                   dataKey.pkcs11Error);
+    }
+
+    HostCrypto::AesGcm cipher;
+    auto result = cipher.init(HostCrypto::AesGcm::Direction::Decrypt, dataKey.value, iv);
+    HostCrypto::cleanse(dataKey.value);
+    if (result.isOk()) {
+        result = cipher.addAAD(header.data(), header.size());
+    }
+    if (!result.isOk()) {
+        return result;
+    }
+
+    std::ofstream output(outputPath, std::ios::binary | std::ios::trunc);
+    if (!output) {
+        return Result<void>::Error(Status::ERROR_FILE_IO, "Failed to open output file");
+    }
+
+    uint64_t remaining = fileSize - header.size() - HostCrypto::GCM_TAG_LEN;
+    std::vector<CK_BYTE> in(CHUNK_SIZE), out(CHUNK_SIZE);
+    while (remaining > 0) {
+        size_t step = remaining < in.size() ? static_cast<size_t>(remaining) : in.size();
+        if (!input.read(reinterpret_cast<char*>(in.data()), step)) {
+            result = Result<void>::Error(Status::ERROR_FILE_IO, "Failed to read ciphertext");
+            break;
+        }
+        result = cipher.update(in.data(), step, out.data());
+        if (!result.isOk()) {
+            break;
+        }
+        if (!output.write(reinterpret_cast<const char*>(out.data()), step)) {
+            result = Result<void>::Error(Status::ERROR_FILE_IO, "Failed to write plaintext");
+            break;
+        }
+        remaining -= step;
+    }
+
+    std::vector<CK_BYTE> tag(HostCrypto::GCM_TAG_LEN);
+    if (result.isOk() && !input.read(reinterpret_cast<char*>(tag.data()), tag.size())) {
+        result = Result<void>::Error(Status::ERROR_FILE_IO, "Failed to read authentication tag");
+    }
+    if (result.isOk()) {
+        result = cipher.finishDecrypt(tag);
+    }
+    output.close();
+    if (result.isOk() && output.fail()) {
+        result = Result<void>::Error(Status::ERROR_FILE_IO, "Failed to write plaintext");
+    }
+
+    // Never leave unauthenticated or truncated plaintext behind
+    if (!result.isOk()) {
+        std::remove(outputPath.c_str());
+    }
+    return result;
+}
+
+} // namespace PKCS11Lib
@@ -0,0 +1,139 @@
+#include "host_crypto.h"
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <limits>
+
+namespace PKCS11Lib {
+namespace HostCrypto {
+
+Result<std::vector<CK_BYTE>> randomBytes(size_t count) {
+    std::vector<CK_BYTE> bytes(count);
+    if (count > static_cast<size_t>(std::numeric_limits<int>::max()) ||
+        RAND_bytes(bytes.data(), static_cast<int>(count)) != 1) {
+        return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_RANDOM_NO_RNG, "Failed to generate random bytes");
+    }
+    return Result<std::vector<CK_BYTE>>::Ok(bytes);
+}
+
+Result<std::vector<CK_BYTE>> digest(HashAlgorithm algorithm, const std::vector<CK_BYTE>& data) {
+    const EVP_MD* md = nullptr;
+    switch (algorithm) {
+        case HashAlgorithm::SHA1: md = EVP_sha1(); break;
+        case HashAlgorithm::SHA224: md = EVP_sha224(); break;
+        case HashAlgorithm::SHA256: md = EVP_sha256(); break;
+        case HashAlgorithm::SHA384: md = EVP_sha384(); break;
+        case HashAlgorithm::SHA512: md = EVP_sha512(); break;
+        case HashAlgorithm::MD5: md = EVP_md5(); break;
+    }
+    if (!md) {
+        return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_UNSUPPORTED_ALGORITHM, "Unsupported hash algorithm");
+    }
+
+    std::vector<CK_BYTE> hash(EVP_MAX_MD_SIZE);
+    unsigned int hashLen = 0;
+    if (EVP_Digest(data.data(), data.size(), hash.data(), &hashLen, md, nullptr) != 1) {
+        return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_FUNCTION_FAILED, "Failed to compute digest");
+    }
+
+    hash.resize(hashLen);
+    return Result<std::vector<CK_BYTE>>::Ok(hash);
+}
+
+void cleanse(std::vector<CK_BYTE>& buffer) {
+    if (!buffer.empty()) {
+        OPENSSL_cleanse(buffer.data(), buffer.size());
+    }
+    buffer.clear();
+}
+
+AesGcm::AesGcm() : ctx_(EVP_CIPHER_CTX_new()), direction_(Direction::Encrypt) {
+}
+
+AesGcm::~AesGcm() {
+    EVP_CIPHER_CTX_free(static_cast<EVP_CIPHER_CTX*>(ctx_));
+}
+
+Result<void> AesGcm::init(Direction direction, const std::vector<CK_BYTE>& key, const std::vector<CK_BYTE>& iv) {
+    auto ctx = static_cast<EVP_CIPHER_CTX*>(ctx_);
+    if (!ctx) {
+        return Result<void>::Error(Status::ERROR_MEMORY, "Failed to allocate cipher context");
+    }
+    if (key.size() != AES256_KEY_LEN || iv.size() != GCM_IV_LEN) {
+        return Result<void>::Error(Status::ERROR_INVALID_PARAMETER, "Invalid AES-256-GCM key or IV length");
+    }
+
+    direction_ = direction;
+    int enc = direction == Direction::Encrypt ? 1 : 0;
+    if (EVP_CipherInit_ex(ctx, EVP_aes_256_gcm(), nullptr, nullptr, nullptr, enc) != 1 ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, static_cast<int>(iv.size()), nullptr) != 1 ||
+        EVP_CipherInit_ex(ctx, nullptr, nullptr, key.data(), iv.data(), enc) != 1) {
+        return Result<void>::Error(Status::ERROR_FUNCTION_FAILED, "Failed to initialize AES-256-GCM");
+    }
+
+    return Result<void>::Ok();
+}
+
+Result<void> AesGcm::addAAD(const CK_BYTE* data, size_t length) {
+    int outLen = 0;
+    if (EVP_CipherUpdate(static_cast<EVP_CIPHER_CTX*>(ctx_), nullptr, &outLen, data, static_cast<int>(length)) != 1) {
+        return Result<void>::Error(Status::ERROR_FUNCTION_FAILED, "Failed to add associated data");
+    }
+    return Result<void>::Ok();
+}
+
+Result<void> AesGcm::update(const CK_BYTE* in, size_t length, CK_BYTE* out) {
+    auto ctx = static_cast<EVP_CIPHER_CTX*>(ctx_);
+    // EVP takes int lengths; split very large buffers
+    const size_t maxStep = static_cast<size_t>(std::numeric_limits<int>::max()) & ~static_cast<size_t>(15);
+    while (length > 0) {
+        size_t step = length < maxStep ? length : maxStep;
+        int outLen = 0;
+        if (EVP_CipherUpdate(ctx, out, &outLen, in, static_cast<int>(step)) != 1) {
+            return Result<void>::Error(Status::ERROR_FUNCTION_FAILED, "AES-256-GCM update failed");
+        }
+        in += step;
+        out += outLen;
+        length -= step;
+    }
+    return Result<void>::Ok();
+}
+
+Result<std::vector<CK_BYTE>> AesGcm::finishEncrypt() {
+    auto ctx = static_cast<EVP_CIPHER_CTX*>(ctx_);
+    if (direction_ != Direction::Encrypt) {
+        return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_OPERATION_NOT_INITIALIZED, "Cipher not in encrypt mode");
+    }
+
+    CK_BYTE trailing[16];
+    int outLen = 0;
+    std::vector<CK_BYTE> tag(GCM_TAG_LEN);
+    if (EVP_CipherFinal_ex(ctx, trailing, &outLen) != 1 ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, static_cast<int>(tag.size()), tag.data()) != 1) {
+        return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_FUNCTION_FAILED, "Failed to finalize AES-256-GCM");
+    }
+
+    return Result<std::vector<CK_BYTE>>::Ok(tag);
+}
+
+Result<void> AesGcm::finishDecrypt(const std::vector<CK_BYTE>& tag) {
+    auto ctx = static_cast<EVP_CIPHER_CTX*>(ctx_);
+    if (direction_ != Direction::Decrypt) {
+        return Result<void>::Error(Status::ERROR_OPERATION_NOT_INITIALIZED, "Cipher not in decrypt mode");
+    }
+    if (tag.size() != GCM_TAG_LEN) {
+        return Result<void>::Error(Status::ERROR_ENCRYPTED_DATA_INVALID, "Invalid authentication tag length");
+    }
+
+    CK_BYTE trailing[16];
+    int outLen = 0;
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, static_cast<int>(tag.size()), (void*)tag.data()) != 1 ||
+        EVP_CipherFinal_ex(ctx, trailing, &outLen) != 1) {
+        return Result<void>::Error(Status::ERROR_ENCRYPTED_DATA_INVALID, "Authentication tag mismatch");
+    }
+
+    return Result<void>::Ok();
+}
+
+} // namespace HostCrypto
+} // namespace PKCS11Lib
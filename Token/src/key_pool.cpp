@@ -0,0 +1,197 @@
+#include "key_pool.h"
+#include "host_crypto.h"
+#include <algorithm>
+
+namespace PKCS11Lib {
+
+KeyPairPool::KeyPairPool(PKCS11Library& lib, const KeyPoolConfig& config)
+    : lib_(lib), config_(config), running_(false) {
+}
+
+KeyPairPool::~KeyPairPool() {
+    stop();
+}
+
+Result<void> KeyPairPool::start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_) {
+        return Result<void>::Ok();
+    }
+    if (!lib_.isSessionOpen()) {
+        return Result<void>::Error(Status::ERROR_GENERAL, "No session open");
+    }
+
+    if (config_.tokenObjects) {
+        adoptExisting();
+    }
+
+    running_ = true;
+    filler_ = std::thread(&KeyPairPool::fillerLoop, this);
+    return Result<void>::Ok();
+}
+
+void KeyPairPool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!running_) {
+            return;
+        }
+        running_ = false;
+    }
+    wakeup_.notify_all();
+    if (filler_.joinable()) {
+        filler_.join();
+    }
+}
+
+size_t KeyPairPool::available() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return ready_.size();
+}
+
+Result<KeyPair> KeyPairPool::claim(const std::string& label) {
+    KeyPair pair;
+    bool pooled = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!ready_.empty()) {
+            pair = ready_.front();
+            ready_.pop_front();
+            pooled = true;
+        }
+    }
+    wakeup_.notify_one();
+
+    if (!pooled) {
+        return generate(label);
+    }
+
+    auto result = relabel(pair, label);
+    if (!result.isOk()) {
+        return Result<KeyPair>::Error(result.errorCode, "Failed to relabel pooled key pair: " + result.errorMessage,
+                                      result.pkcs11Error);
+    }
+    return Result<KeyPair>::Ok(pair);
+}
+
+void KeyPairPool::fillerLoop() {
+    const auto pollInterval = std::max(config_.idleDelay / 5, std::chrono::milliseconds(10));
+    const size_t target = std::min(config_.depth, config_.capacity);
+    // The library's last call tells a foreground caller's short calls between
+    // two polls apart from idleness; the pool's own calls end at ownCalls
+    std::chrono::steady_clock::time_point ownCalls;
+    std::chrono::steady_clock::time_point backOffUntil;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (running_) {
+        wakeup_.wait_for(lock, pollInterval);
+        if (!running_) {
+            break;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (ready_.size() >= target || now < backOffUntil) {
+            continue;
+        }
+
+        lock.unlock();
+        Result<KeyPair> generated = Result<KeyPair>::Error(Status::ERROR_GENERAL);
+        {
+            // Never queue behind a foreground caller: a held mutex means the token is busy
+            std::unique_lock<LibraryMutex> tokenLock(lib_.mutex(), std::try_to_lock);
+            if (tokenLock.owns_lock()) {
+                auto lastCall = lib_.lastCallTime();
+                bool idle = lastCall <= ownCalls || now - lastCall >= config_.idleDelay;
+                if (idle && lib_.isSessionOpen() && hasRoomOnToken(lib_.currentSlotId())) {
+                    generated = generate(nextPoolLabel());
+                    if (!generated.isOk()) {
+                        // Back off instead of hammering a full or failing token
+                        backOffUntil = std::chrono::steady_clock::now() + 60 * config_.idleDelay;
+                    }
+                }
+                if (idle) {
+                    ownCalls = lib_.lastCallTime();
+                }
+            }
+        }
+        lock.lock();
+
+        if (generated.isOk()) {
+            ready_.push_back(generated.value);
+        }
+    }
+}
+
+bool KeyPairPool::hasRoomOnToken(CK_SLOT_ID slotId) {
+    if (!config_.tokenObjects) {
+        return true;
+    }
+
+    auto info = lib_.getTokenInfo(slotId);
+    if (!info.isOk()) {
+        return false;
+    }
+
+    // CK_UNAVAILABLE_INFORMATION / CK_EFFECTIVELY_INFINITE: trust the token
+    CK_ULONG freeMemory = info.value.freePrivateMemory;
+    if (freeMemory == CK_UNAVAILABLE_INFORMATION || freeMemory == CK_EFFECTIVELY_INFINITE) {
+        return true;
+    }
+    return freeMemory >= config_.reservedPrivateMemory + config_.estimatedPairSize;
+}
+
+Result<KeyPair> KeyPairPool::generate(const std::string& label) {
+    if (config_.kind == KeyPoolConfig::KeyKind::EC_P256) {
+        return lib_.generateECKeyPair(label, config_.tokenObjects);
+    }
+    return lib_.generateRSAKeyPair(config_.modulusBits, label, config_.tokenObjects);
+}
+
+Result<void> KeyPairPool::relabel(KeyPair& pair, const std::string& label) {
+    std::vector<CK_BYTE> value(label.begin(), label.end());
+
+    TokenTransaction transaction(lib_);
+    auto result = lib_.setObjectAttribute(pair.publicKey.handle, CKA_LABEL, value);
+    if (result.isOk()) {
+        result = lib_.setObjectAttribute(pair.privateKey.handle, CKA_LABEL, value);
+    }
+    if (result.isOk()) {
+        pair.publicKey.label = label;
+        pair.privateKey.label = label;
+    }
+    return result;
+}
+
+void KeyPairPool::adoptExisting() {
+    auto publicKeys = lib_.findKeys(CKO_PUBLIC_KEY);
+    auto privateKeys = lib_.findKeys(CKO_PRIVATE_KEY);
+    if (!publicKeys.isOk() || !privateKeys.isOk()) {
+        return;
+    }
+
+    const CK_KEY_TYPE keyType = config_.kind == KeyPoolConfig::KeyKind::EC_P256 ? CKK_EC : CKK_RSA;
+    for (const auto& priv : privateKeys.value) {
+        if (ready_.size() >= config_.capacity) {
+            break;
+        }
+        if (priv.keyType != keyType || priv.label.compare(0, config_.labelPrefix.size(), config_.labelPrefix) != 0) {
+            continue;
+        }
+        for (const auto& pub : publicKeys.value) {
+            if (pub.label == priv.label) {
+                ready_.push_back(KeyPair{pub, priv});
+                break;
+            }
+        }
+    }
+}
+
+std::string KeyPairPool::nextPoolLabel() {
+    auto suffix = HostCrypto::randomBytes(8);
+    if (suffix.isOk()) {
+        return config_.labelPrefix + PKCS11Library::bytesToHex(suffix.value);
+    }
+    return config_.labelPrefix + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+}
+
+} // namespace PKCS11Lib
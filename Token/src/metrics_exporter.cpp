@@ -0,0 +1,413 @@
+#include "metrics_exporter.h"
+#include "key_pool.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+namespace PKCS11Lib {
+
+namespace {
+
+// How long a connected client gets to send an HTTP request line before it is
+// treated as a plain socket reader
+constexpr int REQUEST_WAIT_MS = 200;
+
+// A client that stops reading is dropped once a send stalls this long, so it
+// cannot hold up the exporter thread
+constexpr int SEND_TIMEOUT_MS = 1000;
+
+class TextWriter {
+public:
+    void help(const char* name, const char* type, const char* text) {
+        out_ += "# HELP ";
+        out_ += name;
+        out_ += ' ';
+        out_ += text;
+        out_ += "\n# TYPE ";
+        out_ += name;
+        out_ += ' ';
+        out_ += type;
+        out_ += '\n';
+    }
+
+    void sample(const char* name, const std::string& labels, double value) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), " %.9g\n", value);
+        out_ += name;
+        if (!labels.empty()) {
+            out_ += '{';
+            out_ += labels;
+            out_ += '}';
+        }
+        out_ += buf;
+    }
+
+    std::string take() { return std::move(out_); }
+
+private:
+    std::string out_;
+};
+
+std::string functionLabel(const FunctionStats& stats) {
+    return std::string("function=\"") + stats.name() + "\"";
+}
+
+bool knownValue(CK_ULONG value) {
+    return value != CK_UNAVAILABLE_INFORMATION && value != CK_EFFECTIVELY_INFINITE;
+}
+
+bool sendAll(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        length -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+} // namespace
+
+MetricsExporter::MetricsExporter(PKCS11Library& lib, const MetricsExporterConfig& config)
+    : lib_(lib), config_(config), listenFd_(-1), wakeFd_(-1), running_(false) {
+}
+
+MetricsExporter::~MetricsExporter() {
+    stop();
+}
+
+Result<void> MetricsExporter::start() {
+    if (running_) {
+        return Result<void>::Ok();
+    }
+    if (config_.socketPath.empty() && config_.filePath.empty()) {
+        return Result<void>::Error(Status::ERROR_INVALID_PARAMETER, "Neither a socket nor a file path is configured");
+    }
+
+    if (!config_.socketPath.empty()) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (config_.socketPath.size() >= sizeof(address.sun_path)) {
+            return Result<void>::Error(Status::ERROR_INVALID_PARAMETER, "Socket path too long");
+        }
+        strncpy(address.sun_path, config_.socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+        listenFd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (listenFd_ < 0) {
+            return Result<void>::Error(Status::ERROR_FILE_IO, "Failed to create socket");
+        }
+        unlink(config_.socketPath.c_str()); // Stale socket from a previous run
+        if (bind(listenFd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            listen(listenFd_, 8) != 0) {
+            close(listenFd_);
+            listenFd_ = -1;
+            return Result<void>::Error(Status::ERROR_FILE_IO, "Failed to listen on " + config_.socketPath);
+        }
+    }
+
+    wakeFd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wakeFd_ < 0) {
+        if (listenFd_ >= 0) {
+            close(listenFd_);
+            listenFd_ = -1;
+            unlink(config_.socketPath.c_str());
+        }
+        return Result<void>::Error(Status::ERROR_GENERAL, "Failed to create wakeup descriptor");
+    }
+
+    lib_.metrics().setEnabled(true);
+    running_ = true;
+    thread_ = std::thread(&MetricsExporter::run, this);
+    return Result<void>::Ok();
+}
+
+void MetricsExporter::stop() {
+    if (!running_.exchange(false)) {
+        return;
+    }
+    uint64_t one = 1;
+    if (write(wakeFd_, &one, sizeof(one)) < 0) {
+        // The thread also wakes at the next interval
+    }
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+
+    close(wakeFd_);
+    wakeFd_ = -1;
+    if (listenFd_ >= 0) {
+        close(listenFd_);
+        listenFd_ = -1;
+        unlink(config_.socketPath.c_str());
+    }
+}
+
+void MetricsExporter::run() {
+    auto nextTick = std::chrono::steady_clock::now();
+    while (running_) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= nextTick) {
+            sampleToken();
+            updateRates(lib_.metrics().snapshot());
+            if (!config_.filePath.empty()) {
+                writeFile();
+            }
+            nextTick = now + config_.interval;
+        }
+
+        pollfd fds[2] = {{wakeFd_, POLLIN, 0}, {listenFd_, POLLIN, 0}};
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(nextTick - now).count();
+        int ready = poll(fds, listenFd_ >= 0 ? 2 : 1, static_cast<int>(std::max<long long>(wait, 0)));
+        if (ready <= 0) {
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            uint64_t value;
+            if (read(wakeFd_, &value, sizeof(value)) < 0) {
+                // Nonblocking, already drained
+            }
+        }
+        if (listenFd_ >= 0 && (fds[1].revents & POLLIN)) {
+            int client = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client >= 0) {
+                timeval timeout = {SEND_TIMEOUT_MS / 1000, (SEND_TIMEOUT_MS % 1000) * 1000};
+                setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                serveClient(client);
+                close(client);
+            }
+        }
+    }
+}
+
+void MetricsExporter::sampleToken() {
+    TokenSample sample;
+    {
+        // Never queue behind a foreground caller: a held mutex means the token is busy
+        std::unique_lock<LibraryMutex> tokenLock(lib_.mutex(), std::try_to_lock);
+        if (!tokenLock.owns_lock() || !lib_.isInitialized()) {
+            return;
+        }
+
+        // The probe notices a pulled token and drops a session that went with
+        // it; sampling only a live session keeps getPinInfo() from ever
+        // starting session recovery on the exporter thread
+        auto probe = lib_.probeToken();
+        bool present = probe.isOk() && probe.value.present;
+
+        sample.valid = true;
+        sample.takenAt = std::chrono::steady_clock::now();
+        sample.sessionOpen = lib_.isSessionOpen();
+        sample.loggedIn = lib_.isLoggedIn();
+        if (present && sample.sessionOpen) {
+            auto pinInfo = lib_.getPinInfo();
+            if (pinInfo.isOk()) {
+                sample.havePinInfo = true;
+                sample.pinInfo = pinInfo.value;
+            }
+        }
+        if (present) {
+            auto tokenInfo = lib_.getTokenInfo(lib_.currentSlotId());
+            if (tokenInfo.isOk()) {
+                sample.haveTokenInfo = true;
+                sample.tokenInfo = tokenInfo.value;
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    sample_ = sample;
+}
+
+void MetricsExporter::updateRates(const MetricsSnapshot& snapshot) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    double seconds = std::chrono::duration<double>(now - rates_.at).count();
+    bool first = rates_.at == std::chrono::steady_clock::time_point();
+    std::map<P11Function, uint64_t> calls;
+    std::map<P11Function, double> perSecond;
+    for (const auto& stats : snapshot.functions) {
+        calls[stats.function] = stats.calls;
+        auto previous = rates_.calls.find(stats.function);
+        uint64_t before = previous != rates_.calls.end() ? previous->second : 0;
+        // A metrics reset makes the counter go backwards; count from zero then
+        uint64_t delta = stats.calls >= before ? stats.calls - before : stats.calls;
+        if (!first && seconds > 0) {
+            perSecond[stats.function] = delta / seconds;
+        }
+    }
+    rates_.at = now;
+    rates_.calls = std::move(calls);
+    rates_.perSecond = std::move(perSecond);
+}
+
+std::string MetricsExporter::render() {
+    MetricsSnapshot snapshot = lib_.metrics().snapshot();
+    TokenSample sample;
+    std::map<P11Function, double> perSecond;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sample = sample_;
+        perSecond = rates_.perSecond;
+    }
+
+    TextWriter out;
+
+    out.help("pkcs11_calls_total", "counter", "PKCS#11 and aux calls made by the library.");
+    for (const auto& stats : snapshot.functions) {
+        out.sample("pkcs11_calls_total", functionLabel(stats), static_cast<double>(stats.calls));
+    }
+    out.help("pkcs11_errors_total", "counter", "Calls that returned an error.");
+    for (const auto& stats : snapshot.functions) {
+        out.sample("pkcs11_errors_total", functionLabel(stats), static_cast<double>(stats.errors));
+    }
+    out.help("pkcs11_calls_per_second", "gauge", "Call rate over the last exporter interval.");
+    for (const auto& stats : snapshot.functions) {
+        auto it = perSecond.find(stats.function);
+        out.sample("pkcs11_calls_per_second", functionLabel(stats), it != perSecond.end() ? it->second : 0.0);
+    }
+
+    out.help("pkcs11_call_duration_seconds", "summary", "Call latency since the metrics were last reset.");
+    for (const auto& stats : snapshot.functions) {
+        std::string label = functionLabel(stats);
+        out.sample("pkcs11_call_duration_seconds", label + ",quantile=\"0.5\"", stats.p50Nanos / 1e9);
+        out.sample("pkcs11_call_duration_seconds", label + ",quantile=\"0.9\"", stats.p90Nanos / 1e9);
+        out.sample("pkcs11_call_duration_seconds", label + ",quantile=\"0.99\"", stats.p99Nanos / 1e9);
+        out.sample("pkcs11_call_duration_seconds_sum", label, stats.totalNanos / 1e9);
+        out.sample("pkcs11_call_duration_seconds_count", label, static_cast<double>(stats.calls));
+    }
+    out.help("pkcs11_call_duration_max_seconds", "gauge", "Slowest call since the metrics were last reset.");
+    for (const auto& stats : snapshot.functions) {
+        out.sample("pkcs11_call_duration_max_seconds", functionLabel(stats), stats.maxNanos / 1e9);
+    }
+
+    out.help("pkcs11_bytes_total", "counter", "Data bytes passed to and returned by the token.");
+    for (const auto& stats : snapshot.functions) {
+        if (stats.bytesIn || stats.bytesOut) {
+            std::string label = functionLabel(stats);
+            out.sample("pkcs11_bytes_total", label + ",direction=\"in\"", static_cast<double>(stats.bytesIn));
+            out.sample("pkcs11_bytes_total", label + ",direction=\"out\"", static_cast<double>(stats.bytesOut));
+        }
+    }
+
+    uint64_t loginFailures = 0;
+    if (const FunctionStats* login = snapshot.find(P11Function::C_Login)) {
+        for (const auto& entry : login->errorsByRv) {
+            if (entry.first != CKR_USER_ALREADY_LOGGED_IN) {
+                loginFailures += entry.second;
+            }
+        }
+    }
+    out.help("pkcs11_login_failures_total", "counter", "Failed C_Login calls.");
+    out.sample("pkcs11_login_failures_total", "", static_cast<double>(loginFailures));
+
+    if (config_.keyPool) {
+        out.help("pkcs11_keypool_available", "gauge", "Pre-generated key pairs ready to claim.");
+        out.sample("pkcs11_keypool_available", "", static_cast<double>(config_.keyPool->available()));
+        out.help("pkcs11_keypool_capacity", "gauge", "Maximum pooled key pairs.");
+        out.sample("pkcs11_keypool_capacity", "", static_cast<double>(config_.keyPool->capacity()));
+    }
+
+    if (sample.valid) {
+        out.help("pkcs11_token_sample_age_seconds", "gauge", "Age of the token state below.");
+        out.sample("pkcs11_token_sample_age_seconds", "",
+                   std::chrono::duration<double>(std::chrono::steady_clock::now() - sample.takenAt).count());
+        out.help("pkcs11_session_open", "gauge", "Whether the library holds an open session.");
+        out.sample("pkcs11_session_open", "", sample.sessionOpen ? 1 : 0);
+        out.help("pkcs11_logged_in", "gauge", "Whether the session is logged in.");
+        out.sample("pkcs11_logged_in", "", sample.loggedIn ? 1 : 0);
+    }
+
+    if (sample.havePinInfo) {
+        const PinInfo& pin = sample.pinInfo;
+        out.help("pkcs11_pin_retries_remaining", "gauge", "PIN attempts left before the PIN locks.");
+        out.sample("pkcs11_pin_retries_remaining", "user=\"user\"", pin.userCurCounter);
+        out.sample("pkcs11_pin_retries_remaining", "user=\"so\"", pin.soCurCounter);
+        out.help("pkcs11_pin_retries_max", "gauge", "PIN attempts allowed.");
+        out.sample("pkcs11_pin_retries_max", "user=\"user\"", pin.userMaxRetries);
+        out.sample("pkcs11_pin_retries_max", "user=\"so\"", pin.soMaxRetries);
+    }
+
+    if (sample.haveTokenInfo) {
+        const TokenInfo& info = sample.tokenInfo;
+        out.help("pkcs11_token_memory_free_bytes", "gauge", "Free token memory.");
+        if (knownValue(info.freePublicMemory)) {
+            out.sample("pkcs11_token_memory_free_bytes", "kind=\"public\"", static_cast<double>(info.freePublicMemory));
+        }
+        if (knownValue(info.freePrivateMemory)) {
+            out.sample("pkcs11_token_memory_free_bytes", "kind=\"private\"", static_cast<double>(info.freePrivateMemory));
+        }
+        out.help("pkcs11_token_memory_total_bytes", "gauge", "Total token memory.");
+        if (knownValue(info.totalPublicMemory)) {
+            out.sample("pkcs11_token_memory_total_bytes", "kind=\"public\"", static_cast<double>(info.totalPublicMemory));
+        }
+        if (knownValue(info.totalPrivateMemory)) {
+            out.sample("pkcs11_token_memory_total_bytes", "kind=\"private\"", static_cast<double>(info.totalPrivateMemory));
+        }
+        out.help("pkcs11_token_sessions", "gauge", "Sessions open on the token, all applications.");
+        if (knownValue(info.sessionCount)) {
+            out.sample("pkcs11_token_sessions", "type=\"all\"", static_cast<double>(info.sessionCount));
+        }
+        if (knownValue(info.rwSessionCount)) {
+            out.sample("pkcs11_token_sessions", "type=\"rw\"", static_cast<double>(info.rwSessionCount));
+        }
+        out.help("pkcs11_token_sessions_max", "gauge", "Session limit of the token.");
+        if (knownValue(info.maxSessionCount)) {
+            out.sample("pkcs11_token_sessions_max", "type=\"all\"", static_cast<double>(info.maxSessionCount));
+        }
+        if (knownValue(info.maxRwSessionCount)) {
+            out.sample("pkcs11_token_sessions_max", "type=\"rw\"", static_cast<double>(info.maxRwSessionCount));
+        }
+    }
+
+    return out.take();
+}
+
+void MetricsExporter::serveClient(int fd) {
+    char request[512];
+    ssize_t received = 0;
+    pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, REQUEST_WAIT_MS) > 0) {
+        received = recv(fd, request, sizeof(request) - 1, 0);
+    }
+
+    std::string body = render();
+    if (received >= 4 && memcmp(request, "GET ", 4) == 0) {
+        char header[160];
+        int length = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\nConnection: close\r\n\r\n", body.size());
+        if (!sendAll(fd, header, static_cast<size_t>(length))) {
+            return;
+        }
+    }
+    sendAll(fd, body.data(), body.size());
+}
+
+void MetricsExporter::writeFile() {
+    // Write-then-rename so that readers never see a partial file
+    std::string temporary = config_.filePath + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "w");
+    if (!file) {
+        return;
+    }
+    std::string body = render();
+    bool ok = fwrite(body.data(), 1, body.size(), file) == body.size();
+    ok = fclose(file) == 0 && ok;
+    if (ok) {
+        rename(temporary.c_str(), config_.filePath.c_str());
+    } else {
+        unlink(temporary.c_str());
+    }
+}
+
+} // namespace PKCS11Lib
@@ -1,17 +1,226 @@
 #include "pkcs11_lib.h"
+#include "host_crypto.h"
+#include "public_key.h"
+#include "pkcs12.h"
+#include "p11_trace_capture.h"
+#include "token_probes.h"
 #include <dlfcn.h>
 #include <cstring>
 #include <fstream>
 #include <sstream>
 #include <iomanip>
 #include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <condition_variable>
+#include <thread>
+
+PKCS11LIB_DEFINE_PROBE_SEMAPHORES()
 
 namespace PKCS11Lib {
 
+// DER-encoded OID 1.2.840.10045.3.1.7 (prime256v1 / NIST P-256)
+static const CK_BYTE P256_EC_PARAMS[] = {0x06, 0x08, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x03, 0x01, 0x07};
+static const size_t P256_COORDINATE_LEN = 32;
+
+// Waits alongside a module call made under an OperationContext and
+// interrupts the call when the context expires. One thread per library,
+// started on first use; it checks for cancellation every CANCEL_POLL.
+class PKCS11Library::Watchdog {
+public:
+    enum class Outcome {
+        NotFired,
+        Unable,         // fired, but the module cannot be interrupted
+        Cancelled,      // C_CancelFunction stopped the call
+        Closed          // the call's session was closed under it
+    };
+
+    explicit Watchdog(std::function<CK_RV(CK_SESSION_HANDLE)> interrupt)
+        : interrupt_(std::move(interrupt)), context_(nullptr), session_(0), armed_(false),
+          outcome_(Outcome::NotFired), stopping_(false) {}
+
+    ~Watchdog() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    void arm(const OperationContext& context, CK_SESSION_HANDLE session) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!thread_.joinable()) {
+                thread_ = std::thread(&Watchdog::run, this);
+            }
+            context_ = &context;
+            session_ = session;
+            armed_ = true;
+            outcome_ = Outcome::NotFired;
+        }
+        wake_.notify_one();
+    }
+
+    // Waits for an interrupt in progress, so the session is not closed
+    // after the caller has moved on
+    Outcome disarm() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        armed_ = false;
+        context_ = nullptr;
+        return outcome_;
+    }
+
+private:
+    static constexpr std::chrono::milliseconds CANCEL_POLL{50};
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stopping_) {
+            if (!armed_) {
+                wake_.wait(lock);
+                continue;
+            }
+            if (context_->check() == Status::OK) {
+                auto next = OperationContext::Clock::now() + CANCEL_POLL;
+                wake_.wait_until(lock, std::min(next, context_->effectiveDeadline()));
+                continue;
+            }
+            armed_ = false;
+            CK_RV rv = interrupt_(session_);
+            outcome_ = rv == CKR_OK ? Outcome::Cancelled : rv == CKR_SESSION_CLOSED ? Outcome::Closed : Outcome::Unable;
+        }
+    }
+
+    std::function<CK_RV(CK_SESSION_HANDLE)> interrupt_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    const OperationContext* context_;
+    CK_SESSION_HANDLE session_;
+    bool armed_;
+    Outcome outcome_;
+    bool stopping_;
+    std::thread thread_;
+};
+
+// A module is process-global: every instance on it shares one C_Initialize,
+// and C_Finalize waits for the last one. Keyed by function list, which the
+// module hands out once per process.
+struct ModuleUse {
+    size_t users = 0;
+    bool osLocking = false;
+};
+
+static std::mutex moduleUsesMutex;
+static std::map<CK_FUNCTION_LIST_PTR, ModuleUse> moduleUses;
+
+// Calls that leave the session in the middle of a multi-part operation if
+// they are skipped or cut short
+static bool touchesOperationState(P11Function function) {
+    switch (function) {
+        case P11Function::C_FindObjectsInit: case P11Function::C_FindObjects: case P11Function::C_FindObjectsFinal:
+        case P11Function::C_EncryptInit: case P11Function::C_Encrypt:
+        case P11Function::C_EncryptUpdate: case P11Function::C_EncryptFinal:
+        case P11Function::C_DecryptInit: case P11Function::C_Decrypt:
+        case P11Function::C_DecryptUpdate: case P11Function::C_DecryptFinal:
+        case P11Function::C_DigestInit: case P11Function::C_Digest:
+        case P11Function::C_DigestUpdate: case P11Function::C_DigestFinal:
+        case P11Function::C_SignInit: case P11Function::C_Sign:
+        case P11Function::C_SignUpdate: case P11Function::C_SignFinal:
+        case P11Function::C_VerifyInit: case P11Function::C_Verify:
+        case P11Function::C_VerifyUpdate: case P11Function::C_VerifyFinal:
+            return true;
+        default:
+            return false;
+    }
+}
+
+template<typename Fn, typename... Args>
+CK_RV PKCS11Library::call(P11Function function, Fn fn, Args&&... args) {
+    CK_RV rv;
+    if (context_) {
+        rv = guardedCall(function, fn, args...);
+    } else if (metrics_.isEnabled() || trace_.isEnabled() ||
+               PKCS11LIB_PROBE_ENABLED(call__entry) || PKCS11LIB_PROBE_ENABLED(call__return)) {
+        rv = instrumentedCall(function, fn, args...);
+    } else {
+        rv = fn(std::forward<Args>(args)...);
+        TokenProbes::noteRv(rv);
+    }
+    lastCall_.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    return rv;
+}
+
+// Out of line so that timing and argument inspection stay off the normal path
+template<typename Fn, typename... Args>
+CK_RV PKCS11Library::instrumentedCall(P11Function function, Fn fn, Args&... args) {
+    bool probed = PKCS11LIB_PROBE_ENABLED(call__entry) || PKCS11LIB_PROBE_ENABLED(call__return);
+    bool traced = trace_.isEnabled();
+    uint64_t bytesIn = 0;
+    if (probed || traced) {
+        bytesIn = measureCallBytes(function, CKR_FUNCTION_FAILED, args...).in;
+    }
+    PKCS11LIB_PROBE4(call__entry, static_cast<uint16_t>(function), p11FunctionName(function),
+                     currentSlotId_, bytesIn);
+
+    uint64_t start = TokenTrace::nowNanos();
+    CK_RV rv = fn(args...);
+    uint64_t elapsed = TokenTrace::nowNanos() - start;
+    TokenProbes::noteRv(rv);
+
+    if (metrics_.isEnabled()) {
+        metrics_.record(function, rv, elapsed);
+    }
+    if (probed || traced) {
+        uint64_t bytesOut = measureCallBytes(function, rv, args...).out;
+        PKCS11LIB_PROBE6(call__return, static_cast<uint16_t>(function), p11FunctionName(function),
+                         currentSlotId_, rv, bytesIn, bytesOut);
+        if (traced) {
+            trace_.record({p11FunctionName(function), "pkcs11", start, elapsed, TokenTrace::currentThreadId(),
+                           currentSlotId_, rv, true, bytesIn, bytesOut});
+        }
+    }
+    return rv;
+}
+
+// Refused once the context has expired; otherwise made with the watchdog
+// armed, and reported as abandoned if the watchdog had to step in
+template<typename Fn, typename... Args>
+CK_RV PKCS11Library::guardedCall(P11Function function, Fn fn, Args&... args) {
+    Status reason = abandoned_ != Status::OK ? abandoned_ : context_->check();
+    if (reason != Status::OK) {
+        abandon(reason, touchesOperationState(function));
+        return CKR_FUNCTION_CANCELED;
+    }
+
+    const OperationContext* context = context_;
+    context_ = nullptr;
+    watchdog_->arm(*context, sessionOpen_ ? session_ : 0);
+    CK_RV rv = call(function, fn, args...);
+    Watchdog::Outcome outcome = watchdog_->disarm();
+    context_ = context;
+
+    // A call that finished despite the watchdog keeps its result; the next
+    // one is refused anyway
+    if (outcome == Watchdog::Outcome::NotFired ||
+        (rv == CKR_OK && outcome != Watchdog::Outcome::Closed)) {
+        return rv;
+    }
+    bool sessionUnknown = outcome == Watchdog::Outcome::Closed ||
+                          (outcome == Watchdog::Outcome::Unable && touchesOperationState(function));
+    abandon(context->check(), sessionUnknown);
+    return CKR_FUNCTION_CANCELED;
+}
+
 PKCS11Library::PKCS11Library() 
     : initialized_(false), sessionOpen_(false), loggedIn_(false),
       libraryHandle_(nullptr), functionList_(nullptr), auxFunctionList_(nullptr),
-      session_(0), currentSlotId_(0) {
+      session_(0), currentSlotId_(0), transactionDepth_(0), probeGeneration_(0), probeStale_(false),
+      sessionReadWrite_(true), loginWanted_(false), loginUserType_(CKU_USER),
+      context_(nullptr), abandoned_(Status::OK), sessionReset_(false), osLocking_(false),
+      watchdog_(std::make_unique<Watchdog>([this](CK_SESSION_HANDLE session) { return interruptCall(session); })) {
 }
 
 PKCS11Library::~PKCS11Library() {
@@ -19,6 +228,9 @@ PKCS11Library::~PKCS11Library() {
 }
 
 Result<void> PKCS11Library::initialize(const std::string& libraryPath) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "initialize", currentSlotId_);
+
     if (initialized_) {
         return Result<void>::Ok();
     }
@@ -31,10 +243,28 @@ Result<void> PKCS11Library::initialize(const std::string& libraryPath) {
         return result;
     }
 
-    CK_RV rv = functionList_->C_Initialize(nullptr);
-    if (rv != CKR_OK && rv != CKR_CRYPTOKI_ALREADY_INITIALIZED) {
-        return Result<void>::Error(Status::ERROR_GENERAL, "Failed to initialize PKCS#11", rv);
+    std::lock_guard<std::mutex> usesLock(moduleUsesMutex);
+    ModuleUse& use = moduleUses[functionList_];
+    if (use.users == 0) {
+        // OS locking makes the module safe to call from the watchdog while a
+        // call is in progress; modules that refuse it are initialized as before
+        CK_C_INITIALIZE_ARGS initArgs = {};
+        initArgs.flags = CKF_OS_LOCKING_OK;
+        CK_RV rv = call(P11Function::C_Initialize, functionList_->C_Initialize, &initArgs);
+        use.osLocking = rv == CKR_OK;
+        if (rv != CKR_OK && rv != CKR_CRYPTOKI_ALREADY_INITIALIZED) {
+            rv = call(P11Function::C_Initialize, functionList_->C_Initialize, nullptr);
+        }
+        if (rv != CKR_OK && rv != CKR_CRYPTOKI_ALREADY_INITIALIZED) {
+            moduleUses.erase(functionList_);
+            functionList_ = nullptr;
+            dlclose(libraryHandle_);
+            libraryHandle_ = nullptr;
+            return Result<void>::Error(Status::ERROR_GENERAL, "Failed to initialize PKCS#11", rv);
+        }
     }
+    use.users++;
+    osLocking_ = use.osLocking;
 
     loadAuxFunctions(); // Best effort, don't fail if aux functions not available
 
@@ -43,16 +273,25 @@ Result<void> PKCS11Library::initialize(const std::string& libraryPath) {
 }
 
 Result<void> PKCS11Library::finalize() {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "finalize", currentSlotId_);
+
     if (!initialized_) {
         return Result<void>::Ok();
     }
 
-    if (sessionOpen_) {
-        closeSession();
-    }
+    closeSession();
 
     if (functionList_) {
-        functionList_->C_Finalize(nullptr);
+        // Other instances on the module keep it initialized
+        std::lock_guard<std::mutex> usesLock(moduleUsesMutex);
+        auto use = moduleUses.find(functionList_);
+        if (use == moduleUses.end() || --use->second.users == 0) {
+            call(P11Function::C_Finalize, functionList_->C_Finalize, nullptr);
+            if (use != moduleUses.end()) {
+                moduleUses.erase(use);
+            }
+        }
         functionList_ = nullptr;
     }
 
@@ -63,6 +302,12 @@ Result<void> PKCS11Library::finalize() {
 
     auxFunctionList_ = nullptr;
     initialized_ = false;
+    publicKeyCache_.clear();
+    forgetProbe();
+    {
+        std::lock_guard<std::mutex> probeLock(probeMutex_);
+        lastProbe_ = TokenProbe();
+    }
     return Result<void>::Ok();
 }
 
@@ -82,7 +327,7 @@ Result<void> PKCS11Library::loadLibrary(const std::string& path) {
         return Result<void>::Error(Status::ERROR_GENERAL, "Failed to get C_GetFunctionList");
     }
 
-    CK_RV rv = getFunctionList(&functionList_);
+    CK_RV rv = call(P11Function::C_GetFunctionList, getFunctionList, &functionList_);
     if (rv != CKR_OK || !functionList_) {
         dlclose(libraryHandle_);
         libraryHandle_ = nullptr;
@@ -108,12 +353,15 @@ Result<void> PKCS11Library::loadAuxFunctions() {
 }
 
 Result<std::vector<CK_SLOT_ID>> PKCS11Library::getSlotList(bool tokenPresent) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "getSlotList", currentSlotId_);
+
     if (!initialized_) {
         return Result<std::vector<CK_SLOT_ID>>::Error(Status::ERROR_GENERAL, "Library not initialized");
     }
 
     CK_ULONG count = 0;
-    CK_RV rv = functionList_->C_GetSlotList(tokenPresent ? CK_TRUE : CK_FALSE, nullptr, &count);
+    CK_RV rv = call(P11Function::C_GetSlotList, functionList_->C_GetSlotList, tokenPresent ? CK_TRUE : CK_FALSE, nullptr, &count);
     if (rv != CKR_OK) {
         return Result<std::vector<CK_SLOT_ID>>::Error(convertPKCS11Error(rv), "Failed to get slot count", rv);
     }
@@ -123,7 +371,7 @@ Result<std::vector<CK_SLOT_ID>> PKCS11Library::getSlotList(bool tokenPresent) {
     }
 
     std::vector<CK_SLOT_ID> slots(count);
-    rv = functionList_->C_GetSlotList(tokenPresent ? CK_TRUE : CK_FALSE, slots.data(), &count);
+    rv = call(P11Function::C_GetSlotList, functionList_->C_GetSlotList, tokenPresent ? CK_TRUE : CK_FALSE, slots.data(), &count);
     if (rv != CKR_OK) {
         return Result<std::vector<CK_SLOT_ID>>::Error(convertPKCS11Error(rv), "Failed to get slot list", rv);
     }
@@ -133,12 +381,15 @@ Result<std::vector<CK_SLOT_ID>> PKCS11Library::getSlotList(bool tokenPresent) {
 }
 
 Result<SlotInfo> PKCS11Library::getSlotInfo(CK_SLOT_ID slotId) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "getSlotInfo", slotId);
+
     if (!initialized_) {
         return Result<SlotInfo>::Error(Status::ERROR_GENERAL, "Library not initialized");
     }
 
     CK_SLOT_INFO slotInfo;
-    CK_RV rv = functionList_->C_GetSlotInfo(slotId, &slotInfo);
+    CK_RV rv = call(P11Function::C_GetSlotInfo, functionList_->C_GetSlotInfo, slotId, &slotInfo);
     if (rv != CKR_OK) {
         return Result<SlotInfo>::Error(convertPKCS11Error(rv), "Failed to get slot info", rv);
     }
@@ -154,12 +405,15 @@ Result<SlotInfo> PKCS11Library::getSlotInfo(CK_SLOT_ID slotId) {
 }
 
 Result<TokenInfo> PKCS11Library::getTokenInfo(CK_SLOT_ID slotId) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "getTokenInfo", slotId);
+
     if (!initialized_) {
         return Result<TokenInfo>::Error(Status::ERROR_GENERAL, "Library not initialized");
     }
 
     CK_TOKEN_INFO tokenInfo;
-    CK_RV rv = functionList_->C_GetTokenInfo(slotId, &tokenInfo);
+    CK_RV rv = call(P11Function::C_GetTokenInfo, functionList_->C_GetTokenInfo, slotId, &tokenInfo);
     if (rv != CKR_OK) {
         return Result<TokenInfo>::Error(convertPKCS11Error(rv), "Failed to get token info", rv);
     }
@@ -186,7 +440,108 @@ Result<TokenInfo> PKCS11Library::getTokenInfo(CK_SLOT_ID slotId) {
     return Result<TokenInfo>::Ok(info);
 }
 
+Result<TokenProbe> PKCS11Library::probeToken() {
+    std::unique_lock<LibraryMutex> lock(mutex_, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        // A call is in progress: the token was there when it started
+        std::lock_guard<std::mutex> probeLock(probeMutex_);
+        TokenProbe last = lastProbe_;
+        last.busy = true;
+        return Result<TokenProbe>::Ok(last);
+    }
+    ApiScope probe(trace_, "probeToken", currentSlotId_);
+
+    if (!initialized_) {
+        return Result<TokenProbe>::Error(Status::ERROR_GENERAL, "Library not initialized");
+    }
+
+    TokenProbe result;
+    auto stateFunc = auxFunctionList_ ? (EP_GetTokenState)auxFunctionList_->pFunc[EP_GET_TOKEN_STATE] : nullptr;
+    if (stateFunc) {
+        // State byte: bit 0 token present, bit 1 user logged in, bit 2 SO logged in
+        CK_BYTE state[16] = {0};
+        CK_ULONG stateLen = sizeof(state);
+        CK_RV rv = call(P11Function::EP_GetTokenState, stateFunc, currentSlotId_, CK_TRUE, state, &stateLen);
+        if (rv == CKR_OK && stateLen > 0) {
+            result.present = (state[0] & 0x01) != 0;
+            result.userLoggedIn = (state[0] & 0x02) != 0;
+            result.soLoggedIn = (state[0] & 0x04) != 0;
+        } else if (rv != CKR_TOKEN_NOT_PRESENT && !isConnectionLoss(rv)) {
+            return Result<TokenProbe>::Error(convertPKCS11Error(rv), "Failed to get token state", rv);
+        }
+    } else {
+        CK_SLOT_INFO slotInfo;
+        CK_RV rv = call(P11Function::C_GetSlotInfo, functionList_->C_GetSlotInfo, currentSlotId_, &slotInfo);
+        if (rv != CKR_OK) {
+            return Result<TokenProbe>::Error(convertPKCS11Error(rv), "Failed to get slot info", rv);
+        }
+        result.present = (slotInfo.flags & CKF_TOKEN_PRESENT) != 0;
+    }
+
+    auto readSerial = [this] {
+        std::vector<CK_BYTE> serial;
+        auto devInfoFunc = auxFunctionList_ ? (EP_GetDevInfo)auxFunctionList_->pFunc[EP_GET_DEV_INFO] : nullptr;
+        DEV_INFO devInfo;
+        std::memset(&devInfo, 0, sizeof(devInfo));
+        devInfo.version = {1, 0};
+        if (devInfoFunc && call(P11Function::EP_GetDevInfo, devInfoFunc, currentSlotId_, &devInfo) == CKR_OK) {
+            CK_ULONG serialLen = std::min<CK_ULONG>(devInfo.ulSNLen, sizeof(devInfo.ucSerialNumber));
+            serial.assign(devInfo.ucSerialNumber, devInfo.ucSerialNumber + serialLen);
+        }
+        return serial;
+    };
+
+    // Present now and at the last probe says nothing about a removal in
+    // between. An open session does not survive one; without a session there
+    // are no handles to go stale, and a different token has another serial.
+    std::vector<CK_BYTE> serial;
+    bool serialRead = false;
+    if (result.present && lastProbe_.present && !probeStale_) {
+        if (sessionOpen_) {
+            if (sessionLost()) {
+                handleConnectionLoss();
+            }
+        } else {
+            serial = readSerial();
+            serialRead = true;
+            if (serial != lastProbe_.hardwareSerial) {
+                forgetProbe();
+            }
+        }
+    }
+    if (!stateFunc) {
+        result.userLoggedIn = result.present && loggedIn_ && loginUserType_ == CKU_USER;
+        result.soLoggedIn = result.present && loggedIn_ && loginUserType_ == CKU_SO;
+    }
+
+    if (result.present) {
+        if (lastProbe_.present && !probeStale_) {
+            result.generation = lastProbe_.generation;
+            result.hardwareSerial = lastProbe_.hardwareSerial;
+        } else {
+            if (probeGeneration_ != 0) {
+                // Re-inserted, possibly a different or re-provisioned token
+                publicKeyCache_.clear();
+                keySerial_.clear();
+            }
+            auto now = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+            probeGeneration_ = std::max(static_cast<uint64_t>(now), probeGeneration_ + 1);
+            result.generation = probeGeneration_;
+            result.hardwareSerial = serialRead ? serial : readSerial();
+        }
+    }
+
+    probeStale_ = false;
+    std::lock_guard<std::mutex> probeLock(probeMutex_);
+    lastProbe_ = result;
+    return Result<TokenProbe>::Ok(result);
+}
+
 Result<void> PKCS11Library::openSession(CK_SLOT_ID slotId, bool readWrite) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "openSession", slotId);
+
     if (!initialized_) {
         return Result<void>::Error(Status::ERROR_GENERAL, "Library not initialized");
     }
@@ -200,18 +555,34 @@ Result<void> PKCS11Library::openSession(CK_SLOT_ID slotId, bool readWrite) {
         flags |= CKF_RW_SESSION;
     }
 
-    CK_RV rv = functionList_->C_OpenSession(slotId, flags, nullptr, nullptr, &session_);
+    CK_RV rv = call(P11Function::C_OpenSession, functionList_->C_OpenSession, slotId, flags, nullptr, nullptr, &session_);
     if (rv != CKR_OK) {
         return Result<void>::Error(convertPKCS11Error(rv), "Failed to open session", rv);
     }
 
     sessionOpen_ = true;
+    if (slotId != currentSlotId_) {
+        forgetProbe();
+    }
     currentSlotId_ = slotId;
+    sessionReadWrite_ = readWrite;
+    loginWanted_ = false;
+    sessionSerial_.clear();
+    keySerial_.clear();
+    if (recoveryPolicy_.enabled) {
+        rememberSessionToken();
+    }
     return Result<void>::Ok();
 }
 
 Result<void> PKCS11Library::closeSession() {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "closeSession", currentSlotId_);
+
     if (!sessionOpen_) {
+        // A session lost or abandoned and not yet recovered stays closed
+        sessionSerial_.clear();
+        keySerial_.clear();
         return Result<void>::Ok();
     }
 
@@ -219,9 +590,16 @@ Result<void> PKCS11Library::closeSession() {
         logout();
     }
 
-    CK_RV rv = functionList_->C_CloseSession(session_);
+    if (transactionDepth_ > 0) {
+        transactionDepth_ = 1;
+        endTransaction();
+    }
+
+    CK_RV rv = call(P11Function::C_CloseSession, functionList_->C_CloseSession, session_);
     sessionOpen_ = false;
     session_ = 0;
+    sessionSerial_.clear();
+    keySerial_.clear();
     
     if (rv != CKR_OK) {
         return Result<void>::Error(convertPKCS11Error(rv), "Failed to close session", rv);
@@ -231,27 +609,36 @@ Result<void> PKCS11Library::closeSession() {
 }
 
 Result<void> PKCS11Library::login(const std::string& pin, CK_USER_TYPE userType) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "login", currentSlotId_);
+
     if (!sessionOpen_) {
         return Result<void>::Error(Status::ERROR_GENERAL, "No session open");
     }
 
-    CK_RV rv = functionList_->C_Login(session_, userType, 
-                                     (CK_UTF8CHAR_PTR)pin.c_str(), pin.length());
+    CK_RV rv = call(P11Function::C_Login, functionList_->C_Login, session_, userType, 
+                   (CK_UTF8CHAR_PTR)pin.c_str(), pin.length());
     if (rv != CKR_OK) {
         return Result<void>::Error(convertPKCS11Error(rv), "Failed to login", rv);
     }
 
     loggedIn_ = true;
+    loginWanted_ = true;
+    loginUserType_ = userType;
     return Result<void>::Ok();
 }
 
 Result<void> PKCS11Library::logout() {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "logout", currentSlotId_);
+
     if (!loggedIn_) {
         return Result<void>::Ok();
     }
 
-    CK_RV rv = functionList_->C_Logout(session_);
+    CK_RV rv = call(P11Function::C_Logout, functionList_->C_Logout, session_);
     loggedIn_ = false;
+    loginWanted_ = false;
     
     if (rv != CKR_OK) {
         return Result<void>::Error(convertPKCS11Error(rv), "Failed to logout", rv);
@@ -261,32 +648,39 @@ Result<void> PKCS11Library::logout() {
 }
 
 Result<PinInfo> PKCS11Library::getPinInfo() {
-    if (!sessionOpen_ || !auxFunctionList_) {
-        return Result<PinInfo>::Error(Status::ERROR_GENERAL, "Session not open or aux functions not available");
-    }
+    std::unique_lock<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "getPinInfo", currentSlotId_);
+    return withRecovery(lock, Replay::Allowed, [&] {
+        if (!sessionOpen_ || !auxFunctionList_) {
+            return Result<PinInfo>::Error(Status::ERROR_GENERAL, "Session not open or aux functions not available");
+        }
 
-    AUX_PIN_INFO pinInfo;
-    auto getPinInfoFunc = (EP_GetPinInfo)auxFunctionList_->pFunc[EP_GET_PIN_INFO];
-    if (!getPinInfoFunc) {
-        return Result<PinInfo>::Error(Status::ERROR_FUNCTION_FAILED, "GetPinInfo function not available");
-    }
+        AUX_PIN_INFO pinInfo;
+        auto getPinInfoFunc = (EP_GetPinInfo)auxFunctionList_->pFunc[EP_GET_PIN_INFO];
+        if (!getPinInfoFunc) {
+            return Result<PinInfo>::Error(Status::ERROR_FUNCTION_FAILED, "GetPinInfo function not available");
+        }
 
-    CK_RV rv = getPinInfoFunc(currentSlotId_, &pinInfo);
-    if (rv != CKR_OK) {
-        return Result<PinInfo>::Error(convertPKCS11Error(rv), "Failed to get PIN info", rv);
-    }
+        CK_RV rv = call(P11Function::EP_GetPinInfo, getPinInfoFunc, currentSlotId_, &pinInfo);
+        if (rv != CKR_OK) {
+            return Result<PinInfo>::Error(convertPKCS11Error(rv), "Failed to get PIN info", rv);
+        }
 
-    PinInfo info;
-    info.soMaxRetries = pinInfo.bSOPinMaxRetries;
-    info.soCurCounter = pinInfo.bSOPinCurCounter;
-    info.userMaxRetries = pinInfo.bUserPinMaxRetries;
-    info.userCurCounter = pinInfo.bUserPinCurCounter;
-    info.pinFlags = pinInfo.pinflags;
+        PinInfo info;
+        info.soMaxRetries = pinInfo.bSOPinMaxRetries;
+        info.soCurCounter = pinInfo.bSOPinCurCounter;
+        info.userMaxRetries = pinInfo.bUserPinMaxRetries;
+        info.userCurCounter = pinInfo.bUserPinCurCounter;
+        info.pinFlags = pinInfo.pinflags;
 
-    return Result<PinInfo>::Ok(info);
+        return Result<PinInfo>::Ok(info);
+    });
 }
 
 Result<void> PKCS11Library::setTokenLabel(const std::string& label) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "setTokenLabel", currentSlotId_);
+
     if (!sessionOpen_ || !auxFunctionList_) {
         return Result<void>::Error(Status::ERROR_GENERAL, "Session not open or aux functions not available");
     }
@@ -296,8 +690,8 @@ Result<void> PKCS11Library::setTokenLabel(const std::string& label) {
         return Result<void>::Error(Status::ERROR_FUNCTION_FAILED, "SetTokenLabel function not available");
     }
 
-    CK_RV rv = setLabelFunc(currentSlotId_, CKU_USER, nullptr, 0, 
-                           (CK_UTF8CHAR_PTR)label.c_str());
+    CK_RV rv = call(P11Function::EP_SetTokenLabel, setLabelFunc, currentSlotId_, CKU_USER, nullptr, 0, 
+                   (CK_UTF8CHAR_PTR)label.c_str());
     if (rv != CKR_OK) {
         return Result<void>::Error(convertPKCS11Error(rv), "Failed to set token label", rv);
     }
@@ -306,6 +700,9 @@ Result<void> PKCS11Library::setTokenLabel(const std::string& label) {
 }
 
 Result<void> PKCS11Library::setTokenTimeout(CK_ULONG timeoutSeconds) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "setTokenTimeout", currentSlotId_);
+
     if (!sessionOpen_ || !auxFunctionList_) {
         return Result<void>::Error(Status::ERROR_GENERAL, "Session not open or aux functions not available");
     }
@@ -315,7 +712,7 @@ Result<void> PKCS11Library::setTokenTimeout(CK_ULONG timeoutSeconds) {
         return Result<void>::Error(Status::ERROR_FUNCTION_FAILED, "SetTokenTimeout function not available");
     }
 
-    CK_RV rv = setTimeoutFunc(currentSlotId_, timeoutSeconds * 1000); // Convert to milliseconds
+    CK_RV rv = call(P11Function::EP_SetTokenTimeout, setTimeoutFunc, currentSlotId_, timeoutSeconds * 1000); // Convert to milliseconds
     if (rv != CKR_OK) {
         return Result<void>::Error(convertPKCS11Error(rv), "Failed to set token timeout", rv);
     }
@@ -324,177 +721,207 @@ Result<void> PKCS11Library::setTokenTimeout(CK_ULONG timeoutSeconds) {
 }
 
 Result<CK_ULONG> PKCS11Library::getTokenTimeout() {
-    if (!sessionOpen_ || !auxFunctionList_) {
-        return Result<CK_ULONG>::Error(Status::ERROR_GENERAL, "Session not open or aux functions not available");
-    }
+    std::unique_lock<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "getTokenTimeout", currentSlotId_);
+    return withRecovery(lock, Replay::Allowed, [&] {
+        if (!sessionOpen_ || !auxFunctionList_) {
+            return Result<CK_ULONG>::Error(Status::ERROR_GENERAL, "Session not open or aux functions not available");
+        }
 
-    auto getTimeoutFunc = (EP_GetTokenTimeout)auxFunctionList_->pFunc[EP_GET_TOKEN_TIMEOUT];
-    if (!getTimeoutFunc) {
-        return Result<CK_ULONG>::Error(Status::ERROR_FUNCTION_FAILED, "GetTokenTimeout function not available");
-    }
+        auto getTimeoutFunc = (EP_GetTokenTimeout)auxFunctionList_->pFunc[EP_GET_TOKEN_TIMEOUT];
+        if (!getTimeoutFunc) {
+            return Result<CK_ULONG>::Error(Status::ERROR_FUNCTION_FAILED, "GetTokenTimeout function not available");
+        }
 
-    CK_ULONG timeoutMs;
-    CK_RV rv = getTimeoutFunc(currentSlotId_, &timeoutMs);
-    if (rv != CKR_OK) {
-        return Result<CK_ULONG>::Error(convertPKCS11Error(rv), "Failed to get token timeout", rv);
-    }
+        CK_ULONG timeoutMs;
+        CK_RV rv = call(P11Function::EP_GetTokenTimeout, getTimeoutFunc, currentSlotId_, &timeoutMs);
+        if (rv != CKR_OK) {
+            return Result<CK_ULONG>::Error(convertPKCS11Error(rv), "Failed to get token timeout", rv);
+        }
 
-    return Result<CK_ULONG>::Ok(timeoutMs / 1000); // Convert from milliseconds
+        return Result<CK_ULONG>::Ok(timeoutMs / 1000); // Convert from milliseconds
+    });
 }
 
 Result<std::vector<CertificateInfo>> PKCS11Library::findCertificates() {
-    if (!sessionOpen_) {
-        return Result<std::vector<CertificateInfo>>::Error(Status::ERROR_GENERAL, "No session open");
-    }
+    std::unique_lock<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "findCertificates", currentSlotId_);
+    return withRecovery(lock, Replay::Allowed, [&] {
+        if (!sessionOpen_) {
+            return Result<std::vector<CertificateInfo>>::Error(Status::ERROR_GENERAL, "No session open");
+        }
 
-    std::vector<CertificateInfo> certificates;
+        std::vector<CertificateInfo> certificates;
 
-    CK_OBJECT_CLASS certClass = CKO_CERTIFICATE;
-    CK_BBOOL isToken = CK_TRUE;
-    CK_ATTRIBUTE template_[] = {
-        {CKA_CLASS, &certClass, sizeof(certClass)},
-        {CKA_TOKEN, &isToken, sizeof(isToken)}
-    };
+        CK_OBJECT_CLASS certClass = CKO_CERTIFICATE;
+        CK_BBOOL isToken = CK_TRUE;
+        CK_ATTRIBUTE template_[] = {
+            {CKA_CLASS, &certClass, sizeof(certClass)},
+            {CKA_TOKEN, &isToken, sizeof(isToken)}
+        };
 
-    CK_RV rv = functionList_->C_FindObjectsInit(session_, template_, 2);
-    if (rv != CKR_OK) {
-        return Result<std::vector<CertificateInfo>>::Error(convertPKCS11Error(rv), "Failed to init certificate search", rv);
-    }
+        // Enumeration issues several attribute reads per object; hold the card once
+        TokenTransaction transaction(*this);
 
-    CK_OBJECT_HANDLE handle;
-    CK_ULONG count;
-    
-    while (true) {
-        rv = functionList_->C_FindObjects(session_, &handle, 1, &count);
-        if (rv != CKR_OK || count == 0) {
-            break;
+        CK_RV rv = call(P11Function::C_FindObjectsInit, functionList_->C_FindObjectsInit, session_, template_, 2);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CertificateInfo>>::Error(convertPKCS11Error(rv), "Failed to init certificate search", rv);
         }
 
-        CertificateInfo cert;
-        cert.handle = handle;
+        CK_OBJECT_HANDLE handle;
+        CK_ULONG count;
 
-        // Get certificate attributes
-        auto labelBytes = getAttributeBytes(handle, CKA_LABEL);
-        if (labelBytes.isOk()) {
-            cert.label = std::string(labelBytes.value.begin(), labelBytes.value.end());
-        }
+        while (true) {
+            rv = call(P11Function::C_FindObjects, functionList_->C_FindObjects, session_, &handle, 1, &count);
+            if (rv != CKR_OK || count == 0) {
+                break;
+            }
 
-        auto subject = getAttributeBytes(handle, CKA_SUBJECT);
-        if (subject.isOk()) {
-            cert.subject = subject.value;
-        }
+            CertificateInfo cert;
+            cert.handle = handle;
 
-        auto id = getAttributeBytes(handle, CKA_ID);
-        if (id.isOk()) {
-            cert.id = id.value;
-        }
+            // Get certificate attributes
+            auto labelBytes = getAttributeBytes(handle, CKA_LABEL);
+            if (labelBytes.isOk()) {
+                cert.label = std::string(labelBytes.value.begin(), labelBytes.value.end());
+            }
 
-        auto value = getAttributeBytes(handle, CKA_VALUE);
-        if (value.isOk()) {
-            cert.value = value.value;
-        }
+            auto subject = getAttributeBytes(handle, CKA_SUBJECT);
+            if (subject.isOk()) {
+                cert.subject = subject.value;
+            }
+
+            auto id = getAttributeBytes(handle, CKA_ID);
+            if (id.isOk()) {
+                cert.id = id.value;
+            }
+
+            auto value = getAttributeBytes(handle, CKA_VALUE);
+            if (value.isOk()) {
+                cert.value = value.value;
+            }
+
+            auto type = getAttribute<CK_CERTIFICATE_TYPE>(handle, CKA_CERTIFICATE_TYPE);
+            if (type.isOk()) {
+                cert.type = type.value;
+            }
 
-        auto type = getAttribute<CK_CERTIFICATE_TYPE>(handle, CKA_CERTIFICATE_TYPE);
-        if (type.isOk()) {
-            cert.type = type.value;
+            certificates.push_back(cert);
         }
 
-        certificates.push_back(cert);
-    }
+        if (isConnectionLoss(rv)) {
+            return Result<std::vector<CertificateInfo>>::Error(convertPKCS11Error(rv), "Token lost during object search", rv);
+        }
 
-    functionList_->C_FindObjectsFinal(session_);
-    return Result<std::vector<CertificateInfo>>::Ok(certificates);
+        call(P11Function::C_FindObjectsFinal, functionList_->C_FindObjectsFinal, session_);
+        return Result<std::vector<CertificateInfo>>::Ok(certificates);
+    });
 }
 
 Result<std::vector<KeyInfo>> PKCS11Library::findKeys(CK_OBJECT_CLASS keyClass) {
-    if (!sessionOpen_) {
-        return Result<std::vector<KeyInfo>>::Error(Status::ERROR_GENERAL, "No session open");
-    }
+    std::unique_lock<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "findKeys", currentSlotId_);
+    return withRecovery(lock, Replay::Allowed, [&] {
+        if (!sessionOpen_) {
+            return Result<std::vector<KeyInfo>>::Error(Status::ERROR_GENERAL, "No session open");
+        }
 
-    std::vector<KeyInfo> keys;
+        std::vector<KeyInfo> keys;
 
-    CK_BBOOL isToken = CK_TRUE;
-    CK_ATTRIBUTE template_[] = {
-        {CKA_CLASS, &keyClass, sizeof(keyClass)},
-        {CKA_TOKEN, &isToken, sizeof(isToken)}
-    };
+        CK_BBOOL isToken = CK_TRUE;
+        CK_ATTRIBUTE template_[] = {
+            {CKA_CLASS, &keyClass, sizeof(keyClass)},
+            {CKA_TOKEN, &isToken, sizeof(isToken)}
+        };
 
-    CK_RV rv = functionList_->C_FindObjectsInit(session_, template_, 2);
-    if (rv != CKR_OK) {
-        return Result<std::vector<KeyInfo>>::Error(convertPKCS11Error(rv), "Failed to init key search", rv);
-    }
+        TokenTransaction transaction(*this);
 
-    CK_OBJECT_HANDLE handle;
-    CK_ULONG count;
-    
-    while (true) {
-        rv = functionList_->C_FindObjects(session_, &handle, 1, &count);
-        if (rv != CKR_OK || count == 0) {
-            break;
+        CK_RV rv = call(P11Function::C_FindObjectsInit, functionList_->C_FindObjectsInit, session_, template_, 2);
+        if (rv != CKR_OK) {
+            return Result<std::vector<KeyInfo>>::Error(convertPKCS11Error(rv), "Failed to init key search", rv);
         }
 
-        KeyInfo key;
-        key.handle = handle;
-        key.objectClass = keyClass;
+        CK_OBJECT_HANDLE handle;
+        CK_ULONG count;
 
-        // Get key attributes
-        auto labelBytes = getAttributeBytes(handle, CKA_LABEL);
-        if (labelBytes.isOk()) {
-            key.label = std::string(labelBytes.value.begin(), labelBytes.value.end());
-        }
+        while (true) {
+            rv = call(P11Function::C_FindObjects, functionList_->C_FindObjects, session_, &handle, 1, &count);
+            if (rv != CKR_OK || count == 0) {
+                break;
+            }
 
-        auto keyType = getAttribute<CK_KEY_TYPE>(handle, CKA_KEY_TYPE);
-        if (keyType.isOk()) {
-            key.keyType = keyType.value;
-        }
+            KeyInfo key;
+            key.handle = handle;
+            key.objectClass = keyClass;
 
-        auto id = getAttributeBytes(handle, CKA_ID);
-        if (id.isOk()) {
-            key.id = id.value;
-        }
+            // Get key attributes
+            auto labelBytes = getAttributeBytes(handle, CKA_LABEL);
+            if (labelBytes.isOk()) {
+                key.label = std::string(labelBytes.value.begin(), labelBytes.value.end());
+            }
 
-        // Get capability flags
-        auto flag = getAttribute<CK_BBOOL>(handle, CKA_ENCRYPT);
-        key.canEncrypt = flag.isOk() && flag.value;
-        
-        flag = getAttribute<CK_BBOOL>(handle, CKA_DECRYPT);
-        key.canDecrypt = flag.isOk() && flag.value;
-        
-        flag = getAttribute<CK_BBOOL>(handle, CKA_SIGN);
-        key.canSign = flag.isOk() && flag.value;
-        
-        flag = getAttribute<CK_BBOOL>(handle, CKA_VERIFY);
-        key.canVerify = flag.isOk() && flag.value;
-        
-        flag = getAttribute<CK_BBOOL>(handle, CKA_WRAP);
-        key.canWrap = flag.isOk() && flag.value;
-        
-        flag = getAttribute<CK_BBOOL>(handle, CKA_UNWRAP);
-        key.canUnwrap = flag.isOk() && flag.value;
-        
-        flag = getAttribute<CK_BBOOL>(handle, CKA_DERIVE);
-        key.canDerive = flag.isOk() && flag.value;
-        
-        flag = getAttribute<CK_BBOOL>(handle, CKA_SENSITIVE);
-        key.isSensitive = flag.isOk() && flag.value;
-        
-        flag = getAttribute<CK_BBOOL>(handle, CKA_EXTRACTABLE);
-        key.isExtractable = flag.isOk() && flag.value;
+            auto keyType = getAttribute<CK_KEY_TYPE>(handle, CKA_KEY_TYPE);
+            if (keyType.isOk()) {
+                key.keyType = keyType.value;
+            }
 
-        keys.push_back(key);
-    }
+            auto id = getAttributeBytes(handle, CKA_ID);
+            if (id.isOk()) {
+                key.id = id.value;
+            }
+
+            // Get capability flags
+            auto flag = getAttribute<CK_BBOOL>(handle, CKA_ENCRYPT);
+            key.canEncrypt = flag.isOk() && flag.value;
+
+            flag = getAttribute<CK_BBOOL>(handle, CKA_DECRYPT);
+            key.canDecrypt = flag.isOk() && flag.value;
+
+            flag = getAttribute<CK_BBOOL>(handle, CKA_SIGN);
+            key.canSign = flag.isOk() && flag.value;
+
+            flag = getAttribute<CK_BBOOL>(handle, CKA_VERIFY);
+            key.canVerify = flag.isOk() && flag.value;
+
+            flag = getAttribute<CK_BBOOL>(handle, CKA_WRAP);
+            key.canWrap = flag.isOk() && flag.value;
+
+            flag = getAttribute<CK_BBOOL>(handle, CKA_UNWRAP);
+            key.canUnwrap = flag.isOk() && flag.value;
+
+            flag = getAttribute<CK_BBOOL>(handle, CKA_DERIVE);
+            key.canDerive = flag.isOk() && flag.value;
+
+            flag = getAttribute<CK_BBOOL>(handle, CKA_SENSITIVE);
+            key.isSensitive = flag.isOk() && flag.value;
 
-    functionList_->C_FindObjectsFinal(session_);
-    return Result<std::vector<KeyInfo>>::Ok(keys);
+            flag = getAttribute<CK_BBOOL>(handle, CKA_EXTRACTABLE);
+            key.isExtractable = flag.isOk() && flag.value;
+
+            keys.push_back(key);
+        }
+
+        if (isConnectionLoss(rv)) {
+            return Result<std::vector<KeyInfo>>::Error(convertPKCS11Error(rv), "Token lost during object search", rv);
+        }
+
+        call(P11Function::C_FindObjectsFinal, functionList_->C_FindObjectsFinal, session_);
+        return Result<std::vector<KeyInfo>>::Ok(keys);
+    });
 }
 
-Result<KeyPair> PKCS11Library::generateRSAKeyPair(CK_ULONG modulusBits, const std::string& label) {
+Result<KeyPair> PKCS11Library::generateRSAKeyPair(CK_ULONG modulusBits, const std::string& label,
+                                                  bool tokenObject) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "generateRSAKeyPair", currentSlotId_);
+
     if (!sessionOpen_) {
         return Result<KeyPair>::Error(Status::ERROR_GENERAL, "No session open");
     }
 
     CK_MECHANISM mechanism = {CKM_RSA_PKCS_KEY_PAIR_GEN, nullptr, 0};
     CK_BBOOL bTrue = CK_TRUE;
+    CK_BBOOL isToken = tokenObject ? CK_TRUE : CK_FALSE;
     CK_ULONG keyType = CKK_RSA;
 
     // Public key template
@@ -507,7 +934,7 @@ Result<KeyPair> PKCS11Library::generateRSAKeyPair(CK_ULONG modulusBits, const st
         {CKA_ENCRYPT, &bTrue, sizeof(bTrue)},
         {CKA_VERIFY, &bTrue, sizeof(bTrue)},
         {CKA_WRAP, &bTrue, sizeof(bTrue)},
-        {CKA_TOKEN, &bTrue, sizeof(bTrue)}
+        {CKA_TOKEN, &isToken, sizeof(isToken)}
     };
 
     // Private key template
@@ -521,18 +948,19 @@ Result<KeyPair> PKCS11Library::generateRSAKeyPair(CK_ULONG modulusBits, const st
         {CKA_UNWRAP, &bTrue, sizeof(bTrue)},
         {CKA_PRIVATE, &bTrue, sizeof(bTrue)},
         {CKA_SENSITIVE, &bTrue, sizeof(bTrue)},
-        {CKA_TOKEN, &bTrue, sizeof(bTrue)},
+        {CKA_TOKEN, &isToken, sizeof(isToken)},
         {CKA_EXTRACTABLE, &bTrue, sizeof(bTrue)}
     };
 
     CK_OBJECT_HANDLE pubKey, priKey;
-    CK_RV rv = functionList_->C_GenerateKeyPair(session_, &mechanism,
-                                               pubTemplate, sizeof(pubTemplate)/sizeof(CK_ATTRIBUTE),
-                                               priTemplate, sizeof(priTemplate)/sizeof(CK_ATTRIBUTE),
-                                               &pubKey, &priKey);
+    CK_RV rv = call(P11Function::C_GenerateKeyPair, functionList_->C_GenerateKeyPair, session_, &mechanism,
+                   pubTemplate, sizeof(pubTemplate)/sizeof(CK_ATTRIBUTE),
+                   priTemplate, sizeof(priTemplate)/sizeof(CK_ATTRIBUTE),
+                   &pubKey, &priKey);
     if (rv != CKR_OK) {
         return Result<KeyPair>::Error(convertPKCS11Error(rv), "Failed to generate RSA key pair", rv);
     }
+    publicKeyCache_.clear(); // The new key may reuse a CKA_ID
 
     // Fill key pair info
     KeyPair keyPair;
@@ -557,8 +985,74 @@ Result<KeyPair> PKCS11Library::generateRSAKeyPair(CK_ULONG modulusBits, const st
     return Result<KeyPair>::Ok(keyPair);
 }
 
+Result<KeyPair> PKCS11Library::generateECKeyPair(const std::string& label, bool tokenObject) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "generateECKeyPair", currentSlotId_);
+
+    if (!sessionOpen_) {
+        return Result<KeyPair>::Error(Status::ERROR_GENERAL, "No session open");
+    }
+
+    CK_MECHANISM mechanism = {CKM_EC_KEY_PAIR_GEN, nullptr, 0};
+    CK_BBOOL bTrue = CK_TRUE;
+    CK_BBOOL isToken = tokenObject ? CK_TRUE : CK_FALSE;
+    CK_ULONG keyType = CKK_EC;
+
+    // Public key template
+    CK_OBJECT_CLASS pubClass = CKO_PUBLIC_KEY;
+    CK_ATTRIBUTE pubTemplate[] = {
+        {CKA_CLASS, &pubClass, sizeof(pubClass)},
+        {CKA_KEY_TYPE, &keyType, sizeof(keyType)},
+        {CKA_LABEL, (void*)label.c_str(), label.length()},
+        {CKA_EC_PARAMS, (void*)P256_EC_PARAMS, sizeof(P256_EC_PARAMS)},
+        {CKA_VERIFY, &bTrue, sizeof(bTrue)},
+        {CKA_TOKEN, &isToken, sizeof(isToken)}
+    };
+
+    // Private key template
+    CK_OBJECT_CLASS priClass = CKO_PRIVATE_KEY;
+    CK_ATTRIBUTE priTemplate[] = {
+        {CKA_CLASS, &priClass, sizeof(priClass)},
+        {CKA_KEY_TYPE, &keyType, sizeof(keyType)},
+        {CKA_LABEL, (void*)label.c_str(), label.length()},
+        {CKA_SIGN, &bTrue, sizeof(bTrue)},
+        {CKA_PRIVATE, &bTrue, sizeof(bTrue)},
+        {CKA_SENSITIVE, &bTrue, sizeof(bTrue)},
+        {CKA_TOKEN, &isToken, sizeof(isToken)}
+    };
+
+    CK_OBJECT_HANDLE pubKey, priKey;
+    CK_RV rv = call(P11Function::C_GenerateKeyPair, functionList_->C_GenerateKeyPair, session_, &mechanism,
+                   pubTemplate, sizeof(pubTemplate)/sizeof(CK_ATTRIBUTE),
+                   priTemplate, sizeof(priTemplate)/sizeof(CK_ATTRIBUTE),
+                   &pubKey, &priKey);
+    if (rv != CKR_OK) {
+        return Result<KeyPair>::Error(convertPKCS11Error(rv), "Failed to generate EC key pair", rv);
+    }
+    publicKeyCache_.clear(); // The new key may reuse a CKA_ID
+
+    KeyPair keyPair{};
+    keyPair.publicKey.handle = pubKey;
+    keyPair.publicKey.label = label;
+    keyPair.publicKey.keyType = CKK_EC;
+    keyPair.publicKey.objectClass = CKO_PUBLIC_KEY;
+    keyPair.publicKey.canVerify = true;
+
+    keyPair.privateKey.handle = priKey;
+    keyPair.privateKey.label = label;
+    keyPair.privateKey.keyType = CKK_EC;
+    keyPair.privateKey.objectClass = CKO_PRIVATE_KEY;
+    keyPair.privateKey.canSign = true;
+    keyPair.privateKey.isSensitive = true;
+
+    return Result<KeyPair>::Ok(keyPair);
+}
+
 Result<KeyInfo> PKCS11Library::generateSymmetricKey(SymmetricAlgorithm algorithm, CK_ULONG keyLength, 
                                                    const std::string& label) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "generateSymmetricKey", currentSlotId_);
+
     if (!sessionOpen_) {
         return Result<KeyInfo>::Error(Status::ERROR_GENERAL, "No session open");
     }
@@ -609,8 +1103,8 @@ Result<KeyInfo> PKCS11Library::generateSymmetricKey(SymmetricAlgorithm algorithm
     };
 
     CK_OBJECT_HANDLE keyHandle;
-    CK_RV rv = functionList_->C_GenerateKey(session_, &mechanism, keyTemplate, 
-                                           sizeof(keyTemplate)/sizeof(CK_ATTRIBUTE), &keyHandle);
+    CK_RV rv = call(P11Function::C_GenerateKey, functionList_->C_GenerateKey, session_, &mechanism, keyTemplate, 
+                   sizeof(keyTemplate)/sizeof(CK_ATTRIBUTE), &keyHandle);
     if (rv != CKR_OK) {
         return Result<KeyInfo>::Error(convertPKCS11Error(rv), "Failed to generate symmetric key", rv);
     }
@@ -628,187 +1122,308 @@ Result<KeyInfo> PKCS11Library::generateSymmetricKey(SymmetricAlgorithm algorithm
 
 Result<std::vector<CK_BYTE>> PKCS11Library::sign(CK_OBJECT_HANDLE privateKeyHandle, const std::vector<CK_BYTE>& data,
                                                  HashAlgorithm hashAlg) {
-    if (!sessionOpen_) {
-        return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_GENERAL, "No session open");
-    }
+    std::unique_lock<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "sign", currentSlotId_);
+    return withRecovery(lock, Replay::Refused, [&] {
+        if (!sessionOpen_) {
+            return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_GENERAL, "No session open");
+        }
 
-    CK_MECHANISM mechanism = createHashMechanism(hashAlg, AsymmetricAlgorithm::RSA);
-    
-    CK_RV rv = functionList_->C_SignInit(session_, &mechanism, privateKeyHandle);
-    if (rv != CKR_OK) {
-        return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to initialize signing", rv);
-    }
+        CK_MECHANISM mechanism = createHashMechanism(hashAlg, AsymmetricAlgorithm::RSA);
 
-    CK_ULONG signatureLen = 0;
-    rv = functionList_->C_Sign(session_, (CK_BYTE_PTR)data.data(), data.size(), nullptr, &signatureLen);
-    if (rv != CKR_OK) {
-        return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to get signature length", rv);
-    }
+        CK_RV rv = call(P11Function::C_SignInit, functionList_->C_SignInit, session_, &mechanism, privateKeyHandle);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to initialize signing", rv);
+        }
 
-    std::vector<CK_BYTE> signature(signatureLen);
-    rv = functionList_->C_Sign(session_, (CK_BYTE_PTR)data.data(), data.size(), 
-                              signature.data(), &signatureLen);
-    if (rv != CKR_OK) {
-        return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to sign data", rv);
-    }
+        CK_ULONG signatureLen = 0;
+        rv = call(P11Function::C_Sign, functionList_->C_Sign, session_, (CK_BYTE_PTR)data.data(), data.size(), nullptr, &signatureLen);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to get signature length", rv);
+        }
+
+        std::vector<CK_BYTE> signature(signatureLen);
+        rv = call(P11Function::C_Sign, functionList_->C_Sign, session_, (CK_BYTE_PTR)data.data(), data.size(), 
+                 signature.data(), &signatureLen);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to sign data", rv);
+        }
 
-    signature.resize(signatureLen);
-    return Result<std::vector<CK_BYTE>>::Ok(signature);
+        metrics_.addBytes(P11Function::C_Sign, data.size(), signatureLen);
+        signature.resize(signatureLen);
+        return Result<std::vector<CK_BYTE>>::Ok(signature);
+    });
 }
 
 Result<void> PKCS11Library::verify(CK_OBJECT_HANDLE publicKeyHandle, const std::vector<CK_BYTE>& data,
                                   const std::vector<CK_BYTE>& signature, HashAlgorithm hashAlg) {
-    if (!sessionOpen_) {
-        return Result<void>::Error(Status::ERROR_GENERAL, "No session open");
-    }
+    std::unique_lock<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "verify", currentSlotId_);
+    return withRecovery(lock, Replay::Refused, [&] {
+        if (!sessionOpen_) {
+            return Result<void>::Error(Status::ERROR_GENERAL, "No session open");
+        }
 
-    CK_MECHANISM mechanism = createHashMechanism(hashAlg, AsymmetricAlgorithm::RSA);
-    
-    CK_RV rv = functionList_->C_VerifyInit(session_, &mechanism, publicKeyHandle);
-    if (rv != CKR_OK) {
-        return Result<void>::Error(convertPKCS11Error(rv), "Failed to initialize verification", rv);
-    }
+        CK_MECHANISM mechanism = createHashMechanism(hashAlg, AsymmetricAlgorithm::RSA);
 
-    rv = functionList_->C_Verify(session_, (CK_BYTE_PTR)data.data(), data.size(),
-                                (CK_BYTE_PTR)signature.data(), signature.size());
-    if (rv != CKR_OK) {
-        return Result<void>::Error(convertPKCS11Error(rv), "Verification failed", rv);
-    }
+        CK_RV rv = call(P11Function::C_VerifyInit, functionList_->C_VerifyInit, session_, &mechanism, publicKeyHandle);
+        if (rv != CKR_OK) {
+            return Result<void>::Error(convertPKCS11Error(rv), "Failed to initialize verification", rv);
+        }
 
-    return Result<void>::Ok();
+        rv = call(P11Function::C_Verify, functionList_->C_Verify, session_, (CK_BYTE_PTR)data.data(), data.size(),
+                 (CK_BYTE_PTR)signature.data(), signature.size());
+        if (rv != CKR_OK) {
+            return Result<void>::Error(convertPKCS11Error(rv), "Verification failed", rv);
+        }
+
+        metrics_.addBytes(P11Function::C_Verify, data.size() + signature.size(), 0);
+        return Result<void>::Ok();
+    });
 }
 
-Result<std::vector<CK_BYTE>> PKCS11Library::encrypt(CK_OBJECT_HANDLE keyHandle, const std::vector<CK_BYTE>& plaintext,
-                                                    SymmetricAlgorithm algorithm, CipherMode mode, 
-                                                    const std::vector<CK_BYTE>& iv) {
-    if (!sessionOpen_) {
-        return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_GENERAL, "No session open");
-    }
+Result<std::vector<CK_BYTE>> PKCS11Library::signECDSA(CK_OBJECT_HANDLE privateKeyHandle, 
+                                                      const std::vector<CK_BYTE>& data,
+                                                      HashAlgorithm hashAlg, SignatureEncoding encoding) {
+    std::unique_lock<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "signECDSA", currentSlotId_);
+    return withRecovery(lock, Replay::Refused, [&] {
+        if (!sessionOpen_) {
+            return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_GENERAL, "No session open");
+        }
 
-    CK_MECHANISM mechanism = createMechanism(algorithm, mode, iv);
-    
-    CK_RV rv = functionList_->C_EncryptInit(session_, &mechanism, keyHandle);
-    if (rv != CKR_OK) {
-        return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to initialize encryption", rv);
-    }
+        auto digest = HostCrypto::digest(hashAlg, data);
+        if (!digest.isOk()) {
+            return digest;
+        }
 
-    CK_ULONG ciphertextLen = 0;
-    rv = functionList_->C_Encrypt(session_, (CK_BYTE_PTR)plaintext.data(), plaintext.size(), 
-                                 nullptr, &ciphertextLen);
-    if (rv != CKR_OK) {
-        return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to get ciphertext length", rv);
-    }
+        CK_MECHANISM mechanism = createHashMechanism(hashAlg, AsymmetricAlgorithm::ECDSA);
 
-    std::vector<CK_BYTE> ciphertext(ciphertextLen);
-    rv = functionList_->C_Encrypt(session_, (CK_BYTE_PTR)plaintext.data(), plaintext.size(),
-                                 ciphertext.data(), &ciphertextLen);
-    if (rv != CKR_OK) {
-        return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to encrypt data", rv);
-    }
+        CK_RV rv = call(P11Function::C_SignInit, functionList_->C_SignInit, session_, &mechanism, privateKeyHandle);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to initialize ECDSA signing", rv);
+        }
+
+        // P-256 signatures are a fixed 64 bytes; skip the length query round trip
+        std::vector<CK_BYTE> signature(2 * P256_COORDINATE_LEN);
+        CK_ULONG signatureLen = signature.size();
+        rv = call(P11Function::C_Sign, functionList_->C_Sign, session_, digest.value.data(), digest.value.size(),
+                 signature.data(), &signatureLen);
+        if (rv == CKR_BUFFER_TOO_SMALL) {
+            signature.resize(signatureLen);
+            rv = call(P11Function::C_Sign, functionList_->C_Sign, session_, digest.value.data(), digest.value.size(),
+                     signature.data(), &signatureLen);
+        }
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to sign data with ECDSA", rv);
+        }
+
+        metrics_.addBytes(P11Function::C_Sign, digest.value.size(), signatureLen);
+        signature.resize(signatureLen);
+        if (encoding == SignatureEncoding::DER) {
+            signature = ecdsaRawToDer(signature);
+            if (signature.empty()) {
+                return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_SIGNATURE_LEN_RANGE,
+                                                           "Cannot DER-encode ECDSA signature");
+            }
+        }
+        return Result<std::vector<CK_BYTE>>::Ok(signature);
+    });
+}
+
+Result<void> PKCS11Library::verifyECDSA(CK_OBJECT_HANDLE publicKeyHandle, const std::vector<CK_BYTE>& data,
+                                       const std::vector<CK_BYTE>& signature, HashAlgorithm hashAlg,
+                                       SignatureEncoding encoding) {
+    std::unique_lock<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "verifyECDSA", currentSlotId_);
+    return withRecovery(lock, Replay::Refused, [&] {
+        if (!sessionOpen_) {
+            return Result<void>::Error(Status::ERROR_GENERAL, "No session open");
+        }
 
-    ciphertext.resize(ciphertextLen);
-    return Result<std::vector<CK_BYTE>>::Ok(ciphertext);
+        std::vector<CK_BYTE> rawSignature = encoding == SignatureEncoding::DER ?
+            ecdsaDerToRaw(signature, P256_COORDINATE_LEN) : signature;
+        if (rawSignature.empty()) {
+            return Result<void>::Error(Status::ERROR_SIGNATURE_INVALID, "Malformed DER signature");
+        }
+
+        auto digest = HostCrypto::digest(hashAlg, data);
+        if (!digest.isOk()) {
+            return Result<void>::Error(digest.errorCode, digest.errorMessage);
+        }
+
+        CK_MECHANISM mechanism = createHashMechanism(hashAlg, AsymmetricAlgorithm::ECDSA);
+
+        CK_RV rv = call(P11Function::C_VerifyInit, functionList_->C_VerifyInit, session_, &mechanism, publicKeyHandle);
+        if (rv != CKR_OK) {
+            return Result<void>::Error(convertPKCS11Error(rv), "Failed to initialize ECDSA verification", rv);
+        }
+
+        rv = call(P11Function::C_Verify, functionList_->C_Verify, session_, digest.value.data(), digest.value.size(),
+                 rawSignature.data(), rawSignature.size());
+        if (rv != CKR_OK) {
+            return Result<void>::Error(convertPKCS11Error(rv), "ECDSA verification failed", rv);
+        }
+
+        metrics_.addBytes(P11Function::C_Verify, digest.value.size() + rawSignature.size(), 0);
+        return Result<void>::Ok();
+    });
+}
+
+Result<std::vector<CK_BYTE>> PKCS11Library::encrypt(CK_OBJECT_HANDLE keyHandle, const std::vector<CK_BYTE>& plaintext,
+                                                    SymmetricAlgorithm algorithm, CipherMode mode, 
+                                                    const std::vector<CK_BYTE>& iv) {
+    std::unique_lock<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "encrypt", currentSlotId_);
+    return withRecovery(lock, Replay::Refused, [&] {
+        if (!sessionOpen_) {
+            return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_GENERAL, "No session open");
+        }
+
+        CK_MECHANISM mechanism = createMechanism(algorithm, mode, iv);
+
+        CK_RV rv = call(P11Function::C_EncryptInit, functionList_->C_EncryptInit, session_, &mechanism, keyHandle);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to initialize encryption", rv);
+        }
+
+        CK_ULONG ciphertextLen = 0;
+        rv = call(P11Function::C_Encrypt, functionList_->C_Encrypt, session_, (CK_BYTE_PTR)plaintext.data(), plaintext.size(), 
+                 nullptr, &ciphertextLen);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to get ciphertext length", rv);
+        }
+
+        std::vector<CK_BYTE> ciphertext(ciphertextLen);
+        rv = call(P11Function::C_Encrypt, functionList_->C_Encrypt, session_, (CK_BYTE_PTR)plaintext.data(), plaintext.size(),
+                 ciphertext.data(), &ciphertextLen);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to encrypt data", rv);
+        }
+
+        metrics_.addBytes(P11Function::C_Encrypt, plaintext.size(), ciphertextLen);
+        ciphertext.resize(ciphertextLen);
+        return Result<std::vector<CK_BYTE>>::Ok(ciphertext);
+    });
 }
 
 Result<std::vector<CK_BYTE>> PKCS11Library::decrypt(CK_OBJECT_HANDLE keyHandle, const std::vector<CK_BYTE>& ciphertext,
                                                     SymmetricAlgorithm algorithm, CipherMode mode, 
                                                     const std::vector<CK_BYTE>& iv) {
-    if (!sessionOpen_) {
-        return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_GENERAL, "No session open");
-    }
+    std::unique_lock<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "decrypt", currentSlotId_);
+    return withRecovery(lock, Replay::Refused, [&] {
+        if (!sessionOpen_) {
+            return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_GENERAL, "No session open");
+        }
 
-    CK_MECHANISM mechanism = createMechanism(algorithm, mode, iv);
-    
-    CK_RV rv = functionList_->C_DecryptInit(session_, &mechanism, keyHandle);
-    if (rv != CKR_OK) {
-        return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to initialize decryption", rv);
-    }
+        CK_MECHANISM mechanism = createMechanism(algorithm, mode, iv);
 
-    CK_ULONG plaintextLen = 0;
-    rv = functionList_->C_Decrypt(session_, (CK_BYTE_PTR)ciphertext.data(), ciphertext.size(),
-                                 nullptr, &plaintextLen);
-    if (rv != CKR_OK) {
-        return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to get plaintext length", rv);
-    }
+        CK_RV rv = call(P11Function::C_DecryptInit, functionList_->C_DecryptInit, session_, &mechanism, keyHandle);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to initialize decryption", rv);
+        }
 
-    std::vector<CK_BYTE> plaintext(plaintextLen);
-    rv = functionList_->C_Decrypt(session_, (CK_BYTE_PTR)ciphertext.data(), ciphertext.size(),
-                                 plaintext.data(), &plaintextLen);
-    if (rv != CKR_OK) {
-        return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to decrypt data", rv);
-    }
+        CK_ULONG plaintextLen = 0;
+        rv = call(P11Function::C_Decrypt, functionList_->C_Decrypt, session_, (CK_BYTE_PTR)ciphertext.data(), ciphertext.size(),
+                 nullptr, &plaintextLen);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to get plaintext length", rv);
+        }
+
+        std::vector<CK_BYTE> plaintext(plaintextLen);
+        rv = call(P11Function::C_Decrypt, functionList_->C_Decrypt, session_, (CK_BYTE_PTR)ciphertext.data(), ciphertext.size(),
+                 plaintext.data(), &plaintextLen);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to decrypt data", rv);
+        }
 
-    plaintext.resize(plaintextLen);
-    return Result<std::vector<CK_BYTE>>::Ok(plaintext);
+        metrics_.addBytes(P11Function::C_Decrypt, ciphertext.size(), plaintextLen);
+        plaintext.resize(plaintextLen);
+        return Result<std::vector<CK_BYTE>>::Ok(plaintext);
+    });
 }
 
 Result<std::vector<CK_BYTE>> PKCS11Library::encryptRSA(CK_OBJECT_HANDLE publicKeyHandle, 
                                                        const std::vector<CK_BYTE>& plaintext) {
-    if (!sessionOpen_) {
-        return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_GENERAL, "No session open");
-    }
+    std::unique_lock<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "encryptRSA", currentSlotId_);
+    return withRecovery(lock, Replay::Refused, [&] {
+        if (!sessionOpen_) {
+            return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_GENERAL, "No session open");
+        }
 
-    CK_MECHANISM mechanism = {CKM_RSA_PKCS, nullptr, 0};
-    
-    CK_RV rv = functionList_->C_EncryptInit(session_, &mechanism, publicKeyHandle);
-    if (rv != CKR_OK) {
-        return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to initialize RSA encryption", rv);
-    }
+        CK_MECHANISM mechanism = {CKM_RSA_PKCS, nullptr, 0};
 
-    CK_ULONG ciphertextLen = 0;
-    rv = functionList_->C_Encrypt(session_, (CK_BYTE_PTR)plaintext.data(), plaintext.size(),
-                                 nullptr, &ciphertextLen);
-    if (rv != CKR_OK) {
-        return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to get RSA ciphertext length", rv);
-    }
+        CK_RV rv = call(P11Function::C_EncryptInit, functionList_->C_EncryptInit, session_, &mechanism, publicKeyHandle);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to initialize RSA encryption", rv);
+        }
 
-    std::vector<CK_BYTE> ciphertext(ciphertextLen);
-    rv = functionList_->C_Encrypt(session_, (CK_BYTE_PTR)plaintext.data(), plaintext.size(),
-                                 ciphertext.data(), &ciphertextLen);
-    if (rv != CKR_OK) {
-        return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to encrypt with RSA", rv);
-    }
+        CK_ULONG ciphertextLen = 0;
+        rv = call(P11Function::C_Encrypt, functionList_->C_Encrypt, session_, (CK_BYTE_PTR)plaintext.data(), plaintext.size(),
+                 nullptr, &ciphertextLen);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to get RSA ciphertext length", rv);
+        }
 
-    ciphertext.resize(ciphertextLen);
-    return Result<std::vector<CK_BYTE>>::Ok(ciphertext);
+        std::vector<CK_BYTE> ciphertext(ciphertextLen);
+        rv = call(P11Function::C_Encrypt, functionList_->C_Encrypt, session_, (CK_BYTE_PTR)plaintext.data(), plaintext.size(),
+                 ciphertext.data(), &ciphertextLen);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to encrypt with RSA", rv);
+        }
+
+        metrics_.addBytes(P11Function::C_Encrypt, plaintext.size(), ciphertextLen);
+        ciphertext.resize(ciphertextLen);
+        return Result<std::vector<CK_BYTE>>::Ok(ciphertext);
+    });
 }
 
 Result<std::vector<CK_BYTE>> PKCS11Library::decryptRSA(CK_OBJECT_HANDLE privateKeyHandle, 
                                                        const std::vector<CK_BYTE>& ciphertext) {
-    if (!sessionOpen_) {
-        return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_GENERAL, "No session open");
-    }
+    std::unique_lock<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "decryptRSA", currentSlotId_);
+    return withRecovery(lock, Replay::Refused, [&] {
+        if (!sessionOpen_) {
+            return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_GENERAL, "No session open");
+        }
 
-    CK_MECHANISM mechanism = {CKM_RSA_PKCS, nullptr, 0};
-    
-    CK_RV rv = functionList_->C_DecryptInit(session_, &mechanism, privateKeyHandle);
-    if (rv != CKR_OK) {
-        return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to initialize RSA decryption", rv);
-    }
+        CK_MECHANISM mechanism = {CKM_RSA_PKCS, nullptr, 0};
 
-    CK_ULONG plaintextLen = 0;
-    rv = functionList_->C_Decrypt(session_, (CK_BYTE_PTR)ciphertext.data(), ciphertext.size(),
-                                 nullptr, &plaintextLen);
-    if (rv != CKR_OK) {
-        return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to get RSA plaintext length", rv);
-    }
+        CK_RV rv = call(P11Function::C_DecryptInit, functionList_->C_DecryptInit, session_, &mechanism, privateKeyHandle);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to initialize RSA decryption", rv);
+        }
 
-    std::vector<CK_BYTE> plaintext(plaintextLen);
-    rv = functionList_->C_Decrypt(session_, (CK_BYTE_PTR)ciphertext.data(), ciphertext.size(),
-                                 plaintext.data(), &plaintextLen);
-    if (rv != CKR_OK) {
-        return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to decrypt with RSA", rv);
-    }
+        CK_ULONG plaintextLen = 0;
+        rv = call(P11Function::C_Decrypt, functionList_->C_Decrypt, session_, (CK_BYTE_PTR)ciphertext.data(), ciphertext.size(),
+                 nullptr, &plaintextLen);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to get RSA plaintext length", rv);
+        }
+
+        std::vector<CK_BYTE> plaintext(plaintextLen);
+        rv = call(P11Function::C_Decrypt, functionList_->C_Decrypt, session_, (CK_BYTE_PTR)ciphertext.data(), ciphertext.size(),
+                 plaintext.data(), &plaintextLen);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to decrypt with RSA", rv);
+        }
 
-    plaintext.resize(plaintextLen);
-    return Result<std::vector<CK_BYTE>>::Ok(plaintext);
+        metrics_.addBytes(P11Function::C_Decrypt, ciphertext.size(), plaintextLen);
+        plaintext.resize(plaintextLen);
+        return Result<std::vector<CK_BYTE>>::Ok(plaintext);
+    });
 }
 
 Result<std::vector<CK_BYTE>> PKCS11Library::exportCertificate(CK_OBJECT_HANDLE certHandle) {
-    return getAttributeBytes(certHandle, CKA_VALUE);
+    std::unique_lock<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "exportCertificate", currentSlotId_);
+    return withRecovery(lock, Replay::Refused, [&] { return getAttributeBytes(certHandle, CKA_VALUE); });
 }
 
 Result<void> PKCS11Library::exportCertificateToFile(CK_OBJECT_HANDLE certHandle, const std::string& filename) {
+    ApiScope probe(trace_, "exportCertificateToFile", currentSlotId_);
     auto certData = exportCertificate(certHandle);
     if (!certData.isOk()) {
         return Result<void>::Error(certData.errorCode, certData.errorMessage, certData.pkcs11Error);
@@ -827,20 +1442,510 @@ Result<void> PKCS11Library::exportCertificateToFile(CK_OBJECT_HANDLE certHandle,
     return Result<void>::Ok();
 }
 
+Result<std::vector<CK_BYTE>> PKCS11Library::exportPublicKey(CK_OBJECT_HANDLE keyHandle, KeyFormat format) {
+    std::unique_lock<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "exportPublicKey", currentSlotId_);
+
+    auto der = withRecovery(lock, Replay::Refused, [&] { return publicKeyDer(keyHandle); });
+    if (!der.isOk() || format == KeyFormat::DER) {
+        return der;
+    }
+    std::string text = PublicKey::pem(der.value);
+    return Result<std::vector<CK_BYTE>>::Ok(std::vector<CK_BYTE>(text.begin(), text.end()));
+}
+
+Result<std::vector<CK_BYTE>> PKCS11Library::publicKeyDer(CK_OBJECT_HANDLE keyHandle) {
+    if (!sessionOpen_) {
+        return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_GENERAL, "No session open");
+    }
+
+    if (keySerial_.empty()) {
+        CK_TOKEN_INFO tokenInfo;
+        CK_RV rv = call(P11Function::C_GetTokenInfo, functionList_->C_GetTokenInfo, currentSlotId_, &tokenInfo);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to get token info", rv);
+        }
+        keySerial_ = trimString((char*)tokenInfo.serialNumber, 16);
+    }
+
+    // IDs are short: one round trip in the common case
+    CK_BYTE idBuffer[64];
+    CK_ATTRIBUTE idAttr = {CKA_ID, idBuffer, sizeof(idBuffer)};
+    std::vector<CK_BYTE> id;
+    if (call(P11Function::C_GetAttributeValue, functionList_->C_GetAttributeValue, session_, keyHandle, &idAttr, 1) == CKR_OK) {
+        id.assign(idBuffer, idBuffer + idAttr.ulValueLen);
+    } else {
+        auto longId = getAttributeBytes(keyHandle, CKA_ID);
+        if (!longId.isOk()) {
+            return longId;
+        }
+        id = std::move(longId.value);
+    }
+
+    // Without an ID there is nothing stable to key the memo on
+    std::string cacheKey = keySerial_ + "/" + bytesToHex(id);
+    if (!id.empty()) {
+        auto cached = publicKeyCache_.find(cacheKey);
+        if (cached != publicKeyCache_.end()) {
+            return Result<std::vector<CK_BYTE>>::Ok(cached->second);
+        }
+    }
+
+    auto keyType = getAttribute<CK_KEY_TYPE>(keyHandle, CKA_KEY_TYPE);
+    if (!keyType.isOk()) {
+        return Result<std::vector<CK_BYTE>>::Error(keyType.errorCode, keyType.errorMessage, keyType.pkcs11Error);
+    }
+
+    std::vector<CK_BYTE> der;
+    if (keyType.value == CKK_RSA) {
+        auto modulus = getAttributeBytes(keyHandle, CKA_MODULUS);
+        if (!modulus.isOk()) {
+            return modulus;
+        }
+        auto exponent = getAttributeBytes(keyHandle, CKA_PUBLIC_EXPONENT);
+        if (!exponent.isOk()) {
+            return exponent;
+        }
+        der = PublicKey::rsaSpki(modulus.value, exponent.value);
+    } else if (keyType.value == CKK_EC) {
+        auto params = getAttributeBytes(keyHandle, CKA_EC_PARAMS);
+        if (!params.isOk()) {
+            return params;
+        }
+        auto point = getAttributeBytes(keyHandle, CKA_EC_POINT);
+        if (!point.isOk()) {
+            return point;
+        }
+        der = PublicKey::ecSpki(params.value, point.value);
+        if (der.empty()) {
+            return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_ATTRIBUTE_VALUE_INVALID,
+                                                       "Malformed EC parameters or point");
+        }
+    } else {
+        return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_KEY_TYPE_INCONSISTENT,
+                                                   "Public key export supports RSA and EC keys only");
+    }
+
+    if (!id.empty()) {
+        publicKeyCache_[cacheKey] = der;
+    }
+    return Result<std::vector<CK_BYTE>>::Ok(der);
+}
+
+Result<Pkcs12Import> PKCS11Library::importPkcs12(const std::vector<CK_BYTE>& blob, const std::string& password,
+                                                 const std::string& label) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "importPkcs12", currentSlotId_);
+
+    if (!sessionOpen_) {
+        return Result<Pkcs12Import>::Error(Status::ERROR_GENERAL, "No session open");
+    }
+
+    bool parsedByToken = false;
+    auto contents = parsePkcs12(blob, password, parsedByToken);
+    if (!contents.isOk()) {
+        return Result<Pkcs12Import>::Error(contents.errorCode, contents.errorMessage, contents.pkcs11Error);
+    }
+
+    std::string objectLabel = !label.empty() ? label :
+                              !contents.value.friendlyName.empty() ? contents.value.friendlyName : "imported";
+    std::set<std::vector<CK_BYTE>> knownCertificates;
+    Result<Pkcs12Import> imported = [&] {
+        TokenTransaction transaction(*this);
+        return storePkcs12(contents.value, objectLabel, knownCertificates);
+    }();
+    contents.value.cleanse();
+    if (imported.isOk()) {
+        imported.value.parsedByToken = parsedByToken;
+    }
+    return imported;
+}
+
+Result<std::vector<Pkcs12FileImport>> PKCS11Library::importPkcs12Directory(const std::string& directory,
+                                                                           const std::string& password) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "importPkcs12Directory", currentSlotId_);
+
+    if (!sessionOpen_) {
+        return Result<std::vector<Pkcs12FileImport>>::Error(Status::ERROR_GENERAL, "No session open");
+    }
+
+    std::error_code ec;
+    std::vector<std::filesystem::path> paths;
+    for (std::filesystem::directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec)) {
+        std::string extension = it->path().extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(),
+                       [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        if ((extension == ".p12" || extension == ".pfx") && it->is_regular_file(ec)) {
+            paths.push_back(it->path());
+        }
+    }
+    if (ec) {
+        return Result<std::vector<Pkcs12FileImport>>::Error(Status::ERROR_ARGUMENTS_BAD,
+                                                            "Cannot read directory " + directory + ": " + ec.message());
+    }
+    std::sort(paths.begin(), paths.end());
+
+    // Parse everything first so that the card is held only for the creations
+    std::vector<Result<Pkcs12::Contents>> parsed;
+    std::vector<bool> parsedByToken(paths.size(), false);
+    for (size_t i = 0; i < paths.size(); i++) {
+        std::ifstream file(paths[i], std::ios::binary);
+        std::vector<CK_BYTE> blob((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (!file.good() && !file.eof()) {
+            parsed.push_back(Result<Pkcs12::Contents>::Error(Status::ERROR_GENERAL, "Failed to read file"));
+            continue;
+        }
+        bool onToken = false;
+        parsed.push_back(parsePkcs12(blob, password, onToken));
+        parsedByToken[i] = onToken;
+    }
+
+    std::vector<Pkcs12FileImport> imports;
+    std::set<std::vector<CK_BYTE>> knownCertificates;
+    TokenTransaction transaction(*this);
+    for (size_t i = 0; i < paths.size(); i++) {
+        Pkcs12FileImport entry{paths[i].string(), Result<Pkcs12Import>::Error(parsed[i].errorCode,
+                                                                              parsed[i].errorMessage,
+                                                                              parsed[i].pkcs11Error)};
+        if (parsed[i].isOk()) {
+            Pkcs12::Contents& contents = parsed[i].value;
+            std::string label = contents.friendlyName.empty() ? paths[i].stem().string() : contents.friendlyName;
+            entry.result = storePkcs12(contents, label, knownCertificates);
+            if (entry.result.isOk()) {
+                entry.result.value.parsedByToken = parsedByToken[i];
+            }
+            contents.cleanse();
+        }
+        imports.push_back(std::move(entry));
+    }
+    return Result<std::vector<Pkcs12FileImport>>::Ok(imports);
+}
+
+Result<Pkcs12::Contents> PKCS11Library::parsePkcs12(const std::vector<CK_BYTE>& blob, const std::string& password,
+                                                    bool& parsedByToken) {
+    auto contents = parseComboCertificate(blob, password);
+    parsedByToken = contents.isOk();
+    if (contents.isOk()) {
+        return contents;
+    }
+    // convertPKCS11Error() reports CKR_PIN_INCORRECT as a bad PIN; here it is
+    // the file's password, reported as the host parser would
+    if (contents.pkcs11Error == CKR_PIN_INCORRECT) {
+        return Result<Pkcs12::Contents>::Error(Status::ERROR_PIN_INCORRECT, "Wrong PKCS#12 password",
+                                               contents.pkcs11Error);
+    }
+    // The module may not parse this file (or at all): the host parser decides
+    return Pkcs12::parse(blob, password);
+}
+
+Result<Pkcs12::Contents> PKCS11Library::parseComboCertificate(const std::vector<CK_BYTE>& blob,
+                                                              const std::string& password) {
+    auto parseFunc = auxFunctionList_ ? (EP_ParseComboCertificate)auxFunctionList_->pFunc[EP_PARSE_COMBO_CERT]
+                                      : nullptr;
+    if (!parseFunc) {
+        return Result<Pkcs12::Contents>::Error(Status::ERROR_FUNCTION_NOT_SUPPORTED,
+                                               "ParseComboCertificate function not available");
+    }
+
+    // First call with no buffers reports the certificate and key sizes
+    CK_BYTE_PTR pPassword = (CK_BYTE_PTR)password.data();
+    AUX_CERTIFICATE cert = {0, 0, nullptr};
+    AUX_PUBLIC_KEY pubKey = {0, nullptr, nullptr};
+    AUX_PRIVATE_KEY prvKey = {0, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr};
+    CK_RV rv = call(P11Function::EP_ParseComboCertificate, parseFunc, (CK_BYTE_PTR)blob.data(), blob.size(),
+                    pPassword, password.size(), &cert, &pubKey, &prvKey);
+    if (rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL) {
+        return Result<Pkcs12::Contents>::Error(convertPKCS11Error(rv), "Failed to parse PKCS#12 file", rv);
+    }
+    CK_ULONG modulusLen = prvKey.bit_len / 8;
+    if (modulusLen == 0 || prvKey.bit_len % 16 != 0) {
+        return Result<Pkcs12::Contents>::Error(Status::ERROR_DATA_INVALID, "PKCS#12 file holds no RSA key");
+    }
+
+    // Fixed-width big-endian components: n, e, d at modulus length, the CRT
+    // values at half of it
+    CK_ULONG halfLen = modulusLen / 2;
+    std::vector<CK_BYTE> certBuffer(cert.cert_len);
+    std::vector<CK_BYTE> keyBuffer(3 * modulusLen + 5 * halfLen);
+    cert.cert_buff = certBuffer.empty() ? nullptr : certBuffer.data();
+    CK_BYTE_PTR next = keyBuffer.data();
+    for (CK_BYTE_PTR* field : {&prvKey.ptrN, &prvKey.ptrE, &prvKey.ptrD}) {
+        *field = next;
+        next += modulusLen;
+    }
+    for (CK_BYTE_PTR* field : {&prvKey.ptrP, &prvKey.ptrQ, &prvKey.ptrDmodP, &prvKey.ptrDmodQ, &prvKey.ptrQmodP}) {
+        *field = next;
+        next += halfLen;
+    }
+    pubKey.ptrN = nullptr;
+    pubKey.ptrE = nullptr;
+    rv = call(P11Function::EP_ParseComboCertificate, parseFunc, (CK_BYTE_PTR)blob.data(), blob.size(),
+              pPassword, password.size(), &cert, &pubKey, &prvKey);
+    if (rv != CKR_OK) {
+        HostCrypto::cleanse(keyBuffer);
+        return Result<Pkcs12::Contents>::Error(convertPKCS11Error(rv), "Failed to parse PKCS#12 file", rv);
+    }
+
+    Pkcs12::Contents contents;
+    contents.modulus = Pkcs12::trimInteger(prvKey.ptrN, modulusLen);
+    contents.publicExponent = Pkcs12::trimInteger(prvKey.ptrE, modulusLen);
+    contents.privateExponent = Pkcs12::trimInteger(prvKey.ptrD, modulusLen);
+    contents.prime1 = Pkcs12::trimInteger(prvKey.ptrP, halfLen);
+    contents.prime2 = Pkcs12::trimInteger(prvKey.ptrQ, halfLen);
+    contents.exponent1 = Pkcs12::trimInteger(prvKey.ptrDmodP, halfLen);
+    contents.exponent2 = Pkcs12::trimInteger(prvKey.ptrDmodQ, halfLen);
+    contents.coefficient = Pkcs12::trimInteger(prvKey.ptrQmodP, halfLen);
+    HostCrypto::cleanse(keyBuffer);
+    if (!Pkcs12::isConsistent(contents)) {
+        contents.cleanse();
+        return Result<Pkcs12::Contents>::Error(Status::ERROR_DATA_INVALID, "Module returned an inconsistent key");
+    }
+
+    // The key's own certificate is the one carrying its modulus; the rest is chain
+    for (auto& der : Pkcs12::splitDer(certBuffer.data(), std::min<size_t>(cert.cert_len, certBuffer.size()))) {
+        auto fields = Pkcs12::certificateFields(der);
+        if (contents.certificate.empty() && fields.isOk() && fields.value.modulus == contents.modulus) {
+            contents.certificate = std::move(der);
+        } else {
+            contents.chain.push_back(std::move(der));
+        }
+    }
+
+    auto result = Result<Pkcs12::Contents>::Ok(contents);
+    contents.cleanse();
+    return result;
+}
+
+Result<Pkcs12Import> PKCS11Library::storePkcs12(const Pkcs12::Contents& contents, const std::string& label,
+                                                std::set<std::vector<CK_BYTE>>& knownCertificates) {
+    auto id = HostCrypto::digest(HashAlgorithm::SHA1, contents.modulus);
+    if (!id.isOk()) {
+        return Result<Pkcs12Import>::Error(id.errorCode, id.errorMessage);
+    }
+
+    Pkcs12Import imported;
+    imported.label = label;
+    imported.id = id.value;
+
+    std::vector<CK_OBJECT_HANDLE> created;
+    auto failed = [&](Status status, const std::string& message, CK_RV rv) {
+        std::set<CK_OBJECT_HANDLE> left;
+        for (auto it = created.rbegin(); it != created.rend(); ++it) {
+            if (call(P11Function::C_DestroyObject, functionList_->C_DestroyObject, session_, *it) != CKR_OK) {
+                left.insert(*it);
+            }
+        }
+        if (left.empty()) {
+            return Result<Pkcs12Import>::Error(status, message, rv);
+        }
+
+        // As executeBatch() does: say so, and hand back what is still on the
+        // token so the caller can remove it
+        auto survivor = [&](CK_OBJECT_HANDLE handle) { return left.count(handle) ? handle : CK_INVALID_HANDLE; };
+        imported.privateKey = survivor(imported.privateKey);
+        imported.publicKey = survivor(imported.publicKey);
+        imported.certificate = survivor(imported.certificate);
+        imported.chain.erase(std::remove_if(imported.chain.begin(), imported.chain.end(),
+                                            [&](CK_OBJECT_HANDLE handle) { return !left.count(handle); }),
+                             imported.chain.end());
+        auto result = Result<Pkcs12Import>::Error(Status::ERROR_ROLLBACK_FAILED,
+                                                  message + "; rollback failed, objects left on token", rv);
+        result.value = imported;
+        return result;
+    };
+
+    CK_BBOOL bTrue = CK_TRUE;
+    CK_BBOOL bFalse = CK_FALSE;
+    CK_ULONG keyType = CKK_RSA;
+    std::vector<CK_BYTE> subject;
+    if (!contents.certificate.empty()) {
+        auto fields = Pkcs12::certificateFields(contents.certificate);
+        if (!fields.isOk()) {
+            return failed(fields.errorCode, fields.errorMessage, 0);
+        }
+        subject = fields.value.subject;
+    }
+    auto bytes = [](const std::vector<CK_BYTE>& value) { return (void*)value.data(); };
+
+    CK_OBJECT_CLASS priClass = CKO_PRIVATE_KEY;
+    std::vector<CK_ATTRIBUTE> priTemplate = {
+        {CKA_CLASS, &priClass, sizeof(priClass)},
+        {CKA_KEY_TYPE, &keyType, sizeof(keyType)},
+        {CKA_TOKEN, &bTrue, sizeof(bTrue)},
+        {CKA_PRIVATE, &bTrue, sizeof(bTrue)},
+        {CKA_SENSITIVE, &bTrue, sizeof(bTrue)},
+        {CKA_EXTRACTABLE, &bFalse, sizeof(bFalse)},
+        {CKA_DECRYPT, &bTrue, sizeof(bTrue)},
+        {CKA_SIGN, &bTrue, sizeof(bTrue)},
+        {CKA_UNWRAP, &bTrue, sizeof(bTrue)},
+        {CKA_LABEL, (void*)label.c_str(), label.length()},
+        {CKA_ID, bytes(imported.id), imported.id.size()},
+        {CKA_MODULUS, bytes(contents.modulus), contents.modulus.size()},
+        {CKA_PUBLIC_EXPONENT, bytes(contents.publicExponent), contents.publicExponent.size()},
+        {CKA_PRIVATE_EXPONENT, bytes(contents.privateExponent), contents.privateExponent.size()},
+        {CKA_PRIME_1, bytes(contents.prime1), contents.prime1.size()},
+        {CKA_PRIME_2, bytes(contents.prime2), contents.prime2.size()},
+        {CKA_EXPONENT_1, bytes(contents.exponent1), contents.exponent1.size()},
+        {CKA_EXPONENT_2, bytes(contents.exponent2), contents.exponent2.size()},
+        {CKA_COEFFICIENT, bytes(contents.coefficient), contents.coefficient.size()}
+    };
+    if (!subject.empty()) {
+        priTemplate.push_back({CKA_SUBJECT, bytes(subject), subject.size()});
+    }
+    auto privateKey = createObject(priTemplate);
+    if (!privateKey.isOk()) {
+        return failed(privateKey.errorCode, "Failed to create private key: " + privateKey.errorMessage,
+                      privateKey.pkcs11Error);
+    }
+    created.push_back(privateKey.value);
+    imported.privateKey = privateKey.value;
+
+    CK_OBJECT_CLASS pubClass = CKO_PUBLIC_KEY;
+    std::vector<CK_ATTRIBUTE> pubTemplate = {
+        {CKA_CLASS, &pubClass, sizeof(pubClass)},
+        {CKA_KEY_TYPE, &keyType, sizeof(keyType)},
+        {CKA_TOKEN, &bTrue, sizeof(bTrue)},
+        {CKA_ENCRYPT, &bTrue, sizeof(bTrue)},
+        {CKA_VERIFY, &bTrue, sizeof(bTrue)},
+        {CKA_WRAP, &bTrue, sizeof(bTrue)},
+        {CKA_LABEL, (void*)label.c_str(), label.length()},
+        {CKA_ID, bytes(imported.id), imported.id.size()},
+        {CKA_MODULUS, bytes(contents.modulus), contents.modulus.size()},
+        {CKA_PUBLIC_EXPONENT, bytes(contents.publicExponent), contents.publicExponent.size()}
+    };
+    if (!subject.empty()) {
+        pubTemplate.push_back({CKA_SUBJECT, bytes(subject), subject.size()});
+    }
+    auto publicKey = createObject(pubTemplate);
+    if (!publicKey.isOk()) {
+        return failed(publicKey.errorCode, "Failed to create public key: " + publicKey.errorMessage,
+                      publicKey.pkcs11Error);
+    }
+    created.push_back(publicKey.value);
+    imported.publicKey = publicKey.value;
+
+    if (!contents.certificate.empty()) {
+        auto certificate = createCertificate(contents.certificate, label, imported.id);
+        if (!certificate.isOk()) {
+            return failed(certificate.errorCode, "Failed to create certificate: " + certificate.errorMessage,
+                          certificate.pkcs11Error);
+        }
+        created.push_back(certificate.value);
+        imported.certificate = certificate.value;
+    }
+
+    // CA certificates are shared between many files: store each once
+    std::vector<std::vector<CK_BYTE>> added;
+    for (const auto& der : contents.chain) {
+        if (knownCertificates.count(der)) {
+            continue;
+        }
+        auto present = hasCertificate(der);
+        if (!present.isOk()) {
+            return failed(present.errorCode, present.errorMessage, present.pkcs11Error);
+        }
+        if (!present.value) {
+            auto certificate = createCertificate(der, label, {});
+            if (!certificate.isOk()) {
+                return failed(certificate.errorCode, "Failed to create chain certificate: " + certificate.errorMessage,
+                              certificate.pkcs11Error);
+            }
+            created.push_back(certificate.value);
+            imported.chain.push_back(certificate.value);
+        }
+        added.push_back(der);
+    }
+    knownCertificates.insert(added.begin(), added.end());
+
+    return Result<Pkcs12Import>::Ok(imported);
+}
+
+Result<CK_OBJECT_HANDLE> PKCS11Library::createCertificate(const std::vector<CK_BYTE>& der, const std::string& label,
+                                                          const std::vector<CK_BYTE>& id) {
+    auto fields = Pkcs12::certificateFields(der);
+    if (!fields.isOk()) {
+        return Result<CK_OBJECT_HANDLE>::Error(fields.errorCode, fields.errorMessage);
+    }
+
+    CK_OBJECT_CLASS certClass = CKO_CERTIFICATE;
+    CK_CERTIFICATE_TYPE certType = CKC_X_509;
+    CK_BBOOL bTrue = CK_TRUE;
+    std::vector<CK_ATTRIBUTE> certTemplate = {
+        {CKA_CLASS, &certClass, sizeof(certClass)},
+        {CKA_CERTIFICATE_TYPE, &certType, sizeof(certType)},
+        {CKA_TOKEN, &bTrue, sizeof(bTrue)},
+        {CKA_LABEL, (void*)label.c_str(), label.length()},
+        {CKA_SUBJECT, fields.value.subject.data(), fields.value.subject.size()},
+        {CKA_ISSUER, fields.value.issuer.data(), fields.value.issuer.size()},
+        {CKA_SERIAL_NUMBER, fields.value.serialNumber.data(), fields.value.serialNumber.size()},
+        {CKA_VALUE, (void*)der.data(), der.size()}
+    };
+    if (!id.empty()) {
+        certTemplate.push_back({CKA_ID, (void*)id.data(), id.size()});
+    }
+    return createObject(certTemplate);
+}
+
+Result<bool> PKCS11Library::hasCertificate(const std::vector<CK_BYTE>& der) {
+    CK_OBJECT_CLASS certClass = CKO_CERTIFICATE;
+    CK_ATTRIBUTE template_[] = {
+        {CKA_CLASS, &certClass, sizeof(certClass)},
+        {CKA_VALUE, (void*)der.data(), der.size()}
+    };
+    CK_RV rv = call(P11Function::C_FindObjectsInit, functionList_->C_FindObjectsInit, session_, template_, 2);
+    if (rv != CKR_OK) {
+        return Result<bool>::Error(convertPKCS11Error(rv), "Failed to initialize certificate search", rv);
+    }
+    CK_OBJECT_HANDLE handle;
+    CK_ULONG count = 0;
+    rv = call(P11Function::C_FindObjects, functionList_->C_FindObjects, session_, &handle, 1, &count);
+    call(P11Function::C_FindObjectsFinal, functionList_->C_FindObjectsFinal, session_);
+    if (rv != CKR_OK) {
+        return Result<bool>::Error(convertPKCS11Error(rv), "Failed to search certificates", rv);
+    }
+    return Result<bool>::Ok(count > 0);
+}
+
+Result<CK_OBJECT_HANDLE> PKCS11Library::createObject(const std::vector<CK_ATTRIBUTE>& attributes) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "createObject", currentSlotId_);
+
+    if (!sessionOpen_) {
+        return Result<CK_OBJECT_HANDLE>::Error(Status::ERROR_GENERAL, "No session open");
+    }
+
+    CK_OBJECT_HANDLE handle = CK_INVALID_HANDLE;
+    CK_RV rv = call(P11Function::C_CreateObject, functionList_->C_CreateObject, session_,
+                    const_cast<CK_ATTRIBUTE_PTR>(attributes.data()), attributes.size(), &handle);
+    if (rv != CKR_OK) {
+        return Result<CK_OBJECT_HANDLE>::Error(convertPKCS11Error(rv), "Failed to create object", rv);
+    }
+    publicKeyCache_.clear(); // Imports and created keys may reuse a CKA_ID
+    return Result<CK_OBJECT_HANDLE>::Ok(handle);
+}
+
 Result<void> PKCS11Library::destroyObject(CK_OBJECT_HANDLE objectHandle) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "destroyObject", currentSlotId_);
+
     if (!sessionOpen_) {
         return Result<void>::Error(Status::ERROR_GENERAL, "No session open");
     }
 
-    CK_RV rv = functionList_->C_DestroyObject(session_, objectHandle);
+    CK_RV rv = call(P11Function::C_DestroyObject, functionList_->C_DestroyObject, session_, objectHandle);
     if (rv != CKR_OK) {
         return Result<void>::Error(convertPKCS11Error(rv), "Failed to destroy object", rv);
     }
 
+    publicKeyCache_.clear();
     return Result<void>::Ok();
 }
 
 Result<std::pair<CK_SLOT_ID, CK_ULONG>> PKCS11Library::waitForSlotEvent(bool blocking) {
+    std::unique_lock<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "waitForSlotEvent", currentSlotId_);
+
     if (!sessionOpen_ || !auxFunctionList_) {
         return Result<std::pair<CK_SLOT_ID, CK_ULONG>>::Error(Status::ERROR_GENERAL, 
             "Session not open or aux functions not available");
@@ -852,12 +1957,31 @@ Result<std::pair<CK_SLOT_ID, CK_ULONG>> PKCS11Library::waitForSlotEvent(bool blo
             "WaitForSlotEvent function not available");
     }
 
-    CK_FLAGS flags = blocking ? 0 : CKF_DONT_BLOCK;
     CK_SLOT_ID slotId;
     CK_ULONG event;
     CK_ULONG extData;
-    
-    CK_RV rv = waitFunc(flags, &slotId, &event, &extData, nullptr);
+
+    // A blocking wait inside the module would hold the mutex indefinitely and
+    // cannot be interrupted, so a blocking wait polls and sleeps unlocked
+    // (under an OperationScope the scope keeps holding it); each poll also
+    // checks the context
+    const auto pollInterval = std::chrono::milliseconds(100);
+    CK_RV rv;
+    while ((rv = call(P11Function::EP_WaitForSlotEvent, waitFunc, CKF_DONT_BLOCK, &slotId, &event, &extData,
+                      nullptr)) == CKR_NO_EVENT && blocking) {
+        auto wake = std::chrono::steady_clock::now() + pollInterval;
+        if (context_) {
+            wake = std::min(wake, context_->effectiveDeadline());
+        }
+        lock.unlock();
+        std::this_thread::sleep_until(wake);
+        lock.lock();
+        if (!sessionOpen_ || !auxFunctionList_) {
+            return Result<std::pair<CK_SLOT_ID, CK_ULONG>>::Error(Status::ERROR_GENERAL,
+                "Session closed while waiting for slot event");
+        }
+        waitFunc = (EP_WaitForSlotEvent)auxFunctionList_->pFunc[EP_WAITFORSLOTEVENT];
+    }
     if (rv != CKR_OK) {
         return Result<std::pair<CK_SLOT_ID, CK_ULONG>>::Error(convertPKCS11Error(rv), 
             "Failed to wait for slot event", rv);
@@ -866,54 +1990,291 @@ Result<std::pair<CK_SLOT_ID, CK_ULONG>> PKCS11Library::waitForSlotEvent(bool blo
     return Result<std::pair<CK_SLOT_ID, CK_ULONG>>::Ok(std::make_pair(slotId, event));
 }
 
-Result<std::vector<CK_OBJECT_HANDLE>> PKCS11Library::findDataObjects() {
-    if (!sessionOpen_) {
-        return Result<std::vector<CK_OBJECT_HANDLE>>::Error(Status::ERROR_GENERAL, "No session open");
+Result<void> PKCS11Library::beginTransaction() {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "beginTransaction", currentSlotId_);
+
+    if (!sessionOpen_ || !auxFunctionList_) {
+        return Result<void>::Error(Status::ERROR_GENERAL, "Session not open or aux functions not available");
     }
 
-    std::vector<CK_OBJECT_HANDLE> objects;
+    if (transactionDepth_ > 0) {
+        transactionDepth_++;
+        return Result<void>::Ok();
+    }
 
-    CK_OBJECT_CLASS dataClass = CKO_DATA;
-    CK_BBOOL isToken = CK_TRUE;
-    CK_ATTRIBUTE template_[] = {
-        {CKA_CLASS, &dataClass, sizeof(dataClass)},
-        {CKA_TOKEN, &isToken, sizeof(isToken)}
-    };
+    auto beginFunc = (EP_BeginTransaction)auxFunctionList_->pFunc[EP_BEGIN_TRANS_APDU];
+    if (!beginFunc) {
+        return Result<void>::Error(Status::ERROR_AUX_FUNCTION_NOT_AVAILABLE, "BeginTransaction function not available");
+    }
 
-    CK_RV rv = functionList_->C_FindObjectsInit(session_, template_, 2);
+    CK_RV rv = call(P11Function::EP_BeginTransaction, beginFunc, currentSlotId_);
     if (rv != CKR_OK) {
-        return Result<std::vector<CK_OBJECT_HANDLE>>::Error(convertPKCS11Error(rv), 
-            "Failed to init data object search", rv);
+        return Result<void>::Error(convertPKCS11Error(rv), "Failed to begin card transaction", rv);
     }
 
-    CK_OBJECT_HANDLE handle;
-    CK_ULONG count;
-    
-    while (true) {
-        rv = functionList_->C_FindObjects(session_, &handle, 1, &count);
-        if (rv != CKR_OK || count == 0) {
-            break;
-        }
-        objects.push_back(handle);
+    transactionDepth_ = 1;
+    return Result<void>::Ok();
+}
+
+Result<void> PKCS11Library::endTransaction() {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "endTransaction", currentSlotId_);
+
+    if (transactionDepth_ == 0) {
+        return Result<void>::Error(Status::ERROR_GENERAL, "No card transaction active");
+    }
+
+    if (--transactionDepth_ > 0) {
+        return Result<void>::Ok();
+    }
+
+    auto endFunc = auxFunctionList_ ? (EP_EndTransaction)auxFunctionList_->pFunc[EP_END_TRANS_APDU] : nullptr;
+    if (!endFunc) {
+        return Result<void>::Error(Status::ERROR_AUX_FUNCTION_NOT_AVAILABLE, "EndTransaction function not available");
     }
 
-    functionList_->C_FindObjectsFinal(session_);
-    return Result<std::vector<CK_OBJECT_HANDLE>>::Ok(objects);
+    CK_RV rv = call(P11Function::EP_EndTransaction, endFunc, currentSlotId_);
+    if (rv != CKR_OK) {
+        return Result<void>::Error(convertPKCS11Error(rv), "Failed to end card transaction", rv);
+    }
+
+    return Result<void>::Ok();
+}
+
+Result<std::vector<CK_BYTE>> PKCS11Library::transmitAPDU(const std::vector<CK_BYTE>& command) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "transmitAPDU", currentSlotId_);
+
+    if (!sessionOpen_ || !auxFunctionList_) {
+        return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_GENERAL, 
+            "Session not open or aux functions not available");
+    }
+
+    auto transmitFunc = (EP_TransmitAPDU)auxFunctionList_->pFunc[EP_TRANSEMIT_APDU];
+    if (!transmitFunc) {
+        return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_AUX_FUNCTION_NOT_AVAILABLE, 
+            "TransmitAPDU function not available");
+    }
+
+    // Short APDU response: up to 256 data bytes plus SW1/SW2
+    std::vector<CK_BYTE> response(258);
+    CK_ULONG responseLen = response.size();
+    CK_RV rv = call(P11Function::EP_TransmitAPDU, transmitFunc, currentSlotId_, (CK_BYTE_PTR)command.data(), command.size(),
+                    response.data(), &responseLen, 0, nullptr, 0);
+    if (rv != CKR_OK) {
+        return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to transmit APDU", rv);
+    }
+
+    metrics_.addBytes(P11Function::EP_TransmitAPDU, command.size(), responseLen);
+    response.resize(responseLen);
+    return Result<std::vector<CK_BYTE>>::Ok(response);
+}
+
+Result<std::vector<CK_OBJECT_HANDLE>> PKCS11Library::findDataObjects() {
+    std::unique_lock<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "findDataObjects", currentSlotId_);
+    return withRecovery(lock, Replay::Allowed, [&] {
+        if (!sessionOpen_) {
+            return Result<std::vector<CK_OBJECT_HANDLE>>::Error(Status::ERROR_GENERAL, "No session open");
+        }
+
+        std::vector<CK_OBJECT_HANDLE> objects;
+
+        CK_OBJECT_CLASS dataClass = CKO_DATA;
+        CK_BBOOL isToken = CK_TRUE;
+        CK_ATTRIBUTE template_[] = {
+            {CKA_CLASS, &dataClass, sizeof(dataClass)},
+            {CKA_TOKEN, &isToken, sizeof(isToken)}
+        };
+
+        CK_RV rv = call(P11Function::C_FindObjectsInit, functionList_->C_FindObjectsInit, session_, template_, 2);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_OBJECT_HANDLE>>::Error(convertPKCS11Error(rv), 
+                "Failed to init data object search", rv);
+        }
+
+        CK_OBJECT_HANDLE handle;
+        CK_ULONG count;
+
+        while (true) {
+            rv = call(P11Function::C_FindObjects, functionList_->C_FindObjects, session_, &handle, 1, &count);
+            if (rv != CKR_OK || count == 0) {
+                break;
+            }
+            objects.push_back(handle);
+        }
+
+        if (isConnectionLoss(rv)) {
+            return Result<std::vector<CK_OBJECT_HANDLE>>::Error(convertPKCS11Error(rv), "Token lost during object search", rv);
+        }
+
+        call(P11Function::C_FindObjectsFinal, functionList_->C_FindObjectsFinal, session_);
+        return Result<std::vector<CK_OBJECT_HANDLE>>::Ok(objects);
+    });
+}
+
+Result<std::vector<CK_OBJECT_HANDLE>> PKCS11Library::findObjects(const std::vector<CK_ATTRIBUTE>& attributes) {
+    std::unique_lock<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "findObjects", currentSlotId_);
+    return withRecovery(lock, Replay::Allowed, [&] {
+        if (!sessionOpen_) {
+            return Result<std::vector<CK_OBJECT_HANDLE>>::Error(Status::ERROR_GENERAL, "No session open");
+        }
+
+        CK_RV rv = call(P11Function::C_FindObjectsInit, functionList_->C_FindObjectsInit, session_,
+                        const_cast<CK_ATTRIBUTE_PTR>(attributes.data()), attributes.size());
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_OBJECT_HANDLE>>::Error(convertPKCS11Error(rv),
+                "Failed to init object search", rv);
+        }
+
+        // Fetch in batches: one module call per 32 objects, not per object
+        std::vector<CK_OBJECT_HANDLE> objects;
+        CK_OBJECT_HANDLE batch[32];
+        CK_ULONG count = 0;
+        while (true) {
+            rv = call(P11Function::C_FindObjects, functionList_->C_FindObjects, session_, batch, 32, &count);
+            if (rv != CKR_OK || count == 0) {
+                break;
+            }
+            objects.insert(objects.end(), batch, batch + count);
+        }
+
+        if (isConnectionLoss(rv)) {
+            return Result<std::vector<CK_OBJECT_HANDLE>>::Error(convertPKCS11Error(rv), "Token lost during object search", rv);
+        }
+
+        call(P11Function::C_FindObjectsFinal, functionList_->C_FindObjectsFinal, session_);
+        if (rv != CKR_OK) {
+            return Result<std::vector<CK_OBJECT_HANDLE>>::Error(convertPKCS11Error(rv), "Object search failed", rv);
+        }
+        return Result<std::vector<CK_OBJECT_HANDLE>>::Ok(objects);
+    });
 }
 
 Result<std::vector<CK_BYTE>> PKCS11Library::getObjectAttribute(CK_OBJECT_HANDLE objectHandle, 
                                                                CK_ATTRIBUTE_TYPE attrType) {
-    return getAttributeBytes(objectHandle, attrType);
+    std::unique_lock<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "getObjectAttribute", currentSlotId_);
+    return withRecovery(lock, Replay::Refused, [&] { return getAttributeBytes(objectHandle, attrType); });
+}
+
+Result<void> PKCS11Library::setObjectAttribute(CK_OBJECT_HANDLE objectHandle, CK_ATTRIBUTE_TYPE attrType,
+                                              const std::vector<CK_BYTE>& value) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "setObjectAttribute", currentSlotId_);
+
+    if (!sessionOpen_) {
+        return Result<void>::Error(Status::ERROR_GENERAL, "No session open");
+    }
+
+    CK_ATTRIBUTE attr = {attrType, (void*)value.data(), value.size()};
+    CK_RV rv = call(P11Function::C_SetAttributeValue, functionList_->C_SetAttributeValue, session_, objectHandle, &attr, 1);
+    if (rv != CKR_OK) {
+        return Result<void>::Error(convertPKCS11Error(rv), "Failed to set attribute", rv);
+    }
+
+    metrics_.addBytes(P11Function::C_SetAttributeValue, value.size(), 0);
+    publicKeyCache_.clear();
+    return Result<void>::Ok();
+}
+
+Result<std::vector<Result<CK_OBJECT_HANDLE>>> PKCS11Library::executeBatch(const std::vector<BatchOperation>& operations,
+                                                                          bool rollbackOnFailure) {
+    using ItemResult = Result<CK_OBJECT_HANDLE>;
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "executeBatch", currentSlotId_);
+
+    if (!sessionOpen_) {
+        return Result<std::vector<ItemResult>>::Error(Status::ERROR_GENERAL, "No session open");
+    }
+
+    std::vector<ItemResult> results;
+    results.reserve(operations.size());
+    std::vector<size_t> created;        // indices of successful creates, for rollback
+    bool modified = false;
+    bool stopped = false;
+
+    TokenTransaction transaction(*this);
+    for (const auto& operation : operations) {
+        if (stopped) {
+            results.push_back(ItemResult::Error(Status::ERROR_FUNCTION_CANCELED, "Not run: an earlier operation failed"));
+            continue;
+        }
+
+        CK_OBJECT_HANDLE handle = operation.handle;
+        CK_ATTRIBUTE_PTR attributes = const_cast<CK_ATTRIBUTE_PTR>(operation.attributes.data());
+        CK_ULONG count = operation.attributes.size();
+        CK_RV rv = CKR_OK;
+        const char* failure = nullptr;
+        switch (operation.kind) {
+            case BatchOperation::Kind::Create:
+                rv = call(P11Function::C_CreateObject, functionList_->C_CreateObject, session_, attributes, count, &handle);
+                failure = "Failed to create object";
+                break;
+            case BatchOperation::Kind::Destroy:
+                rv = call(P11Function::C_DestroyObject, functionList_->C_DestroyObject, session_, handle);
+                failure = "Failed to destroy object";
+                break;
+            case BatchOperation::Kind::SetAttributes:
+                rv = call(P11Function::C_SetAttributeValue, functionList_->C_SetAttributeValue, session_, handle,
+                          attributes, count);
+                failure = "Failed to set attribute";
+                break;
+        }
+
+        if (rv == CKR_OK) {
+            if (operation.kind == BatchOperation::Kind::Create) {
+                created.push_back(results.size());
+            }
+            modified = true;
+            results.push_back(ItemResult::Ok(handle));
+            continue;
+        }
+
+        results.push_back(ItemResult::Error(convertPKCS11Error(rv), failure, rv));
+        // Nothing more can run once the session is gone, and nothing can be rolled back
+        if (!sessionOpen_) {
+            stopped = true;
+            continue;
+        }
+        if (rollbackOnFailure) {
+            stopped = true;
+            for (auto it = created.rbegin(); it != created.rend(); ++it) {
+                CK_OBJECT_HANDLE object = results[*it].value;
+                CK_RV undone = call(P11Function::C_DestroyObject, functionList_->C_DestroyObject, session_, object);
+                if (undone == CKR_OK) {
+                    results[*it] = ItemResult::Error(Status::ERROR_FUNCTION_CANCELED,
+                                                     "Rolled back: a later operation failed");
+                    continue;
+                }
+                // The caller has to clean up: keep the handle of what was left behind
+                results[*it] = ItemResult::Error(Status::ERROR_ROLLBACK_FAILED,
+                                                 "Rollback failed; object left on token", undone);
+                results[*it].value = object;
+            }
+            created.clear();
+        }
+    }
+
+    if (modified) {
+        publicKeyCache_.clear();
+    }
+    return Result<std::vector<ItemResult>>::Ok(std::move(results));
 }
 
 Result<void> PKCS11Library::changePin(const std::string& oldPin, const std::string& newPin) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "changePin", currentSlotId_);
+
     if (!sessionOpen_) {
         return Result<void>::Error(Status::ERROR_GENERAL, "No session open");
     }
 
-    CK_RV rv = functionList_->C_SetPIN(session_, 
-                                      (CK_UTF8CHAR_PTR)oldPin.c_str(), oldPin.length(),
-                                      (CK_UTF8CHAR_PTR)newPin.c_str(), newPin.length());
+    CK_RV rv = call(P11Function::C_SetPIN, functionList_->C_SetPIN, session_, 
+                   (CK_UTF8CHAR_PTR)oldPin.c_str(), oldPin.length(),
+                   (CK_UTF8CHAR_PTR)newPin.c_str(), newPin.length());
     if (rv != CKR_OK) {
         return Result<void>::Error(convertPKCS11Error(rv), "Failed to change PIN", rv);
     }
@@ -922,12 +2283,15 @@ Result<void> PKCS11Library::changePin(const std::string& oldPin, const std::stri
 }
 
 Result<void> PKCS11Library::initPin(const std::string& pin) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "initPin", currentSlotId_);
+
     if (!sessionOpen_) {
         return Result<void>::Error(Status::ERROR_GENERAL, "No session open");
     }
 
-    CK_RV rv = functionList_->C_InitPIN(session_, 
-                                       (CK_UTF8CHAR_PTR)pin.c_str(), pin.length());
+    CK_RV rv = call(P11Function::C_InitPIN, functionList_->C_InitPIN, session_, 
+                   (CK_UTF8CHAR_PTR)pin.c_str(), pin.length());
     if (rv != CKR_OK) {
         return Result<void>::Error(convertPKCS11Error(rv), "Failed to initialize PIN", rv);
     }
@@ -936,6 +2300,9 @@ Result<void> PKCS11Library::initPin(const std::string& pin) {
 }
 
 Result<void> PKCS11Library::blankToken(const std::string& soPin) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    ApiScope probe(trace_, "blankToken", currentSlotId_);
+
     if (!sessionOpen_ || !auxFunctionList_) {
         return Result<void>::Error(Status::ERROR_GENERAL, "Session not open or aux functions not available");
     }
@@ -945,7 +2312,7 @@ Result<void> PKCS11Library::blankToken(const std::string& soPin) {
         return Result<void>::Error(Status::ERROR_FUNCTION_FAILED, "BlankToken function not available");
     }
 
-    CK_RV rv = blankFunc(currentSlotId_, (CK_UTF8CHAR_PTR)soPin.c_str(), soPin.length());
+    CK_RV rv = call(P11Function::EP_BlankToken, blankFunc, currentSlotId_, (CK_UTF8CHAR_PTR)soPin.c_str(), soPin.length());
     if (rv != CKR_OK) {
         return Result<void>::Error(convertPKCS11Error(rv), "Failed to blank token", rv);
     }
@@ -953,6 +2320,232 @@ Result<void> PKCS11Library::blankToken(const std::string& soPin) {
     return Result<void>::Ok();
 }
 
+void PKCS11Library::setRecoveryPolicy(const RecoveryPolicy& policy) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    recoveryPolicy_ = policy;
+    if (recoveryPolicy_.enabled && sessionOpen_ && sessionSerial_.empty()) {
+        rememberSessionToken();
+    }
+}
+
+void PKCS11Library::setCredentialProvider(CredentialProvider provider) {
+    std::lock_guard<LibraryMutex> lock(mutex_);
+    credentialProvider_ = std::move(provider);
+}
+
+bool PKCS11Library::isConnectionLoss(CK_RV rv) {
+    return rv == CKR_DEVICE_REMOVED || rv == CKR_TOKEN_NOT_PRESENT ||
+           rv == CKR_SESSION_HANDLE_INVALID || rv == CKR_SESSION_CLOSED;
+}
+
+void PKCS11Library::rememberSessionToken() {
+    CK_TOKEN_INFO tokenInfo;
+    if (call(P11Function::C_GetTokenInfo, functionList_->C_GetTokenInfo, currentSlotId_, &tokenInfo) == CKR_OK) {
+        sessionSerial_ = trimString((char*)tokenInfo.serialNumber, 16);
+    }
+}
+
+void PKCS11Library::handleConnectionLoss() {
+    // The session and any card transaction died with the token; keep
+    // sessionSerial_/loginWanted_ so recoverSession() knows what to restore
+    sessionOpen_ = false;
+    loggedIn_ = false;
+    session_ = 0;
+    transactionDepth_ = 0;
+
+    // A token that comes back may have been re-provisioned meanwhile
+    publicKeyCache_.clear();
+    keySerial_.clear();
+    forgetProbe();
+}
+
+void PKCS11Library::forgetProbe() {
+    // The next probe that finds a token starts a new generation; until then
+    // a busy probe still answers with the last values
+    probeStale_ = true;
+}
+
+// Whether the open session is really gone: a loss rv may also come from a
+// call on another slot, which must not tear down a healthy session
+bool PKCS11Library::sessionLost() {
+    if (!sessionOpen_) {
+        return true;
+    }
+    CK_SESSION_INFO info;
+    return call(P11Function::C_GetSessionInfo, functionList_->C_GetSessionInfo, session_, &info) != CKR_OK;
+}
+
+// The mutex is released while waiting for the token to come back. A frame
+// further out that also holds it (a TokenTransaction, an OperationScope, a
+// caller's own lock) would keep it through the wait, so then the token
+// gets one look and no wait.
+Result<void> PKCS11Library::recoverSession(std::unique_lock<LibraryMutex>& lock) {
+    if (!recoveryPolicy_.enabled || sessionSerial_.empty()) {
+        return Result<void>::Error(Status::ERROR_UNSUPPORTED_OPERATION, "Session recovery not enabled");
+    }
+
+    std::optional<std::string> pin;
+    if (loginWanted_) {
+        if (!credentialProvider_ || !(pin = credentialProvider_())) {
+            return Result<void>::Error(Status::ERROR_USER_NOT_LOGGED_IN, "No credentials for re-login");
+        }
+    }
+
+    // An OperationScope holds the mutex, so under one there is a single look
+    // at the slots, and none once the scope has expired or been cancelled
+    const OperationContext* context = context_;
+    const auto deadline = std::chrono::steady_clock::now() + recoveryPolicy_.reinsertTimeout;
+    CK_FLAGS flags = CKF_SERIAL_SESSION | (sessionReadWrite_ ? CKF_RW_SESSION : 0);
+
+    while (true) {
+        Status expired = context ? context->check() : Status::OK;
+        if (expired != Status::OK) {
+            return Result<void>::Error(expired, "Operation ended before the session was recovered");
+        }
+
+        // The slot ID may change across a re-plug; match the token by serial
+        CK_ULONG count = 0;
+        std::vector<CK_SLOT_ID> slots;
+        if (call(P11Function::C_GetSlotList, functionList_->C_GetSlotList, CK_TRUE, nullptr, &count) == CKR_OK && count > 0) {
+            slots.resize(count);
+            if (call(P11Function::C_GetSlotList, functionList_->C_GetSlotList, CK_TRUE, slots.data(), &count) != CKR_OK) {
+                count = 0;
+            }
+            slots.resize(count);
+        }
+
+        for (CK_SLOT_ID slotId : slots) {
+            CK_TOKEN_INFO tokenInfo;
+            if (call(P11Function::C_GetTokenInfo, functionList_->C_GetTokenInfo, slotId, &tokenInfo) != CKR_OK ||
+                trimString((char*)tokenInfo.serialNumber, 16) != sessionSerial_) {
+                continue;
+            }
+
+            CK_SESSION_HANDLE session;
+            CK_RV rv = call(P11Function::C_OpenSession, functionList_->C_OpenSession, slotId, flags, nullptr, nullptr, &session);
+            if (rv != CKR_OK) {
+                break; // Token still settling, retry after the poll interval
+            }
+
+            if (pin) {
+                rv = call(P11Function::C_Login, functionList_->C_Login, session, loginUserType_,
+                         (CK_UTF8CHAR_PTR)pin->c_str(), pin->length());
+                if (rv != CKR_OK && rv != CKR_USER_ALREADY_LOGGED_IN) {
+                    call(P11Function::C_CloseSession, functionList_->C_CloseSession, session);
+                    return Result<void>::Error(convertPKCS11Error(rv), "Re-login after token re-insert failed", rv);
+                }
+            }
+
+            session_ = session;
+            sessionOpen_ = true;
+            loggedIn_ = pin.has_value();
+            currentSlotId_ = slotId;
+            return Result<void>::Ok();
+        }
+
+        if (std::chrono::steady_clock::now() + recoveryPolicy_.pollInterval > deadline) {
+            return Result<void>::Error(Status::ERROR_TOKEN_NOT_PRESENT, "Token was not re-inserted in time");
+        }
+        if (mutex_.depth() > 1) {
+            return Result<void>::Error(Status::ERROR_TOKEN_NOT_PRESENT,
+                                       "Token not present; the library is held, so recovery cannot wait");
+        }
+        lock.unlock();
+        std::this_thread::sleep_for(recoveryPolicy_.pollInterval);
+        lock.lock();
+        // Another thread may have recovered, closed or finalized meanwhile
+        if (sessionOpen_) {
+            return Result<void>::Ok();
+        }
+        if (!initialized_ || sessionSerial_.empty()) {
+            return Result<void>::Error(Status::ERROR_SESSION_CLOSED, "Session closed during recovery");
+        }
+    }
+}
+
+// Runs on the watchdog thread while the caller is blocked in the module.
+// CKR_OK: the call was cancelled; CKR_SESSION_CLOSED: its session was closed.
+// guardedCall() clears context_ before arming the watchdog, so these go
+// through call() unguarded but still traced and counted.
+CK_RV PKCS11Library::interruptCall(CK_SESSION_HANDLE session) {
+    if (!osLocking_ || !functionList_) {
+        return CKR_FUNCTION_NOT_PARALLEL;
+    }
+    if (session != 0 && call(P11Function::C_CancelFunction, functionList_->C_CancelFunction, session) == CKR_OK) {
+        return CKR_OK;
+    }
+    if (session != 0 && call(P11Function::C_CloseSession, functionList_->C_CloseSession, session) == CKR_OK) {
+        return CKR_SESSION_CLOSED;
+    }
+    return CKR_FUNCTION_NOT_PARALLEL;
+}
+
+void PKCS11Library::abandon(Status reason, bool resetSession) {
+    abandoned_ = reason;
+    if (!resetSession || sessionReset_ || !sessionOpen_) {
+        return;
+    }
+    sessionReset_ = true;
+
+    // The session may be mid-operation or already closed by the watchdog;
+    // close it and reopen as recovery would, without the expired context
+    const OperationContext* context = context_;
+    context_ = nullptr;
+    // The card transaction is the slot's, not the session's; end it as
+    // closeSession() does so a TokenTransaction left open cannot pin it
+    if (transactionDepth_ > 0) {
+        transactionDepth_ = 1;
+        endTransaction();
+    }
+    call(P11Function::C_CloseSession, functionList_->C_CloseSession, session_);
+    sessionOpen_ = false;
+    loggedIn_ = false;
+    session_ = 0;
+    // With recovery enabled the next call outside the scope reopens it; the
+    // wait for the token must not run on this call's expired deadline
+    context_ = context;
+}
+
+template<typename Op>
+auto PKCS11Library::withRecovery(std::unique_lock<LibraryMutex>& lock, Replay replay, Op op)
+    -> decltype(op()) {
+    // A session lost earlier or closed by abandon(), and not closed by the
+    // caller since, is reopened before the call
+    if (recoveryPolicy_.enabled && !sessionOpen_ && !sessionSerial_.empty()) {
+        auto recovered = recoverSession(lock);
+        if (!recovered.isOk()) {
+            return decltype(op())::Error(recovered.errorCode, recovered.errorMessage, recovered.pkcs11Error);
+        }
+        if (replay == Replay::Refused) {
+            return decltype(op())::Error(Status::ERROR_HANDLES_INVALIDATED,
+                                         "Session was recovered; object handles must be looked up again");
+        }
+    }
+
+    auto result = op();
+    // A session still open means the loss rv was not about this session
+    if (result.isOk() || !isConnectionLoss(result.pkcs11Error) || !recoveryPolicy_.enabled || sessionOpen_) {
+        return result;
+    }
+
+    auto recovered = recoverSession(lock);
+    if (!recovered.isOk()) {
+        // A scope that ran out, or a hold that ruled out waiting, says so;
+        // otherwise the loss stands
+        if (recovered.errorCode == Status::ERROR_TIMEOUT || recovered.errorCode == Status::ERROR_FUNCTION_CANCELED ||
+            mutex_.depth() > 1) {
+            return decltype(op())::Error(recovered.errorCode, recovered.errorMessage, result.pkcs11Error);
+        }
+        return result;
+    }
+    if (replay == Replay::Refused) {
+        return decltype(op())::Error(Status::ERROR_HANDLES_INVALIDATED,
+                                     "Session was recovered; object handles must be looked up again",
+                                     result.pkcs11Error);
+    }
+    return op(); // Replay once
+}
+
 // Helper methods implementation
 
 CK_MECHANISM PKCS11Library::createMechanism(SymmetricAlgorithm algorithm, CipherMode mode, 
@@ -1016,6 +2609,9 @@ CK_MECHANISM PKCS11Library::createHashMechanism(HashAlgorithm hashAlg, Asymmetri
             case HashAlgorithm::SHA512: mechanism.mechanism = CKM_SHA512_RSA_PKCS; break;
             case HashAlgorithm::MD5: mechanism.mechanism = CKM_MD5_RSA_PKCS; break;
         }
+    } else if (asymAlg == AsymmetricAlgorithm::ECDSA) {
+        // Hashing is done on the host; the token only signs the digest
+        mechanism.mechanism = CKM_ECDSA;
     }
     
     mechanism.pParameter = nullptr;
@@ -1024,9 +2620,24 @@ CK_MECHANISM PKCS11Library::createHashMechanism(HashAlgorithm hashAlg, Asymmetri
 }
 
 Status PKCS11Library::convertPKCS11Error(CK_RV rv) {
+    // Every failed call passes through here, so this is where a vanished
+    // token or session is noticed and the cached state is brought in line
+    if (isConnectionLoss(rv) && sessionLost()) {
+        handleConnectionLoss();
+    }
+
+    // Abandoned under an expired OperationContext
+    if (rv == CKR_FUNCTION_CANCELED && abandoned_ != Status::OK) {
+        return abandoned_;
+    }
+
     switch (rv) {
         case CKR_OK: return Status::OK;
+        case CKR_FUNCTION_CANCELED: return Status::ERROR_FUNCTION_CANCELED;
         case CKR_TOKEN_NOT_PRESENT: return Status::ERROR_TOKEN_NOT_PRESENT;
+        case CKR_DEVICE_REMOVED: return Status::ERROR_DEVICE_REMOVED;
+        case CKR_SESSION_HANDLE_INVALID: return Status::ERROR_SESSION_HANDLE_INVALID;
+        case CKR_SESSION_CLOSED: return Status::ERROR_SESSION_CLOSED;
         case CKR_PIN_INCORRECT: 
         case CKR_PIN_INVALID: return Status::ERROR_PIN_INVALID;
         case CKR_PIN_LOCKED: return Status::ERROR_PIN_LOCKED;
@@ -1048,7 +2659,7 @@ template<typename T>
 Result<T> PKCS11Library::getAttribute(CK_OBJECT_HANDLE handle, CK_ATTRIBUTE_TYPE type) {
     T value;
     CK_ATTRIBUTE attr = {type, &value, sizeof(T)};
-    CK_RV rv = functionList_->C_GetAttributeValue(session_, handle, &attr, 1);
+    CK_RV rv = call(P11Function::C_GetAttributeValue, functionList_->C_GetAttributeValue, session_, handle, &attr, 1);
     if (rv != CKR_OK) {
         return Result<T>::Error(convertPKCS11Error(rv), "Failed to get attribute", rv);
     }
@@ -1057,7 +2668,7 @@ Result<T> PKCS11Library::getAttribute(CK_OBJECT_HANDLE handle, CK_ATTRIBUTE_TYPE
 
 Result<std::vector<CK_BYTE>> PKCS11Library::getAttributeBytes(CK_OBJECT_HANDLE handle, CK_ATTRIBUTE_TYPE type) {
     CK_ATTRIBUTE attr = {type, nullptr, 0};
-    CK_RV rv = functionList_->C_GetAttributeValue(session_, handle, &attr, 1);
+    CK_RV rv = call(P11Function::C_GetAttributeValue, functionList_->C_GetAttributeValue, session_, handle, &attr, 1);
     if (rv != CKR_OK) {
         return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to get attribute length", rv);
     }
@@ -1069,11 +2680,12 @@ Result<std::vector<CK_BYTE>> PKCS11Library::getAttributeBytes(CK_OBJECT_HANDLE h
     std::vector<CK_BYTE> value(attr.ulValueLen);
     attr.pValue = value.data();
     
-    rv = functionList_->C_GetAttributeValue(session_, handle, &attr, 1);
+    rv = call(P11Function::C_GetAttributeValue, functionList_->C_GetAttributeValue, session_, handle, &attr, 1);
     if (rv != CKR_OK) {
         return Result<std::vector<CK_BYTE>>::Error(convertPKCS11Error(rv), "Failed to get attribute value", rv);
     }
 
+    metrics_.addBytes(P11Function::C_GetAttributeValue, 0, attr.ulValueLen);
     return Result<std::vector<CK_BYTE>>::Ok(value);
 }
 
@@ -1192,4 +2804,85 @@ std::vector<CK_BYTE> PKCS11Library::hexToBytes(const std::string& hex) {
     return bytes;
 }
 
-} // namespace PKCS11Lib
\ No newline at end of file
+static void appendDerInteger(std::vector<CK_BYTE>& out, const CK_BYTE* value, size_t len) {
+    while (len > 1 && value[0] == 0) {
+        value++;
+        len--;
+    }
+    bool pad = (value[0] & 0x80) != 0;
+    out.push_back(0x02);
+    out.push_back(static_cast<CK_BYTE>(len + (pad ? 1 : 0)));
+    if (pad) {
+        out.push_back(0x00);
+    }
+    out.insert(out.end(), value, value + len);
+}
+
+std::vector<CK_BYTE> PKCS11Library::ecdsaRawToDer(const std::vector<CK_BYTE>& raw) {
+    // Two INTEGERs of up to 60 bytes, a 0x00 pad and a 2-byte header each
+    // keep the SEQUENCE body within the 127 bytes of a short-form length
+    if (raw.empty() || raw.size() % 2 != 0 || raw.size() > 2 * 60) {
+        return std::vector<CK_BYTE>();
+    }
+
+    size_t half = raw.size() / 2;
+    std::vector<CK_BYTE> body;
+    appendDerInteger(body, raw.data(), half);
+    appendDerInteger(body, raw.data() + half, half);
+
+    std::vector<CK_BYTE> der = {0x30, static_cast<CK_BYTE>(body.size())};
+    der.insert(der.end(), body.begin(), body.end());
+    return der;
+}
+
+std::vector<CK_BYTE> PKCS11Library::ecdsaDerToRaw(const std::vector<CK_BYTE>& der, size_t coordinateLen) {
+    std::vector<CK_BYTE> raw;
+    if (der.size() < 8 || der[0] != 0x30 || der[1] != der.size() - 2) {
+        return raw;
+    }
+
+    raw.assign(2 * coordinateLen, 0);
+    size_t pos = 2;
+    for (int i = 0; i < 2; i++) {
+        if (pos + 2 > der.size() || der[pos] != 0x02) {
+            return std::vector<CK_BYTE>();
+        }
+        size_t len = der[pos + 1];
+        pos += 2;
+        if (len == 0 || pos + len > der.size()) {
+            return std::vector<CK_BYTE>();
+        }
+        const CK_BYTE* value = der.data() + pos;
+        while (len > coordinateLen && value[0] == 0) {
+            value++;
+            len--;
+        }
+        if (len > coordinateLen) {
+            return std::vector<CK_BYTE>();
+        }
+        std::copy(value, value + len, raw.begin() + (i + 1) * coordinateLen - len);
+        pos += der[pos - 1];
+    }
+
+    if (pos != der.size()) {
+        return std::vector<CK_BYTE>();
+    }
+    return raw;
+}
+
+OperationScope::OperationScope(PKCS11Library& lib, const OperationContext& context)
+    : lib_(lib), lock_(lib.mutex_), context_(context), previous_(lib.context_),
+      previousAbandoned_(lib.abandoned_), previousSessionReset_(lib.sessionReset_) {
+    context_.parent = previous_;
+    lib_.context_ = &context_;
+    lib_.abandoned_ = Status::OK;
+    lib_.sessionReset_ = false;
+}
+
+OperationScope::~OperationScope() {
+    lib_.context_ = previous_;
+    lib_.abandoned_ = previousAbandoned_;
+    lib_.sessionReset_ = previousSessionReset_;
+}
+
+} // namespace PKCS11Lib
@@ -0,0 +1,251 @@
+#include "pkcs12.h"
+#include "host_crypto.h"
+
+#include <openssl/bn.h>
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pkcs12.h>
+#include <openssl/x509.h>
+
+#include <memory>
+#include <utility>
+
+namespace PKCS11Lib {
+namespace Pkcs12 {
+
+namespace {
+
+template<typename T, void (*Free)(T*)>
+struct Deleter {
+    void operator()(T* p) const { Free(p); }
+};
+
+using Pkcs12Ptr = std::unique_ptr<PKCS12, Deleter<PKCS12, PKCS12_free>>;
+using PkeyPtr = std::unique_ptr<EVP_PKEY, Deleter<EVP_PKEY, EVP_PKEY_free>>;
+using X509Ptr = std::unique_ptr<X509, Deleter<X509, X509_free>>;
+using BignumPtr = std::unique_ptr<BIGNUM, Deleter<BIGNUM, BN_clear_free>>;
+
+void freeCertificates(STACK_OF(X509)* certificates) {
+    sk_X509_pop_free(certificates, X509_free);
+}
+
+using CertificatesPtr = std::unique_ptr<STACK_OF(X509), Deleter<STACK_OF(X509), freeCertificates>>;
+
+std::vector<CK_BYTE> toDer(X509* certificate) {
+    int length = i2d_X509(certificate, nullptr);
+    if (length <= 0) {
+        return {};
+    }
+    std::vector<CK_BYTE> der(static_cast<size_t>(length));
+    CK_BYTE* out = der.data();
+    i2d_X509(certificate, &out);
+    return der;
+}
+
+bool rsaComponent(EVP_PKEY* key, const char* name, std::vector<CK_BYTE>& out) {
+    BIGNUM* raw = nullptr;
+    if (EVP_PKEY_get_bn_param(key, name, &raw) != 1) {
+        return false;
+    }
+    BignumPtr value(raw);
+    out.resize(static_cast<size_t>(BN_num_bytes(value.get())));
+    BN_bn2bin(value.get(), out.data());
+    return true;
+}
+
+template<typename Encode, typename T>
+std::vector<CK_BYTE> encode(Encode encoder, T* value) {
+    int length = encoder(value, nullptr);
+    if (length <= 0) {
+        return {};
+    }
+    std::vector<CK_BYTE> der(static_cast<size_t>(length));
+    CK_BYTE* out = der.data();
+    encoder(value, &out);
+    return der;
+}
+
+// The old components are wiped first: assigning may reallocate and free them
+template<typename Other>
+void assign(Contents& to, Other&& from) {
+    to.cleanse();
+    to.friendlyName = std::forward<Other>(from).friendlyName;
+    to.certificate = std::forward<Other>(from).certificate;
+    to.chain = std::forward<Other>(from).chain;
+    to.modulus = std::forward<Other>(from).modulus;
+    to.publicExponent = std::forward<Other>(from).publicExponent;
+    to.privateExponent = std::forward<Other>(from).privateExponent;
+    to.prime1 = std::forward<Other>(from).prime1;
+    to.prime2 = std::forward<Other>(from).prime2;
+    to.exponent1 = std::forward<Other>(from).exponent1;
+    to.exponent2 = std::forward<Other>(from).exponent2;
+    to.coefficient = std::forward<Other>(from).coefficient;
+}
+
+} // namespace
+
+void Contents::cleanse() {
+    for (auto* component : {&privateExponent, &prime1, &prime2, &exponent1, &exponent2, &coefficient}) {
+        HostCrypto::cleanse(*component);
+    }
+}
+
+Contents& Contents::operator=(const Contents& other) {
+    if (this != &other) {
+        assign(*this, other);
+    }
+    return *this;
+}
+
+Contents& Contents::operator=(Contents&& other) {
+    if (this != &other) {
+        assign(*this, std::move(other));
+    }
+    return *this;
+}
+
+Result<Contents> parse(const std::vector<CK_BYTE>& blob, const std::string& password) {
+    const unsigned char* in = blob.data();
+    Pkcs12Ptr p12(d2i_PKCS12(nullptr, &in, static_cast<long>(blob.size())));
+    if (!p12) {
+        ERR_clear_error();
+        return Result<Contents>::Error(Status::ERROR_DATA_INVALID, "Not a PKCS#12 file");
+    }
+    if (PKCS12_verify_mac(p12.get(), password.c_str(), static_cast<int>(password.size())) != 1) {
+        ERR_clear_error();
+        return Result<Contents>::Error(Status::ERROR_PIN_INCORRECT, "Wrong PKCS#12 password");
+    }
+
+    EVP_PKEY* rawKey = nullptr;
+    X509* rawCertificate = nullptr;
+    STACK_OF(X509)* rawChain = nullptr;
+    if (PKCS12_parse(p12.get(), password.c_str(), &rawKey, &rawCertificate, &rawChain) != 1) {
+        ERR_clear_error();
+        return Result<Contents>::Error(Status::ERROR_DATA_INVALID, "Cannot decode PKCS#12 contents");
+    }
+    PkeyPtr key(rawKey);
+    X509Ptr certificate(rawCertificate);
+    CertificatesPtr chain(rawChain);
+
+    if (!key) {
+        return Result<Contents>::Error(Status::ERROR_DATA_INVALID, "PKCS#12 file holds no private key");
+    }
+    if (EVP_PKEY_get_base_id(key.get()) != EVP_PKEY_RSA) {
+        return Result<Contents>::Error(Status::ERROR_UNSUPPORTED_ALGORITHM, "Only RSA keys can be imported");
+    }
+
+    Contents contents;
+    bool complete = rsaComponent(key.get(), OSSL_PKEY_PARAM_RSA_N, contents.modulus) &&
+                    rsaComponent(key.get(), OSSL_PKEY_PARAM_RSA_E, contents.publicExponent) &&
+                    rsaComponent(key.get(), OSSL_PKEY_PARAM_RSA_D, contents.privateExponent) &&
+                    rsaComponent(key.get(), OSSL_PKEY_PARAM_RSA_FACTOR1, contents.prime1) &&
+                    rsaComponent(key.get(), OSSL_PKEY_PARAM_RSA_FACTOR2, contents.prime2) &&
+                    rsaComponent(key.get(), OSSL_PKEY_PARAM_RSA_EXPONENT1, contents.exponent1) &&
+                    rsaComponent(key.get(), OSSL_PKEY_PARAM_RSA_EXPONENT2, contents.exponent2) &&
+                    rsaComponent(key.get(), OSSL_PKEY_PARAM_RSA_COEFFICIENT1, contents.coefficient);
+    if (!complete) {
+        contents.cleanse();
+        ERR_clear_error();
+        return Result<Contents>::Error(Status::ERROR_DATA_INVALID, "RSA key lacks CRT components");
+    }
+
+    if (certificate) {
+        contents.certificate = toDer(certificate.get());
+        int length = 0;
+        if (const unsigned char* alias = X509_alias_get0(certificate.get(), &length)) {
+            contents.friendlyName.assign(reinterpret_cast<const char*>(alias), static_cast<size_t>(length));
+        }
+    }
+    for (int i = 0; chain && i < sk_X509_num(chain.get()); i++) {
+        contents.chain.push_back(toDer(sk_X509_value(chain.get(), i)));
+    }
+    auto result = Result<Contents>::Ok(contents);
+    contents.cleanse();
+    return result;
+}
+
+Result<CertificateFields> certificateFields(const std::vector<CK_BYTE>& der) {
+    const unsigned char* in = der.data();
+    X509Ptr certificate(d2i_X509(nullptr, &in, static_cast<long>(der.size())));
+    if (!certificate) {
+        ERR_clear_error();
+        return Result<CertificateFields>::Error(Status::ERROR_DATA_INVALID, "Malformed certificate");
+    }
+    CertificateFields fields;
+    fields.subject = encode(i2d_X509_NAME, X509_get_subject_name(certificate.get()));
+    fields.issuer = encode(i2d_X509_NAME, X509_get_issuer_name(certificate.get()));
+    fields.serialNumber = encode(i2d_ASN1_INTEGER, X509_get0_serialNumber(certificate.get()));
+    if (EVP_PKEY* key = X509_get0_pubkey(certificate.get())) {
+        if (EVP_PKEY_get_base_id(key) == EVP_PKEY_RSA) {
+            rsaComponent(key, OSSL_PKEY_PARAM_RSA_N, fields.modulus);
+        }
+    }
+    ERR_clear_error();
+    return Result<CertificateFields>::Ok(std::move(fields));
+}
+
+bool isConsistent(const Contents& contents) {
+    std::unique_ptr<BN_CTX, Deleter<BN_CTX, BN_CTX_free>> ctx(BN_CTX_secure_new());
+    if (!ctx) {
+        return false;
+    }
+    auto number = [](const std::vector<CK_BYTE>& bytes) {
+        return BignumPtr(BN_bin2bn(bytes.data(), static_cast<int>(bytes.size()), nullptr));
+    };
+    BignumPtr n = number(contents.modulus), e = number(contents.publicExponent);
+    BignumPtr d = number(contents.privateExponent), p = number(contents.prime1), q = number(contents.prime2);
+    BignumPtr dp = number(contents.exponent1), qInv = number(contents.coefficient);
+    BignumPtr pMinus1(BN_new()), product(BN_new());
+    if (!n || !e || !d || !p || !q || !dp || !qInv || !pMinus1 || !product || BN_is_zero(p.get())) {
+        return false;
+    }
+    BN_sub(pMinus1.get(), p.get(), BN_value_one());
+
+    bool consistent = BN_mul(product.get(), p.get(), q.get(), ctx.get()) && BN_cmp(product.get(), n.get()) == 0 &&
+                      BN_mod_mul(product.get(), e.get(), dp.get(), pMinus1.get(), ctx.get()) &&
+                      BN_is_one(product.get()) &&
+                      BN_nnmod(product.get(), d.get(), pMinus1.get(), ctx.get()) &&
+                      BN_cmp(product.get(), dp.get()) == 0 &&
+                      BN_mod_mul(product.get(), q.get(), qInv.get(), p.get(), ctx.get()) &&
+                      BN_is_one(product.get());
+    ERR_clear_error();
+    return consistent;
+}
+
+std::vector<std::vector<CK_BYTE>> splitDer(const CK_BYTE* data, size_t length) {
+    std::vector<std::vector<CK_BYTE>> elements;
+    size_t pos = 0;
+    while (pos + 2 <= length && data[pos] == 0x30) {
+        size_t header = 2;
+        size_t body = data[pos + 1];
+        if (body & 0x80) {
+            size_t count = body & 0x7f;
+            if (count == 0 || count > sizeof(size_t) || pos + 2 + count > length) {
+                break;
+            }
+            body = 0;
+            for (size_t i = 0; i < count; i++) {
+                body = (body << 8) | data[pos + 2 + i];
+            }
+            header += count;
+        }
+        if (body > length - pos - header) {
+            break;
+        }
+        elements.emplace_back(data + pos, data + pos + header + body);
+        pos += header + body;
+    }
+    return elements;
+}
+
+std::vector<CK_BYTE> trimInteger(const CK_BYTE* data, size_t length) {
+    size_t start = 0;
+    while (start < length && data[start] == 0) {
+        start++;
+    }
+    return std::vector<CK_BYTE>(data + start, data + length);
+}
+
+} // namespace Pkcs12
+} // namespace PKCS11Lib
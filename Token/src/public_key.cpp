@@ -0,0 +1,161 @@
+#include "public_key.h"
+
+namespace PKCS11Lib {
+namespace PublicKey {
+
+namespace {
+
+// rsaEncryption, 1.2.840.113549.1.1.1
+const CK_BYTE RSA_ENCRYPTION_OID[] = {0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x01};
+// id-ecPublicKey, 1.2.840.10045.2.1
+const CK_BYTE EC_PUBLIC_KEY_OID[] = {0x06, 0x07, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x02, 0x01};
+const CK_BYTE DER_NULL[] = {0x05, 0x00};
+
+void appendLength(std::vector<CK_BYTE>& out, size_t length) {
+    if (length < 0x80) {
+        out.push_back(static_cast<CK_BYTE>(length));
+        return;
+    }
+    CK_BYTE bytes[sizeof(size_t)];
+    size_t count = 0;
+    for (size_t rest = length; rest; rest >>= 8) {
+        bytes[count++] = static_cast<CK_BYTE>(rest & 0xff);
+    }
+    out.push_back(static_cast<CK_BYTE>(0x80 | count));
+    while (count) {
+        out.push_back(bytes[--count]);
+    }
+}
+
+void appendTagged(std::vector<CK_BYTE>& out, CK_BYTE tag, const std::vector<CK_BYTE>& body) {
+    out.push_back(tag);
+    appendLength(out, body.size());
+    out.insert(out.end(), body.begin(), body.end());
+}
+
+// Unsigned big-endian value as a DER INTEGER: minimal, with a 0x00 pad
+// when the top bit is set
+void appendUnsignedInteger(std::vector<CK_BYTE>& out, const std::vector<CK_BYTE>& value) {
+    size_t start = 0;
+    while (start + 1 < value.size() && value[start] == 0) {
+        start++;
+    }
+    std::vector<CK_BYTE> body;
+    if (value.empty() || (value[start] & 0x80)) {
+        body.push_back(0x00);
+    }
+    body.insert(body.end(), value.begin() + start, value.end());
+    appendTagged(out, 0x02, body);
+}
+
+// Reads one DER length at data[pos]; false if it is malformed or overruns
+bool readLength(const std::vector<CK_BYTE>& data, size_t& pos, size_t& length) {
+    if (pos >= data.size()) {
+        return false;
+    }
+    CK_BYTE first = data[pos++];
+    if (first < 0x80) {
+        length = first;
+    } else {
+        size_t count = first & 0x7f;
+        if (count == 0 || count > sizeof(size_t) || pos + count > data.size()) {
+            return false;
+        }
+        length = 0;
+        for (size_t i = 0; i < count; i++) {
+            length = (length << 8) | data[pos++];
+        }
+    }
+    return length <= data.size() - pos;
+}
+
+std::vector<CK_BYTE> spki(const CK_BYTE* oid, size_t oidLength, const std::vector<CK_BYTE>& parameters,
+                          const std::vector<CK_BYTE>& subjectPublicKey) {
+    std::vector<CK_BYTE> algorithm(oid, oid + oidLength);
+    algorithm.insert(algorithm.end(), parameters.begin(), parameters.end());
+
+    std::vector<CK_BYTE> bitString = {0x00}; // no unused bits
+    bitString.insert(bitString.end(), subjectPublicKey.begin(), subjectPublicKey.end());
+
+    std::vector<CK_BYTE> body;
+    appendTagged(body, 0x30, algorithm);
+    appendTagged(body, 0x03, bitString);
+
+    std::vector<CK_BYTE> der;
+    appendTagged(der, 0x30, body);
+    return der;
+}
+
+} // namespace
+
+std::vector<CK_BYTE> rsaSpki(const std::vector<CK_BYTE>& modulus, const std::vector<CK_BYTE>& publicExponent) {
+    std::vector<CK_BYTE> integers;
+    appendUnsignedInteger(integers, modulus);
+    appendUnsignedInteger(integers, publicExponent);
+    std::vector<CK_BYTE> rsaPublicKey;
+    appendTagged(rsaPublicKey, 0x30, integers);
+
+    return spki(RSA_ENCRYPTION_OID, sizeof(RSA_ENCRYPTION_OID),
+                std::vector<CK_BYTE>(DER_NULL, DER_NULL + sizeof(DER_NULL)), rsaPublicKey);
+}
+
+std::vector<CK_BYTE> ecSpki(const std::vector<CK_BYTE>& ecParams, const std::vector<CK_BYTE>& ecPoint) {
+    // Only namedCurve parameters: an OBJECT IDENTIFIER filling ecParams
+    size_t pos = 1;
+    size_t length;
+    if (ecParams.empty() || ecParams[0] != 0x06 || !readLength(ecParams, pos, length) ||
+        pos + length != ecParams.size()) {
+        return std::vector<CK_BYTE>();
+    }
+
+    // PKCS#11 says DER OCTET STRING; some modules hand back the bare point.
+    // A bare uncompressed point also starts with 0x04, so unwrap only when
+    // the OCTET STRING length accounts for every byte
+    std::vector<CK_BYTE> point = ecPoint;
+    pos = 1;
+    if (ecPoint.size() > 2 && ecPoint[0] == 0x04 && readLength(ecPoint, pos, length) &&
+        pos + length == ecPoint.size() && length > 0 && ecPoint[pos] >= 0x02 && ecPoint[pos] <= 0x04) {
+        point.assign(ecPoint.begin() + pos, ecPoint.end());
+    }
+    if (point.empty() || point[0] < 0x02 || point[0] > 0x04) {
+        return std::vector<CK_BYTE>();
+    }
+
+    return spki(EC_PUBLIC_KEY_OID, sizeof(EC_PUBLIC_KEY_OID), ecParams, point);
+}
+
+std::string base64(const std::vector<CK_BYTE>& data) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    out.reserve((data.size() + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 2 < data.size(); i += 3) {
+        uint32_t group = data[i] << 16 | data[i + 1] << 8 | data[i + 2];
+        out += alphabet[group >> 18];
+        out += alphabet[(group >> 12) & 0x3f];
+        out += alphabet[(group >> 6) & 0x3f];
+        out += alphabet[group & 0x3f];
+    }
+    if (i < data.size()) {
+        uint32_t group = data[i] << 16 | (i + 1 < data.size() ? data[i + 1] << 8 : 0);
+        out += alphabet[group >> 18];
+        out += alphabet[(group >> 12) & 0x3f];
+        out += i + 1 < data.size() ? alphabet[(group >> 6) & 0x3f] : '=';
+        out += '=';
+    }
+    return out;
+}
+
+std::string pem(const std::vector<CK_BYTE>& der, const std::string& label) {
+    std::string encoded = base64(der);
+    std::string out = "-----BEGIN " + label + "-----\n";
+    for (size_t pos = 0; pos < encoded.size(); pos += 64) {
+        out += encoded.substr(pos, 64);
+        out += '\n';
+    }
+    out += "-----END " + label + "-----\n";
+    return out;
+}
+
+} // namespace PublicKey
+} // namespace PKCS11Lib
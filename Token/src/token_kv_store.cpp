@@ -0,0 +1,578 @@
+#include "token_kv_store.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace PKCS11Lib {
+
+namespace {
+
+// Chunk header: "KV", version, flags, index and count (uint16), uncompressed
+// value length and write stamp (uint32), all big-endian
+constexpr size_t HEADER_LEN = 16;
+constexpr CK_BYTE FORMAT_VERSION = 1;
+constexpr CK_BYTE FLAG_COMPRESSED = 0x01;
+constexpr size_t MAX_CHUNKS = 0xffff;
+
+struct ChunkHeader {
+    CK_BYTE flags;
+    uint16_t index;
+    uint16_t count;
+    uint32_t length;
+    uint32_t stamp;
+};
+
+void putBE(std::vector<CK_BYTE>& out, uint32_t value, size_t bytes) {
+    for (size_t i = bytes; i-- > 0;) {
+        out.push_back(static_cast<CK_BYTE>(value >> (8 * i)));
+    }
+}
+
+void setBE(CK_BYTE* out, uint32_t value, size_t bytes) {
+    for (size_t i = bytes; i-- > 0;) {
+        *out++ = static_cast<CK_BYTE>(value >> (8 * i));
+    }
+}
+
+uint32_t getBE(const CK_BYTE* in, size_t bytes) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+bool parseHeader(const std::vector<CK_BYTE>& chunk, ChunkHeader& header) {
+    if (chunk.size() < HEADER_LEN || chunk[0] != 'K' || chunk[1] != 'V' || chunk[2] != FORMAT_VERSION) {
+        return false;
+    }
+    header.flags = chunk[3];
+    header.index = static_cast<uint16_t>(getBE(&chunk[4], 2));
+    header.count = static_cast<uint16_t>(getBE(&chunk[6], 2));
+    header.length = getBE(&chunk[8], 4);
+    header.stamp = getBE(&chunk[12], 4);
+    return header.count > 0 && header.index < header.count;
+}
+
+// LZF: a control byte below 32 starts a run of ctrl+1 literals; otherwise
+// its top 3 bits (extended by one byte when 7) are the match length - 2 and
+// the low 5 bits plus the next byte the distance - 1, within 8 KiB. Cheap to
+// decode and good enough for the text and padding typical of stored blobs.
+std::vector<CK_BYTE> lzfCompress(const std::vector<CK_BYTE>& in) {
+    constexpr size_t HASH_BITS = 13;
+    constexpr size_t MAX_DISTANCE = 1 << 13;
+    constexpr size_t MAX_MATCH = 7 + 255 + 2;
+    constexpr size_t NONE = ~size_t(0);
+
+    std::vector<size_t> table(size_t(1) << HASH_BITS, NONE);
+    std::vector<CK_BYTE> out;
+    out.reserve(in.size());
+    size_t literalStart = 0;
+    auto flushLiterals = [&](size_t end) {
+        while (literalStart < end) {
+            size_t run = std::min<size_t>(32, end - literalStart);
+            out.push_back(static_cast<CK_BYTE>(run - 1));
+            out.insert(out.end(), in.begin() + literalStart, in.begin() + literalStart + run);
+            literalStart += run;
+        }
+    };
+
+    size_t ip = 0;
+    while (ip + 2 < in.size()) {
+        uint32_t triple = (uint32_t(in[ip]) << 16) | (uint32_t(in[ip + 1]) << 8) | in[ip + 2];
+        size_t slot = (triple * 2654435761u) >> (32 - HASH_BITS);
+        size_t ref = table[slot];
+        table[slot] = ip;
+        if (ref != NONE && ip - ref <= MAX_DISTANCE &&
+            in[ref] == in[ip] && in[ref + 1] == in[ip + 1] && in[ref + 2] == in[ip + 2]) {
+            size_t length = 3;
+            size_t limit = std::min(MAX_MATCH, in.size() - ip);
+            while (length < limit && in[ref + length] == in[ip + length]) {
+                length++;
+            }
+            flushLiterals(ip);
+            size_t distance = ip - ref - 1;
+            size_t code = length - 2;
+            if (code < 7) {
+                out.push_back(static_cast<CK_BYTE>((code << 5) | (distance >> 8)));
+            } else {
+                out.push_back(static_cast<CK_BYTE>((7 << 5) | (distance >> 8)));
+                out.push_back(static_cast<CK_BYTE>(code - 7));
+            }
+            out.push_back(static_cast<CK_BYTE>(distance & 0xff));
+            ip += length;
+            literalStart = ip;
+            if (out.size() >= in.size()) {
+                return {};
+            }
+            continue;
+        }
+        ip++;
+    }
+    flushLiterals(in.size());
+    return out;
+}
+
+bool lzfDecompress(const std::vector<CK_BYTE>& in, size_t length, std::vector<CK_BYTE>& out) {
+    out.clear();
+    out.reserve(length);
+    size_t ip = 0;
+    while (ip < in.size()) {
+        size_t control = in[ip++];
+        if (control < 32) {
+            size_t run = control + 1;
+            if (run > in.size() - ip || run > length - out.size()) {
+                return false;
+            }
+            out.insert(out.end(), in.begin() + ip, in.begin() + ip + run);
+            ip += run;
+            continue;
+        }
+        size_t match = control >> 5;
+        if (match == 7) {
+            if (ip >= in.size()) {
+                return false;
+            }
+            match += in[ip++];
+        }
+        if (ip >= in.size()) {
+            return false;
+        }
+        size_t distance = ((control & 0x1f) << 8) + in[ip++] + 1;
+        match += 2;
+        if (distance > out.size() || match > length - out.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < match; i++) {
+            out.push_back(out[out.size() - distance]);
+        }
+    }
+    return out.size() == length;
+}
+
+} // namespace
+
+TokenKeyValueStore::TokenKeyValueStore(PKCS11Library& lib, const KeyValueStoreConfig& config)
+    : lib_(lib), config_(config), indexed_(false), dirty_(0) {
+    config_.chunkSize = std::max<size_t>(config_.chunkSize, 1);
+    config_.maxDirty = std::max<size_t>(config_.maxDirty, 1);
+}
+
+TokenKeyValueStore::~TokenKeyValueStore() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    flushLocked();
+}
+
+Result<std::vector<CK_BYTE>> TokenKeyValueStore::get(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto entry = lookup(key);
+    if (!entry.isOk()) {
+        return Result<std::vector<CK_BYTE>>::Error(entry.errorCode, entry.errorMessage, entry.pkcs11Error);
+    }
+    if (entry.value->state == State::Unloaded) {
+        auto loaded = load(*entry.value);
+        if (!loaded.isOk()) {
+            return Result<std::vector<CK_BYTE>>::Error(loaded.errorCode,
+                                                       "Failed to read '" + key + "': " + loaded.errorMessage,
+                                                       loaded.pkcs11Error);
+        }
+    }
+    if (entry.value->state == State::Absent) {
+        return Result<std::vector<CK_BYTE>>::Error(Status::ERROR_OBJECT_NOT_FOUND, "No value for '" + key + "'");
+    }
+    return Result<std::vector<CK_BYTE>>::Ok(entry.value->value);
+}
+
+Result<void> TokenKeyValueStore::put(const std::string& key, const std::vector<CK_BYTE>& value) {
+    if (key.empty()) {
+        return Result<void>::Error(Status::ERROR_ARGUMENTS_BAD, "Empty key");
+    }
+    if (value.size() > config_.chunkSize * MAX_CHUNKS || value.size() > UINT32_MAX) {
+        return Result<void>::Error(Status::ERROR_DATA_LEN_RANGE, "Value too large for '" + key + "'");
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto inserted = entries_.emplace(key, Entry());
+    Entry& entry = inserted.first->second;
+    if (inserted.second && indexed_) {
+        entry.handlesKnown = true;      // not on the token
+    }
+    entry.state = State::Loaded;
+    entry.value = value;
+    markDirty(entry);
+    return dirty_ >= config_.maxDirty ? flushLocked() : Result<void>::Ok();
+}
+
+Result<void> TokenKeyValueStore::remove(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto inserted = entries_.emplace(key, Entry());
+    Entry& entry = inserted.first->second;
+    if (inserted.second && indexed_) {
+        entry.handlesKnown = true;
+    }
+    if (entry.state == State::Absent && entry.handlesKnown && entry.handles.empty()) {
+        return Result<void>::Ok();      // nothing stored, nothing pending
+    }
+    entry.state = State::Absent;
+    entry.value.clear();
+    markDirty(entry);
+    return dirty_ >= config_.maxDirty ? flushLocked() : Result<void>::Ok();
+}
+
+Result<std::vector<std::string>> TokenKeyValueStore::keys() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!indexed_) {
+        TokenTransaction transaction(lib_);
+        auto handles = findChunks(nullptr);
+        if (!handles.isOk()) {
+            return Result<std::vector<std::string>>::Error(handles.errorCode, handles.errorMessage,
+                                                           handles.pkcs11Error);
+        }
+        std::map<std::string, std::vector<CK_OBJECT_HANDLE>> found;
+        for (CK_OBJECT_HANDLE handle : handles.value) {
+            auto label = lib_.getObjectAttribute(handle, CKA_LABEL);
+            if (!label.isOk()) {
+                return Result<std::vector<std::string>>::Error(label.errorCode, label.errorMessage,
+                                                               label.pkcs11Error);
+            }
+            found[std::string(label.value.begin(), label.value.end())].push_back(handle);
+        }
+
+        for (auto& item : entries_) {
+            Entry& entry = item.second;
+            auto onToken = found.find(item.first);
+            if (!entry.dirty) {
+                entry.state = onToken == found.end() ? State::Absent :
+                              entry.state == State::Loaded ? State::Loaded : State::Unloaded;
+            }
+            auto handles = onToken == found.end() ? std::vector<CK_OBJECT_HANDLE>() : onToken->second;
+            if (handles != entry.handles) {
+                entry.handles = std::move(handles);
+                entry.stamp.reset();
+            }
+            entry.handlesKnown = true;
+        }
+        for (auto& item : found) {
+            if (entries_.find(item.first) == entries_.end()) {
+                Entry& entry = entries_[item.first];
+                entry.state = State::Unloaded;
+                entry.handles = item.second;
+                entry.handlesKnown = true;
+            }
+        }
+        indexed_ = true;
+    }
+
+    std::vector<std::string> names;
+    for (const auto& item : entries_) {
+        if (item.second.state != State::Absent) {
+            names.push_back(item.first);
+        }
+    }
+    return Result<std::vector<std::string>>::Ok(names);
+}
+
+Result<void> TokenKeyValueStore::flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return flushLocked();
+}
+
+size_t TokenKeyValueStore::pending() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return dirty_;
+}
+
+void TokenKeyValueStore::invalidate() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end();) {
+        if (it->second.dirty) {
+            it->second.handlesKnown = false;
+            it->second.handles.clear();
+            it->second.stamp.reset();
+            ++it;
+        } else {
+            it = entries_.erase(it);
+        }
+    }
+    indexed_ = false;
+}
+
+Result<void> TokenKeyValueStore::flushLocked() {
+    if (dirty_ == 0) {
+        return Result<void>::Ok();
+    }
+
+    struct Write {
+        const std::string* key;
+        Entry* entry;
+        std::vector<std::vector<CK_BYTE>> chunks;
+    };
+    std::vector<Write> writes;
+    CK_ULONG needed = 0;
+    for (auto& item : entries_) {
+        Entry& entry = item.second;
+        if (!entry.dirty) {
+            continue;
+        }
+        Write write{&item.first, &entry, {}};
+        if (entry.state == State::Loaded) {
+            write.chunks = encode(entry.value);
+            for (const auto& chunk : write.chunks) {
+                needed += chunk.size() + item.first.size() + config_.application.size() + config_.objectOverhead;
+            }
+        }
+        writes.push_back(std::move(write));
+    }
+
+    // One card acquisition for the whole batch. Removals go first: they
+    // make room for the writes.
+    TokenTransaction transaction(lib_);
+    std::stable_partition(writes.begin(), writes.end(),
+                          [](const Write& write) { return write.entry->state == State::Absent; });
+    CK_OBJECT_CLASS dataClass = CKO_DATA;
+    CK_BBOOL bTrue = CK_TRUE;
+    CK_BBOOL isPrivate = config_.privateObjects ? CK_TRUE : CK_FALSE;
+    bool checked = false;
+    for (Write& write : writes) {
+        const std::string& key = *write.key;
+        Entry& entry = *write.entry;
+        if (!write.chunks.empty() && !checked) {
+            auto available = freeMemory();
+            if (!available.isOk()) {
+                return Result<void>::Error(available.errorCode, available.errorMessage, available.pkcs11Error);
+            }
+            if (available.value != CK_UNAVAILABLE_INFORMATION && needed + config_.reservedMemory > available.value) {
+                return Result<void>::Error(Status::ERROR_DEVICE_MEMORY,
+                                           "Token memory too low for " + std::to_string(dirty_) +
+                                           " pending values (" + std::to_string(needed) + " bytes needed, " +
+                                           std::to_string(available.value) + " free)");
+            }
+            checked = true;
+        }
+        if (!entry.handlesKnown) {
+            auto found = findChunks(&key);
+            if (!found.isOk()) {
+                return Result<void>::Error(found.errorCode, found.errorMessage, found.pkcs11Error);
+            }
+            entry.handles = found.value;
+            entry.handlesKnown = true;
+            entry.stamp.reset();
+        }
+        if (!write.chunks.empty()) {
+            auto stamp = nextStamp(entry);
+            if (!stamp.isOk()) {
+                return Result<void>::Error(stamp.errorCode, "Failed to store '" + key + "': " + stamp.errorMessage,
+                                           stamp.pkcs11Error);
+            }
+            for (auto& chunk : write.chunks) {
+                setBE(&chunk[12], stamp.value, 4);
+            }
+        }
+
+        // New chunks first: until they all exist the old value stays readable
+        std::vector<CK_OBJECT_HANDLE> created;
+        for (auto& chunk : write.chunks) {
+            std::vector<CK_ATTRIBUTE> attributes = {
+                {CKA_CLASS, &dataClass, sizeof(dataClass)},
+                {CKA_TOKEN, &bTrue, sizeof(bTrue)},
+                {CKA_PRIVATE, &isPrivate, sizeof(isPrivate)},
+                {CKA_APPLICATION, (void*)config_.application.data(), config_.application.size()},
+                {CKA_LABEL, (void*)key.data(), key.size()},
+                {CKA_VALUE, chunk.data(), chunk.size()}
+            };
+            auto handle = lib_.createObject(attributes);
+            if (!handle.isOk()) {
+                for (CK_OBJECT_HANDLE orphan : created) {
+                    lib_.destroyObject(orphan);
+                }
+                return Result<void>::Error(handle.errorCode, "Failed to store '" + key + "': " + handle.errorMessage,
+                                           handle.pkcs11Error);
+            }
+            created.push_back(handle.value);
+        }
+
+        for (size_t i = 0; i < entry.handles.size(); i++) {
+            auto destroyed = lib_.destroyObject(entry.handles[i]);
+            if (!destroyed.isOk() && destroyed.errorCode != Status::ERROR_OBJECT_HANDLE_INVALID) {
+                // Leftovers carry an older stamp and are ignored on load
+                entry.handles.erase(entry.handles.begin(), entry.handles.begin() + i);
+                entry.handles.insert(entry.handles.end(), created.begin(), created.end());
+                entry.stamp.reset();
+                return Result<void>::Error(destroyed.errorCode,
+                                           "Failed to replace '" + key + "': " + destroyed.errorMessage,
+                                           destroyed.pkcs11Error);
+            }
+        }
+        if (!write.chunks.empty()) {
+            entry.stamp = getBE(&write.chunks[0][12], 4);
+        }
+        entry.handles = created;
+        entry.dirty = false;
+        dirty_--;
+    }
+
+    return Result<void>::Ok();
+}
+
+Result<TokenKeyValueStore::Entry*> TokenKeyValueStore::lookup(const std::string& key) {
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+        return Result<Entry*>::Ok(&it->second);
+    }
+
+    Entry entry;
+    entry.handlesKnown = true;
+    if (!indexed_) {
+        auto handles = findChunks(&key);
+        if (!handles.isOk()) {
+            return Result<Entry*>::Error(handles.errorCode, handles.errorMessage, handles.pkcs11Error);
+        }
+        entry.handles = handles.value;
+        entry.state = entry.handles.empty() ? State::Absent : State::Unloaded;
+    }
+    return Result<Entry*>::Ok(&entries_.emplace(key, std::move(entry)).first->second);
+}
+
+Result<void> TokenKeyValueStore::load(Entry& entry) {
+    TokenTransaction transaction(lib_);
+
+    // Chunks grouped by write stamp: a replace that failed half-way can leave
+    // an older, complete set next to the newer one
+    struct ChunkSet {
+        ChunkHeader header;
+        std::vector<std::vector<CK_BYTE>> parts;
+        std::vector<bool> seen;     // by index: an empty value is one empty chunk
+    };
+    std::map<uint32_t, ChunkSet> sets;
+    uint32_t highest = 0;
+    for (CK_OBJECT_HANDLE handle : entry.handles) {
+        auto chunk = lib_.getObjectAttribute(handle, CKA_VALUE);
+        if (!chunk.isOk()) {
+            return Result<void>::Error(chunk.errorCode, chunk.errorMessage, chunk.pkcs11Error);
+        }
+        ChunkHeader header;
+        if (!parseHeader(chunk.value, header)) {
+            continue;
+        }
+        highest = std::max(highest, header.stamp);
+        auto found = sets.find(header.stamp);
+        if (found == sets.end()) {
+            found = sets.emplace(header.stamp, ChunkSet{header, std::vector<std::vector<CK_BYTE>>(header.count),
+                                                        std::vector<bool>(header.count, false)}).first;
+        }
+        ChunkSet& set = found->second;
+        if (set.header.count != header.count || set.header.flags != header.flags ||
+            set.header.length != header.length) {
+            continue;
+        }
+        set.parts[header.index].assign(chunk.value.begin() + HEADER_LEN, chunk.value.end());
+        set.seen[header.index] = true;
+    }
+    entry.stamp = highest;
+
+    for (auto it = sets.rbegin(); it != sets.rend(); ++it) {
+        const ChunkSet& set = it->second;
+        const ChunkHeader& header = set.header;
+        if (std::find(set.seen.begin(), set.seen.end(), false) != set.seen.end()) {
+            continue;
+        }
+        std::vector<CK_BYTE> payload;
+        for (const auto& part : set.parts) {
+            payload.insert(payload.end(), part.begin(), part.end());
+        }
+
+        if (header.flags & FLAG_COMPRESSED) {
+            if (!lzfDecompress(payload, header.length, entry.value)) {
+                return Result<void>::Error(Status::ERROR_DATA_INVALID, "Corrupt compressed value");
+            }
+        } else if (payload.size() == header.length) {
+            entry.value = std::move(payload);
+        } else {
+            return Result<void>::Error(Status::ERROR_DATA_INVALID, "Value length mismatch");
+        }
+        entry.state = State::Loaded;
+        return Result<void>::Ok();
+    }
+    return Result<void>::Error(Status::ERROR_DATA_INVALID, "No complete set of value chunks");
+}
+
+Result<std::vector<CK_OBJECT_HANDLE>> TokenKeyValueStore::findChunks(const std::string* key) {
+    CK_OBJECT_CLASS dataClass = CKO_DATA;
+    CK_BBOOL isToken = CK_TRUE;
+    std::vector<CK_ATTRIBUTE> attributes = {
+        {CKA_CLASS, &dataClass, sizeof(dataClass)},
+        {CKA_TOKEN, &isToken, sizeof(isToken)},
+        {CKA_APPLICATION, (void*)config_.application.data(), config_.application.size()}
+    };
+    if (key) {
+        attributes.push_back({CKA_LABEL, (void*)key->data(), key->size()});
+    }
+    return lib_.findObjects(attributes);
+}
+
+std::vector<std::vector<CK_BYTE>> TokenKeyValueStore::encode(const std::vector<CK_BYTE>& value) {
+    CK_BYTE flags = 0;
+    std::vector<CK_BYTE> compressed;
+    if (config_.compress && value.size() >= 64) {
+        compressed = lzfCompress(value);
+        if (!compressed.empty() && compressed.size() < value.size()) {
+            flags |= FLAG_COMPRESSED;
+        }
+    }
+    const std::vector<CK_BYTE>& payload = (flags & FLAG_COMPRESSED) ? compressed : value;
+
+    // The write stamp is filled in by flushLocked() once the key's chunks
+    // on the token are known
+    size_t count = std::max<size_t>(1, (payload.size() + config_.chunkSize - 1) / config_.chunkSize);
+    std::vector<std::vector<CK_BYTE>> chunks;
+    for (size_t i = 0; i < count; i++) {
+        size_t offset = i * config_.chunkSize;
+        size_t length = std::min(config_.chunkSize, payload.size() - offset);
+        std::vector<CK_BYTE> chunk = {'K', 'V', FORMAT_VERSION, flags};
+        putBE(chunk, static_cast<uint32_t>(i), 2);
+        putBE(chunk, static_cast<uint32_t>(count), 2);
+        putBE(chunk, static_cast<uint32_t>(value.size()), 4);
+        putBE(chunk, 0, 4);
+        chunk.insert(chunk.end(), payload.begin() + offset, payload.begin() + offset + length);
+        chunks.push_back(std::move(chunk));
+    }
+    return chunks;
+}
+
+Result<uint32_t> TokenKeyValueStore::nextStamp(Entry& entry) {
+    if (!entry.stamp) {
+        uint32_t highest = 0;
+        for (CK_OBJECT_HANDLE handle : entry.handles) {
+            auto chunk = lib_.getObjectAttribute(handle, CKA_VALUE);
+            if (!chunk.isOk()) {
+                if (chunk.errorCode == Status::ERROR_OBJECT_HANDLE_INVALID) {
+                    continue;       // already gone
+                }
+                return Result<uint32_t>::Error(chunk.errorCode, chunk.errorMessage, chunk.pkcs11Error);
+            }
+            ChunkHeader header;
+            if (parseHeader(chunk.value, header)) {
+                highest = std::max(highest, header.stamp);
+            }
+        }
+        entry.stamp = highest;
+    }
+    return Result<uint32_t>::Ok(*entry.stamp + 1);
+}
+
+Result<CK_ULONG> TokenKeyValueStore::freeMemory() {
+    auto info = lib_.getTokenInfo(lib_.currentSlotId());
+    if (!info.isOk()) {
+        return Result<CK_ULONG>::Error(info.errorCode, info.errorMessage, info.pkcs11Error);
+    }
+    return Result<CK_ULONG>::Ok(config_.privateObjects ? info.value.freePrivateMemory : info.value.freePublicMemory);
+}
+
+void TokenKeyValueStore::markDirty(Entry& entry) {
+    if (!entry.dirty) {
+        entry.dirty = true;
+        dirty_++;
+    }
+}
+
+} // namespace PKCS11Lib
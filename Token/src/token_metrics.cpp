@@ -0,0 +1,274 @@
+#include "token_metrics.h"
+#include <algorithm>
+
+namespace PKCS11Lib {
+
+namespace {
+
+constexpr size_t RV_SLOTS = 8;
+constexpr CK_RV RV_EMPTY = ~CK_RV(0);
+
+std::atomic<uint64_t> nextMetricsId{1};
+
+} // namespace
+
+struct TokenMetrics::Counters {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> bytesIn{0};
+    std::atomic<uint64_t> bytesOut{0};
+    std::atomic<uint64_t> totalNanos{0};
+    std::atomic<uint64_t> maxNanos{0};
+    std::atomic<uint64_t> buckets[BUCKET_COUNT];
+    // Small open table of error codes; codes beyond RV_SLOTS land in otherErrors
+    std::atomic<CK_RV> rvCodes[RV_SLOTS];
+    std::atomic<uint64_t> rvCounts[RV_SLOTS];
+    std::atomic<uint64_t> otherErrors{0};
+
+    Counters() {
+        for (auto& bucket : buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < RV_SLOTS; i++) {
+            rvCodes[i].store(RV_EMPTY, std::memory_order_relaxed);
+            rvCounts[i].store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+// One per (TokenMetrics, thread). Only the owning thread writes; counters are
+// allocated lazily so a thread pays only for the functions it calls.
+struct TokenMetrics::Shard {
+    std::atomic<Counters*> counters[P11_FUNCTION_COUNT];
+
+    Shard() {
+        for (auto& c : counters) {
+            c.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~Shard() {
+        for (auto& c : counters) {
+            delete c.load(std::memory_order_relaxed);
+        }
+    }
+};
+
+TokenMetrics::TokenMetrics() : enabled_(false), id_(nextMetricsId.fetch_add(1)) {
+}
+
+TokenMetrics::~TokenMetrics() = default;
+
+size_t TokenMetrics::bucketIndex(uint64_t nanos) {
+    if (nanos < SUB_BUCKETS) {
+        return static_cast<size_t>(nanos);
+    }
+    unsigned exponent = 63 - __builtin_clzll(nanos);
+    size_t sub = (nanos >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+uint64_t TokenMetrics::bucketUpperBound(size_t index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    unsigned exponent = static_cast<unsigned>(index / SUB_BUCKETS) + SUB_BUCKET_BITS - 1;
+    uint64_t sub = index % SUB_BUCKETS;
+    uint64_t width = uint64_t(1) << (exponent - SUB_BUCKET_BITS);
+    return ((SUB_BUCKETS + sub) << (exponent - SUB_BUCKET_BITS)) + width - 1;
+}
+
+TokenMetrics::Counters& TokenMetrics::localCounters(P11Function function) {
+    // Keyed by instance id rather than address so a recycled address never
+    // resolves to a dead instance's shard
+    thread_local std::vector<std::pair<uint64_t, Shard*>> cache;
+
+    Shard* shard = nullptr;
+    for (const auto& entry : cache) {
+        if (entry.first == id_) {
+            shard = entry.second;
+            break;
+        }
+    }
+    if (!shard) {
+        std::lock_guard<std::mutex> lock(shardsMutex_);
+        shards_.push_back(std::make_unique<Shard>());
+        shard = shards_.back().get();
+        cache.emplace_back(id_, shard);
+    }
+
+    auto& slot = shard->counters[static_cast<size_t>(function)];
+    Counters* counters = slot.load(std::memory_order_acquire);
+    if (!counters) {
+        counters = new Counters();
+        slot.store(counters, std::memory_order_release);
+    }
+    return *counters;
+}
+
+void TokenMetrics::record(P11Function function, CK_RV rv, uint64_t nanos) {
+    if (!isEnabled() || function >= P11Function::Count) {
+        return;
+    }
+
+    Counters& c = localCounters(function);
+    // Single writer per shard: plain load+store instead of read-modify-write
+    auto bump = [](std::atomic<uint64_t>& counter, uint64_t delta) {
+        counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    };
+
+    bump(c.calls, 1);
+    bump(c.totalNanos, nanos);
+    bump(c.buckets[bucketIndex(nanos)], 1);
+    if (nanos > c.maxNanos.load(std::memory_order_relaxed)) {
+        c.maxNanos.store(nanos, std::memory_order_relaxed);
+    }
+
+    if (rv != CKR_OK) {
+        bump(c.errors, 1);
+        for (size_t i = 0; i < RV_SLOTS; i++) {
+            CK_RV code = c.rvCodes[i].load(std::memory_order_relaxed);
+            if (code == RV_EMPTY) {
+                c.rvCodes[i].store(rv, std::memory_order_relaxed);
+                code = rv;
+            }
+            if (code == rv) {
+                bump(c.rvCounts[i], 1);
+                return;
+            }
+        }
+        bump(c.otherErrors, 1);
+    }
+}
+
+void TokenMetrics::addBytes(P11Function function, uint64_t bytesIn, uint64_t bytesOut) {
+    if (!isEnabled() || function >= P11Function::Count) {
+        return;
+    }
+
+    Counters& c = localCounters(function);
+    c.bytesIn.store(c.bytesIn.load(std::memory_order_relaxed) + bytesIn, std::memory_order_relaxed);
+    c.bytesOut.store(c.bytesOut.load(std::memory_order_relaxed) + bytesOut, std::memory_order_relaxed);
+}
+
+MetricsSnapshot TokenMetrics::snapshot() const {
+    std::vector<FunctionStats> stats(P11_FUNCTION_COUNT);
+    std::vector<std::vector<uint64_t>> histograms(P11_FUNCTION_COUNT);
+
+    {
+        std::lock_guard<std::mutex> lock(shardsMutex_);
+        for (const auto& shard : shards_) {
+            for (size_t f = 0; f < P11_FUNCTION_COUNT; f++) {
+                const Counters* c = shard->counters[f].load(std::memory_order_acquire);
+                if (!c) {
+                    continue;
+                }
+
+                FunctionStats& s = stats[f];
+                s.calls += c->calls.load(std::memory_order_relaxed);
+                s.errors += c->errors.load(std::memory_order_relaxed);
+                s.bytesIn += c->bytesIn.load(std::memory_order_relaxed);
+                s.bytesOut += c->bytesOut.load(std::memory_order_relaxed);
+                s.totalNanos += c->totalNanos.load(std::memory_order_relaxed);
+                s.maxNanos = std::max(s.maxNanos, c->maxNanos.load(std::memory_order_relaxed));
+
+                for (size_t i = 0; i < RV_SLOTS; i++) {
+                    CK_RV code = c->rvCodes[i].load(std::memory_order_relaxed);
+                    if (code != RV_EMPTY) {
+                        s.errorsByRv[code] += c->rvCounts[i].load(std::memory_order_relaxed);
+                    }
+                }
+                uint64_t other = c->otherErrors.load(std::memory_order_relaxed);
+                if (other) {
+                    s.errorsByRv[CKR_VENDOR_DEFINED] += other;
+                }
+
+                auto& histogram = histograms[f];
+                histogram.resize(BUCKET_COUNT);
+                for (size_t b = 0; b < BUCKET_COUNT; b++) {
+                    histogram[b] += c->buckets[b].load(std::memory_order_relaxed);
+                }
+            }
+        }
+    }
+
+    MetricsSnapshot snapshot;
+    for (size_t f = 0; f < P11_FUNCTION_COUNT; f++) {
+        FunctionStats& s = stats[f];
+        s.function = static_cast<P11Function>(f);
+        if (s.calls == 0) {
+            continue;
+        }
+
+        const auto& histogram = histograms[f];
+        uint64_t total = 0;
+        for (uint64_t count : histogram) {
+            total += count;
+        }
+
+        auto quantile = [&](double q) -> uint64_t {
+            uint64_t rank = static_cast<uint64_t>(q * (total - 1)) + 1;
+            uint64_t seen = 0;
+            for (size_t b = 0; b < histogram.size(); b++) {
+                seen += histogram[b];
+                if (seen >= rank) {
+                    return std::min(bucketUpperBound(b), s.maxNanos);
+                }
+            }
+            return s.maxNanos;
+        };
+        if (total > 0) {
+            s.p50Nanos = quantile(0.50);
+            s.p90Nanos = quantile(0.90);
+            s.p99Nanos = quantile(0.99);
+        }
+
+        snapshot.functions.push_back(std::move(s));
+    }
+    return snapshot;
+}
+
+void TokenMetrics::reset() {
+    std::lock_guard<std::mutex> lock(shardsMutex_);
+    for (const auto& shard : shards_) {
+        for (auto& slot : shard->counters) {
+            Counters* c = slot.load(std::memory_order_acquire);
+            if (!c) {
+                continue;
+            }
+            // Racing writers may carry a few in-flight increments across the reset
+            c->calls.store(0, std::memory_order_relaxed);
+            c->errors.store(0, std::memory_order_relaxed);
+            c->bytesIn.store(0, std::memory_order_relaxed);
+            c->bytesOut.store(0, std::memory_order_relaxed);
+            c->totalNanos.store(0, std::memory_order_relaxed);
+            c->maxNanos.store(0, std::memory_order_relaxed);
+            c->otherErrors.store(0, std::memory_order_relaxed);
+            for (auto& bucket : c->buckets) {
+                bucket.store(0, std::memory_order_relaxed);
+            }
+            for (auto& count : c->rvCounts) {
+                count.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+const FunctionStats* MetricsSnapshot::find(P11Function function) const {
+    for (const auto& stats : functions) {
+        if (stats.function == function) {
+            return &stats;
+        }
+    }
+    return nullptr;
+}
+
+uint64_t MetricsSnapshot::totalCalls() const {
+    uint64_t total = 0;
+    for (const auto& stats : functions) {
+        total += stats.calls;
+    }
+    return total;
+}
+
+} // namespace PKCS11Lib
@@ -0,0 +1,196 @@
+#include "token_scheduler.h"
+
+#include <algorithm>
+
+namespace PKCS11Lib {
+
+namespace {
+
+uint64_t nanosBetween(TokenScheduler::Clock::time_point from, TokenScheduler::Clock::time_point to) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count());
+}
+
+} // namespace
+
+const char* priorityName(Priority priority) {
+    switch (priority) {
+        case Priority::Interactive: return "interactive";
+        case Priority::Normal: return "normal";
+        case Priority::Bulk: return "bulk";
+    }
+    return "unknown";
+}
+
+void TokenScheduler::Histogram::record(uint64_t nanos) {
+    buckets[TokenMetrics::bucketIndex(nanos)]++;
+    count++;
+    max = std::max(max, nanos);
+}
+
+uint64_t TokenScheduler::Histogram::quantile(double q) const {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(count - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t b = 0; b < buckets.size(); b++) {
+        seen += buckets[b];
+        if (seen >= rank) {
+            return std::min(TokenMetrics::bucketUpperBound(b), max);
+        }
+    }
+    return max;
+}
+
+TokenScheduler::TokenScheduler(const SchedulerConfig& config)
+    : config_(config), nextSequence_(0), stopping_(false) {
+}
+
+TokenScheduler::~TokenScheduler() {
+    stop();
+}
+
+void TokenScheduler::start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!thread_.joinable()) {
+        stopping_ = false;
+        thread_ = std::thread(&TokenScheduler::run, this);
+    }
+}
+
+void TokenScheduler::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wakeup_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+bool TokenScheduler::submit(Priority priority, Task task, Task expired, Clock::time_point deadline) {
+    ClassCounters& counters = counters_[static_cast<size_t>(priority)];
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        counters.submitted++;
+        if (stopping_ || queue_.size() >= config_.queueDepth) {
+            counters.rejected++;
+            return false;
+        }
+        queue_.push_back({priority, deadline, Clock::now(), nextSequence_++, std::move(task), std::move(expired)});
+        counters.pending++;
+    }
+    wakeup_.notify_one();
+    return true;
+}
+
+size_t TokenScheduler::pending() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queue_.size();
+}
+
+int TokenScheduler::effectiveClass(const Entry& entry, Clock::time_point now) const {
+    int level = static_cast<int>(entry.priority);
+    if (config_.agingInterval.count() > 0) {
+        auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(now - entry.enqueued);
+        level -= static_cast<int>(std::min<int64_t>(waited / config_.agingInterval, level));
+    }
+    return level;
+}
+
+size_t TokenScheduler::pick(Clock::time_point now) const {
+    // Linear scan: the queue is bounded by queueDepth and each pick is
+    // followed by a token operation that costs milliseconds
+    size_t best = 0;
+    int bestClass = effectiveClass(queue_[0], now);
+    for (size_t i = 1; i < queue_.size(); i++) {
+        const Entry& entry = queue_[i];
+        int level = effectiveClass(entry, now);
+        const Entry& current = queue_[best];
+        // Deadlines rank only within one submitted class; a promoted entry
+        // without one would otherwise lose every tie and bulk would starve
+        bool sameClass = entry.priority == current.priority;
+        if (level < bestClass ||
+            (level == bestClass && sameClass && (entry.deadline < current.deadline ||
+                                                 (entry.deadline == current.deadline && entry.sequence < current.sequence))) ||
+            (level == bestClass && !sameClass && entry.sequence < current.sequence)) {
+            best = i;
+            bestClass = level;
+        }
+    }
+    return best;
+}
+
+void TokenScheduler::run() {
+    for (;;) {
+        Entry entry;
+        bool expired = false;
+        Clock::time_point started;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wakeup_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+
+            started = Clock::now();
+            size_t index = pick(started);
+            entry = std::move(queue_[index]);
+            queue_[index] = std::move(queue_.back());
+            queue_.pop_back();
+
+            ClassCounters& counters = counters_[static_cast<size_t>(entry.priority)];
+            counters.pending--;
+            expired = entry.deadline < started;
+            if (expired) {
+                counters.expired++;
+            } else {
+                counters.wait.record(nanosBetween(entry.enqueued, started));
+                if (effectiveClass(entry, started) < static_cast<int>(entry.priority)) {
+                    counters.promoted++;
+                }
+            }
+        }
+
+        if (expired) {
+            if (entry.expired) {
+                entry.expired();
+            }
+            continue;
+        }
+
+        entry.task();
+
+        Clock::time_point finished = Clock::now();
+        std::lock_guard<std::mutex> lock(mutex_);
+        ClassCounters& counters = counters_[static_cast<size_t>(entry.priority)];
+        counters.completed++;
+        counters.latency.record(nanosBetween(entry.enqueued, finished));
+    }
+}
+
+std::array<PriorityStats, PRIORITY_CLASSES> TokenScheduler::stats() const {
+    std::array<PriorityStats, PRIORITY_CLASSES> result;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < PRIORITY_CLASSES; i++) {
+        const ClassCounters& c = counters_[i];
+        PriorityStats& s = result[i];
+        s.priority = static_cast<Priority>(i);
+        s.submitted = c.submitted;
+        s.completed = c.completed;
+        s.expired = c.expired;
+        s.rejected = c.rejected;
+        s.promoted = c.promoted;
+        s.pending = c.pending;
+        s.waitP50Nanos = c.wait.quantile(0.5);
+        s.waitP99Nanos = c.wait.quantile(0.99);
+        s.waitMaxNanos = c.wait.max;
+        s.latencyP50Nanos = c.latency.quantile(0.5);
+        s.latencyP99Nanos = c.latency.quantile(0.99);
+        s.latencyMaxNanos = c.latency.max;
+    }
+    return result;
+}
+
+} // namespace PKCS11Lib
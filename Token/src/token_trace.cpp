@@ -0,0 +1,179 @@
+#include "token_trace.h"
+
+#include <cinttypes>
+#include <cstdlib>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+namespace PKCS11Lib {
+
+namespace {
+
+void writeEscaped(FILE* out, const std::string& text) {
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            fputc('\\', out);
+            fputc(c, out);
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+}
+
+void writeMetadata(FILE* out, uint32_t pid) {
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":0,"
+            "\"args\":{\"name\":\"pkcs11lib\"}}", pid);
+}
+
+} // namespace
+
+TokenTrace::TokenTrace(size_t ringCapacity)
+    : enabled_(false), capacity_(ringCapacity ? ringCapacity : 1), next_(0), file_(nullptr) {
+}
+
+TokenTrace::~TokenTrace() {
+    stop();
+}
+
+uint64_t TokenTrace::nowNanos() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+uint32_t TokenTrace::currentThreadId() {
+    thread_local uint32_t tid = static_cast<uint32_t>(syscall(SYS_gettid));
+    return tid;
+}
+
+bool TokenTrace::start(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool ok = true;
+    if (!path.empty() && !file_) {
+        file_ = fopen(path.c_str(), "w");
+        if (file_) {
+            fputs("[\n", file_);
+            writeMetadata(file_, static_cast<uint32_t>(getpid()));
+        } else {
+            ok = false;
+        }
+    }
+    enabled_.store(true, std::memory_order_relaxed);
+    return ok;
+}
+
+void TokenTrace::stop() {
+    enabled_.store(false, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_) {
+        fputs("\n]\n", file_);
+        fclose(file_);
+        file_ = nullptr;
+    }
+}
+
+void TokenTrace::record(TraceSpan span) {
+    if (!isEnabled()) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_) {
+        // Streamed in the caller's thread: spans are as frequent as token
+        // round trips, which cost far more than a buffered write
+        fputs(",\n", file_);
+        writeEvent(file_, span, static_cast<uint32_t>(getpid()));
+    }
+
+    if (ring_.size() < capacity_) {
+        ring_.push_back(std::move(span));
+    } else {
+        ring_[next_] = std::move(span);
+    }
+    next_ = (next_ + 1) % capacity_;
+}
+
+std::vector<TraceSpan> TokenTrace::snapshot() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<TraceSpan> spans;
+    spans.reserve(ring_.size());
+    size_t first = ring_.size() < capacity_ ? 0 : next_;
+    for (size_t i = 0; i < ring_.size(); i++) {
+        spans.push_back(ring_[(first + i) % ring_.size()]);
+    }
+    return spans;
+}
+
+void TokenTrace::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ring_.clear();
+    next_ = 0;
+}
+
+void TokenTrace::writeEvent(FILE* out, const TraceSpan& span, uint32_t pid) const {
+    fputs("{\"name\":\"", out);
+    writeEscaped(out, span.name);
+    fprintf(out, "\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u,"
+            "\"pid\":%u,\"tid\":%u,\"args\":{\"slot\":%lu,\"rv\":\"0x%lx\"",
+            span.category, span.startNs / 1000, static_cast<unsigned>(span.startNs % 1000),
+            span.durationNs / 1000, static_cast<unsigned>(span.durationNs % 1000),
+            pid, span.threadId, span.slot, span.rv);
+    if (span.hasBytes) {
+        fprintf(out, ",\"bytesIn\":%" PRIu64 ",\"bytesOut\":%" PRIu64, span.bytesIn, span.bytesOut);
+    }
+    fputs("}}", out);
+}
+
+void TokenTrace::writeDocument(FILE* out) const {
+    uint32_t pid = static_cast<uint32_t>(getpid());
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out);
+    writeMetadata(out, pid);
+    for (const auto& span : snapshot()) {
+        fputs(",\n", out);
+        writeEvent(out, span, pid);
+    }
+    fputs("\n]}\n", out);
+}
+
+bool TokenTrace::writeJson(const std::string& path) const {
+    FILE* out = fopen(path.c_str(), "w");
+    if (!out) {
+        return false;
+    }
+    writeDocument(out);
+    return fclose(out) == 0;
+}
+
+std::string TokenTrace::toJson() const {
+    char* buffer = nullptr;
+    size_t length = 0;
+    FILE* out = open_memstream(&buffer, &length);
+    if (!out) {
+        return std::string();
+    }
+    writeDocument(out);
+    fclose(out);
+
+    std::string json(buffer, length);
+    free(buffer);
+    return json;
+}
+
+TokenTrace::Span::Span(TokenTrace& trace, std::string name, const char* category)
+    : trace_(trace), name_(std::move(name)), category_(category), startNs_(0), active_(trace.isEnabled()) {
+    if (active_) {
+        startNs_ = nowNanos();
+    }
+}
+
+TokenTrace::Span::~Span() {
+    if (active_) {
+        trace_.record({std::move(name_), category_, startNs_, nowNanos() - startNs_, currentThreadId(),
+                       0, CKR_OK, false, 0, 0});
+    }
+}
+
+} // namespace PKCS11Lib
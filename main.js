@@ -11,8 +11,9 @@ import path from "path";
 import { fileURLToPath } from "url";
 import fs from "fs/promises";
 import os from "os";
-import { randomBytes, createVerify } from "crypto";
-import { exec } from "node:child_process";
+import { randomBytes, createVerify, createPublicKey, createHash } from "crypto";
+import { exec, spawn } from "node:child_process";
+import { createRequire } from "node:module";
 import FormData from "form-data";
 
 // Conditional import for PKCS#11
@@ -79,6 +80,19 @@ const getDriverPath = () => {
   return potentialPaths.filter(Boolean);
 };
 
+// Native PKCS#11 binding (Token/addon), shipped next to the drivers in lib/.
+// It keeps the driver initialized for the app's lifetime and runs token
+// calls off the main thread; graphene remains the fallback without it.
+let tokenAddon = null;
+try {
+  const addonPath = app.isPackaged
+    ? path.join(process.resourcesPath, "lib", "token_addon.node")
+    : path.join(currentDir, "Token", "lib", "token_addon.node");
+  tokenAddon = createRequire(import.meta.url)(addonPath);
+} catch (error) {
+  console.warn("Native token addon not available:", error.message);
+}
+
 
 
 
@@ -126,11 +140,109 @@ class Pkcs11TokenManager {
     this.availableDriverPath = null;
     this.isInitialized = false;
     this.verificationCache = new Map();
+    this.nativeToken = null;
+    this.nativeQueue = Promise.resolve();
+    this.inFlight = new Map();
+  }
+
+  // Callers asking for an operation that is already running share its
+  // result instead of opening their own session and logging in again
+  singleFlight(key, fn) {
+    let flight = this.inFlight.get(key);
+    if (!flight) {
+      flight = Promise.resolve()
+        .then(fn)
+        .finally(() => this.inFlight.delete(key));
+      this.inFlight.set(key, flight);
+    }
+    return flight;
+  }
+
+  // The addon's Token, initialized once on first use
+  getNativeToken() {
+    if (!this.nativeToken) {
+      const token = new tokenAddon.Token();
+      this.nativeToken = (async () => {
+        if (!this.availableDriverPath) {
+          await this.findAvailableDriver();
+        }
+        await token.initialize(this.availableDriverPath);
+        return token;
+      })();
+      this.nativeToken.catch(() => {
+        this.nativeToken = null;
+      });
+    }
+    return this.nativeToken;
+  }
+
+  // Runs fn(token) with a session on the first token slot. The library has
+  // one session, so these are queued rather than interleaved.
+  withNativeSession(readWrite, fn) {
+    const run = this.nativeQueue.then(async () => {
+      const token = await this.getNativeToken();
+      const [slot] = await token.getSlotList(true);
+      if (slot === undefined) {
+        throw new Error("هیچ توکنی یافت نشد. لطفاً توکن را متصل کنید.");
+      }
+      await token.openSession(slot, readWrite);
+      try {
+        return await fn(token, slot);
+      } finally {
+        await token.closeSession().catch(() => {});
+      }
+    });
+    this.nativeQueue = run.catch(() => {});
+    return run;
+  }
+
+  async shutdown() {
+    const token = this.nativeToken;
+    this.nativeToken = null;
+    if (token) {
+      await this.nativeQueue;
+      await token.then((t) => t.finalize()).catch(() => {});
+    }
   }
 
+  // SubjectPublicKeyInfo DER of an RSA key of any size
+  rsaPublicKeyDER(modulus, publicExponent) {
+    return createPublicKey({
+      key: {
+        kty: "RSA",
+        n: Buffer.from(modulus).toString("base64url"),
+        e: Buffer.from(publicExponent).toString("base64url"),
+      },
+      format: "jwk",
+    }).export({ type: "spki", format: "der" });
+  }
+
+  // The PEM exactly as license token IDs were issued: no final newline, and
+  // a newline after every 64 characters even where the END line follows
+  tokenIdPEM(der) {
+    return `-----BEGIN PUBLIC KEY-----\n${Buffer.from(der).toString('base64').replace(/(.{64})/g, '$1\n')}\n-----END PUBLIC KEY-----`;
+  }
+
+
 
+  getTokenPublicKeyPEM() {
+    return this.singleFlight("publicKey", () => this.readTokenPublicKeyPEM());
+  }
+
+  async readTokenPublicKeyPEM() {
+    if (tokenAddon) {
+      await this.initialize();
+      return this.withNativeSession(false, async (token) => {
+        const keys = await token.findKeys(2); // CKO_PUBLIC_KEY
+        const publicKey = keys.find((key) => key.label === CONFIG.KEY_LABEL);
+        if (!publicKey) {
+          throw new Error(`کلید عمومی با برچسب "${CONFIG.KEY_LABEL}" یافت نشد.`);
+        }
+        // Memoized by the library per token serial and key ID
+        return this.tokenIdPEM(await token.exportPublicKey(publicKey.handle, "DER"));
+      });
+    }
 
-  async getTokenPublicKeyPEM() {
     let session = null;
     let mod = null;
     try {
@@ -154,20 +266,7 @@ class Pkcs11TokenManager {
       const modulus = publicKeyHandle.getAttribute("modulus");
       const publicExponent = publicKeyHandle.getAttribute("publicExponent");
 
-      // ساختار استاندارد یک کلید عمومی RSA در فرمت DER
-      const header = Buffer.from('30820122300d06092a864886f70d01010105000382010f00', 'hex');
-      const keyStructure = Buffer.concat([
-        Buffer.from('3082010a0282010100', 'hex'),
-        modulus,
-        Buffer.from('0203', 'hex'),
-        publicExponent
-      ]);
-      const derKey = Buffer.concat([header, keyStructure]);
-      
-      // تبدیل به فرمت PEM
-      const pemKey = `-----BEGIN PUBLIC KEY-----\n${derKey.toString('base64').replace(/(.{64})/g, '$1\n')}\n-----END PUBLIC KEY-----`;
-      
-      return pemKey;
+      return this.tokenIdPEM(this.rsaPublicKeyDER(modulus, publicExponent));
 
     } finally {
       if (session) session.close();
@@ -192,7 +291,7 @@ class Pkcs11TokenManager {
   async initialize() {
     if (this.isInitialized) return;
 
-    if (!graphene) {
+    if (!graphene && !tokenAddon) {
       throw new Error("PKCS#11 library not available");
     }
 
@@ -205,6 +304,27 @@ class Pkcs11TokenManager {
   }
 
   async listAvailableSlots() {
+    if (tokenAddon) {
+      try {
+        const token = await this.getNativeToken();
+        const slots = await token.getSlotList(true);
+        return await Promise.all(
+          slots.map(async (slotId) => {
+            const info = await token.getTokenInfo(slotId);
+            return {
+              slotId,
+              description: info.model,
+              tokenLabel: info.label,
+              tokenPresent: true,
+            };
+          })
+        );
+      } catch (error) {
+        console.error("خطا در لیست کردن اسلات‌ها:", error);
+        return [];
+      }
+    }
+
     let mod = null;
     try {
       if (!graphene) {
@@ -269,65 +389,38 @@ class Pkcs11TokenManager {
 
   // Enhanced verification with caching and better error handling
   async performTokenVerification(customPin = null, forceRefresh = false) {
-    let session = null;
-    let mod = null;
-
-    try {
-      // Check cache first (unless force refresh)
-      if (!forceRefresh && this.lastVerification) {
-        const cacheAge =
-          Date.now() - new Date(this.lastVerification.timestamp).getTime();
-        if (
-          cacheAge < CONFIG.VERIFICATION_CACHE_TIME &&
-          this.lastVerification.success
-        ) {
-          console.log("استفاده از نتیجه تایید کش شده");
-          return this.lastVerification;
-        }
+    // Check cache first (unless force refresh)
+    if (!forceRefresh && this.lastVerification) {
+      const cacheAge =
+        Date.now() - new Date(this.lastVerification.timestamp).getTime();
+      if (
+        cacheAge < CONFIG.VERIFICATION_CACHE_TIME &&
+        this.lastVerification.success
+      ) {
+        console.log("استفاده از نتیجه تایید کش شده");
+        return this.lastVerification;
       }
+    }
 
+    // Concurrent verifications with the same PIN share one login; a forced
+    // refresh joining one that is running still gets a fresh result
+    const pinKey = createHash("sha256")
+      .update(customPin || CONFIG.DEFAULT_PIN)
+      .digest("hex");
+    return this.singleFlight(`verify:${pinKey}`, () =>
+      this.verifyToken(customPin)
+    );
+  }
+
+  async verifyToken(customPin) {
+    try {
       await this.initialize();
       console.log("شروع تایید توکن...");
 
-      if (!graphene) {
-        throw new Error("PKCS#11 library not available");
-      }
-
-      mod = graphene.Module.load(this.availableDriverPath, "ShuttlePKCS11");
-      mod.initialize();
-      console.log("ماژول PKCS#11 بارگذاری شد");
-
-      const slots = mod.getSlots(true);
-      if (slots.length === 0) {
-        throw new Error("هیچ توکنی یافت نشد. لطفاً توکن را متصل کنید.");
-      }
-
-      const slot = slots.items(0);
-      console.log(`استفاده از اسلات: ${slot.slotDescription}`);
-
-      session = slot.open(
-        graphene.SessionFlag.RW_SESSION | graphene.SessionFlag.SERIAL_SESSION
-      );
-      console.log("نشست باز شد");
-
       const pin = customPin || CONFIG.DEFAULT_PIN;
-      console.log("تلاش برای ورود...");
-      session.login(pin);
-      console.log("ورود موفق");
-
-      const privateKey = await this.findPrivateKeyByLabel(
-        session,
-        CONFIG.KEY_LABEL
-      );
-      console.log("کلید خصوصی یافت شد");
-
-      const challenge = randomBytes(256);
-      console.log("داده تصادفی تولید شد");
-
-      const signature = session
-        .createSign(CONFIG.SIGNATURE_MECHANISM, privateKey)
-        .once(challenge);
-      console.log("امضا انجام شد");
+      const { challenge, signature, slotDescription } = tokenAddon
+        ? await this.signChallengeNative(pin)
+        : await this.signChallengeGraphene(pin);
 
       const verify = createVerify("sha256");
       verify.update(challenge);
@@ -351,7 +444,7 @@ class Pkcs11TokenManager {
           challengeSize: challenge.length,
           signatureSize: signature.length,
           publicKeyMatch: true,
-          slotDescription: slot.slotDescription,
+          slotDescription,
           driverPath: this.availableDriverPath,
         },
       };
@@ -378,6 +471,55 @@ class Pkcs11TokenManager {
         mainWindow.webContents.send("token-verification-result", result);
       }
       return result;
+    }
+  }
+
+  // Signs a random challenge with the application key, loading the driver for this call
+  async signChallengeGraphene(pin) {
+    let session = null;
+    let mod = null;
+
+    try {
+      if (!graphene) {
+        throw new Error("PKCS#11 library not available");
+      }
+
+      mod = graphene.Module.load(this.availableDriverPath, "ShuttlePKCS11");
+      mod.initialize();
+      console.log("ماژول PKCS#11 بارگذاری شد");
+
+      const slots = mod.getSlots(true);
+      if (slots.length === 0) {
+        throw new Error("هیچ توکنی یافت نشد. لطفاً توکن را متصل کنید.");
+      }
+
+      const slot = slots.items(0);
+      console.log(`استفاده از اسلات: ${slot.slotDescription}`);
+
+      session = slot.open(
+        graphene.SessionFlag.RW_SESSION | graphene.SessionFlag.SERIAL_SESSION
+      );
+      console.log("نشست باز شد");
+
+      console.log("تلاش برای ورود...");
+      session.login(pin);
+      console.log("ورود موفق");
+
+      const privateKey = await this.findPrivateKeyByLabel(
+        session,
+        CONFIG.KEY_LABEL
+      );
+      console.log("کلید خصوصی یافت شد");
+
+      const challenge = randomBytes(256);
+      console.log("داده تصادفی تولید شد");
+
+      const signature = session
+        .createSign(CONFIG.SIGNATURE_MECHANISM, privateKey)
+        .once(challenge);
+      console.log("امضا انجام شد");
+
+      return { challenge, signature, slotDescription: slot.slotDescription };
     } finally {
       if (session) {
         try {
@@ -399,6 +541,28 @@ class Pkcs11TokenManager {
     }
   }
 
+  // Same as signChallengeGraphene on the addon's long-lived module
+  signChallengeNative(pin) {
+    return this.withNativeSession(true, async (token, slot) => {
+      await token.login(pin);
+      try {
+        const keys = await token.findKeys(3); // CKO_PRIVATE_KEY
+        const privateKey =
+          keys.find((key) => key.label === CONFIG.KEY_LABEL) || keys[0];
+        if (!privateKey) {
+          throw new Error(`کلید خصوصی با برچسب "${CONFIG.KEY_LABEL}" یافت نشد`);
+        }
+
+        const challenge = randomBytes(256);
+        const signature = await token.sign(privateKey.handle, challenge, "SHA256");
+        const { model } = await token.getTokenInfo(slot);
+        return { challenge, signature, slotDescription: model };
+      } finally {
+        await token.logout().catch(() => {});
+      }
+    });
+  }
+
   getErrorMessage(error) {
     if (error.code) {
       switch (error.code) {
@@ -437,6 +601,7 @@ class Pkcs11TokenManager {
       isInitialized: this.isInitialized,
       driverPath: this.availableDriverPath,
       grapheneAvailable: !!graphene,
+      nativeAddonAvailable: !!tokenAddon,
     };
   }
 
@@ -1260,6 +1425,130 @@ ipcMain.handle("run-test123-command", async (event, commandArgs = "") => {
   });
 });
 
+// Persistent token server: one token-serve process keeps the driver loaded,
+// initialized and logged in, instead of paying that on every command.
+// Requests are length-prefixed JSON frames matched to responses by id.
+// Each carries timeoutMs, past which token-serve abandons the token call;
+// a request still unanswered a grace period later is failed here, so a
+// hung server cannot leave a caller waiting forever.
+const TOKEN_SERVE_TIMEOUT_MS = 30000;
+const TOKEN_SERVE_GRACE_MS = 5000;
+
+const tokenServe = {
+  child: null,
+  starting: null,
+  buffer: Buffer.alloc(0),
+  nextId: 1,
+  pending: new Map(),
+
+  // Concurrent first requests share one start, so only one child is spawned
+  start() {
+    if (this.child) return Promise.resolve();
+    this.starting ??= this.launch().finally(() => {
+      this.starting = null;
+    });
+    return this.starting;
+  },
+
+  async launch() {
+    const driverPath =
+      tokenManager.availableDriverPath || (await tokenManager.findAvailableDriver());
+    // Shipped in lib/ next to the drivers and the addon
+    const name = process.platform === "win32" ? "token-serve.exe" : "token-serve";
+    const binary =
+      process.env.TOKEN_SERVE_PATH ||
+      (app.isPackaged
+        ? path.join(process.resourcesPath, "lib", name)
+        : path.join(currentDir, "Token", "lib", name));
+
+    const child = spawn(binary, ["--library", driverPath], {
+      stdio: ["pipe", "pipe", "inherit"],
+    });
+    this.child = child;
+    child.stdout.on("data", (chunk) => {
+      if (child === this.child) this.receive(chunk);
+    });
+    child.stdin.on("error", (error) => this.stopped(child, error));
+    child.on("error", (error) => this.stopped(child, error));
+    child.on("exit", (code) => this.stopped(child, new Error(`token-serve exited with code ${code}`)));
+  },
+
+  receive(chunk) {
+    this.buffer = Buffer.concat([this.buffer, chunk]);
+    while (this.buffer.length >= 4) {
+      const length = this.buffer.readUInt32LE(0);
+      if (this.buffer.length < 4 + length) break;
+      const frame = this.buffer.subarray(4, 4 + length).toString("utf8");
+      this.buffer = this.buffer.subarray(4 + length);
+
+      let response;
+      try {
+        response = JSON.parse(frame);
+      } catch (error) {
+        console.error("token-serve sent invalid JSON:", error.message);
+        continue;
+      }
+      // A request that already timed out here is no longer pending
+      const waiter = this.pending.get(response.id);
+      if (!waiter) continue;
+      this.pending.delete(response.id);
+      clearTimeout(waiter.timer);
+      waiter.resolve(
+        response.ok
+          ? { success: true, result: response.result }
+          : { success: false, error: response.error.message, status: response.error.status, rv: response.error.rv }
+      );
+    }
+  },
+
+  // Events from a child that was already replaced or shut down are ignored
+  stopped(child, error) {
+    if (child !== this.child) return;
+    this.child = null;
+    this.buffer = Buffer.alloc(0);
+    for (const waiter of this.pending.values()) {
+      clearTimeout(waiter.timer);
+      waiter.resolve({ success: false, error: error.message });
+    }
+    this.pending.clear();
+  },
+
+  async request(method, params = {}, timeoutMs = TOKEN_SERVE_TIMEOUT_MS) {
+    await this.start();
+    if (!this.child) return { success: false, error: "token-serve is not running" };
+    const id = this.nextId++;
+    const body = Buffer.from(JSON.stringify({ id, method, params, timeoutMs }), "utf8");
+    const header = Buffer.alloc(4);
+    header.writeUInt32LE(body.length, 0);
+
+    return new Promise((resolve) => {
+      const timer = setTimeout(() => {
+        if (!this.pending.delete(id)) return;
+        // 258: ERROR_TIMEOUT, as token-serve reports its own timeouts
+        resolve({ success: false, error: `token-serve did not answer ${method} in time`, status: 258 });
+      }, timeoutMs + TOKEN_SERVE_GRACE_MS);
+      this.pending.set(id, { resolve, timer });
+      this.child.stdin.write(Buffer.concat([header, body]));
+    });
+  },
+
+  shutdown() {
+    const child = this.child;
+    if (!child) return;
+    this.stopped(child, new Error("token-serve was shut down"));
+    // Closing stdin ends the server's request loop; it finalizes and exits
+    child.stdin.end();
+  },
+};
+
+ipcMain.handle("token-serve-request", async (event, method, params = {}, timeoutMs) => {
+  try {
+    return await tokenServe.request(method, params, timeoutMs);
+  } catch (error) {
+    return { success: false, error: error.message };
+  }
+});
+
 // ====================================================================
 // SECTION 6: ENHANCED APPLICATION LIFECYCLE
 // ====================================================================
@@ -1300,15 +1589,19 @@ app.whenReady().then(async () => {
 app.on("window-all-closed", () => {
   // Clean shutdown
   hardwareTokenManager.shutdown();
+  tokenServe.shutdown();
   if (process.platform !== "darwin") app.quit();
 });
 
 // Handle app termination
 app.on("before-quit", () => {
   hardwareTokenManager.shutdown();
+  tokenServe.shutdown();
+  tokenManager.shutdown();
 });
 
 // Handle system shutdown/suspend
 app.on("will-quit", (event) => {
   hardwareTokenManager.shutdown();
+  tokenServe.shutdown();
 });
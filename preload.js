@@ -153,6 +153,7 @@ const electronAPI = {
   // Command Execution
   executeShellCommand: (command, options) => ipcRenderer.invoke('execute-shell-command', command, options),
   runTest123Command: (args) => ipcRenderer.invoke('run-test123-command', args),
+  tokenServeRequest: (method, params, timeoutMs) => ipcRenderer.invoke('token-serve-request', method, params, timeoutMs),
   verifyPkcs11Signature: (options) => ipcRenderer.invoke('verify-pkcs11-signature', options),
 
   // Network Operations - Enhanced for FormData